@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+#define CHUNK_MIN 1024
+#define CHUNK_MAX (64 * 1024)
+#define INTERN_MIN 64
+#define ZALLOC_ALIGN 8
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena {
+    size_t refs;
+    struct arena_chunk *chunks; // The one being filled first
+    struct intern_entry {
+        const char *data; // NULL if the entry is empty
+        size_t len;
+        uint64_t hash;
+    } *interned;
+    size_t interned_size; // Always a power of two
+    size_t interned_count;
+};
+
+static uint64_t
+hash_data(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+struct arena *
+arena_new() {
+    struct arena *arena = calloc(1, sizeof(*arena));
+    arena->refs = 1;
+    return arena;
+}
+
+struct arena *
+arena_ref(struct arena *arena) {
+    if (arena) arena->refs++;
+    return arena;
+}
+
+void
+arena_release(struct arena *arena) {
+    if (!arena || --arena->refs) return;
+    struct arena_chunk *chunk = arena->chunks;
+    while (chunk) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena->interned);
+    free(arena);
+}
+
+void *
+arena_alloc(struct arena *arena, size_t len) {
+    struct arena_chunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < len) {
+        // Chunks double in size so that single tracks don't take up much more than they need
+        size_t size = chunk ? chunk->size * 2 : CHUNK_MIN;
+        if (size > CHUNK_MAX) size = CHUNK_MAX;
+        if (size < len) size = len;
+        chunk = malloc(sizeof(*chunk) + size);
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void *p = &chunk->data[chunk->used];
+    chunk->used += len;
+    return p;
+}
+
+void *
+arena_zalloc(struct arena *arena, size_t len) {
+    struct arena_chunk *chunk = arena->chunks;
+    if (chunk) {
+        size_t pad = -(uintptr_t) &chunk->data[chunk->used] & (ZALLOC_ALIGN - 1);
+        if (chunk->size - chunk->used >= pad + len) chunk->used += pad;
+    }
+    // A new chunk starts aligned, since malloc's result and the chunk header both are
+    return memset(arena_alloc(arena, len), 0, len);
+}
+
+void *
+arena_memdup(struct arena *arena, const void *data, size_t len) {
+    return memcpy(arena_alloc(arena, len), data, len);
+}
+
+char *
+arena_strdup(struct arena *arena, const char *str) {
+    return arena_memdup(arena, str, strlen(str) + 1);
+}
+
+static void
+grow_interned(struct arena *arena) {
+    size_t size = arena->interned_size ? arena->interned_size * 2 : INTERN_MIN;
+    struct intern_entry *entries = calloc(size, sizeof(*entries));
+    for (size_t i = 0; i < arena->interned_size; ++i) {
+        struct intern_entry *e = &arena->interned[i];
+        if (!e->data) continue;
+        size_t j = e->hash & (size - 1);
+        while (entries[j].data) j = (j + 1) & (size - 1);
+        entries[j] = *e;
+    }
+    free(arena->interned);
+    arena->interned = entries;
+    arena->interned_size = size;
+}
+
+void *
+arena_intern(struct arena *arena, const void *data, size_t len) {
+    if (arena->interned_count * 4 >= arena->interned_size * 3) grow_interned(arena);
+    uint64_t hash = hash_data(data, len);
+    size_t i = hash & (arena->interned_size - 1);
+    for (; arena->interned[i].data; i = (i + 1) & (arena->interned_size - 1)) {
+        struct intern_entry *e = &arena->interned[i];
+        if (e->hash == hash && e->len == len && !memcmp(e->data, data, len)) return (void *) e->data;
+    }
+    void *copy = arena_memdup(arena, data, len);
+    arena->interned[i] = (struct intern_entry) {.data = copy, .len = len, .hash = hash};
+    arena->interned_count++;
+    return copy;
+}
+
+char *
+arena_intern_string(struct arena *arena, const char *str) {
+    return arena_intern(arena, str, strlen(str) + 1);
+}
+
+void
+arena_seal(struct arena *arena) {
+    free(arena->interned);
+    arena->interned = NULL;
+    arena->interned_size = 0;
+    arena->interned_count = 0;
+}
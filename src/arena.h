@@ -0,0 +1,41 @@
+#ifndef SMP_ARENA_H
+#define SMP_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Reference counted bump allocator for the strings of everything loaded at once, like the tracks of a playlist. Each
+ * track holds a reference, so the memory is released in one go when the last of them is freed instead of string by
+ * string. Allocations aren't aligned unless they are made with arena_zalloc.
+ *
+ * While an arena is being filled, arena_intern stores equal data only once, which is where most of the memory goes
+ * for artist names, album art and region lists repeated across a playlist.
+ */
+struct arena;
+
+// Returns a new arena with one reference, owned by the caller
+struct arena *arena_new();
+
+struct arena *arena_ref(struct arena *arena);
+
+// Drops a reference and frees the arena once there are none left. Does nothing if arena is NULL.
+void arena_release(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t len);
+
+// Returns zeroed memory aligned to 8 bytes, for structs which live as long as the strings they point to
+void *arena_zalloc(struct arena *arena, size_t len);
+
+void *arena_memdup(struct arena *arena, const void *data, size_t len);
+
+char *arena_strdup(struct arena *arena, const char *str);
+
+// Returns a copy of data in the arena, shared with every earlier call with the same bytes
+void *arena_intern(struct arena *arena, const void *data, size_t len);
+
+char *arena_intern_string(struct arena *arena, const char *str);
+
+// Frees the table used by arena_intern once nothing more will be added, the interned data itself stays valid
+void arena_seal(struct arena *arena);
+
+#endif //SMP_ARENA_H
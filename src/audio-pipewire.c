@@ -7,6 +7,7 @@
 #include <spa/param/audio/format-utils.h>
 #include <pipewire/pipewire.h>
 #include <math.h>
+#include "audio.h"
 #include "util.h"
 #include <errno.h>
 #include <unistd.h>
@@ -22,6 +23,7 @@ static const enum AudioThreadSignal SEEKED_SIG = AUDIO_THREAD_SIGNAL_SEEKED;
 struct audio_context {
     bool status: 1;
     bool started: 1;
+    atomic_bool buffering; // Output silence until enough audio has been decoded
     double volume;
     int64_t seek;
 
@@ -39,18 +41,16 @@ struct audio_context {
         bool finished_reading;
     } audio_info;
     struct audio_info previous;
+
+    struct audio_stats stats;
 };
 
-static void on_process(void *userdata) {
-    struct audio_context *data = userdata;
+static void fill_buffer(struct audio_context *data) {
     struct pw_buffer *b;
     struct spa_buffer *buf;
     float *dst;
 
-    if (!data->started){
-        pthread_exit(NULL);
-    }
-    if (!data->status || !data->audio_buf->len || !data->audio_info.channels ||
+    if (!data->status || !data->audio_info.channels ||
         (data->audio_info.finished_reading &&
          data->audio_info.total_frames <=
          data->audio_buf->offset))
@@ -65,6 +65,18 @@ static void on_process(void *userdata) {
     if ((dst = buf->datas[0].data) == NULL)
         return;
 
+    if (atomic_load(&data->buffering)) {
+        memset(dst, 0, buf->datas[0].maxsize);
+        goto finish;
+    }
+
+    struct pw_time time;
+    if (pw_stream_get_time(data->stream, &time) == 0 && time.rate.denom && time.delay > 0) {
+        atomic_store_explicit(&data->stats.device_latency_us,
+                              (uint64_t) time.delay * 1000000 * time.rate.num / time.rate.denom,
+                              memory_order_relaxed);
+    }
+
     if (data->seek != 0) {
         int64_t seek_offset = (int64_t) ((((double) data->seek) * 0.000001) *
                                          (double) data->audio_info.sample_rate);
@@ -97,10 +109,14 @@ static void on_process(void *userdata) {
     }
 
     size_t max_frames = (buf->datas[0].maxsize / sizeof(*data->audio_buf->buf)) / data->audio_info.channels;
-    size_t num_read =
-            max_frames < (data->audio_info.total_frames - data->audio_buf->offset)
-            ? max_frames : (data->audio_info.total_frames - data->audio_buf->offset);
+    size_t available = data->audio_info.total_frames - data->audio_buf->offset;
+    // The graph only consumes what it requested (0 if the server doesn't say), not the whole buffer
+    size_t requested = b->requested && b->requested < max_frames ? (size_t) b->requested : max_frames;
+    audio_stats_record_fill(&data->stats, available, requested, data->audio_info.finished_reading);
+    size_t num_read = max_frames < available ? max_frames : available;
     num_read *= data->audio_info.channels;
+    /* pad whatever couldn't be filled with silence */
+    memset(dst + num_read, 0, (max_frames * data->audio_info.channels - num_read) * sizeof(*dst));
     float *s_buf = &data->audio_buf->buf[data->audio_buf->offset * data->audio_info.channels];
 
     data->audio_buf->offset += num_read / data->audio_info.channels;
@@ -145,6 +161,17 @@ static void on_process(void *userdata) {
     pw_stream_queue_buffer(data->stream, b);
 }
 
+static void on_process(void *userdata) {
+    struct audio_context *data = userdata;
+
+    if (!data->started){
+        pthread_exit(NULL);
+    }
+    uint64_t start = audio_stats_now_us();
+    fill_buffer(data);
+    audio_stats_record_callback(&data->stats, start);
+}
+
 static const struct pw_stream_events stream_events = {
         PW_VERSION_STREAM_EVENTS,
         .process = on_process,
@@ -156,6 +183,7 @@ audio_init(struct buffer *audio_buf, int track_over_fd) {
     struct audio_context *data = calloc(1, sizeof(*data));
     data->audio_buf = audio_buf;
     data->track_over_fd = track_over_fd;
+    audio_stats_reset(&data->stats);
     return data;
 }
 
@@ -229,6 +257,7 @@ int audio_start(struct audio_context *ctx, struct audio_info *info, struct audio
                       params, 1);
 
     ctx->started = true;
+    atomic_store_explicit(&ctx->stats.sample_rate, info->sample_rate, memory_order_relaxed);
     pw_thread_loop_start(ctx->loop);
 
     return audio_play(ctx);
@@ -303,4 +332,25 @@ struct audio_info *audio_get_info_prev(struct audio_context *ctx) {
     return &ctx->previous;
 }
 
+struct audio_stats *audio_get_stats(struct audio_context *ctx) {
+    return &ctx->stats;
+}
+
+void audio_set_buffering(struct audio_context *ctx, bool buffering) {
+    atomic_store(&ctx->buffering, buffering);
+}
+
+bool audio_buffering(struct audio_context *ctx) {
+    return atomic_load(&ctx->buffering);
+}
+
+double audio_get_buffered(struct audio_context *ctx) {
+    if (!ctx->audio_info.sample_rate || ctx->audio_info.total_frames < ctx->audio_buf->offset) return 0;
+    return (double) (ctx->audio_info.total_frames - ctx->audio_buf->offset) / (double) ctx->audio_info.sample_rate;
+}
+
+size_t audio_get_bitrate(struct audio_context *ctx) {
+    return ctx->audio_info.bitrate;
+}
+
 #endif
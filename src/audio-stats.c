@@ -0,0 +1,52 @@
+#include <time.h>
+#include "audio.h"
+
+const uint64_t audio_stats_histogram_bounds[AUDIO_STATS_HISTOGRAM_BUCKETS - 1] = {50, 100, 250, 500, 1000, 2000, 5000};
+
+void
+audio_stats_reset(struct audio_stats *stats) {
+    atomic_store_explicit(&stats->callbacks, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->underruns, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->silence_frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->callback_max_us, 0, memory_order_relaxed);
+    for (int i = 0; i < AUDIO_STATS_HISTOGRAM_BUCKETS; ++i) {
+        atomic_store_explicit(&stats->callback_histogram[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&stats->margin_min_frames, INT64_MAX, memory_order_relaxed);
+}
+
+uint64_t
+audio_stats_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+void
+audio_stats_record_callback(struct audio_stats *stats, uint64_t start_us) {
+    uint64_t duration = audio_stats_now_us() - start_us;
+    int bucket = 0;
+    while (bucket < AUDIO_STATS_HISTOGRAM_BUCKETS - 1 && duration >= audio_stats_histogram_bounds[bucket]) bucket++;
+
+    atomic_fetch_add_explicit(&stats->callbacks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->callback_histogram[bucket], 1, memory_order_relaxed);
+    /*
+     * Besides the audio thread only audio_stats_reset writes this, from the loop. A reset landing between the load and
+     * the store is overwritten by this one callback's duration, which is still a valid maximum since the reset.
+     */
+    if (duration > atomic_load_explicit(&stats->callback_max_us, memory_order_relaxed))
+        atomic_store_explicit(&stats->callback_max_us, duration, memory_order_relaxed);
+}
+
+void
+audio_stats_record_fill(struct audio_stats *stats, size_t available, size_t requested, bool finished) {
+    atomic_store_explicit(&stats->margin_frames, (int_fast64_t) available, memory_order_relaxed);
+    if (finished) return; // Running out of frames at the end of a track is not an underrun
+
+    if ((int_fast64_t) available < atomic_load_explicit(&stats->margin_min_frames, memory_order_relaxed))
+        atomic_store_explicit(&stats->margin_min_frames, (int_fast64_t) available, memory_order_relaxed);
+    if (available < requested) {
+        atomic_fetch_add_explicit(&stats->underruns, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->silence_frames, requested - available, memory_order_relaxed);
+    }
+}
@@ -24,6 +24,7 @@ static const enum AudioThreadSignal SEEKED_SIG = AUDIO_THREAD_SIGNAL_SEEKED;
 struct audio_context {
     bool status: 1;
     bool started: 1;
+    atomic_bool buffering; // Output silence until enough audio has been decoded
     double volume;
     int64_t seek;
 
@@ -40,22 +41,24 @@ struct audio_context {
         bool finished_reading;
     } audio_info;
     struct audio_info previous;
+
+    struct audio_stats stats;
 };
 
 static
 int
-callback(const void *input, void *output, unsigned long frameCount, const PaStreamCallbackTimeInfo *timeInfo,
-         PaStreamCallbackFlags statusFlags, void *userData) {
-    float *out = (float *) output;
-    struct audio_context *ctx = (struct audio_context *) userData;
-
+fill_output(float *out, unsigned long frameCount, struct audio_context *ctx) {
     /* clear output buffer */
-    if (ctx->audio_info.channels) memset(out, 0, sizeof(short) * frameCount * ctx->audio_info.channels);
+    if (ctx->audio_info.channels) memset(out, 0, sizeof(*out) * frameCount * ctx->audio_info.channels);
 
-    if (!ctx->started || !ctx->status || !ctx->audio_buf->len || !ctx->audio_info.channels ||
-        (ctx->audio_info.finished_reading &&
-         ctx->audio_info.total_frames <=
-         ctx->audio_buf->offset))
+    if (!ctx->started || !ctx->status || !ctx->audio_info.channels || atomic_load(&ctx->buffering)) return paContinue;
+    if (!ctx->audio_buf->len) {
+        audio_stats_record_fill(&ctx->stats, 0, frameCount, ctx->audio_info.finished_reading);
+        return paContinue;
+    }
+    if (ctx->audio_info.finished_reading &&
+        ctx->audio_info.total_frames <=
+        ctx->audio_buf->offset)
         return paContinue;
 
     if (ctx->seek != 0) {
@@ -89,9 +92,9 @@ callback(const void *input, void *output, unsigned long frameCount, const PaStre
         write(ctx->track_over_fd, &SEEKED_SIG, sizeof(SEEKED_SIG));
     }
 
-    size_t num_read =
-            frameCount < (ctx->audio_info.total_frames - ctx->audio_buf->offset)
-            ? frameCount : (ctx->audio_info.total_frames - ctx->audio_buf->offset);
+    size_t available = ctx->audio_info.total_frames - ctx->audio_buf->offset;
+    audio_stats_record_fill(&ctx->stats, available, frameCount, ctx->audio_info.finished_reading);
+    size_t num_read = frameCount < available ? frameCount : available;
     num_read *= ctx->audio_info.channels;
     float *s_buf = &ctx->audio_buf->buf[ctx->audio_buf->offset * ctx->audio_info.channels];
 
@@ -132,6 +135,19 @@ callback(const void *input, void *output, unsigned long frameCount, const PaStre
     return paContinue;
 }
 
+static
+int
+callback(const void *input, void *output, unsigned long frameCount, const PaStreamCallbackTimeInfo *timeInfo,
+         PaStreamCallbackFlags statusFlags, void *userData) {
+    struct audio_context *ctx = (struct audio_context *) userData;
+    uint64_t start = audio_stats_now_us();
+
+    int ret = fill_output((float *) output, frameCount, ctx);
+
+    audio_stats_record_callback(&ctx->stats, start);
+    return ret;
+}
+
 struct audio_context *
 audio_init(struct buffer *audio_buf, int track_over_fd) {
     PaError error;
@@ -144,6 +160,7 @@ audio_init(struct buffer *audio_buf, int track_over_fd) {
     struct audio_context *data = calloc(1, sizeof(*data));
     data->audio_buf = audio_buf;
     data->track_over_fd = track_over_fd;
+    audio_stats_reset(&data->stats);
     return data;
 }
 
@@ -198,6 +215,13 @@ int audio_play(struct audio_context *ctx) {
         fprintf(stderr, "[audio] Problem starting Stream: %s\n", Pa_GetErrorText(error));
         return 1;
     }
+
+    const PaStreamInfo *info = Pa_GetStreamInfo(ctx->stream);
+    if (info) {
+        atomic_store_explicit(&ctx->stats.device_latency_us, (uint64_t) (info->outputLatency * 1000000.0),
+                              memory_order_relaxed);
+    }
+    atomic_store_explicit(&ctx->stats.sample_rate, ctx->audio_info.sample_rate, memory_order_relaxed);
     return 0;
 }
 
@@ -283,4 +307,25 @@ struct audio_info *audio_get_info_prev(struct audio_context *ctx) {
     return &ctx->previous;
 }
 
+struct audio_stats *audio_get_stats(struct audio_context *ctx) {
+    return &ctx->stats;
+}
+
+void audio_set_buffering(struct audio_context *ctx, bool buffering) {
+    atomic_store(&ctx->buffering, buffering);
+}
+
+bool audio_buffering(struct audio_context *ctx) {
+    return atomic_load(&ctx->buffering);
+}
+
+double audio_get_buffered(struct audio_context *ctx) {
+    if (!ctx->audio_info.sample_rate || ctx->audio_info.total_frames < ctx->audio_buf->offset) return 0;
+    return (double) (ctx->audio_info.total_frames - ctx->audio_buf->offset) / (double) ctx->audio_info.sample_rate;
+}
+
+size_t audio_get_bitrate(struct audio_context *ctx) {
+    return ctx->audio_info.bitrate;
+}
+
 #endif
\ No newline at end of file
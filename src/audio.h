@@ -7,6 +7,8 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include "dbus-util.h"
 
 struct audio_context;
@@ -15,6 +17,27 @@ struct buffer;
 
 #define FRAMES_PER_BUFFER   (512)
 
+#define AUDIO_STATS_HISTOGRAM_BUCKETS 8
+
+/*
+ * Counters written by the audio thread and read from the main thread. Every field is only ever touched with relaxed
+ * atomics so the audio callback never has to take a lock.
+ */
+struct audio_stats {
+    atomic_uint_fast64_t callbacks;
+    atomic_uint_fast64_t underruns;
+    atomic_uint_fast64_t silence_frames;
+    atomic_uint_fast64_t callback_max_us;
+    atomic_uint_fast64_t callback_histogram[AUDIO_STATS_HISTOGRAM_BUCKETS];
+    atomic_int_fast64_t margin_frames; // Decoded frames ahead of the playback position at the last callback
+    atomic_int_fast64_t margin_min_frames; // Lowest margin seen while the track was still being decoded
+    atomic_uint_fast64_t device_latency_us;
+    atomic_uint_fast64_t sample_rate;
+};
+
+// Upper bound (exclusive, in microseconds) of every histogram bucket. The last bucket has no upper bound.
+extern const uint64_t audio_stats_histogram_bounds[AUDIO_STATS_HISTOGRAM_BUCKETS - 1];
+
 struct audio_context *audio_init(struct buffer *audio_buf, int track_over_fd);
 
 int audio_start(struct audio_context *ctx, struct audio_info *info, struct audio_info *previous);
@@ -51,4 +74,22 @@ struct audio_info *audio_get_info(struct audio_context *ctx);
 
 struct audio_info *audio_get_info_prev(struct audio_context *ctx);
 
+struct audio_stats *audio_get_stats(struct audio_context *ctx);
+
+void audio_set_buffering(struct audio_context *ctx, bool buffering);
+
+bool audio_buffering(struct audio_context *ctx);
+
+double audio_get_buffered(struct audio_context *ctx);
+
+size_t audio_get_bitrate(struct audio_context *ctx);
+
+void audio_stats_reset(struct audio_stats *stats);
+
+uint64_t audio_stats_now_us();
+
+void audio_stats_record_callback(struct audio_stats *stats, uint64_t start_us);
+
+void audio_stats_record_fill(struct audio_stats *stats, size_t available, size_t requested, bool finished);
+
 #endif //SMP_AUDIO_H
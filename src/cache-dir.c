@@ -0,0 +1,476 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "cache-dir.h"
+#include "io-pool.h"
+#include "config.h"
+
+#define MIGRATE_BATCH 256
+
+static const char *extensions[CACHE_DIR_LAST] = {
+        [CACHE_DIR_TRACKS] = ".ogg",
+        [CACHE_DIR_TRACK_INFO] = ".json",
+        [CACHE_DIR_ALBUM_INFO] = ".json",
+        [CACHE_DIR_PLAYLIST_INFO] = ".json",
+        [CACHE_DIR_TRACK_META] = ".bin",
+        [CACHE_DIR_ALBUM_META] = ".bin",
+        [CACHE_DIR_PLAYLIST_META] = ".bin",
+};
+
+static struct {
+    int fds[CACHE_DIR_LAST];
+    // First of the directories with the same path, which moves the flat files of all of them and owns the flags below
+    enum cache_dir owner[CACHE_DIR_LAST];
+    DIR *migrating[CACHE_DIR_LAST]; // Set while flat files of the directory are still being moved into shards
+    atomic_bool flat[CACHE_DIR_LAST]; // Same as migrating, but also read by the I/O threads
+    atomic_uint tmp_counter;
+    struct event *migrate_event;
+} dirs = {.fds = {-1, -1, -1, -1, -1, -1, -1, -1}};
+
+struct read_job {
+    enum cache_dir dir;
+    char id[CACHE_ID_LEN];
+    char *data;
+    size_t len;
+    time_t mtime;
+    cache_read_cb cb;
+    void *userp;
+};
+
+struct write_job {
+    enum cache_dir dir;
+    char id[CACHE_ID_LEN];
+    char *data;
+    size_t len;
+};
+
+static bool
+valid_name(enum cache_dir dir, const char *name) {
+    size_t ext_len = strlen(extensions[dir]);
+    return strlen(name) == CACHE_ID_LEN + ext_len && !strcmp(&name[CACHE_ID_LEN], extensions[dir]) &&
+           name[0] != '.' && name[1] != '.';
+}
+
+// Whether files of dir may still be outside of their shards
+static bool
+flat(enum cache_dir dir) {
+    return dirs.flat[dirs.owner[dir]];
+}
+
+// The directory sharing its path with owner whose files are named like name, or CACHE_DIR_NONE if there is none
+static enum cache_dir
+flat_file_dir(enum cache_dir owner, const char *name) {
+    for (enum cache_dir dir = owner; dir < CACHE_DIR_LAST; ++dir) {
+        if (dirs.owner[dir] == owner && valid_name(dir, name)) return dir;
+    }
+    return CACHE_DIR_NONE;
+}
+
+void
+cache_rel_path(enum cache_dir dir, const char id[CACHE_ID_LEN], char out[CACHE_REL_PATH_LEN]) {
+    snprintf(out, CACHE_REL_PATH_LEN, "%c/%c/%.22s%s", id[0], id[1], id, extensions[dir]);
+}
+
+static int
+make_shard(enum cache_dir dir, const char id[CACHE_ID_LEN]) {
+    char shard[4] = {id[0], 0, id[1], 0};
+    if (mkdirat(dirs.fds[dir], shard, 0755) && errno != EEXIST) return 1;
+    shard[1] = '/';
+    if (mkdirat(dirs.fds[dir], shard, 0755) && errno != EEXIST) return 1;
+    return 0;
+}
+
+int
+cache_dir_fd(enum cache_dir dir) {
+    if (dir <= CACHE_DIR_NONE || dir >= CACHE_DIR_LAST) return -1;
+    return dirs.fds[dir];
+}
+
+int
+cache_open(enum cache_dir dir, const char id[CACHE_ID_LEN], int flags) {
+    if (dir <= CACHE_DIR_NONE || dir >= CACHE_DIR_LAST || dirs.fds[dir] < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    char path[CACHE_REL_PATH_LEN];
+    cache_rel_path(dir, id, path);
+    int fd = openat(dirs.fds[dir], path, flags | O_CLOEXEC, 0644);
+    if (fd >= 0 || errno != ENOENT) return fd;
+
+    if (flags & O_CREAT) {
+        if (make_shard(dir, id)) return -1;
+        return openat(dirs.fds[dir], path, flags | O_CLOEXEC, 0644);
+    }
+    if (!flat(dir)) return -1;
+    fd = openat(dirs.fds[dir], &path[4], flags | O_CLOEXEC); // Not moved yet
+    // Or moved right after the first attempt
+    if (fd < 0 && errno == ENOENT) fd = openat(dirs.fds[dir], path, flags | O_CLOEXEC);
+    return fd;
+}
+
+FILE *
+cache_fopen(enum cache_dir dir, const char id[CACHE_ID_LEN], const char *mode) {
+    int flags;
+    switch (mode[0]) {
+        case 'r':
+            flags = strchr(mode, '+') ? O_RDWR : O_RDONLY;
+            break;
+        case 'w':
+            flags = (strchr(mode, '+') ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+            break;
+        case 'a':
+            flags = (strchr(mode, '+') ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+            break;
+        default:
+            errno = EINVAL;
+            return NULL;
+    }
+    int fd = cache_open(dir, id, flags);
+    if (fd < 0) return NULL;
+    FILE *fp = fdopen(fd, mode);
+    if (!fp) close(fd);
+    return fp;
+}
+
+int
+cache_unlink(enum cache_dir dir, const char id[CACHE_ID_LEN]) {
+    if (dir <= CACHE_DIR_NONE || dir >= CACHE_DIR_LAST || dirs.fds[dir] < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    char path[CACHE_REL_PATH_LEN];
+    cache_rel_path(dir, id, path);
+    int ret = unlinkat(dirs.fds[dir], path, 0);
+    if (ret && errno == ENOENT && flat(dir)) {
+        ret = unlinkat(dirs.fds[dir], &path[4], 0);
+        if (ret && errno == ENOENT) ret = unlinkat(dirs.fds[dir], path, 0);
+    }
+    return ret;
+}
+
+int
+cache_tmp_open(enum cache_dir dir, char name_out[CACHE_TMP_NAME_LEN]) {
+    if (dir <= CACHE_DIR_NONE || dir >= CACHE_DIR_LAST || dirs.fds[dir] < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    int fd;
+    do {
+        unsigned n = atomic_fetch_add(&dirs.tmp_counter, 1);
+        snprintf(name_out, CACHE_TMP_NAME_LEN, CACHE_TMP_DIR "/%08x%08x", (unsigned) time(NULL), n);
+        fd = openat(dirs.fds[dir], name_out, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    } while (fd < 0 && errno == EEXIST);
+    return fd;
+}
+
+int
+cache_tmp_publish(enum cache_dir dir, const char name[CACHE_TMP_NAME_LEN], const char id[CACHE_ID_LEN]) {
+    char path[CACHE_REL_PATH_LEN];
+    cache_rel_path(dir, id, path);
+    if (make_shard(dir, id) || renameat(dirs.fds[dir], name, dirs.fds[dir], path)) return -1;
+    if (flat(dir)) unlinkat(dirs.fds[dir], &path[4], 0); // Would otherwise be moved over the new file
+    return 0;
+}
+
+int
+cache_tmp_discard(enum cache_dir dir, const char name[CACHE_TMP_NAME_LEN]) {
+    return unlinkat(dirs.fds[dir], name, 0);
+}
+
+static void
+read_work(void *arg) {
+    struct read_job *job = arg;
+    int fd = cache_open(job->dir, job->id, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (!fstat(fd, &st)) {
+        job->data = malloc(st.st_size + 1);
+        while (job->len < st.st_size) {
+            ssize_t got = read(fd, &job->data[job->len], st.st_size - job->len);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+            job->len += got;
+        }
+        if (job->len == st.st_size) {
+            job->data[job->len] = 0;
+            job->mtime = st.st_mtime;
+        } else {
+            free(job->data);
+            job->data = NULL;
+        }
+    }
+    close(fd);
+}
+
+static void
+read_done(void *arg) {
+    struct read_job *job = arg;
+    job->cb(job->data, job->len, job->mtime, job->userp);
+    free(job->data);
+    free(job);
+}
+
+void
+cache_read_async(enum cache_dir dir, const char id[CACHE_ID_LEN], cache_read_cb cb, void *userp) {
+    struct read_job *job = calloc(1, sizeof(*job));
+    job->dir = dir;
+    memcpy(job->id, id, CACHE_ID_LEN);
+    job->cb = cb;
+    job->userp = userp;
+    io_pool_submit(read_work, read_done, job);
+}
+
+static void
+write_work(void *arg) {
+    struct write_job *job = arg;
+    char name[CACHE_TMP_NAME_LEN];
+    int fd = cache_tmp_open(job->dir, name);
+    size_t written = 0;
+    if (fd >= 0) {
+        while (written < job->len) {
+            ssize_t ret = write(fd, &job->data[written], job->len - written);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret < 0) break;
+            written += ret;
+        }
+        if (close(fd) || written != job->len || cache_tmp_publish(job->dir, name, job->id)) {
+            int err = errno;
+            cache_tmp_discard(job->dir, name);
+            errno = err;
+            fd = -1;
+        }
+    }
+    if (fd < 0) fprintf(stderr, "[cache] Error when writing cache file for '%.22s': %s\n", job->id, strerror(errno));
+    free(job->data);
+    free(job);
+}
+
+void
+cache_write_async(enum cache_dir dir, const char id[CACHE_ID_LEN], char *data, size_t len) {
+    struct write_job *job = malloc(sizeof(*job));
+    job->dir = dir;
+    memcpy(job->id, id, CACHE_ID_LEN);
+    job->data = data;
+    job->len = len;
+    io_pool_submit(write_work, NULL, job);
+}
+
+static void
+unlink_work(void *arg) {
+    struct write_job *job = arg;
+    cache_unlink(job->dir, job->id);
+    free(job);
+}
+
+void
+cache_unlink_async(enum cache_dir dir, const char id[CACHE_ID_LEN]) {
+    struct write_job *job = calloc(1, sizeof(*job));
+    job->dir = dir;
+    memcpy(job->id, id, CACHE_ID_LEN);
+    io_pool_submit(unlink_work, NULL, job);
+}
+
+static void
+touch_work(void *arg) {
+    struct write_job *job = arg;
+    char path[CACHE_REL_PATH_LEN];
+    cache_rel_path(job->dir, job->id, path);
+    int ret = utimensat(dirs.fds[job->dir], path, NULL, 0);
+    if (ret && errno == ENOENT && flat(job->dir) && utimensat(dirs.fds[job->dir], &path[4], NULL, 0) && errno == ENOENT)
+        utimensat(dirs.fds[job->dir], path, NULL, 0);
+    free(job);
+}
+
+void
+cache_touch_async(enum cache_dir dir, const char id[CACHE_ID_LEN]) {
+    if (dir <= CACHE_DIR_NONE || dir >= CACHE_DIR_LAST || dirs.fds[dir] < 0) return;
+    struct write_job *job = calloc(1, sizeof(*job));
+    job->dir = dir;
+    memcpy(job->id, id, CACHE_ID_LEN);
+    io_pool_submit(touch_work, NULL, job);
+}
+
+static void
+migrate_cb(evutil_socket_t fd, short what, void *arg) {
+    int moved = 0;
+    for (int dir = CACHE_DIR_TRACKS; dir < CACHE_DIR_LAST; ++dir) {
+        DIR *d = dirs.migrating[dir];
+        if (!d) continue;
+        struct dirent *entry;
+        while (moved < MIGRATE_BATCH && (errno = 0, entry = readdir(d))) {
+            enum cache_dir file_dir = flat_file_dir(dir, entry->d_name);
+            if (file_dir == CACHE_DIR_NONE) continue;
+            char path[CACHE_REL_PATH_LEN];
+            cache_rel_path(file_dir, entry->d_name, path);
+            if (make_shard(dir, entry->d_name) || renameat(dirs.fds[dir], entry->d_name, dirs.fds[dir], path)) {
+                fprintf(stderr, "[cache] Error when moving '%s' into its shard: %s\n", entry->d_name, strerror(errno));
+            }
+            moved++;
+        }
+        if (moved < MIGRATE_BATCH) {
+            if (errno) fprintf(stderr, "[cache] Error when reading cache directory: %s\n", strerror(errno));
+            closedir(d);
+            dirs.migrating[dir] = NULL;
+            dirs.flat[dir] = false;
+        } else {
+            break;
+        }
+    }
+    for (int dir = CACHE_DIR_TRACKS; dir < CACHE_DIR_LAST; ++dir) {
+        if (dirs.migrating[dir]) {
+            event_active(dirs.migrate_event, EV_TIMEOUT, 0); // Continue in the next loop iteration
+            return;
+        }
+    }
+}
+
+// Creates the temporary directory, removing files left behind by writes which never finished
+static int
+clear_tmp_dir(enum cache_dir dir) {
+    if (mkdirat(dirs.fds[dir], CACHE_TMP_DIR, 0755) && errno != EEXIST) return 1;
+    int fd = openat(dirs.fds[dir], CACHE_TMP_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (entry->d_name[0] != '.') unlinkat(dirfd(d), entry->d_name, 0);
+    }
+    closedir(d);
+    return 0;
+}
+
+int
+cache_dirs_init(struct event_base *base) {
+    const char *paths[CACHE_DIR_LAST] = {
+            [CACHE_DIR_TRACKS] = track_save_path,
+            [CACHE_DIR_TRACK_INFO] = track_info_path,
+            [CACHE_DIR_ALBUM_INFO] = album_info_path,
+            [CACHE_DIR_PLAYLIST_INFO] = playlist_info_path,
+            [CACHE_DIR_TRACK_META] = track_info_path,
+            [CACHE_DIR_ALBUM_META] = album_info_path,
+            [CACHE_DIR_PLAYLIST_META] = playlist_info_path,
+    };
+    for (enum cache_dir dir = CACHE_DIR_TRACKS; dir < CACHE_DIR_LAST; ++dir) {
+        dirs.owner[dir] = dir;
+        for (enum cache_dir other = CACHE_DIR_TRACKS; other < dir; ++other) {
+            if (!strcmp(paths[other], paths[dir])) {
+                dirs.owner[dir] = other;
+                break;
+            }
+        }
+    }
+    bool migrate = false;
+    for (int dir = CACHE_DIR_TRACKS; dir < CACHE_DIR_LAST; ++dir) {
+        dirs.fds[dir] = open(paths[dir], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirs.fds[dir] < 0) {
+            fprintf(stderr, "[cache] Error when opening cache directory '%s': %s\n", paths[dir], strerror(errno));
+            return 1;
+        }
+        if (dirs.owner[dir] != dir) continue; // Prepared along with its owner
+        if (clear_tmp_dir(dir)) {
+            fprintf(stderr, "[cache] Error when preparing '%s/" CACHE_TMP_DIR "': %s\n", paths[dir], strerror(errno));
+            return 1;
+        }
+        int scan_fd = openat(dirs.fds[dir], ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *d = scan_fd >= 0 ? fdopendir(scan_fd) : NULL;
+        if (!d) {
+            if (scan_fd >= 0) close(scan_fd);
+            continue;
+        }
+        // Only start moving files if there are any which aren't sharded yet
+        struct dirent *entry;
+        while ((entry = readdir(d))) {
+            if (flat_file_dir(dir, entry->d_name) != CACHE_DIR_NONE) break;
+        }
+        if (entry) {
+            rewinddir(d);
+            dirs.migrating[dir] = d;
+            dirs.flat[dir] = true;
+            migrate = true;
+            printf("[cache] Moving files in '%s' into sharded directories\n", paths[dir]);
+        } else {
+            closedir(d);
+        }
+    }
+    dirs.migrate_event = event_new(base, -1, 0, migrate_cb, NULL);
+    if (migrate) event_active(dirs.migrate_event, EV_TIMEOUT, 0);
+    return 0;
+}
+
+void
+cache_dirs_close() {
+    for (int dir = CACHE_DIR_TRACKS; dir < CACHE_DIR_LAST; ++dir) {
+        if (dirs.migrating[dir]) closedir(dirs.migrating[dir]);
+        dirs.migrating[dir] = NULL;
+        dirs.flat[dir] = false;
+        if (dirs.fds[dir] >= 0) close(dirs.fds[dir]);
+        dirs.fds[dir] = -1;
+    }
+    if (dirs.migrate_event) event_free(dirs.migrate_event);
+    dirs.migrate_event = NULL;
+}
+
+static DIR *
+open_subdir(DIR *parent, const char *name) {
+    int fd = openat(dirfd(parent), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    DIR *d = fdopendir(fd);
+    if (!d) close(fd);
+    return d;
+}
+
+void
+cache_dir_iter_begin(enum cache_dir dir, struct cache_dir_iter *it) {
+    memset(it, 0, sizeof(*it));
+    it->dir = dir;
+    it->depth = -1;
+    if (dir <= CACHE_DIR_NONE || dir >= CACHE_DIR_LAST || dirs.fds[dir] < 0) return;
+    // Opened again instead of dup'd since a dup'd descriptor would share its position with other iterators
+    int fd = openat(dirs.fds[dir], ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    it->stack[0] = fdopendir(fd);
+    if (!it->stack[0]) {
+        close(fd);
+        return;
+    }
+    it->depth = 0;
+}
+
+bool
+cache_dir_iter_next(struct cache_dir_iter *it, char id_out[CACHE_ID_LEN], struct stat *st) {
+    while (it->depth >= 0) {
+        DIR *d = it->stack[it->depth];
+        struct dirent *entry = readdir(d);
+        if (!entry) {
+            closedir(d);
+            it->stack[it->depth--] = NULL;
+            continue;
+        }
+        if (entry->d_name[0] == '.') continue;
+        if (it->depth < 2 && entry->d_name[1] == 0) { // Shard directory
+            DIR *sub = open_subdir(d, entry->d_name);
+            if (sub) it->stack[++it->depth] = sub;
+            continue;
+        }
+        if (!valid_name(it->dir, entry->d_name)) continue;
+        if (st && fstatat(dirfd(d), entry->d_name, st, 0)) continue;
+        memcpy(id_out, entry->d_name, CACHE_ID_LEN);
+        return true;
+    }
+    return false;
+}
+
+void
+cache_dir_iter_end(struct cache_dir_iter *it) {
+    while (it->depth >= 0) {
+        closedir(it->stack[it->depth]);
+        it->stack[it->depth--] = NULL;
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef SMP_CACHE_DIR_H
+#define SMP_CACHE_DIR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <event2/event.h>
+
+#define CACHE_ID_LEN 22
+// Path of a file relative to its cache directory: "a/b/<id>.json"
+#define CACHE_REL_PATH_LEN (4 + CACHE_ID_LEN + 5 + 1)
+// Files are written under a temporary name in this directory and only moved to their shard once complete
+#define CACHE_TMP_DIR ".partial"
+#define CACHE_TMP_NAME_LEN (sizeof(CACHE_TMP_DIR) + 16 + 1)
+
+/*
+ * Files in each cache directory are sharded by the first two characters of their id, so the track with id
+ * 4uLU6hMCjMI75M1A2tKUQC is stored at tracks/4/u/4uLU6hMCjMI75M1A2tKUQC.ogg
+ */
+enum cache_dir {
+    CACHE_DIR_NONE = 0,
+    CACHE_DIR_TRACKS,
+    CACHE_DIR_TRACK_INFO,
+    CACHE_DIR_ALBUM_INFO,
+    CACHE_DIR_PLAYLIST_INFO,
+    // Binary copies of the info files above, kept in the same directories
+    CACHE_DIR_TRACK_META,
+    CACHE_DIR_ALBUM_META,
+    CACHE_DIR_PLAYLIST_META,
+    CACHE_DIR_LAST
+};
+
+// Identifies a file in one of the cache directories without building its path, dir is CACHE_DIR_NONE if unset
+struct cache_file {
+    enum cache_dir dir;
+    char id[CACHE_ID_LEN];
+};
+
+struct cache_dir_iter {
+    enum cache_dir dir;
+    DIR *stack[3];
+    int depth;
+};
+
+/*
+ * Opens the cache directories configured in config.h. Caches using the old flat layout are moved into shards in the
+ * background on base, files which haven't been moved yet are still found.
+ */
+int cache_dirs_init(struct event_base *base);
+
+void cache_dirs_close();
+
+// Descriptor of the cache directory itself, owned by this module
+int cache_dir_fd(enum cache_dir dir);
+
+int cache_open(enum cache_dir dir, const char id[CACHE_ID_LEN], int flags);
+
+FILE *cache_fopen(enum cache_dir dir, const char id[CACHE_ID_LEN], const char *mode);
+
+int cache_unlink(enum cache_dir dir, const char id[CACHE_ID_LEN]);
+
+void cache_rel_path(enum cache_dir dir, const char id[CACHE_ID_LEN], char out[CACHE_REL_PATH_LEN]);
+
+/*
+ * Creates a new file with a unique name in the temporary directory of dir, opened for reading and writing. Unlike the
+ * other functions here these may be called from the I/O threads.
+ */
+int cache_tmp_open(enum cache_dir dir, char name_out[CACHE_TMP_NAME_LEN]);
+
+// Atomically replaces the file of id with the temporary file
+int cache_tmp_publish(enum cache_dir dir, const char name[CACHE_TMP_NAME_LEN], const char id[CACHE_ID_LEN]);
+
+int cache_tmp_discard(enum cache_dir dir, const char name[CACHE_TMP_NAME_LEN]);
+
+/*
+ * Called on the event loop once a file has been read by cache_read_async. data is NULL if the file doesn't exist or
+ * couldn't be read, otherwise it is NUL terminated and only valid during the call. mtime is when the file was last
+ * written or touched.
+ */
+typedef void (*cache_read_cb)(char *data, size_t len, time_t mtime, void *userp);
+
+// Reads a whole file on the I/O threads
+void cache_read_async(enum cache_dir dir, const char id[CACHE_ID_LEN], cache_read_cb cb, void *userp);
+
+// Replaces a file with len bytes of data on the I/O threads, takes ownership of data which must have been malloc'd
+void cache_write_async(enum cache_dir dir, const char id[CACHE_ID_LEN], char *data, size_t len);
+
+void cache_unlink_async(enum cache_dir dir, const char id[CACHE_ID_LEN]);
+
+// Sets the modification time of a file to now, marking an entry which turned out to be up to date as fresh again
+void cache_touch_async(enum cache_dir dir, const char id[CACHE_ID_LEN]);
+
+void cache_dir_iter_begin(enum cache_dir dir, struct cache_dir_iter *it);
+
+// Returns the id of the next file in the directory, whether it is sharded or not. st is optional.
+bool cache_dir_iter_next(struct cache_dir_iter *it, char id_out[CACHE_ID_LEN], struct stat *st);
+
+void cache_dir_iter_end(struct cache_dir_iter *it);
+
+#endif //SMP_CACHE_DIR_H
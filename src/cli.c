@@ -195,7 +195,7 @@ search_cli(int argc, char **argv) {
         printf(HELP_TXT_SEARCH);
         exit(EXIT_FAILURE);
     }
-    bool t = false, a = false, p = false;
+    bool t = false, a = false, p = false, local = false;
     int c;
 
     while (1) {
@@ -205,10 +205,11 @@ search_cli(int argc, char **argv) {
                 {"tracks",    no_argument, 0, 't'},
                 {"albums",    no_argument, 0, 'a'},
                 {"playlists", no_argument, 0, 'p'},
+                {"local",     no_argument, 0, 'l'},
                 {0, 0,                     0, 0}
         };
 
-        c = getopt_long(argc, argv, "?tap",
+        c = getopt_long(argc, argv, "?tapl",
                         long_options, &option_index);
         if (c == -1)
             break;
@@ -223,6 +224,9 @@ search_cli(int argc, char **argv) {
             case 'p':
                 p = true;
                 break;
+            case 'l':
+                local = true;
+                break;
             case '?':
                 printf(HELP_TXT_SEARCH);
                 exit(EXIT_SUCCESS);
@@ -269,7 +273,7 @@ search_cli(int argc, char **argv) {
     PlaylistInfo *playlists = NULL;
     size_t track_count = 0, album_count = 0, playlist_count = 0;
     for (int i = 0; i < 3; ++i) {
-        int r = dbus_client_search(t, a, false, p, query, &tracks, &track_count, &albums, &album_count, NULL, NULL,
+        int r = dbus_client_search(local, t, a, false, p, query, &tracks, &track_count, &albums, &album_count, NULL, NULL,
                                    &playlists, &playlist_count);
         if (!r)break;
         if (i == 2) {
@@ -283,7 +287,9 @@ search_cli(int argc, char **argv) {
     if (t) {
         printf("Tracks:\n");
         for (int i = 0; i < track_count; ++i) {
-            printf("\t[%d] %s by %s (%s)\n", i + 1, tracks[i].spotify_name, tracks[i].artist, tracks[i].spotify_uri);
+            char uri[SPOTIFY_URI_LEN_NULL];
+            spotify_track_uri(tracks[i].spotify_id, uri);
+            printf("\t[%d] %s by %s (%s)\n", i + 1, tracks[i].info->spotify_name, tracks[i].info->artist, uri);
         }
         if (one) goto choose_track;
     }
@@ -337,7 +343,9 @@ search_cli(int argc, char **argv) {
             free(line);
             if (init_dbus_client())
                 return;
-            dbus_client_open(tracks[index - 1].spotify_uri);
+            char uri[SPOTIFY_URI_LEN_NULL];
+            spotify_track_uri(tracks[index - 1].spotify_id, uri);
+            dbus_client_open(uri);
             break;
         }
         case 'A':
@@ -553,6 +561,50 @@ void playlists(int argc, char **argv) {
     }
 }
 
+void
+stats(int argc, char **argv) {
+    int c;
+
+    while (1) {
+        int option_index = 0;
+        static struct option long_options[] = {
+                {"help",  no_argument, 0, '?'},
+                {"reset", no_argument, 0, 'r'},
+                {0, 0,                 0, 0}
+        };
+
+        c = getopt_long(argc, argv, "?r",
+                        long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'r':
+                if (init_dbus_client())
+                    return;
+                if (dbus_client_reset_stats()) exit(EXIT_FAILURE);
+                printf("Stats reset\n");
+                return;
+            case '?':
+                printf(HELP_TXT_STATS);
+                exit(EXIT_SUCCESS);
+            default:
+                printf("?? getopt returned character code 0%o ??\n", c);
+        }
+    }
+
+    if (init_dbus_client())
+        return;
+    AudioStat *audio_stats = NULL;
+    size_t count = 0;
+    if (dbus_client_get_stats(&audio_stats, &count))
+        return;
+    for (size_t i = 0; i < count; ++i) {
+        printf("%s: %ld\n", audio_stats[i].name, (long) audio_stats[i].value);
+    }
+    free_stats(audio_stats, count);
+}
+
 int
 handle_cli(int argc, char **argv) {
     if (argc < 2) {
@@ -604,6 +656,8 @@ handle_cli(int argc, char **argv) {
             dbus_client_open(uri);
     } else if (!strcmp(argv[1], "playlist") || !strcmp(argv[1], "p")) {
         playlists(argc - 1, &argv[1]);
+    } else if (!strcmp(argv[1], "stats") || !strcmp(argv[1], "st")) {
+        stats(argc - 1, &argv[1]);
     } else {
         printf(HELP_TXT_GENERAL);
         exit(EXIT_FAILURE);
@@ -28,6 +28,8 @@
                             "\t\tOpen a URL to a track, album or playlist.\n\n"\
                             "\tp, playlist\n"\
                             "\t\tShow saved or currently playing playlists\n\n"\
+                            "\tst, stats\n"\
+                            "\t\tShow audio underrun and latency statistics\n\n"\
                             "\tFor more information regarding any of the subcommands consult their individual help pages by "\
                             "running smp SUBCOMMAND --help or smp SUBCOMMAND -?\n\n"\
 
@@ -82,7 +84,10 @@
                             "\t-a, --albums\n"\
                             "\t\tSearch for albums\n\n"\
                             "\t-p, --playlists\n"\
-                            "\t\tSearch for playlists\n\n"
+                            "\t\tSearch for playlists\n\n"\
+                            "\t-l, --local\n"\
+                            "\t\tOnly search tracks, albums and playlists which have been loaded before, "\
+                            "without asking a backend\n\n"
 #define HELP_TXT_QUIT       "Usage: smp quit\n\n"\
                             "Causes the daemon to quit\n\n"
 #define HELP_TXT_OPEN       "Usage: smp open [URI]\n\n" \
@@ -106,6 +111,16 @@
                             "option or in the interactive menu.\n\n"\
                             "\t-p, --page\n"\
                             "\t\tControl what page should be show on the playlist list. Does nothing by itself.\n\n"
+#define HELP_TXT_STATS      "Usage: smp stats [OPTIONS...]\n\n"\
+                            "Without any options, this command will print the audio statistics collected by the daemon. "\
+                            "These include the number of underruns (times the audio device asked for more audio than had been "\
+                            "downloaded and decoded), the amount of silence inserted because of them, a histogram of how long "\
+                            "the audio callback took, how far decoding is ahead of playback and the latency reported by the audio device.\n\n"\
+                            "OPTIONS\n"\
+                            "\t-?, --help\n"\
+                            "\t\tShow this menu\n\n"\
+                            "\t-r, --reset\n"\
+                            "\t\tReset all counters to zero\n\n"
 
 #define PLAYLISTS_PER_PAGE 10
 
@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <unistd.h>
 #include "config.h"
@@ -11,6 +12,8 @@
 #include "../lib/cjson/cJSON.h"
 
 uint32_t preload_amount;
+char *cache_path;
+size_t cache_path_len;
 char *track_save_path;
 size_t track_save_path_len;
 char *track_info_path;
@@ -20,6 +23,21 @@ size_t album_info_path_len;
 char *playlist_info_path;
 size_t playlist_info_path_len;
 double initial_volume;
+uint32_t prebuffer_min_ms;
+double prebuffer_strictness;
+uint64_t track_cache_size;
+bool track_cache_lfu;
+bool track_store_pack;
+bool verify_cached_tracks;
+uint32_t io_threads;
+uint32_t album_info_ttl;
+uint32_t playlist_info_ttl;
+uint32_t unavailable_ttl;
+uint64_t response_cache_size;
+uint32_t response_cache_ttl;
+bool response_cache_persist;
+uint32_t search_debounce_ms;
+uint32_t radio_lookahead;
 struct backend_instance *backend_instances;
 size_t backend_instance_count;
 
@@ -122,6 +140,13 @@ int load_config() {
     free(config_file);
 
     preload_amount = cJSON_GetDefault(config_root, "preload_amount", int, 3);
+    if (cJSON_HasObjectItem(config_root, "cache_path")) {
+        get_path_config_value(&cache_path, cJSON_GetObjectItem(config_root, "cache_path"));
+    } else {
+        cache_path = strdup(cache_home);
+    }
+    cache_path_len = strlen(cache_path);
+
     if (cJSON_HasObjectItem(config_root, "track_save_path")) {
         get_path_config_value(&track_save_path, cJSON_GetObjectItem(config_root, "track_save_path"));
     } else {
@@ -159,6 +184,34 @@ int load_config() {
     track_info_path_len = strlen(track_info_path);
 
     initial_volume = cJSON_GetDefault(config_root, "initial_volume", double, 1.0);
+    int prebuffer_min = cJSON_GetDefault(config_root, "prebuffer_min_ms", int, 500);
+    prebuffer_min_ms = prebuffer_min > 0 ? prebuffer_min : 0;
+    prebuffer_strictness = cJSON_GetDefault(config_root, "prebuffer_strictness", double, 1.0);
+    if (prebuffer_strictness < 0) prebuffer_strictness = 0;
+    double cache_size_mb = cJSON_GetDefault(config_root, "track_cache_size", double, 4096.0);
+    track_cache_size = cache_size_mb > 0 ? (uint64_t) (cache_size_mb * 1024 * 1024) : 0;
+    cJSON *policy = cJSON_GetObjectItem(config_root, "track_cache_policy");
+    track_cache_lfu = cJSON_IsString(policy) && strcasecmp(policy->valuestring, "lfu") == 0;
+    cJSON *store = cJSON_GetObjectItem(config_root, "track_store");
+    track_store_pack = cJSON_IsString(store) && strcasecmp(store->valuestring, "pack") == 0;
+    verify_cached_tracks = !cJSON_IsFalse(cJSON_GetObjectItem(config_root, "verify_cached_tracks"));
+    int threads = cJSON_GetDefault(config_root, "io_threads", int, 2);
+    io_threads = threads > 0 ? threads : 1;
+    int album_ttl = cJSON_GetDefault(config_root, "album_info_ttl", int, 7 * 24 * 60 * 60);
+    album_info_ttl = album_ttl > 0 ? album_ttl : 0;
+    int playlist_ttl = cJSON_GetDefault(config_root, "playlist_info_ttl", int, 60 * 60);
+    playlist_info_ttl = playlist_ttl > 0 ? playlist_ttl : 0;
+    int unavailable = cJSON_GetDefault(config_root, "unavailable_ttl", int, 24 * 60 * 60);
+    unavailable_ttl = unavailable > 0 ? unavailable : 0;
+    double response_size_mb = cJSON_GetDefault(config_root, "response_cache_size", double, 16.0);
+    response_cache_size = response_size_mb > 0 ? (uint64_t) (response_size_mb * 1024 * 1024) : 0;
+    int response_ttl = cJSON_GetDefault(config_root, "response_cache_ttl", int, 60 * 60);
+    response_cache_ttl = response_ttl > 0 ? response_ttl : 0;
+    response_cache_persist = !cJSON_IsFalse(cJSON_GetObjectItem(config_root, "response_cache_persist"));
+    int debounce = cJSON_GetDefault(config_root, "search_debounce_ms", int, 150);
+    search_debounce_ms = debounce > 0 ? debounce : 0;
+    int lookahead = cJSON_GetDefault(config_root, "radio_lookahead", int, 3);
+    radio_lookahead = lookahead > 0 ? lookahead : 0;
 
     cJSON *v = NULL;
     if (!cJSON_HasObjectItem(config_root, "backend_instances") ||
@@ -175,8 +228,12 @@ int load_config() {
     free(data);
     cJSON_Delete(config_root);
     free(cache_home);
-    printf("[config] Loaded values from config:\n - preload_amount: %d\n - track_save_path: %s\n - playlist_info_path: %s\n - album_info_path: %s\n - track_info_path: %s\n - initial_volume: %f\n",
-           preload_amount, track_save_path, playlist_info_path, album_info_path, track_info_path, initial_volume);
+    printf("[config] Loaded values from config:\n - preload_amount: %d\n - cache_path: %s\n - track_save_path: %s\n - playlist_info_path: %s\n - album_info_path: %s\n - track_info_path: %s\n - initial_volume: %f\n - prebuffer_min_ms: %u\n - prebuffer_strictness: %f\n - track_cache_size: %lu\n - track_cache_policy: %s\n - track_store: %s\n - verify_cached_tracks: %d\n - io_threads: %u\n - album_info_ttl: %u\n - playlist_info_ttl: %u\n - unavailable_ttl: %u\n - response_cache_size: %lu\n - response_cache_ttl: %u\n - response_cache_persist: %d\n - search_debounce_ms: %u\n - radio_lookahead: %u\n",
+           preload_amount, cache_path, track_save_path, playlist_info_path, album_info_path, track_info_path, initial_volume,
+           prebuffer_min_ms, prebuffer_strictness, (unsigned long) track_cache_size, track_cache_lfu ? "lfu" : "lru",
+           track_store_pack ? "pack" : "files", verify_cached_tracks, io_threads,
+           album_info_ttl, playlist_info_ttl, unavailable_ttl, (unsigned long) response_cache_size, response_cache_ttl,
+           response_cache_persist, search_debounce_ms, radio_lookahead);
     printf(" - backend_instances: ");
     for (int i = 0; i < backend_instance_count; ++i) {
         if (i != 0) {
@@ -189,6 +246,7 @@ int load_config() {
 }
 
 void clean_config() {
+    free(cache_path);
     free(playlist_info_path);
     free(album_info_path);
     free(track_info_path);
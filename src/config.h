@@ -10,6 +10,8 @@
 #include <stdbool.h>
 
 extern uint32_t preload_amount;
+extern char *cache_path;
+extern size_t cache_path_len;
 extern char *track_save_path;
 extern size_t track_save_path_len;
 extern char *track_info_path;
@@ -19,6 +21,21 @@ extern size_t album_info_path_len;
 extern char *playlist_info_path;
 extern size_t playlist_info_path_len;
 extern double initial_volume;
+extern uint32_t prebuffer_min_ms;
+extern double prebuffer_strictness;
+extern uint64_t track_cache_size;
+extern bool track_cache_lfu;
+extern bool track_store_pack;
+extern bool verify_cached_tracks;
+extern uint32_t io_threads;
+extern uint32_t album_info_ttl;
+extern uint32_t playlist_info_ttl;
+extern uint32_t unavailable_ttl;
+extern uint64_t response_cache_size;
+extern uint32_t response_cache_ttl;
+extern bool response_cache_persist;
+extern uint32_t search_debounce_ms;
+extern uint32_t radio_lookahead;
 
 extern struct backend_instance {
     char *host;
@@ -0,0 +1,76 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t c = ~crc;
+    for (; len && ((uintptr_t) p & 7); --len) c = _mm_crc32_u8((uint32_t) c, *p++);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len; --len) c = _mm_crc32_u8((uint32_t) c, *p++);
+    return ~(uint32_t) c;
+}
+
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t c = ~crc;
+    for (; len && ((uintptr_t) p & 7); --len) c = __crc32cb(c, *p++);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = __crc32cd(c, v);
+    }
+    for (; len; --len) c = __crc32cb(c, *p++);
+    return ~c;
+}
+
+#else
+#include <stdbool.h>
+
+#define POLY 0x82f63b78 // Reversed Castagnoli polynomial
+
+static uint32_t table[8][256];
+static bool table_ready = false;
+
+static void
+init_table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+    }
+    table_ready = true;
+}
+
+// Slicing-by-8, processes 8 bytes per step using one table per byte position
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t len) {
+    if (!table_ready) init_table();
+    const uint8_t *p = data;
+    uint32_t c = ~crc;
+    for (; len && ((uintptr_t) p & 7); --len) c = table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo = c ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+        uint32_t hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 | (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+        c = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+            table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    for (; len; --len) c = table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+#endif
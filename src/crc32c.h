@@ -0,0 +1,13 @@
+#ifndef SMP_CRC32C_H
+#define SMP_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Continues a CRC-32C (Castagnoli) checksum over len more bytes. Start with crc = 0. Uses the crc32 instructions when
+ * the target supports them, which it does on most machines since smp is built with -march=native.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif //SMP_CRC32C_H
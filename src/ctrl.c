@@ -6,11 +6,19 @@
 #include <event2/event.h>
 #include <unistd.h>
 #include <string.h>
-#include <math.h>
 #include "ctrl.h"
 #include "audio.h"
 #include "dbus.h"
 #include "spotify.h"
+#include "config.h"
+#include "history.h"
+#include "track-cache.h"
+#include "search-session.h"
+#include "local-search.h"
+#include "shuffle.h"
+
+// More tracks than this added at once are announced with TrackListReplaced instead of a TrackAdded signal each
+#define TRACK_SIGNALS_MAX 64
 
 struct smp_context {
     struct event_base *base;
@@ -28,107 +36,517 @@ struct smp_context {
 
     bool shuffle;
 
+    // These hold slots of spotify->tracks, see queue.h
     int64_t track_index;
-    int64_t *shuffle_table;
-    int64_t shuffle_table_size;
-    int64_t shuffle_index;
+    int64_t removed_position; // Position the current track had before it was removed from the queue
+    struct shuffle shuffle_order; // Only kept up to date while shuffle is on
+    int64_t shuffle_index; // Position in shuffle_order
+    int64_t shuffle_anchor; // Track which was playing when shuffle was turned on, -1 if none
+    int64_t shuffle_anchor_limit; // Slots below this queued before the anchor had already been played then
+
+    struct event *prefetch_event;
+    struct connection *prefetch_conn;
+    int64_t prefetch_track; // Slot of the track being downloaded in the background, -1 if none
+    bool play_after_prefetch; // The current track is the one being prefetched and starts once it's stored
+
+    bool tracks_replaced; // Set when the queue was cleared since TrackList clients were told about it
+    uint64_t queue_generation; // Changes whenever the queue is cleared, so tracks requested before can be dropped
+};
+
+struct enqueue_request {
+    struct smp_context *ctx;
+    uint64_t generation;
+    int64_t after;
+    bool play;
+};
+
+// Tracks requested for the queue, which are dropped if the queue was cleared before they arrived
+struct queue_load {
+    struct smp_context *ctx;
+    uint64_t generation;
 };
 
 bool recommendations_loading = false;
 struct connection *currently_streaming;
 PlaylistInfo *previous_playlist = NULL;
 
-static int64_t
-random_int(int64_t max){
-    return (int64_t) round(((double) (rand())/ (double) (RAND_MAX)) * (double) max);
+static bool
+queued(struct smp_context *ctx, int64_t slot) {
+    return slot >= 0 && queue_contains(&ctx->spotify->queue, (uint32_t) slot);
 }
 
+// Position of the first track in the shuffle order which hasn't been played yet
+static int64_t
+first_unplayed(struct smp_context *ctx) {
+    int64_t length = (int64_t) shuffle_length(&ctx->shuffle_order);
+    bool played = audio_started(ctx->audio_ctx) && length > ctx->shuffle_index;
+    int64_t from = ctx->shuffle_index + (int64_t) played;
+    if (from < 0) return 0;
+    return from > length ? length : from;
+}
+
+/*
+ * Whether the track at a position of the shuffle order should be played. Removed tracks are skipped, and so are the
+ * ones which came before the anchor in the queue, since they were played before shuffle was turned on.
+ */
+static bool
+shuffle_playable(struct smp_context *ctx, int64_t slot) {
+    if (!queued(ctx, slot)) return false;
+    if (slot >= ctx->shuffle_anchor_limit || slot == ctx->shuffle_anchor || !queued(ctx, ctx->shuffle_anchor))
+        return true;
+    struct queue *queue = &ctx->spotify->queue;
+    return queue_position(queue, slot) > queue_position(queue, ctx->shuffle_anchor);
+}
+
+// Starts a new shuffle order of the whole queue, which begins with first if it is queued
 static void
-update_shuffle_table(struct smp_context *ctx, int64_t from, int64_t size) {
-    if (!size || (size == ctx->shuffle_table_size && ctx->shuffle_table) || from >= size) return;
-
-    if (ctx->shuffle_table_size != size){
-        int64_t *tmp = realloc(ctx->shuffle_table, size * sizeof(*ctx->shuffle_table));
-        if (!tmp){
-            perror("Error when calling realloc");
-            exit(EXIT_FAILURE);
+restart_shuffle(struct smp_context *ctx, int64_t first) {
+    size_t slot_count = ctx->spotify->queue.synced;
+    bool anchored = queued(ctx, first);
+    shuffle_start(&ctx->shuffle_order, anchored ? (uint32_t) first : SHUFFLE_NONE, slot_count);
+    ctx->shuffle_anchor = anchored ? first : -1;
+    ctx->shuffle_anchor_limit = (int64_t) slot_count;
+    ctx->shuffle_index = 0;
+}
+
+// Position in the queue that the current track has, or had before it was removed when moving in direction dir
+static int64_t
+current_position(struct smp_context *ctx, int64_t dir) {
+    if (queued(ctx, ctx->track_index)) return (int64_t) queue_position(&ctx->spotify->queue, ctx->track_index);
+    return ctx->removed_position - (dir > 0);
+}
+
+/*
+ * Returns the slot of the track that will be played n tracks after the current one, following the shuffle order and
+ * loop mode, or -1 if it isn't known yet.
+ */
+static int64_t
+upcoming_track_index(struct smp_context *ctx, int64_t n) {
+    struct queue *queue = &ctx->spotify->queue;
+    if (loop_mode == LOOP_MODE_TRACK || !queue_length(queue)) return -1;
+    // Waiting for recommendations to be appended
+    if (!ctx->shuffle && ctx->track_index >= (int64_t) ctx->spotify->track_count) return -1;
+    if (ctx->shuffle) {
+        int64_t length = (int64_t) shuffle_length(&ctx->shuffle_order);
+        int64_t pos = ctx->shuffle_index;
+        while (n > 0) {
+            if (++pos >= length) return -1; // Looping starts a new order, which isn't known yet
+            if (shuffle_playable(ctx, shuffle_at(&ctx->shuffle_order, pos))) n--;
         }
-        ctx->shuffle_table = tmp;
-        ctx->shuffle_table_size = size;
+        return shuffle_at(&ctx->shuffle_order, pos);
     }
+    int64_t pos = current_position(ctx, 1) + n;
+    if (pos >= queue_length(queue)) {
+        if (loop_mode != LOOP_MODE_PLAYLIST) return -1;
+        pos %= (int64_t) queue_length(queue);
+    }
+    return queue_at(queue, pos);
+}
 
-    for (int64_t i = from; i < size; ++i) {
-        ctx->shuffle_table[i] = i;
+static bool
+in_prefetch_window(struct smp_context *ctx, int64_t index) {
+    for (int64_t n = 1; n <= preload_amount; ++n) {
+        int64_t i = upcoming_track_index(ctx, n);
+        if (i < 0) return false;
+        if (i == index) return true;
     }
+    return false;
+}
+
+// Whether the background download is still wanted, either for an upcoming track or for the one waiting to play
+static bool
+prefetch_needed(struct smp_context *ctx) {
+    if (ctx->play_after_prefetch && ctx->prefetch_track == ctx->track_index) return true;
+    return in_prefetch_window(ctx, ctx->prefetch_track);
+}
+
+static void
+schedule_prefetch(struct smp_context *ctx) {
+    if (ctx->prefetch_event) event_active(ctx->prefetch_event, EV_TIMEOUT, 0);
+}
+
+static void
+abort_prefetch(struct smp_context *ctx) {
+    ctx->play_after_prefetch = false;
+    if (!ctx->prefetch_conn) return;
+    printf("[ctrl] Aborting background download of track %ld\n", (long) ctx->prefetch_track);
+    abort_track_transfer(ctx->prefetch_conn);
+    if (ctx->prefetch_track >= 0 && ctx->prefetch_track < ctx->spotify->track_count)
+        ctx->spotify->tracks[ctx->prefetch_track].download_state = DS_NOT_DOWNLOADED;
+    ctx->prefetch_conn = NULL;
+    ctx->prefetch_track = -1;
+}
+
+static void play_error_cb(struct spotify_state *spotify, void *userp);
+
+// Starts the track which was waiting for its background download, which plays from the cache if that finished
+static void
+play_prefetched(struct smp_context *ctx) {
+    ctx->play_after_prefetch = false;
+    if (play_track(ctx->spotify, &ctx->spotify->tracks[ctx->track_index], &ctx->audio_buf, &currently_streaming))
+        play_error_cb(ctx->spotify, ctx);
+}
 
-    int64_t i1, i2, tmp;
-    for (int64_t i = from; i < size; ++i) {
-        i1 = from + random_int(size-from-1);
-        i2 = from + random_int(size-from-1);
+static void
+prefetch_done_cb(struct spotify_state *spotify, void *userp) {
+    struct smp_context *ctx = (struct smp_context*) userp;
+    if (ctx->prefetch_track >= 0 && ctx->prefetch_track < spotify->track_count)
+        spotify->tracks[ctx->prefetch_track].download_state = DS_DOWNLOADED;
+    bool waiting = ctx->play_after_prefetch && ctx->prefetch_track == ctx->track_index;
+    ctx->prefetch_conn = NULL;
+    ctx->prefetch_track = -1;
+    if (waiting) play_prefetched(ctx);
+    schedule_prefetch(ctx);
+}
 
-        tmp = ctx->shuffle_table[i1];
-        ctx->shuffle_table[i1] = ctx->shuffle_table[i2];
-        ctx->shuffle_table[i2] = tmp;
+static void
+stream_done_cb(struct spotify_state *spotify, void *userp) {
+    schedule_prefetch((struct smp_context*) userp);
+}
+
+static void
+prefetch_next(int fd, short what, void *arg) {
+    struct smp_context *ctx = (struct smp_context*) arg;
+    if (ctx->prefetch_conn || !audio_started(ctx->audio_ctx)) return;
+    // Background downloads only run while the track that is playing isn't downloading
+    if (currently_streaming && currently_streaming->busy) return;
+
+    for (int64_t n = 1; n <= preload_amount; ++n) {
+        int64_t index = upcoming_track_index(ctx, n);
+        if (index < 0) return;
+        Track *track = &ctx->spotify->tracks[index];
+        if (track->download_state == DS_DOWNLOADED || track->download_state == DS_DOWNLOAD_FAILED) continue;
+
+        struct connection *conn = NULL;
+        if (ensure_track(ctx->spotify, track, prefetch_done_cb, ctx, &conn)) {
+            track->download_state = DS_DOWNLOAD_FAILED;
+            continue;
+        }
+        if (!conn) { // Already cached
+            track->download_state = DS_DOWNLOADED;
+            continue;
+        }
+        printf("[ctrl] Downloading upcoming track '%s' in the background\n", track->info->spotify_name);
+        track->download_state = DS_DOWNLOADING;
+        ctx->prefetch_conn = conn;
+        ctx->prefetch_track = index;
+        return;
+    }
+}
+
+static void
+invalidate_property(dbus_interface *iface, const char *name) {
+    dbus_util_invalidate_property(iface, name);
+    dbus_queue_signals();
+}
+
+static void
+clear_queue(struct smp_context *ctx) {
+    clear_tracks(ctx->spotify->tracks, &ctx->spotify->track_count, &ctx->spotify->track_size);
+    queue_reset(&ctx->spotify->queue);
+    queue_index_reset(&ctx->spotify->queue_index);
+    shuffle_reset(&ctx->shuffle_order);
+    ctx->shuffle_anchor = -1;
+    ctx->tracks_replaced = true;
+    ctx->queue_generation++;
+    recommendations_loading = false; // Whatever is still loading is dropped when it arrives
+}
+
+/*
+ * Adds the tracks appended to spotify->tracks since the last call to the queue at position and to the shuffle order,
+ * with the first of them played next in shuffle order if play_first is set. TrackList clients are sent a TrackAdded
+ * signal for each. If the queue was cleared in the meantime, or many tracks were added at once, a single
+ * TrackListReplaced is sent instead. Returns the slot of the first added track, or -1 if there are none.
+ */
+static int64_t
+sync_queue(struct smp_context *ctx, size_t position, bool play_first) {
+    struct queue *queue = &ctx->spotify->queue;
+    int64_t first = (int64_t) queue->synced;
+    size_t added = queue_sync(queue, ctx->spotify->track_count, position);
+    if (added && ctx->shuffle) {
+        int64_t from = first_unplayed(ctx);
+        shuffle_add(&ctx->shuffle_order, from, (uint32_t) first, added, play_first);
+        if (play_first) ctx->shuffle_index = from;
     }
+
+    if (ctx->bus && (added || ctx->tracks_replaced)) {
+        if (ctx->tracks_replaced || added > TRACK_SIGNALS_MAX) {
+            handle_track_list_replaced(ctx->bus, ctx);
+        } else {
+            for (size_t i = 0; i < added; ++i) handle_track_added(ctx->bus, ctx, first + i);
+        }
+        ctx->tracks_replaced = false;
+    }
+    return added ? first : -1;
 }
 
+static void
+play_error_cb(struct spotify_state *spotify, void *userp) {
+    struct smp_context *ctx = (struct smp_context*) userp;
+    fprintf(stderr, "[ctrl] Error occurred while trying to play track, playing next one.\n");
+    static const enum AudioThreadSignal NEXT_SIG = AUDIO_THREAD_SIGNAL_TRACK_OVER;
+    write(ctx->audio_next_fd[1], &NEXT_SIG, sizeof(NEXT_SIG));
+}
+
+static void refill_radio(struct smp_context *ctx);
+
 static void
 wrapped_play_track(struct smp_context *ctx) {
-    cancel_track_transfer(currently_streaming);
-    if (ctx->shuffle) ctx->track_index = ctx->shuffle_table[ctx->shuffle_index];
+    if (currently_streaming != ctx->prefetch_conn) cancel_track_transfer(currently_streaming);
+    currently_streaming = NULL;
+    if (ctx->shuffle) {
+        int64_t length = (int64_t) shuffle_length(&ctx->shuffle_order);
+        while (ctx->shuffle_index < length &&
+               !shuffle_playable(ctx, shuffle_at(&ctx->shuffle_order, ctx->shuffle_index)))
+            ctx->shuffle_index++;
+        if (ctx->shuffle_index >= length) return;
+        ctx->track_index = shuffle_at(&ctx->shuffle_order, ctx->shuffle_index);
+    }
+    ctx->play_after_prefetch = false;
+    if (!queued(ctx, ctx->track_index)) return;
     Track *track = &ctx->spotify->tracks[ctx->track_index];
-    if(play_track(ctx->spotify, track, &ctx->audio_buf, &currently_streaming)){
-        fprintf(stderr, "[ctrl] Error occurred while trying to play track, playing next one.\n");
-        static const enum AudioThreadSignal NEXT_SIG = AUDIO_THREAD_SIGNAL_TRACK_OVER;
-        write(ctx->audio_next_fd[1], &NEXT_SIG, sizeof(NEXT_SIG));
-        return;
+    if (ctx->prefetch_conn && ctx->prefetch_track == ctx->track_index) {
+        // A half finished background download can't be played, but restarting it would throw away what it has
+        printf("[ctrl] Waiting for the background download of '%s' to finish\n", track->info->spotify_name);
+        hold_playback(ctx->spotify);
+        ctx->play_after_prefetch = true;
+    } else {
+        if (ctx->prefetch_conn && !in_prefetch_window(ctx, ctx->prefetch_track)) abort_prefetch(ctx);
+        if (play_track(ctx->spotify, track, &ctx->audio_buf, &currently_streaming)) {
+            play_error_cb(ctx->spotify, ctx);
+            return;
+        }
     }
+    history_record(HISTORY_TRACK, track->spotify_id);
     if (track->playlist != previous_playlist){
         deref_playlist(previous_playlist);
         previous_playlist = track->playlist;
-        if (previous_playlist) previous_playlist->reference_count++;
-        dbus_util_invalidate_property(ctx->playlist_iface, "ActivePlaylist");
+        SpotifyId playlist_id;
+        if (previous_playlist) {
+            previous_playlist->reference_count++;
+            if (spotify_id_parse(previous_playlist->spotify_id, &playlist_id))
+                history_record(previous_playlist->album ? HISTORY_ALBUM : HISTORY_PLAYLIST, playlist_id);
+            previous_playlist->last_played = time(NULL);
+        }
+        invalidate_property(ctx->playlist_iface, "ActivePlaylist");
+    }
+    invalidate_property(ctx->player_iface, "Metadata");
+    schedule_prefetch(ctx);
+    refill_radio(ctx);
+}
+
+static void
+refresh_prefetch(struct smp_context *ctx) {
+    if (ctx->prefetch_conn && !prefetch_needed(ctx)) abort_prefetch(ctx);
+    schedule_prefetch(ctx);
+}
+
+/*
+ * Drops the tracks appended since the queue was last synced which are already queued, and the ones which were played
+ * before unless that would leave none of them. Returns how many are left.
+ */
+static size_t
+dedupe_recommendations(struct spotify_state *spotify) {
+    size_t first = spotify->queue.synced, kept = first;
+    bool skip_played = false;
+    for (size_t i = first; i < spotify->track_count && !skip_played; ++i)
+        skip_played = !history_get(HISTORY_TRACK, spotify->tracks[i].spotify_id, NULL, NULL);
+
+    for (size_t i = first; i < spotify->track_count; ++i) {
+        Track *track = &spotify->tracks[i];
+        // Only the slots before kept are looked at, which also catches a track recommended twice
+        if (queue_index_find(&spotify->queue_index, spotify->tracks, kept, track->spotify_id) >= 0 ||
+            (skip_played && history_get(HISTORY_TRACK, track->spotify_id, NULL, NULL))) {
+            free_track(track);
+            continue;
+        }
+        if (i != kept) {
+            spotify->tracks[kept] = *track;
+            memset(track, 0, sizeof(*track));
+        }
+        kept++;
+    }
+    spotify->track_count = kept;
+    return kept - first;
+}
+
+// Queues the recommendations appended to spotify->tracks, and plays the first if playback ran past the end for them
+static void
+queue_recommendations(struct smp_context *ctx) {
+    struct spotify_state *spotify = ctx->spotify;
+    bool waiting = ctx->shuffle ? ctx->shuffle_index >= (int64_t) shuffle_length(&ctx->shuffle_order)
+                                : ctx->track_index >= (int64_t) spotify->queue.synced;
+    size_t added = dedupe_recommendations(spotify);
+    printf("[ctrl] Added %zu recommended tracks to the queue\n", added);
+    int64_t first = sync_queue(ctx, SIZE_MAX, false);
+    if (first < 0) return;
+    if (waiting) {
+        ctx->track_index = first;
+        wrapped_play_track(ctx);
+        return;
+    }
+    refresh_prefetch(ctx);
+    refill_radio(ctx);
+}
+
+/*
+ * Returns whether the queue was cleared since tracks were requested for it in generation, in which case the tracks
+ * appended to spotify->tracks for them are freed. Tracks are appended by the response right before its callback runs,
+ * so they are all the ones after the synced part.
+ */
+static bool
+drop_stale_load(struct smp_context *ctx, uint64_t generation) {
+    struct spotify_state *spotify = ctx->spotify;
+    if (generation == ctx->queue_generation) return false;
+    for (size_t i = spotify->queue.synced; i < spotify->track_count; ++i) free_track(&spotify->tracks[i]);
+    spotify->track_count = spotify->queue.synced;
+    return true;
+}
+
+static struct queue_load *
+new_queue_load(struct smp_context *ctx) {
+    struct queue_load *load = malloc(sizeof(*load));
+    load->ctx = ctx;
+    load->generation = ctx->queue_generation;
+    return load;
+}
+
+static void
+recommendations_loaded_cb(struct spotify_state *spotify, void *userp) {
+    struct queue_load *load = userp;
+    struct smp_context *ctx = load->ctx;
+    bool stale = drop_stale_load(ctx, load->generation);
+    free(load);
+    if (stale) return; // A newer request may be loading already
+    recommendations_loading = false;
+    queue_recommendations(ctx);
+}
+
+static void
+request_recommendations(struct smp_context *ctx) {
+    if (recommendations_loading) return;
+    struct spotify_state *spotify = ctx->spotify;
+    struct queue_load *load = new_queue_load(ctx);
+    recommendations_loading = true;
+    if (add_recommendations_from_tracks(spotify, &spotify->tracks, &spotify->track_size, &spotify->track_count,
+                                        recommendations_loaded_cb, load)) {
+        fprintf(stderr, "[ctrl] Error when requesting recommendations\n");
+        recommendations_loading = false;
+        free(load);
     }
-    dbus_util_invalidate_property(ctx->player_iface, "Metadata");
+    // Cached tracks found locally can play right away, while the backend is asked for more or is unreachable
+    if (add_local_recommendations(spotify, &spotify->tracks, &spotify->track_size, &spotify->track_count))
+        queue_recommendations(ctx);
+}
+
+/*
+ * Requests recommendations in the background once fewer than radio_lookahead tracks are left to play, so that the
+ * queue is refilled before it runs out instead of after.
+ */
+static void
+refill_radio(struct smp_context *ctx) {
+    if (!radio_lookahead || loop_mode == LOOP_MODE_TRACK || loop_mode == LOOP_MODE_PLAYLIST) return;
+    if (!queue_length(&ctx->spotify->queue) || !audio_started(ctx->audio_ctx)) return;
+    if (upcoming_track_index(ctx, radio_lookahead) >= 0) return;
+    request_recommendations(ctx);
 }
 
 static void
 wrapped_update_shuffle_table(struct spotify_state *spotify, void *userp){
     struct smp_context *ctx = (struct smp_context*) userp;
-    bool should_add = audio_started(ctx->audio_ctx) && ctx->shuffle_table_size > ctx->shuffle_index;
-    update_shuffle_table(ctx, ctx->shuffle_index + ((int64_t) should_add), (int64_t) spotify->track_count);
+    sync_queue(ctx, SIZE_MAX, false);
+    refresh_prefetch(ctx);
 }
 
 static void
-tracks_loaded_cb(struct spotify_state *spotify, void *userp) {
-    struct smp_context *ctx = (struct smp_context*) userp;
-    recommendations_loading = false;
+tracks_appended_cb(struct spotify_state *spotify, void *userp) {
+    struct queue_load *load = userp;
+    struct smp_context *ctx = load->ctx;
+    bool stale = drop_stale_load(ctx, load->generation);
+    free(load);
+    if (!stale) wrapped_update_shuffle_table(spotify, ctx);
+}
+
+static void
+play_loaded_tracks(struct smp_context *ctx) {
     printf("[ctrl] Track list loaded\n");
-    bool should_add = audio_started(ctx->audio_ctx) && ctx->shuffle_table_size > ctx->shuffle_index;
-    update_shuffle_table(ctx, ctx->shuffle_index + ((int64_t) should_add), (int64_t) ctx->spotify->track_count);
+    int64_t first = sync_queue(ctx, SIZE_MAX, false);
+    if (first >= 0 && !queued(ctx, ctx->track_index)) ctx->track_index = first;
     wrapped_play_track(ctx);
-    dbus_util_invalidate_property(ctx->tracks_iface, "Tracks");
+}
+
+static void
+tracks_loaded_cb(struct spotify_state *spotify, void *userp) {
+    struct queue_load *load = userp;
+    struct smp_context *ctx = load->ctx;
+    bool stale = drop_stale_load(ctx, load->generation);
+    free(load);
+    if (!stale) play_loaded_tracks(ctx);
+}
+
+static void
+enqueue_loaded_cb(struct spotify_state *spotify, void *userp) {
+    struct enqueue_request *req = userp;
+    struct smp_context *ctx = req->ctx;
+    if (drop_stale_load(ctx, req->generation)) {
+        free(req);
+        return;
+    }
+    struct queue *queue = &spotify->queue;
+    size_t position = queue_length(queue);
+    if (req->after == CTRL_ENQUEUE_FRONT) position = 0;
+    else if (queued(ctx, req->after)) position = queue_position(queue, req->after) + 1;
+
+    bool play = req->play || !queue_length(queue);
+    int64_t first = sync_queue(ctx, position, play);
+    free(req);
+    if (first < 0) return;
+    if (play) {
+        ctx->track_index = first;
+        wrapped_play_track(ctx);
+    } else {
+        refresh_prefetch(ctx);
+    }
+}
+
+static void
+tracks_added_cb(struct spotify_state *spotify, void *userp) {
+    wrapped_update_shuffle_table(spotify, userp);
 }
 
 static void
 playlist_loaded_cb(struct spotify_state *spotify, void *userp){
-    struct smp_context *ctx = (struct smp_context*) userp;
-    dbus_util_invalidate_property(ctx->tracks_iface, "PlaylistCount");
-    tracks_loaded_cb(spotify, userp);
+    struct queue_load *load = userp;
+    struct smp_context *ctx = load->ctx;
+    bool stale = drop_stale_load(ctx, load->generation);
+    free(load);
+    invalidate_property(ctx->tracks_iface, "PlaylistCount");
+    if (!stale) play_loaded_tracks(ctx);
 }
 
 static void
 spotify_conn_err(struct connection *conn, void *userp) {
+    struct smp_context *ctx = (struct smp_context*) userp;
     if (conn->payload) { // Remove possible left over files
         if (conn->payload[0] == MUSIC_DATA || conn->payload[0] == MUSIC_INFO) {
-            char *music_info_path, *music_data_path;
-            track_info_filepath_id(&conn->payload[1], &music_info_path);
-            track_filepath_id(&conn->payload[1], &music_data_path);
-            remove(music_info_path);
-            remove(music_data_path);
+            cache_unlink(CACHE_DIR_TRACK_INFO, &conn->payload[1]);
+            track_store_remove(&conn->payload[1]);
+            SpotifyId id;
+            if (spotify_id_parse(&conn->payload[1], &id)) track_cache_remove(id);
         }
     }
 
+    if (conn == currently_streaming) audio_set_buffering(ctx->audio_ctx, false);
+    if (conn == ctx->prefetch_conn) {
+        if (ctx->prefetch_track >= 0 && ctx->prefetch_track < ctx->spotify->track_count)
+            ctx->spotify->tracks[ctx->prefetch_track].download_state = DS_DOWNLOAD_FAILED;
+        bool waiting = ctx->play_after_prefetch && ctx->prefetch_track == ctx->track_index;
+        ctx->prefetch_conn = NULL;
+        ctx->prefetch_track = -1;
+        if (waiting) play_prefetched(ctx); // Streams it instead
+        schedule_prefetch(ctx);
+    }
+
     printf("[ctrl] Error occurred on connection, trying to play next track\n");
 }
 
@@ -157,6 +575,69 @@ next_track_cb(int fd, short t, void *param){
     }
 }
 
+void
+ctrl_enqueue(struct smp_context *ctx, const char *uri, int64_t after, bool play) {
+    char id[SPOTIFY_ID_LEN_NULL];
+    enum UriType type = id_from_url(uri, id);
+    if (type == URI_INVALID) return;
+    printf("[ctrl] Adding '%s' to the queue\n", uri);
+
+    struct enqueue_request *req = malloc(sizeof(*req));
+    req->ctx = ctx;
+    req->generation = ctx->queue_generation;
+    req->after = after;
+    req->play = play;
+    struct spotify_state *spotify = ctx->spotify;
+    int err;
+    if (type == URI_TRACK)
+        err = add_track_info(spotify, id, &spotify->tracks, &spotify->track_size, &spotify->track_count,
+                             enqueue_loaded_cb, req);
+    else
+        err = add_playlist(spotify, id, &spotify->tracks, &spotify->track_size, &spotify->track_count,
+                           type == URI_ALBUM, enqueue_loaded_cb, req, NULL);
+    if (err) free(req);
+}
+
+void
+ctrl_remove_track(struct smp_context *ctx, int64_t slot) {
+    if (!queued(ctx, slot)) return;
+    struct spotify_state *spotify = ctx->spotify;
+    if (slot == ctx->track_index) ctx->removed_position = (int64_t) queue_position(&spotify->queue, slot);
+    // Has to be sent while the track is still in the queue
+    if (ctx->bus) handle_track_removed(ctx->bus, ctx, slot);
+    queue_remove(&spotify->queue, slot);
+    queue_index_remove(&spotify->queue_index, spotify->tracks, spotify->track_count, slot);
+    // A removed track keeps playing, so the download it waits for isn't aborted
+    if (slot == ctx->prefetch_track && !ctx->play_after_prefetch) abort_prefetch(ctx);
+    refresh_prefetch(ctx);
+}
+
+void
+ctrl_move_track(struct smp_context *ctx, int64_t slot, size_t position) {
+    if (!queued(ctx, slot)) return;
+    if (ctx->bus) handle_track_removed(ctx->bus, ctx, slot);
+    queue_move(&ctx->spotify->queue, slot, position);
+    if (ctx->bus) handle_track_added(ctx->bus, ctx, slot);
+    refresh_prefetch(ctx);
+}
+
+static void
+pin_queued_tracks(struct idmap *pinned, void *userp) {
+    struct smp_context *ctx = (struct smp_context*) userp;
+    struct spotify_state *spotify = ctx->spotify;
+    for (uint32_t slot = queue_at(&spotify->queue, 0); slot != QUEUE_NONE; slot = queue_next(&spotify->queue, slot))
+        idmap_put(pinned, spotify->tracks[slot].spotify_id, 0);
+    // The playing track stays pinned after it was removed from the queue
+    if (ctx->track_index >= 0 && ctx->track_index < (int64_t) spotify->track_count)
+        idmap_put(pinned, spotify->tracks[ctx->track_index].spotify_id, 0);
+}
+
+static void
+search_results_cb(const char *token, uint32_t serial, bool final, struct spotify_search_results *results, void *userp) {
+    struct smp_context *ctx = (struct smp_context *) userp;
+    handle_search_session_results(ctx->bus, token, serial, final, results);
+}
+
 struct smp_context *ctrl_create_context(struct event_base *base) {
     struct smp_context *ctx = calloc(1, sizeof(*ctx));
     ctx->base = base;
@@ -166,6 +647,19 @@ struct smp_context *ctrl_create_context(struct event_base *base) {
     spotify_state->base = base;
     spotify_state->smp_ctx = ctx;
     spotify_state->err_cb = spotify_conn_err;
+    spotify_state->err_userp = ctx;
+    spotify_state->stream_done_cb = stream_done_cb;
+    spotify_state->stream_done_userp = ctx;
+    spotify_state->play_error_cb = play_error_cb;
+    spotify_state->play_error_userp = ctx;
+    spotify_state->tracks_added_cb = tracks_added_cb;
+    spotify_state->tracks_added_userp = ctx;
+
+    ctx->prefetch_track = -1;
+    ctx->shuffle_anchor = -1;
+    ctx->prefetch_event = event_new(base, -1, 0, prefetch_next, ctx);
+    track_cache_init(base, pin_queued_tracks, ctx);
+    search_session_init(base, spotify_state, search_results_cb, ctx);
 
     pipe(ctx->audio_next_fd);
 
@@ -198,9 +692,7 @@ ctrl_quit(struct smp_context *ctx) {
     for (int i = 0; i < ctx->spotify->connections_len; ++i) {
         struct connection *conn = &ctx->spotify->connections[i];
         if (conn->bev) bufferevent_free(conn->bev);
-        if (conn->cache_fp) fclose(conn->cache_fp);
-        if (conn->cache_path) remove(conn->cache_path); // Remove unfinished file
-        if (conn->params.path) free(conn->params.path);
+        track_writer_finish(&conn->cache_writer, false, NULL, NULL); // Remove unfinished track
     }
     event_base_loopbreak(ctx->base);
 }
@@ -209,17 +701,19 @@ void
 ctrl_free(struct smp_context *ctx){
     audio_clean(ctx->audio_ctx);
     if (ctx->audio_next_event) event_free(ctx->audio_next_event);
+    if (ctx->prefetch_event) event_free(ctx->prefetch_event);
+    track_cache_close();
+    search_session_close();
     clean_vorbis_decode(&ctx->spotify->decode_ctx);
-    for (int i = 0; i < sizeof(ctx->spotify->connections) / sizeof(*ctx->spotify->connections); ++i) {
-        free(ctx->spotify->connections[i].cache_path);
-    }
     clear_tracks(ctx->spotify->tracks, &ctx->spotify->track_count, &ctx->spotify->track_size);
     free(ctx->spotify->tracks);
+    queue_free(&ctx->spotify->queue);
+    queue_index_free(&ctx->spotify->queue_index);
     close(ctx->audio_next_fd[0]);
     close(ctx->audio_next_fd[1]);
     memset(ctx->spotify, 0, sizeof(*ctx->spotify));
     free(ctx->spotify);
-    free(ctx->shuffle_table);
+    shuffle_free(&ctx->shuffle_order);
     memset(ctx, 0, sizeof(*ctx));
     free(ctx);
 }
@@ -228,36 +722,42 @@ void
 ctrl_play_album(struct smp_context *ctx, const char *id) {
     printf("[ctrl] Loading album with id %s\n", id);
     if (dbus_util_get_property_bool(ctx->smp_iface, "ReplaceOld")) {
-        clear_tracks(ctx->spotify->tracks, &ctx->spotify->track_count, &ctx->spotify->track_size);
+        abort_prefetch(ctx);
+        clear_queue(ctx);
         ctx->track_index = 0;
         ctx->shuffle_index = 0;
     }
 
-    if (ctx->spotify->track_count == 0)
-        add_playlist(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size, &ctx->spotify->track_count, true,
-                     playlist_loaded_cb, ctx, tracks_loaded_cb);
+    struct queue_load *load = new_queue_load(ctx);
+    int err;
+    if (queue_length(&ctx->spotify->queue) == 0)
+        err = add_playlist(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size,
+                           &ctx->spotify->track_count, true, playlist_loaded_cb, load, tracks_loaded_cb);
     else
-        add_playlist(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size, &ctx->spotify->track_count,
-                     true,
-                     wrapped_update_shuffle_table, ctx, NULL);
+        err = add_playlist(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size,
+                           &ctx->spotify->track_count, true, tracks_appended_cb, load, NULL);
+    if (err) free(load);
 }
 
 void
 ctrl_play_playlist(struct smp_context *ctx, const char *id){
     printf("[ctrl] Loading playlist with id %s\n", id);
     if (dbus_util_get_property_bool(ctx->smp_iface, "ReplaceOld")) {
-        clear_tracks(ctx->spotify->tracks, &ctx->spotify->track_count, &ctx->spotify->track_size);
+        abort_prefetch(ctx);
+        clear_queue(ctx);
         ctx->track_index = 0;
         ctx->shuffle_index = 0;
     }
 
-    if (ctx->spotify->track_count == 0)
-        add_playlist(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size, &ctx->spotify->track_count, false,
-                     playlist_loaded_cb, ctx, tracks_loaded_cb);
+    struct queue_load *load = new_queue_load(ctx);
+    int err;
+    if (queue_length(&ctx->spotify->queue) == 0)
+        err = add_playlist(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size,
+                           &ctx->spotify->track_count, false, playlist_loaded_cb, load, tracks_loaded_cb);
     else
-        add_playlist(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size, &ctx->spotify->track_count,
-                     false,
-                     wrapped_update_shuffle_table, ctx, NULL);
+        err = add_playlist(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size,
+                           &ctx->spotify->track_count, false, tracks_appended_cb, load, NULL);
+    if (err) free(load);
 }
 
 void
@@ -265,14 +765,18 @@ ctrl_play_track(struct smp_context *ctx, const char *id){
     printf("[ctrl] Loading track with id %s\n", id);
 
     if (dbus_util_get_property_bool(ctx->smp_iface, "ReplaceOld")) {
-        clear_tracks(ctx->spotify->tracks, &ctx->spotify->track_count, &ctx->spotify->track_size);
+        abort_prefetch(ctx);
+        clear_queue(ctx);
         ctx->track_index = 0;
         ctx->shuffle_index = 0;
     }
 
-    info_received_cb cb = wrapped_update_shuffle_table;
-    if (ctx->spotify->track_count == 0) cb = tracks_loaded_cb;
-    add_track_info(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size, &ctx->spotify->track_count, cb, ctx);
+    info_received_cb cb = tracks_appended_cb;
+    if (queue_length(&ctx->spotify->queue) == 0) cb = tracks_loaded_cb;
+    struct queue_load *load = new_queue_load(ctx);
+    if (add_track_info(ctx->spotify, id, &ctx->spotify->tracks, &ctx->spotify->track_size, &ctx->spotify->track_count,
+                       cb, load))
+        free(load);
 }
 
 void ctrl_play_uri(struct smp_context *ctx, const char *id){
@@ -295,13 +799,13 @@ void ctrl_play_uri(struct smp_context *ctx, const char *id){
 void
 ctrl_pause(struct smp_context *ctx){
     audio_pause(ctx->audio_ctx);
-    dbus_util_invalidate_property(ctx->player_iface, "PlaybackStatus");
+    invalidate_property(ctx->player_iface, "PlaybackStatus");
 }
 
 void
 ctrl_play(struct smp_context *ctx){
     audio_play(ctx->audio_ctx);
-    dbus_util_invalidate_property(ctx->player_iface, "PlaybackStatus");
+    invalidate_property(ctx->player_iface, "PlaybackStatus");
 }
 
 void
@@ -312,58 +816,65 @@ ctrl_playpause(struct smp_context *ctx){
 
 void
 ctrl_stop(struct smp_context *ctx){
+    abort_prefetch(ctx);
     audio_stop(ctx->audio_ctx);
-    clear_tracks(ctx->spotify->tracks, &ctx->spotify->track_count, &ctx->spotify->track_size);
+    clear_queue(ctx);
     previous_playlist = NULL;
     cancel_track_transfer(currently_streaming);
     currently_streaming = NULL;
-    recommendations_loading = false;
     ctx->track_index = 0;
     ctx->shuffle_index = 0;
-    free(ctx->shuffle_table);
-    ctx->shuffle_table = NULL;
-    ctx->shuffle_table_size = 0;
+    shuffle_free(&ctx->shuffle_order);
     ctx->shuffle = false;
-    dbus_util_invalidate_property(ctx->player_iface, "PlaybackStatus");
-    dbus_util_invalidate_property(ctx->player_iface, "Shuffle");
-    dbus_util_invalidate_property(ctx->tracks_iface, "Tracks");
+    invalidate_property(ctx->player_iface, "PlaybackStatus");
+    invalidate_property(ctx->player_iface, "Shuffle");
+    sync_queue(ctx, SIZE_MAX, false);
 }
 
 void
 ctrl_change_track_index(struct smp_context *ctx, int32_t i){
-    if (ctx->spotify->track_count == 0 || !audio_started(ctx->audio_ctx)) return;
+    struct queue *queue = &ctx->spotify->queue;
+    if (queue_length(queue) == 0 || !audio_started(ctx->audio_ctx)) return;
     if (loop_mode != LOOP_MODE_TRACK)  {
+        bool past_end;
         if (ctx->shuffle){
-            if (ctx->shuffle_index >= ctx->spotify->track_count) return;
-            ctx->shuffle_index += i;
+            int64_t length = (int64_t) shuffle_length(&ctx->shuffle_order);
+            if (ctx->shuffle_index >= length) return;
+            int64_t dir = i < 0 ? -1 : 1;
+            for (int64_t left = llabs(i); left > 0;) { // Skip removed tracks
+                ctx->shuffle_index += dir;
+                if (ctx->shuffle_index < 0 || ctx->shuffle_index >= length) break;
+                if (shuffle_playable(ctx, shuffle_at(&ctx->shuffle_order, ctx->shuffle_index))) left--;
+            }
+            past_end = ctx->shuffle_index >= length || ctx->shuffle_index < 0;
         } else {
-            if (ctx->track_index >= ctx->spotify->track_count) return;
-            ctx->track_index += i;
+            if (!queued(ctx, ctx->track_index) && ctx->track_index >= ctx->spotify->track_count) return;
+            int64_t pos = current_position(ctx, i) + i;
+            past_end = pos >= queue_length(queue) || pos < 0;
+            // Recommendations are appended, so the first of them will get the next slot
+            ctx->track_index = past_end ? (int64_t) ctx->spotify->track_count : queue_at(queue, pos);
         }
-        if ((!ctx->shuffle && (ctx->track_index >= ctx->spotify->track_count || ctx->track_index < 0)) ||
-              ctx->shuffle && (ctx->shuffle_index >= ctx->spotify->track_count || ctx->shuffle_index < 0)) {
+        if (past_end) {
             if (loop_mode == LOOP_MODE_PLAYLIST) {
-                ctx->track_index = 0;
+                ctx->track_index = queue_at(queue, 0);
                 ctx->shuffle_index = 0;
+                if (ctx->shuffle) restart_shuffle(ctx, -1);
                 wrapped_play_track(ctx);
                 return;
             }
-            //Continue playing recommendations
-            if(!recommendations_loading) {
-                recommendations_loading = true;
-                add_recommendations_from_tracks(ctx->spotify, &ctx->spotify->tracks, &ctx->spotify->track_size, &ctx->spotify->track_count,
-                                                tracks_loaded_cb, ctx);
-            }
+            // Continue playing recommendations, which may already be on their way
+            request_recommendations(ctx);
             return;
         }
     }
     wrapped_play_track(ctx);
 }
 
-void ctrl_set_track_index(struct smp_context *ctx, int32_t i){
+void ctrl_set_track_index(struct smp_context *ctx, int64_t i){
     if (!audio_started(ctx->audio_ctx)) return;
-    if (i >= ctx->spotify->track_count || i < 0) return;
+    if (!queued(ctx, i)) return;
     ctx->track_index = i;
+    refresh_prefetch(ctx);
 }
 
 void ctrl_seek(struct smp_context *ctx, int64_t position){
@@ -380,7 +891,24 @@ search_cb(struct spotify_state *state, void *userp){
 }
 
 void ctrl_search(struct smp_context *ctx, struct search_params *params){
-    search(ctx->spotify, params->query, search_cb, params->tracks, params->artists, params->albums, params->playlists, params);
+    search(ctx->spotify, params->query, search_cb, params->tracks, params->artists, params->albums, params->playlists, params,
+           NULL);
+}
+
+void ctrl_search_local(struct smp_context *ctx, struct search_params *params){
+    struct spotify_search_results *results = calloc(1, sizeof(*results));
+    results->userp = params;
+    local_search(params->query, params->tracks, params->artists, params->albums, params->playlists, results);
+    handle_search_response(results);
+}
+
+void ctrl_search_as_you_type(struct smp_context *ctx, const char *token, uint32_t serial, const char *query, bool tracks,
+                             bool artists, bool albums, bool playlists){
+    search_session_query(token, serial, query, tracks, artists, albums, playlists);
+}
+
+void ctrl_end_search(struct smp_context *ctx, const char *token){
+    search_session_end(token);
 }
 
 struct audio_context *ctrl_get_audio_context(struct smp_context *ctx) {
@@ -404,12 +932,10 @@ size_t ctrl_get_track_index(struct smp_context *ctx){
 }
 
 void ctrl_set_shuffle(struct smp_context *ctx, bool shuffle){
-    if (!ctx->shuffle && shuffle && audio_started(ctx->audio_ctx)){ // Make it so tracks which have already been played aren't played in the future
-        update_shuffle_table(ctx, 0, ctx->track_index + 1);
-        ctx->shuffle_index = ctx->track_index;
-        update_shuffle_table(ctx, ctx->track_index + 1, (int64_t) ctx->spotify->track_count);
-    }
+    // The track which is playing starts the order, and the ones before it in the queue aren't played again
+    if (!ctx->shuffle && shuffle) restart_shuffle(ctx, audio_started(ctx->audio_ctx) ? ctx->track_index : -1);
     ctx->shuffle = shuffle;
+    refresh_prefetch(ctx);
 }
 
 bool ctrl_get_shuffle(struct smp_context *ctx){
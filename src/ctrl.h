@@ -50,10 +50,32 @@ void ctrl_stop(struct smp_context *ctx);
 
 void ctrl_change_track_index(struct smp_context *ctx, int32_t i);
 
-void ctrl_set_track_index(struct smp_context *ctx, int32_t i);
+// Sets the current track to the one in slot i of the queue
+void ctrl_set_track_index(struct smp_context *ctx, int64_t i);
+
+#define CTRL_ENQUEUE_FRONT (-1)
+#define CTRL_ENQUEUE_END (-2)
+
+/*
+ * Loads a track, album or playlist and inserts its tracks into the queue after the track in slot after, or at the
+ * front or end of the queue. If play is set, or the queue is empty, the first of them is played right away.
+ */
+void ctrl_enqueue(struct smp_context *ctx, const char *uri, int64_t after, bool play);
+
+void ctrl_remove_track(struct smp_context *ctx, int64_t slot);
+
+void ctrl_move_track(struct smp_context *ctx, int64_t slot, size_t position);
 
 void ctrl_search(struct smp_context *ctx, struct search_params *params);
 
+// Searches the local index of cached info, the reply is sent before returning
+void ctrl_search_local(struct smp_context *ctx, struct search_params *params);
+
+void ctrl_search_as_you_type(struct smp_context *ctx, const char *token, uint32_t serial, const char *query, bool tracks,
+                             bool artists, bool albums, bool playlists);
+
+void ctrl_end_search(struct smp_context *ctx, const char *token);
+
 void ctrl_seek(struct smp_context *ctx, int64_t position);
 
 void ctrl_seek_to(struct smp_context *ctx, int64_t position);
@@ -603,22 +603,24 @@ dbus_parse_track(Track *track, DBusMessageIter *iter) {
     char *val = NULL;
     dbus_message_iter_recurse(iter, &sub);
     dbus_message_iter_get_basic(&sub, &val);
-    memcpy(track->spotify_id, val, sizeof(track->spotify_id));
+    if (strlen(val) != SPOTIFY_ID_LEN || !spotify_id_parse(val, &track->spotify_id)) track->spotify_id = (SpotifyId) {0};
     dbus_message_iter_next(&sub);
+    dbus_message_iter_next(&sub); // The URI, which is made from the id when needed
+    struct arena *arena = arena_new();
+    TrackInfo *info = new_track_info(track, arena);
     dbus_message_iter_get_basic(&sub, &val);
-    memcpy(track->spotify_uri, val, sizeof(track->spotify_uri));
+    info->spotify_name = arena_strdup(arena, val);
     dbus_message_iter_next(&sub);
     dbus_message_iter_get_basic(&sub, &val);
-    track->spotify_name = strdup(val);
+    info->spotify_album_art = arena_strdup(arena, val);
     dbus_message_iter_next(&sub);
     dbus_message_iter_get_basic(&sub, &val);
-    track->spotify_album_art = strdup(val);
+    info->artist = arena_strdup(arena, val);
     dbus_message_iter_next(&sub);
     dbus_message_iter_get_basic(&sub, &val);
-    track->artist = strdup(val);
-    dbus_message_iter_next(&sub);
-    dbus_message_iter_get_basic(&sub, &val);
-    memcpy(track->spotify_artist_id, val, sizeof(track->spotify_artist_id));
+    if (strlen(val) != SPOTIFY_ID_LEN || !spotify_id_parse(val, &info->spotify_artist_id))
+        info->spotify_artist_id = (SpotifyId) {0};
+    arena_release(arena);
     dbus_message_iter_next(&sub);
     dbus_message_iter_get_basic(&sub, &track->duration_ms);
 }
@@ -681,11 +683,11 @@ dbus_parse_artist(Artist *artist, DBusMessageIter *iter) {
 }
 
 int
-dbus_client_search(bool tracks, bool albums, bool artists, bool playlists, char *query, Track **tracksOut,
+dbus_client_search(bool local, bool tracks, bool albums, bool artists, bool playlists, char *query, Track **tracksOut,
                    size_t *tracks_len, PlaylistInfo **albumsOut, size_t *albums_len, Artist **artistsOut,
                    size_t *artists_len, PlaylistInfo **playlistsOut, size_t *playlists_len) {
     DBusMessage *msg = dbus_message_new_method_call(mpris_name, "/org/mpris/MediaPlayer2",
-                                                    "me.quartzy.smp", "Search");
+                                                    "me.quartzy.smp", local ? "SearchLocal" : "Search");
     dbus_bool_t t = tracks, a1 = artists, a = albums, p = playlists;
     dbus_message_append_args(msg, DBUS_TYPE_BOOLEAN, &t, DBUS_TYPE_BOOLEAN, &a, DBUS_TYPE_BOOLEAN, &a1,
                              DBUS_TYPE_BOOLEAN, &p, DBUS_TYPE_STRING, &query, DBUS_TYPE_INVALID);
@@ -719,6 +721,89 @@ dbus_client_search(bool tracks, bool albums, bool artists, bool playlists, char
     return 0;
 }
 
+int
+dbus_client_get_stats(AudioStat **out, size_t *count) {
+    DBusMessage *msg = dbus_message_new_method_call(mpris_name, "/org/mpris/MediaPlayer2",
+                                                    "me.quartzy.smp", "GetStats");
+
+    dbus_uint32_t serial = 0;
+    dbus_connection_send(client_conn, msg, &serial);
+
+    DBusMessage *reply;
+    for (int j = 0; j < REPLY_WAIT_LOOP_COUNT; ++j) {
+        dbus_connection_read_write(client_conn, 0);
+        reply = dbus_connection_pop_message(client_conn);
+
+        if (reply) break;
+        usleep(REPLY_WAIT_TIME_CHECK_TIME);
+    }
+    dbus_message_unref(msg);
+    if (!reply) {
+        fprintf(stderr, "[dbus-client] Didn't get reply when trying to get stats\n");
+        return 1;
+    }
+
+    DBusMessageIter iter, arr, entry;
+    dbus_message_iter_init(reply, &iter);
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+        fprintf(stderr, "[dbus-client] Unexpected reply when trying to get stats\n");
+        dbus_message_unref(reply);
+        return 1;
+    }
+    *count = dbus_message_iter_get_element_count(&iter);
+    *out = calloc(*count, sizeof(**out));
+    dbus_message_iter_recurse(&iter, &arr);
+    for (size_t i = 0; i < *count; ++i) {
+        dbus_message_iter_recurse(&arr, &entry);
+        char *name = NULL;
+        dbus_message_iter_get_basic(&entry, &name);
+        (*out)[i].name = strdup(name);
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_get_basic(&entry, &(*out)[i].value);
+        dbus_message_iter_next(&arr);
+    }
+    dbus_message_unref(reply);
+    return 0;
+}
+
+int
+dbus_client_reset_stats() {
+    DBusMessage *msg = dbus_message_new_method_call(mpris_name, "/org/mpris/MediaPlayer2",
+                                                    "me.quartzy.smp", "ResetStats");
+
+    dbus_uint32_t serial = 0;
+    dbus_connection_send(client_conn, msg, &serial);
+
+    DBusMessage *reply;
+    for (int j = 0; j < REPLY_WAIT_LOOP_COUNT; ++j) {
+        dbus_connection_read_write(client_conn, 0);
+        reply = dbus_connection_pop_message(client_conn);
+
+        if (reply) break;
+        usleep(REPLY_WAIT_TIME_CHECK_TIME);
+    }
+    dbus_message_unref(msg);
+    if (!reply) {
+        fprintf(stderr, "[dbus-client] Didn't get reply when trying to reset stats\n");
+        return 1;
+    }
+    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        fprintf(stderr, "[dbus-client] Error when trying to reset stats: %s\n", dbus_message_get_error_name(reply));
+        dbus_message_unref(reply);
+        return 1;
+    }
+    dbus_message_unref(reply);
+    return 0;
+}
+
+void
+free_stats(AudioStat *stats, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        free(stats[i].name);
+    }
+    free(stats);
+}
+
 void
 free_dbus_playlist(DBusPlaylistInfo *in) {
     if (!in || !in->valid) return;
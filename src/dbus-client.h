@@ -41,6 +41,11 @@ typedef struct Metadata {
     char *url;
 } Metadata;
 
+typedef struct AudioStat {
+    char *name;
+    int64_t value;
+} AudioStat;
+
 typedef struct PlayerProperties {
     PlaybackStatus playback_status;
     LoopMode loop_mode;
@@ -100,9 +105,16 @@ void dbus_client_set_property(const char *iface, const char *name, int type, voi
 
 int dbus_client_get_property(const char *iface, const char *name, int type, void *value);
 
-int dbus_client_search(bool tracks, bool albums, bool artists, bool playlists, char *query, Track **tracksOut,
-                       size_t *tracks_len, PlaylistInfo **albumsOut, size_t *albums_len, Artist **artistsOut,
-                       size_t *artists_len, PlaylistInfo **playlistsOut, size_t *playlists_len);
+// If local is set only the daemon's index of cached info is searched
+int dbus_client_search(bool local, bool tracks, bool albums, bool artists, bool playlists, char *query,
+                       Track **tracksOut, size_t *tracks_len, PlaylistInfo **albumsOut, size_t *albums_len,
+                       Artist **artistsOut, size_t *artists_len, PlaylistInfo **playlistsOut, size_t *playlists_len);
+
+int dbus_client_get_stats(AudioStat **out, size_t *count);
+
+int dbus_client_reset_stats();
+
+void free_stats(AudioStat *stats, size_t count);
 
 void print_properties(FILE *stream, PlayerProperties *properties);
 
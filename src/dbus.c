@@ -7,39 +7,47 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <dbus-util.h>
+#include <event2/event.h>
 #include "audio.h"
 #include "util.h"
 #include "spotify.h"
 #include "introspection_xml.h"
 #include "ctrl.h"
+#include "playlist-index.h"
 
 #define CHECKERR(x) do{int ret = (x);if(ret != 0){printf("Assert fail in %s:%d with %d\n", __FILE__, __LINE__, ret);dbus_util_free_bus(dbus_state->bus);exit(1);}}while(0)
 
 static const char mpris_name[] = "org.mpris.MediaPlayer2.smp";
 
-static int
-compare_alphabetical(const void *a, const void *b) {
-    return strcmp(((const PlaylistInfo *) a)->name, ((const PlaylistInfo *) b)->name);
-}
+// Track paths hold the queue slot as well as the id (TRACK_PATH "<slot>_<id>"), so copies of a track can be told apart
+#define TRACK_PATH "/org/mpris/MediaPlayer2/smp/track/"
+#define TRACK_PATH_LEN (sizeof(TRACK_PATH) + 10 + 1 + SPOTIFY_ID_LEN)
+#define NO_TRACK_PATH "/org/mpris/MediaPlayer2/TrackList/NoTrack"
 
-static int
-compare_alphabetical_reverse(const void *a, const void *b) {
-    return -strcmp(((const PlaylistInfo *) a)->name, ((const PlaylistInfo *) b)->name);
-}
+// Messages handled per loop iteration before letting other events run
+#define MAX_DISPATCH 64
 
-static int
-compare_last_played(const void *a, const void *b) {
-    return (int) (((const PlaylistInfo *) b)->last_played - ((const PlaylistInfo *) a)->last_played);
-}
+static struct {
+    struct event_base *base;
+    dbus_bus *bus;
+    struct event *dispatch_event;
+    struct event *emit_event; // Active when properties have changed since signals were last emitted
+} loop;
 
-static int
-compare_last_played_reverse(const void *a, const void *b) {
-    return (int) (((const PlaylistInfo *) a)->last_played - ((const PlaylistInfo *) b)->last_played);
+// Writes the object path of the track in slot to path, which must hold TRACK_PATH_LEN characters
+static void track_path(char *path, struct spotify_state *spotify, uint32_t slot) {
+    char id[SPOTIFY_ID_LEN];
+    spotify_id_format(spotify->tracks[slot].spotify_id, id);
+    snprintf(path, TRACK_PATH_LEN, TRACK_PATH "%" PRIu32 "_%.22s", slot, id);
 }
 
-static void add_track_metadata(struct audio_context *audio_ctx, dbus_message_context *ctx, Track *track) {
-    if (!track || !audio_started(audio_ctx) || track->spotify_id[0] == 0 /* unset */){
+static void add_track_metadata(struct audio_context *audio_ctx, dbus_message_context *ctx,
+                               struct spotify_state *spotify, uint32_t slot) {
+    Track *track = slot < spotify->track_count ? &spotify->tracks[slot] : NULL;
+    if (!track || !audio_started(audio_ctx) || spotify_id_none(track->spotify_id)){
         dbus_util_message_context_enter_array(&ctx, "{sv}");
 
         dbus_util_message_context_enter_dict_entry(&ctx);
@@ -51,9 +59,8 @@ static void add_track_metadata(struct audio_context *audio_ctx, dbus_message_con
         return;
     }
 
-    char *obj_path = malloc((strlen(track->spotify_id) + 46 + 1) * sizeof(*obj_path));
-    snprintf(obj_path, (strlen(track->spotify_id) + 46 + 1) * sizeof(*obj_path),
-             "/org/mpris/MediaPlayer2/smp/track/%s", track->spotify_id);
+    char obj_path[TRACK_PATH_LEN];
+    track_path(obj_path, spotify, slot);
 
     dbus_util_message_context_enter_array(&ctx, "{sv}");
 
@@ -69,31 +76,31 @@ static void add_track_metadata(struct audio_context *audio_ctx, dbus_message_con
 
     dbus_util_message_context_enter_dict_entry(&ctx);
     dbus_util_message_context_add_string(ctx, "mpris:artUrl");
-    dbus_util_message_context_add_string_variant(ctx, track->spotify_album_art);
+    dbus_util_message_context_add_string_variant(ctx, track->info->spotify_album_art);
     dbus_util_message_context_exit_dict_entry(&ctx);
 
     dbus_util_message_context_enter_dict_entry(&ctx);
     dbus_util_message_context_add_string(ctx, "xesam:artist");
     dbus_util_message_context_enter_variant(&ctx, "as");
     dbus_util_message_context_enter_array(&ctx, "s");
-    dbus_util_message_context_add_string(ctx, track->artist);
+    dbus_util_message_context_add_string(ctx, track->info->artist);
     dbus_util_message_context_exit_array(&ctx);
     dbus_util_message_context_exit_variant(&ctx);
     dbus_util_message_context_exit_dict_entry(&ctx);
 
     dbus_util_message_context_enter_dict_entry(&ctx);
     dbus_util_message_context_add_string(ctx, "xesam:url");
-    dbus_util_message_context_add_string_variant(ctx, track->spotify_uri);
+    char uri[SPOTIFY_URI_LEN_NULL];
+    spotify_track_uri(track->spotify_id, uri);
+    dbus_util_message_context_add_string_variant(ctx, uri);
     dbus_util_message_context_exit_dict_entry(&ctx);
 
     dbus_util_message_context_enter_dict_entry(&ctx);
     dbus_util_message_context_add_string(ctx, "xesam:title");
-    dbus_util_message_context_add_string_variant(ctx, track->spotify_name);
+    dbus_util_message_context_add_string_variant(ctx, track->info->spotify_name);
     dbus_util_message_context_exit_dict_entry(&ctx);
 
     dbus_util_message_context_exit_array(&ctx);
-
-    free(obj_path);
 }
 
 static void add_playlist_dbus(dbus_message_context *ctx, PlaylistInfo *playlistInfo){
@@ -135,7 +142,7 @@ static void Metadata_cb(dbus_bus *bus, dbus_message_context *ctx, void *param) {
     struct spotify_state *spotify = ctrl_get_spotify_state(smp_ctx);
     struct audio_context *audio_ctx = ctrl_get_audio_context(smp_ctx);
     dbus_util_message_context_enter_variant(&ctx, "a{sv}");
-    add_track_metadata(audio_ctx, ctx, &spotify->tracks[ctrl_get_track_index(smp_ctx)]);
+    add_track_metadata(audio_ctx, ctx, spotify, ctrl_get_track_index(smp_ctx));
     dbus_util_message_context_exit_variant(&ctx);
 }
 
@@ -154,7 +161,7 @@ static void Volume_set_cb(dbus_bus *bus, dbus_message_context *ctx, void *param)
 }
 
 static void PlaylistCount_cb(dbus_bus *bus, dbus_message_context *ctx, void *param) {
-    dbus_util_message_context_add_uint32_variant(ctx, get_saved_playlist_count());
+    dbus_util_message_context_add_uint32_variant(ctx, playlist_index_count());
 }
 
 static void Orderings_cb(dbus_bus *bus, dbus_message_context *ctx, void *param) {
@@ -183,26 +190,52 @@ static void ActivePlaylist_cb(dbus_bus *bus, dbus_message_context *ctx, void *pa
     dbus_util_message_context_exit_variant(&ctx);
 }
 
+// Adds the object paths of count tracks of the queue starting at offset, as an array
+static void add_track_paths(dbus_message_context *ctx, struct spotify_state *spotify, size_t offset, size_t count) {
+    char object[TRACK_PATH_LEN];
+    dbus_util_message_context_enter_array(&ctx, "o");
+    uint32_t slot = queue_at(&spotify->queue, offset);
+    for (size_t i = 0; slot != QUEUE_NONE && i < count; ++i, slot = queue_next(&spotify->queue, slot)) {
+        track_path(object, spotify, slot);
+        dbus_util_message_context_add_object_path(ctx, object);
+    }
+    dbus_util_message_context_exit_array(&ctx);
+}
+
+// Adds the object path of the track in slot of the queue, or of NoTrack if it's QUEUE_NONE
+static void add_track_path(dbus_message_context *ctx, struct spotify_state *spotify, uint32_t slot) {
+    if (slot == QUEUE_NONE) {
+        dbus_util_message_context_add_object_path(ctx, NO_TRACK_PATH);
+        return;
+    }
+    char object[TRACK_PATH_LEN];
+    track_path(object, spotify, slot);
+    dbus_util_message_context_add_object_path(ctx, object);
+}
+
+// Returns the slot of the queued track with the object path obj, or -1 if there is none
+static int64_t find_track(struct spotify_state *spotify, const char *obj) {
+    if (strncmp(obj, TRACK_PATH, sizeof(TRACK_PATH) - 1) != 0) return -1;
+    const char *num = obj + sizeof(TRACK_PATH) - 1;
+    if (*num < '0' || *num > '9') return -1;
+    char *text;
+    SpotifyId id;
+    errno = 0;
+    unsigned long slot = strtoul(num, &text, 10);
+    if (errno || *text++ != '_' || strlen(text) != SPOTIFY_ID_LEN || !spotify_id_parse(text, &id)) return -1;
+    // The slot may have been reused by the time the path comes back, so the id has to match as well
+    if (slot >= spotify->track_count || !queue_contains(&spotify->queue, slot) ||
+        !spotify_id_equal(spotify->tracks[slot].spotify_id, id))
+        return -1;
+    return (int64_t) slot;
+}
+
 static void Tracks_cb(dbus_bus *bus, dbus_message_context *ctx, void *param) {
     struct smp_context *smp_ctx = (struct smp_context*) param;
     struct spotify_state *spotify = ctrl_get_spotify_state(smp_ctx);
 
     dbus_util_message_context_enter_variant(&ctx, "ao");
-    dbus_util_message_context_enter_array(&ctx, "o");
-
-    if (spotify->track_count != -1) {
-        static const char base_path[] = "/org/mpris/MediaPlayer2/smp/track/";
-        char *object = malloc(sizeof(base_path) + 22 * sizeof(*object)); //Enough space for ids
-        object[sizeof(base_path) + 22 - 1] = 0;
-        memcpy(object, base_path, sizeof(base_path) - 1);
-        for (int i = 0; i < spotify->track_count; ++i) {
-            memcpy(object + sizeof(base_path) - 1, spotify->tracks[i].spotify_id, 22);
-            dbus_util_message_context_add_object_path(ctx, object);
-        }
-        free(object);
-    }
-
-    dbus_util_message_context_exit_array(&ctx);
+    add_track_paths(ctx, spotify, 0, queue_length(&spotify->queue));
     dbus_util_message_context_exit_variant(&ctx);
 }
 
@@ -348,13 +381,8 @@ static void SetPosition_cb(dbus_bus *bus, dbus_object *object, dbus_interface *i
     dbus_util_message_context_get_int64(rctx, &pos);
     dbus_util_message_context_free(rctx);
 
-    struct spotify_state *spotify = ctrl_get_spotify_state(ctx);
-    Track *track = &spotify->tracks[ctrl_get_track_index(ctx)];
-    const char *id_start = strrchr(track_obj, '/');
-
-    if (id_start && strlen(id_start+1) >= 22 && !memcmp(id_start+1, track->spotify_id, 22)){
-        ctrl_seek_to(ctx, pos);
-    }
+    int64_t slot = find_track(ctrl_get_spotify_state(ctx), track_obj);
+    if (slot >= 0 && slot == (int64_t) ctrl_get_track_index(ctx)) ctrl_seek_to(ctx, pos);
 
     dbus_util_send_empty_reply(call);
 }
@@ -379,32 +407,23 @@ static void GetPlaylists_cb(dbus_bus *bus, dbus_object *object, dbus_interface *
                                        &order, DBUS_TYPE_BOOLEAN, &reverse_order, DBUS_TYPE_INVALID))
         return;
 
-    PlaylistInfo *playlists;
-    size_t count;
-    int func_ret = get_all_playlist_info(&playlists, &count);
+    enum playlist_index_order index_order = PLAYLIST_INDEX_ALPHABETICAL;
+    if (order[0] == 'P' || order[0] == 'p') index_order = PLAYLIST_INDEX_PLAYED;
 
-    int (*compar)(const void *, const void *) = compare_alphabetical;
-    if (reverse_order) {
-        if (order[0] == 'P' || order[0] == 'p') compar = compare_last_played_reverse;
-        else compar = compare_alphabetical_reverse;
-    } else {
-        if (order[0] == 'P' || order[0] == 'p') compar = compare_last_played;
-    }
-    qsort(playlists, count, sizeof(*playlists), compar);
+    if (max_count > playlist_index_count()) max_count = playlist_index_count();
+    PlaylistInfo *playlists = malloc((max_count ? max_count : 1) * sizeof(*playlists));
+    size_t count = playlist_index_list(index_order, reverse_order, index, max_count, playlists);
 
     dbus_message_context *ctx = dbus_util_make_reply_context(call);
 
     dbus_util_message_context_enter_array(&ctx, "(oss)");
-    for (uint32_t i = index; i < count && i < index + max_count; ++i) {
+    for (size_t i = 0; i < count; ++i) {
         add_playlist_dbus(ctx, &playlists[i]);
     }
     dbus_util_message_context_exit_array(&ctx);
 
     dbus_util_message_context_free(ctx);
-    for (int i = 0; i < count; ++i) {
-        free_playlist(&playlists[i]);
-    }
-    free(playlists);
+    free(playlists); // Entries point into the index and aren't freed
 }
 
 static void ActivatePlaylist_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
@@ -434,13 +453,8 @@ static void Goto_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interfac
     if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_OBJECT_PATH, &obj, DBUS_TYPE_INVALID))
         return;
 
-    struct spotify_state *spotify = ctrl_get_spotify_state(ctx);
-    for (int32_t i = 0; i < spotify->track_count; ++i) {
-        const char *id = strrchr(obj, '/');
-        if (!id || strcmp(++id, spotify->tracks[i].spotify_id) != 0)continue;
-        ctrl_set_track_index(ctx, i);
-        break;
-    }
+    int64_t slot = find_track(ctrl_get_spotify_state(ctx), obj);
+    if (slot >= 0) ctrl_set_track_index(ctx, slot);
 }
 
 static void GetTracksMetadata_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
@@ -455,28 +469,96 @@ static void GetTracksMetadata_cb(dbus_bus *bus, dbus_object *object, dbus_interf
 
     dbus_message_context *ctx = dbus_util_make_reply_context(call);
     dbus_util_message_context_enter_array(&ctx, "a{sv}");
-    const size_t id_offset = strrchr(objs[0], '/') - objs[0] + 1;
-    for (size_t i = 0; i < spotify->track_count; ++i) {
-        for (size_t j = 0; j < len; ++j) {
-            if (strcmp(objs[j] + id_offset, spotify->tracks[i].spotify_id) != 0)continue;
-            add_track_metadata(audio_ctx, ctx, &spotify->tracks[i]);
-        }
+    for (size_t j = 0; j < len; ++j) {
+        int64_t slot = find_track(spotify, objs[j]);
+        if (slot >= 0) add_track_metadata(audio_ctx, ctx, spotify, slot);
     }
     dbus_util_message_context_exit_array(&ctx);
 
     dbus_util_message_context_free(ctx);
 }
 
-static void Search_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
-                                 void *param){
-    struct smp_context *ctx = (struct smp_context*) param;
+static void AddTrack_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                        void *param){
+    const char *uri, *after;
+    dbus_bool_t set_as_current;
+    if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_STRING, &uri, DBUS_TYPE_OBJECT_PATH, &after,
+                                       DBUS_TYPE_BOOLEAN, &set_as_current, DBUS_TYPE_INVALID))
+        return;
+
+    int64_t after_slot = CTRL_ENQUEUE_FRONT;
+    if (strcmp(after, NO_TRACK_PATH) != 0) {
+        after_slot = find_track(ctrl_get_spotify_state(param), after);
+        if (after_slot < 0) after_slot = CTRL_ENQUEUE_END;
+    }
+    ctrl_enqueue(param, uri, after_slot, set_as_current);
+
+    dbus_util_send_empty_reply(call);
+}
+
+static void RemoveTrack_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                           void *param){
+    const char *track;
+    if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_OBJECT_PATH, &track, DBUS_TYPE_INVALID))
+        return;
+
+    int64_t slot = find_track(ctrl_get_spotify_state(param), track);
+    if (slot >= 0) ctrl_remove_track(param, slot);
+
+    dbus_util_send_empty_reply(call);
+}
+
+static void MoveTrack_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                         void *param){
+    const char *track;
+    uint32_t position;
+    if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_OBJECT_PATH, &track, DBUS_TYPE_UINT32, &position,
+                                       DBUS_TYPE_INVALID))
+        return;
+
+    int64_t slot = find_track(ctrl_get_spotify_state(param), track);
+    if (slot >= 0) ctrl_move_track(param, slot, position);
+
+    dbus_util_send_empty_reply(call);
+}
+
+static void Enqueue_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                       void *param){
+    const char *uri;
+    dbus_bool_t next;
+    if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_STRING, &uri, DBUS_TYPE_BOOLEAN, &next, DBUS_TYPE_INVALID))
+        return;
+
+    int64_t current = (int64_t) ctrl_get_track_index(param);
+    bool playing = audio_started(ctrl_get_audio_context(param)) &&
+                   queue_contains(&ctrl_get_spotify_state(param)->queue, current);
+    ctrl_enqueue(param, uri, next && playing ? current : CTRL_ENQUEUE_END, false);
+
+    dbus_util_send_empty_reply(call);
+}
+
+static void GetTrackRange_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                             void *param){
+    struct spotify_state *spotify = ctrl_get_spotify_state(param);
+    uint32_t offset, count;
+    if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_UINT32, &offset, DBUS_TYPE_UINT32, &count,
+                                       DBUS_TYPE_INVALID))
+        return;
+
+    dbus_message_context *ctx = dbus_util_make_reply_context(call);
+    dbus_util_message_context_add_uint32(ctx, queue_length(&spotify->queue));
+    add_track_paths(ctx, spotify, offset, count);
+    dbus_util_message_context_free(ctx);
+}
 
+static struct search_params *
+get_search_params(dbus_bus *bus, dbus_method_call *call){
     dbus_bool_t tracks, albums, artists, playlists;
     char *query;
     if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_BOOLEAN, &tracks, DBUS_TYPE_BOOLEAN, &albums, DBUS_TYPE_BOOLEAN,
                                &artists, DBUS_TYPE_BOOLEAN, &playlists, DBUS_TYPE_STRING, &query,
                                DBUS_TYPE_INVALID)) {
-        return;
+        return NULL;
     }
     struct search_params *params = malloc(sizeof(*params));
     params->tracks = tracks;
@@ -486,7 +568,92 @@ static void Search_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interf
     params->query = strdup(query);
     params->call = dbus_util_make_reply_call(call);
     params->bus = bus;
-    ctrl_search(ctx, params);
+    return params;
+}
+
+static void Search_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                                 void *param){
+    struct search_params *params = get_search_params(bus, call);
+    if (params) ctrl_search(param, params);
+}
+
+static void SearchLocal_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                           void *param){
+    struct search_params *params = get_search_params(bus, call);
+    if (params) ctrl_search_local(param, params);
+}
+
+static void SearchAsYouType_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                               void *param){
+    struct smp_context *ctx = (struct smp_context*) param;
+
+    char *token, *query;
+    uint32_t serial;
+    dbus_bool_t tracks, albums, artists, playlists;
+    if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_STRING, &token, DBUS_TYPE_UINT32, &serial,
+                                       DBUS_TYPE_BOOLEAN, &tracks, DBUS_TYPE_BOOLEAN, &albums, DBUS_TYPE_BOOLEAN,
+                                       &artists, DBUS_TYPE_BOOLEAN, &playlists, DBUS_TYPE_STRING, &query,
+                                       DBUS_TYPE_INVALID)) {
+        return;
+    }
+    dbus_util_send_empty_reply(call);
+    ctrl_search_as_you_type(ctx, token, serial, query, tracks, artists, albums, playlists);
+}
+
+static void EndSearch_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                         void *param){
+    char *token;
+    if (dbus_util_get_method_arguments(bus, call, DBUS_TYPE_STRING, &token, DBUS_TYPE_INVALID)) return;
+    dbus_util_send_empty_reply(call);
+    ctrl_end_search(param, token);
+}
+
+static void add_stat(dbus_message_context *ctx, const char *name, int64_t value) {
+    dbus_util_message_context_enter_dict_entry(&ctx);
+    dbus_util_message_context_add_string(ctx, name);
+    dbus_util_message_context_add_int64(ctx, value);
+    dbus_util_message_context_exit_dict_entry(&ctx);
+}
+
+static void GetStats_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                        void *param){
+    struct audio_stats *stats = audio_get_stats(ctrl_get_audio_context(param));
+    int64_t sample_rate = (int64_t) atomic_load_explicit(&stats->sample_rate, memory_order_relaxed);
+    int64_t silence = (int64_t) atomic_load_explicit(&stats->silence_frames, memory_order_relaxed);
+    int64_t margin = atomic_load_explicit(&stats->margin_frames, memory_order_relaxed);
+    int64_t margin_min = atomic_load_explicit(&stats->margin_min_frames, memory_order_relaxed);
+
+    dbus_message_context *ctx = dbus_util_make_reply_context(call);
+    dbus_util_message_context_enter_array(&ctx, "{sx}");
+
+    add_stat(ctx, "callbacks", (int64_t) atomic_load_explicit(&stats->callbacks, memory_order_relaxed));
+    add_stat(ctx, "underruns", (int64_t) atomic_load_explicit(&stats->underruns, memory_order_relaxed));
+    add_stat(ctx, "silence_frames", silence);
+    add_stat(ctx, "silence_ms", sample_rate ? silence * 1000 / sample_rate : 0);
+    add_stat(ctx, "callback_max_us", (int64_t) atomic_load_explicit(&stats->callback_max_us, memory_order_relaxed));
+    char name[32];
+    for (int i = 0; i < AUDIO_STATS_HISTOGRAM_BUCKETS; ++i) {
+        if (i < AUDIO_STATS_HISTOGRAM_BUCKETS - 1)
+            snprintf(name, sizeof(name), "callback_lt_%luus", (unsigned long) audio_stats_histogram_bounds[i]);
+        else
+            snprintf(name, sizeof(name), "callback_ge_%luus", (unsigned long) audio_stats_histogram_bounds[i - 1]);
+        add_stat(ctx, name, (int64_t) atomic_load_explicit(&stats->callback_histogram[i], memory_order_relaxed));
+    }
+    add_stat(ctx, "decode_ahead_ms", sample_rate ? margin * 1000 / sample_rate : 0);
+    add_stat(ctx, "decode_ahead_min_ms",
+             margin_min == INT64_MAX ? -1 : (sample_rate ? margin_min * 1000 / sample_rate : 0));
+    add_stat(ctx, "device_latency_us", (int64_t) atomic_load_explicit(&stats->device_latency_us, memory_order_relaxed));
+    add_stat(ctx, "sample_rate", sample_rate);
+
+    dbus_util_message_context_exit_array(&ctx);
+    dbus_util_message_context_free(ctx);
+}
+
+static void ResetStats_cb(dbus_bus *bus, dbus_object *object, dbus_interface *interface, dbus_method_call *call,
+                          void *param){
+    audio_stats_reset(audio_get_stats(ctrl_get_audio_context(param)));
+
+    dbus_util_send_empty_reply(call);
 }
 
 struct dbus_state *
@@ -549,12 +716,22 @@ init_dbus(struct smp_context *ctx) {
 
     dbus_state->mtracks_iface = dbus_util_find_interface(dbus_state->mpris_obj, "org.mpris.MediaPlayer2.TrackList");
     dbus_util_set_property_cb(dbus_state->mtracks_iface, "Tracks", Tracks_cb, NULL, ctx);
-    dbus_util_set_property_bool(dbus_state->mtracks_iface, "CanEditTracks", false);
+    dbus_util_set_property_bool(dbus_state->mtracks_iface, "CanEditTracks", true);
     dbus_util_set_method_cb(dbus_state->mtracks_iface, "Goto", Goto_cb, ctx);
     dbus_util_set_method_cb(dbus_state->mtracks_iface, "GetTracksMetadata", GetTracksMetadata_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->mtracks_iface, "AddTrack", AddTrack_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->mtracks_iface, "RemoveTrack", RemoveTrack_cb, ctx);
 
     dbus_state->smp_iface = dbus_util_find_interface(dbus_state->mpris_obj, "me.quartzy.smp");
     dbus_util_set_method_cb(dbus_state->smp_iface, "Search", Search_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->smp_iface, "SearchLocal", SearchLocal_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->smp_iface, "SearchAsYouType", SearchAsYouType_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->smp_iface, "EndSearch", EndSearch_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->smp_iface, "GetTrackRange", GetTrackRange_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->smp_iface, "MoveTrack", MoveTrack_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->smp_iface, "Enqueue", Enqueue_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->smp_iface, "GetStats", GetStats_cb, ctx);
+    dbus_util_set_method_cb(dbus_state->smp_iface, "ResetStats", ResetStats_cb, ctx);
     dbus_util_set_property_bool(dbus_state->smp_iface, "ReplaceOld", false);
 
     return dbus_state;
@@ -563,16 +740,18 @@ init_dbus(struct smp_context *ctx) {
 void
 dbus_add_track(Track *track, dbus_message_context *ctx) {
     dbus_util_message_context_enter_struct(&ctx);
-    char *id_alloced = malloc(sizeof(track->spotify_id));
-    memcpy(id_alloced, track->spotify_id, sizeof(track->spotify_id));
+    char *id_alloced = malloc(SPOTIFY_ID_LEN_NULL);
+    spotify_id_format(track->spotify_id, id_alloced);
+    id_alloced[SPOTIFY_ID_LEN] = 0;
     dbus_util_message_context_add_string(ctx, id_alloced);
-    char *uri_alloced = malloc(sizeof(track->spotify_uri));
-    memcpy(uri_alloced, track->spotify_uri, sizeof(track->spotify_uri));
+    char *uri_alloced = malloc(SPOTIFY_URI_LEN_NULL);
+    spotify_track_uri(track->spotify_id, uri_alloced);
     dbus_util_message_context_add_string(ctx, uri_alloced);
-    dbus_util_message_context_add_string(ctx, track->spotify_name);
-    dbus_util_message_context_add_string(ctx, track->spotify_album_art);
-    dbus_util_message_context_add_string(ctx, track->artist);
-    memcpy(id_alloced, track->spotify_artist_id, sizeof(track->spotify_artist_id));
+    dbus_util_message_context_add_string(ctx, track->info->spotify_name);
+    dbus_util_message_context_add_string(ctx, track->info->spotify_album_art);
+    dbus_util_message_context_add_string(ctx, track->info->artist);
+    if (spotify_id_none(track->info->spotify_artist_id)) id_alloced[0] = 0; // Unknown artist
+    else spotify_id_format(track->info->spotify_artist_id, id_alloced);
     dbus_util_message_context_add_string(ctx, id_alloced);
     dbus_util_message_context_add_uint32(ctx, track->duration_ms);
     dbus_util_message_context_exit_struct(&ctx);
@@ -621,17 +800,20 @@ dbus_add_artist(Artist *artist, dbus_message_context *ctx) {
     dbus_util_message_context_exit_struct(&(ctx));\
 }
 
+static void
+add_search_results(dbus_message_context *ctx, struct spotify_search_results *results) { // Signature: (ba(ssssssu))(ba(bsssu))(ba(bsssu))(ba(ssu))
+    ADD_DBUS_ARRAY(dbus_add_track, "ssssssu", results->track_len, results->tracks, results->qtracks, ctx);
+    ADD_DBUS_ARRAY(dbus_add_playlist, "bsssu", results->album_len, results->albums, results->qalbums, ctx);
+    ADD_DBUS_ARRAY(dbus_add_playlist, "bsssu", results->playlist_len, results->playlists, results->qplaylists, ctx);
+    ADD_DBUS_ARRAY(dbus_add_artist, "ssu", results->artist_len, results->artists, results->qartists, ctx);
+}
+
 void
-handle_search_response(struct spotify_search_results *results) { // Return signature: (ba(ssssssu))(ba(bsssu))(ba(bsssu))(ba(ssu))
+handle_search_response(struct spotify_search_results *results) {
     struct search_params *params = (struct search_params *) results->userp;
 
     dbus_message_context *ctx = dbus_util_make_write_context(params->call);
-
-    ADD_DBUS_ARRAY(dbus_add_track, "ssssssu", results->track_len, results->tracks, params->tracks, ctx);
-    ADD_DBUS_ARRAY(dbus_add_playlist, "bsssu", results->album_len, results->albums, params->albums, ctx);
-    ADD_DBUS_ARRAY(dbus_add_playlist, "bsssu", results->playlist_len, results->playlists, params->playlists, ctx);
-    ADD_DBUS_ARRAY(dbus_add_artist, "ssu", results->artist_len, results->artists, params->artists, ctx);
-
+    add_search_results(ctx, results);
     dbus_util_message_context_free(ctx);
 
     dbus_util_send_method(params->bus, params->call, NULL, NULL);
@@ -640,31 +822,196 @@ handle_search_response(struct spotify_search_results *results) { // Return signa
     dbus_util_free_method_call(params->call);
     free(params->query);
     free(params);
-    free_tracks(results->tracks, results->track_len);
-    free(results->tracks);
-    results->tracks = NULL;
-    for (int i = 0; i < results->playlist_len; ++i) {
-        free_playlist(&results->playlists[i]);
-    }
-    free(results->playlists);
-    results->playlists = NULL;
-    for (int i = 0; i < results->album_len; ++i) {
-        free_playlist(&results->albums[i]);
+    free_search_results(results);
+}
+
+void
+handle_search_session_results(dbus_bus *bus, const char *token, uint32_t serial, bool final,
+                              struct spotify_search_results *results) {
+    dbus_method_call *call = dbus_util_new_signal("/org/mpris/MediaPlayer2", "me.quartzy.smp", "SearchResults");
+    dbus_message_context *ctx = dbus_util_make_write_context(call);
+    dbus_util_message_context_add_string(ctx, token);
+    dbus_util_message_context_add_uint32(ctx, serial);
+    dbus_util_message_context_add_bool(ctx, final);
+    add_search_results(ctx, results);
+    dbus_util_message_context_free(ctx);
+
+    dbus_util_send_method(bus, call, NULL, NULL);
+    free_search_results(results);
+}
+
+void
+handle_track_list_replaced(dbus_bus *bus, struct smp_context *smp_ctx) {
+    struct spotify_state *spotify = ctrl_get_spotify_state(smp_ctx);
+    dbus_method_call *call = dbus_util_new_signal("/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.TrackList",
+                                                  "TrackListReplaced");
+    dbus_message_context *ctx = dbus_util_make_write_context(call);
+    add_track_paths(ctx, spotify, 0, queue_length(&spotify->queue));
+    size_t current = ctrl_get_track_index(smp_ctx);
+    bool playing = audio_started(ctrl_get_audio_context(smp_ctx)) && queue_contains(&spotify->queue, current);
+    add_track_path(ctx, spotify, playing ? current : QUEUE_NONE);
+    dbus_util_message_context_free(ctx);
+
+    dbus_util_send_method(bus, call, NULL, NULL);
+}
+
+void
+handle_track_added(dbus_bus *bus, struct smp_context *smp_ctx, uint32_t slot) {
+    struct spotify_state *spotify = ctrl_get_spotify_state(smp_ctx);
+    dbus_method_call *call = dbus_util_new_signal("/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.TrackList",
+                                                  "TrackAdded");
+    dbus_message_context *ctx = dbus_util_make_write_context(call);
+    add_track_metadata(ctrl_get_audio_context(smp_ctx), ctx, spotify, slot);
+    add_track_path(ctx, spotify, queue_prev(&spotify->queue, slot));
+    dbus_util_message_context_free(ctx);
+
+    dbus_util_send_method(bus, call, NULL, NULL);
+}
+
+void
+handle_track_removed(dbus_bus *bus, struct smp_context *smp_ctx, uint32_t slot) {
+    dbus_method_call *call = dbus_util_new_signal("/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.TrackList",
+                                                  "TrackRemoved");
+    dbus_message_context *ctx = dbus_util_make_write_context(call);
+    add_track_path(ctx, ctrl_get_spotify_state(smp_ctx), slot);
+    dbus_util_message_context_free(ctx);
+
+    dbus_util_send_method(bus, call, NULL, NULL);
+}
+
+static void
+dispatch_cb(evutil_socket_t fd, short what, void *arg) {
+    DBusConnection *conn = loop.bus->conn;
+    for (int i = 0; i < MAX_DISPATCH && dbus_connection_get_dispatch_status(conn) == DBUS_DISPATCH_DATA_REMAINS; ++i)
+        dbus_util_poll_messages(loop.bus);
+    // Replies and property changes made while handling these all go out together
+    dbus_queue_signals();
+    if (dbus_connection_get_dispatch_status(conn) == DBUS_DISPATCH_DATA_REMAINS)
+        event_active(loop.dispatch_event, EV_TIMEOUT, 0); // Let other events run before the rest
+}
+
+static void
+emit_cb(evutil_socket_t fd, short what, void *arg) {
+    dbus_util_emit_signals(loop.bus);
+}
+
+static void
+dispatch_status_cb(DBusConnection *conn, DBusDispatchStatus status, void *data) {
+    if (status == DBUS_DISPATCH_DATA_REMAINS) event_active(loop.dispatch_event, EV_TIMEOUT, 0);
+}
+
+static void
+watch_cb(evutil_socket_t fd, short what, void *arg) {
+    unsigned int flags = 0;
+    if (what & EV_READ) flags |= DBUS_WATCH_READABLE;
+    if (what & EV_WRITE) flags |= DBUS_WATCH_WRITABLE;
+    dbus_watch_handle(arg, flags);
+}
+
+static dbus_bool_t
+add_watch(DBusWatch *watch, void *data) {
+    unsigned int flags = dbus_watch_get_flags(watch);
+    short what = EV_PERSIST;
+    if (flags & DBUS_WATCH_READABLE) what |= EV_READ;
+    if (flags & DBUS_WATCH_WRITABLE) what |= EV_WRITE;
+    struct event *ev = event_new(loop.base, dbus_watch_get_unix_fd(watch), what, watch_cb, watch);
+    if (!ev) return FALSE;
+    dbus_watch_set_data(watch, ev, NULL);
+    if (dbus_watch_get_enabled(watch)) event_add(ev, NULL);
+    return TRUE;
+}
+
+static void
+remove_watch(DBusWatch *watch, void *data) {
+    struct event *ev = dbus_watch_get_data(watch);
+    if (ev) event_free(ev);
+    dbus_watch_set_data(watch, NULL, NULL);
+}
+
+static void
+toggle_watch(DBusWatch *watch, void *data) {
+    struct event *ev = dbus_watch_get_data(watch);
+    if (!ev) return;
+    if (dbus_watch_get_enabled(watch)) event_add(ev, NULL);
+    else event_del(ev);
+}
+
+static void
+timeout_cb(evutil_socket_t fd, short what, void *arg) {
+    dbus_timeout_handle(arg);
+}
+
+static void
+arm_timeout(DBusTimeout *timeout, struct event *ev) {
+    int interval = dbus_timeout_get_interval(timeout);
+    struct timeval tv = {
+            .tv_sec = interval / 1000,
+            .tv_usec = (interval % 1000) * 1000,
+    };
+    event_add(ev, &tv);
+}
+
+static dbus_bool_t
+add_timeout(DBusTimeout *timeout, void *data) {
+    // Persistent, since libdbus expects the timeout to keep firing every interval until it's disabled or removed
+    struct event *ev = event_new(loop.base, -1, EV_PERSIST, timeout_cb, timeout);
+    if (!ev) return FALSE;
+    dbus_timeout_set_data(timeout, ev, NULL);
+    if (dbus_timeout_get_enabled(timeout)) arm_timeout(timeout, ev);
+    return TRUE;
+}
+
+static void
+remove_timeout(DBusTimeout *timeout, void *data) {
+    struct event *ev = dbus_timeout_get_data(timeout);
+    if (ev) event_free(ev);
+    dbus_timeout_set_data(timeout, NULL, NULL);
+}
+
+static void
+toggle_timeout(DBusTimeout *timeout, void *data) {
+    struct event *ev = dbus_timeout_get_data(timeout);
+    if (!ev) return;
+    if (dbus_timeout_get_enabled(timeout)) arm_timeout(timeout, ev);
+    else event_del(ev);
+}
+
+int
+dbus_attach_event_base(struct dbus_state *dbus_state, struct event_base *base) {
+    DBusConnection *conn = dbus_state->bus->conn;
+    loop.base = base;
+    loop.bus = dbus_state->bus;
+    loop.dispatch_event = event_new(base, -1, 0, dispatch_cb, NULL);
+    loop.emit_event = event_new(base, -1, 0, emit_cb, NULL);
+    if (!loop.dispatch_event || !loop.emit_event ||
+        !dbus_connection_set_watch_functions(conn, add_watch, remove_watch, toggle_watch, NULL, NULL) ||
+        !dbus_connection_set_timeout_functions(conn, add_timeout, remove_timeout, toggle_timeout, NULL, NULL)) {
+        fprintf(stderr, "[dbus] Error when adding the bus connection to the event loop\n");
+        dbus_detach_event_base();
+        return 1;
     }
-    free(results->albums);
-    results->albums = NULL;
-    for (int i = 0; i < results->artist_len; ++i) {
-        free_artist(&results->artists[i]);
+    dbus_connection_set_dispatch_status_function(conn, dispatch_status_cb, NULL, NULL);
+    // Anything which arrived while setting up the bus is already queued and won't make the socket readable again
+    event_active(loop.dispatch_event, EV_TIMEOUT, 0);
+    return 0;
+}
+
+void
+dbus_detach_event_base() {
+    if (loop.bus) {
+        DBusConnection *conn = loop.bus->conn;
+        dbus_connection_set_dispatch_status_function(conn, NULL, NULL, NULL);
+        dbus_connection_set_watch_functions(conn, NULL, NULL, NULL, NULL, NULL);
+        dbus_connection_set_timeout_functions(conn, NULL, NULL, NULL, NULL, NULL);
     }
-    free(results->artists);
-    results->artists = NULL;
-    free(results);
+    if (loop.dispatch_event) event_free(loop.dispatch_event);
+    if (loop.emit_event) event_free(loop.emit_event);
+    memset(&loop, 0, sizeof(loop));
 }
 
 void
-handle_message(dbus_bus *bus) {
-    dbus_util_poll_messages(bus);
-    dbus_util_emit_signals(bus);
+dbus_queue_signals() {
+    if (loop.emit_event) event_active(loop.emit_event, EV_TIMEOUT, 0);
 }
 
 
@@ -6,6 +6,8 @@
 #define SMP_DBUS_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "dbus-util.h"
 
 struct dbus_state{
@@ -24,8 +26,34 @@ struct spotify_search_results;
 
 struct dbus_state * init_dbus(struct smp_context *ctx);
 
-void handle_message(dbus_bus *bus);
+// Emits TrackListReplaced with every track of the queue
+void handle_track_list_replaced(dbus_bus *bus, struct smp_context *ctx);
+
+// Emit TrackAdded or TrackRemoved for the track in slot of the queue, which has to be in it
+void handle_track_added(dbus_bus *bus, struct smp_context *ctx, uint32_t slot);
+
+void handle_track_removed(dbus_bus *bus, struct smp_context *ctx, uint32_t slot);
+
+struct event_base;
+
+/*
+ * Adds the bus connection's sockets and timeouts to the event loop, so messages are handled as soon as they arrive
+ * instead of being polled for.
+ */
+int dbus_attach_event_base(struct dbus_state *dbus_state, struct event_base *base);
+
+void dbus_detach_event_base();
+
+/*
+ * Emits the PropertiesChanged signals for every property invalidated so far once the current loop iteration's other
+ * events have run, so several changes made together go out as one signal.
+ */
+void dbus_queue_signals();
 
 void handle_search_response(struct spotify_search_results *results);
 
+// Emits the SearchResults signal with the results of a search session query, and frees them
+void handle_search_session_results(dbus_bus *bus, const char *token, uint32_t serial, bool final,
+                                   struct spotify_search_results *results);
+
 #endif //SMP_DBUS_H
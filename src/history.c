@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "history.h"
+#include "idmap.h"
+#include "playlist-index.h"
+#include "io-pool.h"
+
+#define HISTORY_MAGIC 0x48504d53 // "SMPH"
+#define HISTORY_VERSION 1
+#define FLUSH_INTERVAL_S 5
+#define FLUSH_MAX_PENDING 64 // Plays buffered before they are written out without waiting for the timer
+#define COMPACT_MIN_RECORDS 1024
+
+struct history_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/*
+ * Every play appends one record with a count of 1. Compaction replaces all records of an id with a single one
+ * holding the total count and the time of the last play.
+ */
+struct history_record {
+    int64_t time;
+    uint32_t count;
+    uint8_t kind;
+    char id[SPOTIFY_ID_LEN];
+    uint8_t reserved;
+};
+
+struct history_entry {
+    int64_t last_played;
+    uint32_t play_count;
+};
+
+static struct {
+    int fd;
+    char *path;
+    struct event *flush_event;
+    struct history_record *pending;
+    size_t pending_len;
+    size_t pending_size;
+    bool busy; // A write or compaction is running on the I/O pool, plays are buffered until it is done
+    size_t record_count; // Records in the journal file
+    struct idmap ids[HISTORY_KIND_LAST]; // Id to index in entries
+    struct history_entry *entries;
+    size_t entries_len;
+    size_t entries_size;
+} hist = {.fd = -1};
+
+static void
+apply_plays(enum history_kind kind, SpotifyId id, int64_t time, uint32_t count) {
+    uint64_t *index = idmap_upsert(&hist.ids[kind], id, hist.entries_len);
+    if (*index == hist.entries_len) {
+        if (hist.entries_len == hist.entries_size) {
+            hist.entries_size = hist.entries_size ? hist.entries_size * 2 : 64;
+            hist.entries = realloc(hist.entries, hist.entries_size * sizeof(*hist.entries));
+        }
+        hist.entries[hist.entries_len++] = (struct history_entry) {0};
+    }
+    struct history_entry *entry = &hist.entries[*index];
+    entry->play_count += count;
+    if (time > entry->last_played) entry->last_played = time;
+}
+
+static void
+apply_record(const struct history_record *rec) {
+    SpotifyId id;
+    if (rec->kind >= HISTORY_KIND_LAST || !spotify_id_parse(rec->id, &id)) return;
+    apply_plays(rec->kind, id, rec->time, rec->count);
+}
+
+static int
+write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Records which are appended to the journal, or which replace it when compacting, on the I/O pool
+struct history_write {
+    char *path; // Set when compacting
+    int fd; // The journal, or the new one once it was compacted
+    struct history_record *records;
+    size_t len;
+    int error;
+};
+
+static void flush();
+
+static void
+schedule_flush() {
+    if (!hist.pending_len) return;
+    if (hist.pending_len >= FLUSH_MAX_PENDING && !hist.busy) {
+        evtimer_del(hist.flush_event);
+        flush();
+    } else if (!evtimer_pending(hist.flush_event, NULL)) {
+        struct timeval tv = {.tv_sec = FLUSH_INTERVAL_S};
+        evtimer_add(hist.flush_event, &tv);
+    }
+}
+
+static void
+compact_work(void *arg) {
+    struct history_write *job = arg;
+    size_t path_len = strlen(job->path);
+    char tmp_path[path_len + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        job->error = errno;
+        return;
+    }
+    struct history_header header = {.magic = HISTORY_MAGIC, .version = HISTORY_VERSION};
+    if (write_all(fd, &header, sizeof(header)) || write_all(fd, job->records, job->len * sizeof(*job->records)) ||
+        fdatasync(fd) || rename(tmp_path, job->path) || (job->fd = open(job->path, O_WRONLY | O_APPEND)) < 0) {
+        job->error = errno;
+        remove(tmp_path);
+    }
+    close(fd);
+}
+
+static void
+compact_done(void *arg) {
+    struct history_write *job = arg;
+    hist.busy = false;
+    if (job->error) {
+        fprintf(stderr, "[history] Error when compacting play history: %s\n", strerror(job->error));
+    } else {
+        close(hist.fd);
+        hist.fd = job->fd;
+        hist.record_count = job->len;
+        printf("[history] Compacted play history to %zu records\n", hist.record_count);
+    }
+    free(job->path);
+    free(job->records);
+    free(job);
+    schedule_flush();
+}
+
+// Rewrites the journal with a single record per id
+static void
+compact() {
+    struct history_write *job = calloc(1, sizeof(*job));
+    job->path = strdup(hist.path);
+    job->fd = -1;
+    job->records = malloc((hist.entries_len ? hist.entries_len : 1) * sizeof(*job->records));
+    for (int kind = 0; kind < HISTORY_KIND_LAST; ++kind) {
+        idmap_foreach(&hist.ids[kind], e) {
+            struct history_entry *entry = &hist.entries[e->value];
+            struct history_record *rec = &job->records[job->len++];
+            *rec = (struct history_record) {
+                    .time = entry->last_played,
+                    .count = entry->play_count,
+                    .kind = kind
+            };
+            spotify_id_format(e->id, rec->id);
+        }
+    }
+    hist.busy = true;
+    io_pool_submit(compact_work, compact_done, job);
+}
+
+static void
+maybe_compact() {
+    if (!hist.busy && hist.record_count > COMPACT_MIN_RECORDS && hist.record_count > hist.entries_len * 2) compact();
+}
+
+static void
+flush_work(void *arg) {
+    struct history_write *job = arg;
+    if (write_all(job->fd, job->records, job->len * sizeof(*job->records)) || fdatasync(job->fd)) job->error = errno;
+}
+
+static void
+flush_done(void *arg) {
+    struct history_write *job = arg;
+    hist.busy = false;
+    if (job->error) fprintf(stderr, "[history] Error when writing play history: %s\n", strerror(job->error));
+    else hist.record_count += job->len;
+    free(job->records);
+    free(job);
+    maybe_compact();
+    schedule_flush();
+}
+
+static void
+flush() {
+    if (!hist.pending_len || hist.fd < 0 || hist.busy) return;
+    struct history_write *job = calloc(1, sizeof(*job));
+    job->fd = hist.fd;
+    job->records = hist.pending;
+    job->len = hist.pending_len;
+    hist.pending = NULL;
+    hist.pending_len = hist.pending_size = 0;
+    hist.busy = true;
+    io_pool_submit(flush_work, flush_done, job);
+}
+
+static void
+flush_cb(evutil_socket_t fd, short what, void *arg) {
+    flush();
+}
+
+static int
+load(int fd) {
+    struct stat st;
+    if (fstat(fd, &st)) return 1;
+    struct history_header header;
+    if (st.st_size == 0) {
+        header = (struct history_header) {.magic = HISTORY_MAGIC, .version = HISTORY_VERSION};
+        return write_all(fd, &header, sizeof(header));
+    }
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != HISTORY_MAGIC ||
+        header.version != HISTORY_VERSION) {
+        fprintf(stderr, "[history] Play history file is invalid, starting a new one\n");
+        if (ftruncate(fd, 0)) return 1;
+        header = (struct history_header) {.magic = HISTORY_MAGIC, .version = HISTORY_VERSION};
+        return pwrite(fd, &header, sizeof(header), 0) != sizeof(header);
+    }
+
+    struct history_record recs[256];
+    ssize_t got;
+    size_t leftover = 0;
+    while ((got = read(fd, (uint8_t *) recs + leftover, sizeof(recs) - leftover)) > 0) {
+        size_t total = leftover + got;
+        size_t n = total / sizeof(*recs);
+        for (size_t i = 0; i < n; ++i) apply_record(&recs[i]);
+        hist.record_count += n;
+        leftover = total - n * sizeof(*recs);
+        memmove(recs, &recs[n], leftover);
+    }
+    if (leftover) { // A record which was only partially written before exiting
+        if (ftruncate(fd, (off_t) (sizeof(header) + hist.record_count * sizeof(*recs)))) return 1;
+    }
+    return 0;
+}
+
+int
+history_init(struct event_base *base, const char *path) {
+    hist.path = strdup(path);
+    for (int i = 0; i < HISTORY_KIND_LAST; ++i) idmap_init(&hist.ids[i], 64);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || load(fd)) {
+        fprintf(stderr, "[history] Error when opening play history '%s': %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    close(fd);
+    hist.fd = open(path, O_WRONLY | O_APPEND);
+    hist.flush_event = evtimer_new(base, flush_cb, NULL);
+    maybe_compact();
+
+    for (int kind = HISTORY_PLAYLIST; kind <= HISTORY_ALBUM; ++kind) {
+        idmap_foreach(&hist.ids[kind], e) {
+            playlist_index_set_last_played(e->id, hist.entries[e->value].last_played);
+        }
+    }
+    printf("[history] Loaded play history of %zu tracks and %zu playlists\n", hist.ids[HISTORY_TRACK].count,
+           hist.ids[HISTORY_PLAYLIST].count + hist.ids[HISTORY_ALBUM].count);
+    return 0;
+}
+
+void
+history_close() {
+    flush();
+    if (hist.flush_event) event_free(hist.flush_event);
+    if (hist.fd >= 0) close(hist.fd);
+    for (int i = 0; i < HISTORY_KIND_LAST; ++i) idmap_free(&hist.ids[i]);
+    free(hist.entries);
+    free(hist.pending);
+    free(hist.path);
+    memset(&hist, 0, sizeof(hist));
+    hist.fd = -1;
+}
+
+void
+history_record(enum history_kind kind, SpotifyId id) {
+    if (hist.fd < 0 || kind >= HISTORY_KIND_LAST) return;
+    struct history_record rec = {
+            .time = time(NULL),
+            .count = 1,
+            .kind = kind
+    };
+    spotify_id_format(id, rec.id);
+    apply_plays(kind, id, rec.time, rec.count);
+    if (kind != HISTORY_TRACK) playlist_index_set_last_played(id, rec.time);
+
+    if (hist.pending_len == hist.pending_size) {
+        hist.pending_size = hist.pending_size ? hist.pending_size * 2 : FLUSH_MAX_PENDING;
+        hist.pending = realloc(hist.pending, hist.pending_size * sizeof(*hist.pending));
+    }
+    hist.pending[hist.pending_len++] = rec;
+    schedule_flush();
+}
+
+bool
+history_get(enum history_kind kind, SpotifyId id, time_t *last_played, uint32_t *play_count) {
+    uint64_t index;
+    if (kind >= HISTORY_KIND_LAST || !idmap_get(&hist.ids[kind], id, &index)) return false;
+    if (last_played) *last_played = hist.entries[index].last_played;
+    if (play_count) *play_count = hist.entries[index].play_count;
+    return true;
+}
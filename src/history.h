@@ -0,0 +1,33 @@
+#ifndef SMP_HISTORY_H
+#define SMP_HISTORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <event2/event.h>
+#include "spotify.h"
+
+#define HISTORY_FILE "history.log"
+
+enum history_kind {
+    HISTORY_TRACK = 0,
+    HISTORY_PLAYLIST,
+    HISTORY_ALBUM,
+    HISTORY_KIND_LAST
+};
+
+/*
+ * Loads the play history journal at path into memory and applies the last played times of playlists and albums to
+ * the playlist index. New plays are buffered and written out on a timer on base.
+ */
+int history_init(struct event_base *base, const char *path);
+
+// Flushes any buffered plays and closes the journal
+void history_close();
+
+void history_record(enum history_kind kind, SpotifyId id);
+
+// Returns false if id has never been played
+bool history_get(enum history_kind kind, SpotifyId id, time_t *last_played, uint32_t *play_count);
+
+#endif //SMP_HISTORY_H
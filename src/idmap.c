@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "idmap.h"
+
+#define IDMAP_MIN_SIZE 16
+
+static uint64_t
+hash_id(SpotifyId id) {
+    uint64_t hash = id.lo ^ (id.hi * 0x9e3779b97f4a7c15ULL);
+    hash ^= hash >> 32; // Ids are random already, this only spreads the high half into the bits the mask keeps
+    hash *= 0xd6e8feb86659fd93ULL;
+    return hash ^ (hash >> 32);
+}
+
+void
+idmap_init(struct idmap *map, size_t capacity) {
+    size_t size = IDMAP_MIN_SIZE;
+    while (size < capacity * 2) size <<= 1;
+    map->entries = calloc(size, sizeof(*map->entries));
+    map->size = size;
+    map->count = 0;
+}
+
+void
+idmap_free(struct idmap *map) {
+    free(map->entries);
+    memset(map, 0, sizeof(*map));
+}
+
+void
+idmap_clear(struct idmap *map) {
+    if (map->entries) memset(map->entries, 0, map->size * sizeof(*map->entries));
+    map->count = 0;
+}
+
+static struct idmap_entry *
+find_slot(const struct idmap *map, SpotifyId id) {
+    size_t mask = map->size - 1;
+    for (size_t i = hash_id(id) & mask;; i = (i + 1) & mask) {
+        struct idmap_entry *e = &map->entries[i];
+        if (!e->used || spotify_id_equal(e->id, id)) return e;
+    }
+}
+
+static void
+grow(struct idmap *map) {
+    struct idmap old = *map;
+    map->size = old.size ? old.size * 2 : IDMAP_MIN_SIZE;
+    map->entries = calloc(map->size, sizeof(*map->entries));
+    if (!map->entries) {
+        perror("[idmap] Error when calling calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old.size; ++i) {
+        if (old.entries[i].used) *find_slot(map, old.entries[i].id) = old.entries[i];
+    }
+    free(old.entries);
+}
+
+bool
+idmap_get(const struct idmap *map, SpotifyId id, uint64_t *value) {
+    if (!map->count) return false;
+    struct idmap_entry *e = find_slot(map, id);
+    if (!e->used) return false;
+    if (value) *value = e->value;
+    return true;
+}
+
+uint64_t *
+idmap_upsert(struct idmap *map, SpotifyId id, uint64_t def) {
+    if ((map->count + 1) * 4 > map->size * 3) grow(map); // Keep the load factor under 0.75
+    struct idmap_entry *e = find_slot(map, id);
+    if (!e->used) {
+        e->id = id;
+        e->used = true;
+        e->value = def;
+        map->count++;
+    }
+    return &e->value;
+}
+
+void
+idmap_put(struct idmap *map, SpotifyId id, uint64_t value) {
+    *idmap_upsert(map, id, value) = value;
+}
+
+bool
+idmap_remove(struct idmap *map, SpotifyId id) {
+    if (!map->count) return false;
+    struct idmap_entry *e = find_slot(map, id);
+    if (!e->used) return false;
+
+    // Backward shift deletion, so no tombstones are needed
+    size_t mask = map->size - 1;
+    size_t hole = e - map->entries;
+    for (size_t i = (hole + 1) & mask; map->entries[i].used; i = (i + 1) & mask) {
+        size_t home = hash_id(map->entries[i].id) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->entries[hole] = map->entries[i];
+            hole = i;
+        }
+    }
+    map->entries[hole].used = false;
+    map->count--;
+    return true;
+}
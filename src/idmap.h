@@ -0,0 +1,40 @@
+#ifndef SMP_IDMAP_H
+#define SMP_IDMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "spotify-id.h"
+
+/*
+ * Open addressing hash map from spotify ids to 64-bit values. Entries are stored inline, so lookups only touch
+ * one contiguous array.
+ */
+struct idmap {
+    struct idmap_entry {
+        SpotifyId id;
+        uint64_t value;
+        bool used;
+    } *entries;
+    size_t size; // Always a power of two
+    size_t count;
+};
+
+void idmap_init(struct idmap *map, size_t capacity);
+
+void idmap_free(struct idmap *map);
+
+void idmap_clear(struct idmap *map);
+
+bool idmap_get(const struct idmap *map, SpotifyId id, uint64_t *value);
+
+// Returns a pointer to the value for id, inserting it with a value of def if it doesn't exist
+uint64_t *idmap_upsert(struct idmap *map, SpotifyId id, uint64_t def);
+
+void idmap_put(struct idmap *map, SpotifyId id, uint64_t value);
+
+bool idmap_remove(struct idmap *map, SpotifyId id);
+
+#define idmap_foreach(map, e) for (struct idmap_entry *e = (map)->entries; e && e < (map)->entries + (map)->size; ++e) if (e->used)
+
+#endif //SMP_IDMAP_H
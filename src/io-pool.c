@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "io-pool.h"
+
+struct io_job {
+    io_work_fn work;
+    io_done_fn done;
+    void *arg;
+    struct io_job *next;
+};
+
+struct job_list {
+    struct io_job *head;
+    struct io_job *tail;
+};
+
+static struct {
+    bool running;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    int thread_count;
+    struct job_list queued;
+    struct job_list finished;
+    int event_fd;
+    struct event *done_event;
+} pool = {.event_fd = -1};
+
+static void
+list_push(struct job_list *list, struct io_job *job) {
+    job->next = NULL;
+    if (list->tail) list->tail->next = job;
+    else list->head = job;
+    list->tail = job;
+}
+
+static void
+run_done(struct io_job *jobs) {
+    while (jobs) {
+        struct io_job *next = jobs->next;
+        if (jobs->done) jobs->done(jobs->arg);
+        free(jobs);
+        jobs = next;
+    }
+}
+
+static struct io_job *
+take_finished() {
+    pthread_mutex_lock(&pool.lock);
+    struct io_job *jobs = pool.finished.head;
+    pool.finished.head = pool.finished.tail = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    return jobs;
+}
+
+static void *
+worker(void *arg) {
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.queued.head && !pool.stopping) pthread_cond_wait(&pool.cond, &pool.lock);
+        struct io_job *job = pool.queued.head;
+        if (!job) break; // Stopping and nothing left to do
+        pool.queued.head = job->next;
+        if (!pool.queued.head) pool.queued.tail = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        job->work(job->arg);
+
+        pthread_mutex_lock(&pool.lock);
+        bool wake = !pool.finished.head;
+        list_push(&pool.finished, job);
+        if (wake) {
+            // The loop takes all finished jobs at once, so it only needs waking up for the first one
+            uint64_t one = 1;
+            while (write(pool.event_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void
+done_cb(evutil_socket_t fd, short what, void *arg) {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR);
+    run_done(take_finished());
+}
+
+int
+io_pool_init(struct event_base *base, int threads) {
+    pool.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool.event_fd < 0) {
+        fprintf(stderr, "[io] Error when creating eventfd: %s\n", strerror(errno));
+        return 1;
+    }
+    pool.done_event = event_new(base, pool.event_fd, EV_READ | EV_PERSIST, done_cb, NULL);
+    event_add(pool.done_event, NULL);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.stopping = false;
+    pool.threads = calloc(threads, sizeof(*pool.threads));
+    for (pool.thread_count = 0; pool.thread_count < threads; ++pool.thread_count) {
+        int err = pthread_create(&pool.threads[pool.thread_count], NULL, worker, NULL);
+        if (err) {
+            fprintf(stderr, "[io] Error when starting I/O thread: %s\n", strerror(err));
+            break;
+        }
+    }
+    pool.running = pool.thread_count > 0;
+    return !pool.running;
+}
+
+void
+io_pool_close() {
+    if (pool.thread_count) {
+        pthread_mutex_lock(&pool.lock);
+        pool.stopping = true;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+        for (int i = 0; i < pool.thread_count; ++i) pthread_join(pool.threads[i], NULL);
+        pool.running = false;
+        // Done functions may submit more jobs, which now run right away
+        run_done(take_finished());
+        pthread_cond_destroy(&pool.cond);
+        pthread_mutex_destroy(&pool.lock);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.thread_count = 0;
+    if (pool.done_event) event_free(pool.done_event);
+    pool.done_event = NULL;
+    if (pool.event_fd >= 0) close(pool.event_fd);
+    pool.event_fd = -1;
+}
+
+void
+io_pool_submit(io_work_fn work, io_done_fn done, void *arg) {
+    if (!pool.running) {
+        work(arg);
+        if (done) done(arg);
+        return;
+    }
+    struct io_job *job = malloc(sizeof(*job));
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    pthread_mutex_lock(&pool.lock);
+    list_push(&pool.queued, job);
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,23 @@
+#ifndef SMP_IO_POOL_H
+#define SMP_IO_POOL_H
+
+#include <event2/event.h>
+
+/*
+ * Runs blocking file system calls on worker threads so the event loop never waits for the disk. The work function of
+ * a job runs on one of the workers and must not touch any state owned by the event loop. Its done function then runs
+ * on the event loop, which is woken up through an eventfd. Jobs can run in any order.
+ */
+typedef void (*io_work_fn)(void *arg);
+
+typedef void (*io_done_fn)(void *arg);
+
+int io_pool_init(struct event_base *base, int threads);
+
+// Waits for all submitted jobs and runs their done functions
+void io_pool_close();
+
+// done is optional. While the pool isn't running both functions are called before returning.
+void io_pool_submit(io_work_fn work, io_done_fn done, void *arg);
+
+#endif //SMP_IO_POOL_H
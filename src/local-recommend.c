@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "local-recommend.h"
+#include "idmap.h"
+#include "history.h"
+#include "track-cache.h"
+
+#define GRAPH_MAGIC 0x47504d53 // "SMPG"
+#define GRAPH_VERSION 2
+#define GRAPH_NONE UINT32_MAX // Artist of a track whose artist isn't known
+#define SCAN_ROWS 32 // Rows added since the transposed rows were built which a query scans instead of building them
+#define SCAN_TRACKS 1024 // Same for tracks, whose artists are compared with the seed artists
+#define SAVE_ROWS 256 // Rows added before the graph is saved again
+#define ROW_WEIGHT 16.0 // A row of this many tracks counts for half as much as a tiny one
+#define ARTIST_WEIGHT 0.5 // What sharing an artist with a seed counts for, compared to sharing a tiny row
+#define PLAY_COUNT_MAX 10 // Plays above this don't make a track rank higher
+
+// The file holds the header, the tracks, the artist ids, the row ids, the row starts and the tracks of the rows
+struct graph_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t track_count;
+    uint32_t artist_count;
+    uint32_t row_count;
+    uint32_t entry_count;
+};
+
+struct graph_track {
+    SpotifyId id;
+    uint32_t artist; // Index of its artist, GRAPH_NONE if unknown
+    uint32_t reserved;
+};
+
+struct candidate {
+    uint32_t track;
+    double score;
+};
+
+static struct {
+    char *path;
+    size_t save_at; // Number of unsaved rows at which the graph is saved
+    bool rebuilding; // The file couldn't be read, the rows are added from the cached info before it is saved
+    size_t unsaved;
+
+    struct idmap track_ids; // Id to index in tracks
+    struct graph_track *tracks;
+    size_t track_count;
+    size_t track_size;
+
+    struct idmap artist_ids; // Id to index in artists
+    SpotifyId *artists;
+    size_t artist_count;
+    size_t artist_size;
+
+    struct idmap row_ids; // Id to the index of its row, replaced rows aren't in it anymore
+    SpotifyId *row_keys;
+    uint32_t *row_start; // row_count + 1 entries, the tracks of row i are entries[row_start[i]..row_start[i + 1])
+    bool *row_dead;
+    size_t row_count;
+    size_t row_size;
+    uint32_t *entries; // Sorted within each row
+    size_t entry_count;
+    size_t entry_size;
+    size_t dead_entries; // Held by replaced rows
+
+    // Transposed rows of the first built_rows rows and built_tracks tracks, rebuilt when stale is set
+    uint32_t *track_start; // built_tracks + 1 entries into track_rows
+    uint32_t *track_rows;
+    uint32_t *artist_start; // built_artists + 1 entries into artist_tracks
+    uint32_t *artist_tracks;
+    size_t built_rows;
+    size_t built_tracks;
+    size_t built_artists;
+    bool stale;
+
+    // Scores of the current query, only valid for the tracks whose stamp is query
+    double *score;
+    uint32_t *stamp;
+    uint32_t *touched;
+    size_t scratch_size;
+    uint32_t query;
+} rg;
+
+static void save();
+
+static size_t
+grown_size(size_t size, size_t needed) {
+    size_t size_new = size ? size : 64;
+    while (size_new < needed) size_new *= 2;
+    return size_new;
+}
+
+static void *
+resize(void *array, size_t count, size_t elem_size) {
+    void *tmp = realloc(array, count * elem_size);
+    if (!tmp) {
+        perror("[recommend] Error when calling realloc");
+        exit(EXIT_FAILURE);
+    }
+    return tmp;
+}
+
+static void *
+reserve(void *array, size_t *size, size_t needed, size_t elem_size) {
+    if (needed <= *size) return array;
+    *size = grown_size(*size, needed);
+    return resize(array, *size, elem_size);
+}
+
+static void
+reserve_rows(size_t needed) {
+    if (needed <= rg.row_size) return;
+    rg.row_size = grown_size(rg.row_size, needed);
+    rg.row_keys = resize(rg.row_keys, rg.row_size, sizeof(*rg.row_keys));
+    rg.row_dead = resize(rg.row_dead, rg.row_size, sizeof(*rg.row_dead));
+    rg.row_start = resize(rg.row_start, rg.row_size + 1, sizeof(*rg.row_start));
+}
+
+static uint32_t
+add_artist(SpotifyId id) {
+    if (spotify_id_none(id)) return GRAPH_NONE;
+    uint64_t *index = idmap_upsert(&rg.artist_ids, id, rg.artist_count);
+    if (*index == rg.artist_count) {
+        rg.artists = reserve(rg.artists, &rg.artist_size, rg.artist_count + 1, sizeof(*rg.artists));
+        rg.artists[rg.artist_count++] = id;
+    }
+    return (uint32_t) *index;
+}
+
+static uint32_t
+add_track(const Track *track) {
+    uint32_t artist = add_artist(track->info ? track->info->spotify_artist_id : (SpotifyId) {0});
+    uint64_t *index = idmap_upsert(&rg.track_ids, track->spotify_id, rg.track_count);
+    if (*index == rg.track_count) {
+        rg.tracks = reserve(rg.tracks, &rg.track_size, rg.track_count + 1, sizeof(*rg.tracks));
+        struct graph_track *t = &rg.tracks[rg.track_count++];
+        memset(t, 0, sizeof(*t));
+        t->id = track->spotify_id;
+        t->artist = artist;
+    } else if (artist != GRAPH_NONE && rg.tracks[*index].artist != artist) {
+        rg.tracks[*index].artist = artist;
+        if (*index < rg.built_tracks) rg.stale = true; // It is listed under its old artist
+    }
+    return (uint32_t) *index;
+}
+
+// Drops replaced rows, which changes the index of the rows after them
+static void
+compact_rows() {
+    if (!rg.dead_entries && rg.row_count == rg.row_ids.count) return;
+    size_t rows = 0, entries = 0;
+    for (size_t i = 0; i < rg.row_count; ++i) {
+        if (rg.row_dead[i]) continue;
+        uint32_t start = rg.row_start[i], len = rg.row_start[i + 1] - start;
+        memmove(&rg.entries[entries], &rg.entries[start], len * sizeof(*rg.entries));
+        rg.row_keys[rows] = rg.row_keys[i];
+        rg.row_start[rows] = entries;
+        rg.row_dead[rows] = false;
+        idmap_put(&rg.row_ids, rg.row_keys[rows], rows);
+        entries += len;
+        rows++;
+    }
+    rg.row_start[rows] = entries;
+    rg.row_count = rows;
+    rg.entry_count = entries;
+    rg.dead_entries = 0;
+    rg.stale = true;
+}
+
+static int
+compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void
+add_row(SpotifyId id, uint32_t *tracks, size_t count) {
+    qsort(tracks, count, sizeof(*tracks), compare_u32);
+    size_t len = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (!len || tracks[len - 1] != tracks[i]) tracks[len++] = tracks[i];
+    }
+
+    uint64_t old;
+    if (idmap_get(&rg.row_ids, id, &old)) {
+        uint32_t start = rg.row_start[old], old_len = rg.row_start[old + 1] - start;
+        if (old_len == len && !memcmp(&rg.entries[start], tracks, len * sizeof(*tracks))) return; // Nothing changed
+        rg.row_dead[old] = true;
+        rg.dead_entries += old_len;
+    }
+    if (rg.dead_entries > rg.entry_count / 2) compact_rows();
+
+    reserve_rows(rg.row_count + 1);
+    rg.entries = reserve(rg.entries, &rg.entry_size, rg.entry_count + len, sizeof(*rg.entries));
+    memcpy(&rg.entries[rg.entry_count], tracks, len * sizeof(*tracks));
+    rg.row_keys[rg.row_count] = id;
+    rg.row_dead[rg.row_count] = false;
+    rg.row_start[rg.row_count] = rg.entry_count;
+    rg.entry_count += len;
+    rg.row_start[++rg.row_count] = rg.entry_count;
+    idmap_put(&rg.row_ids, id, rg.row_count - 1);
+
+    if (++rg.unsaved >= rg.save_at) save();
+}
+
+// Counting sort of the rows by track and of the tracks by artist
+static void
+build_transposed() {
+    free(rg.track_start);
+    free(rg.track_rows);
+    free(rg.artist_start);
+    free(rg.artist_tracks);
+
+    rg.track_start = calloc(rg.track_count + 1, sizeof(*rg.track_start));
+    for (size_t i = 0; i < rg.row_count; ++i) {
+        if (rg.row_dead[i]) continue;
+        for (uint32_t j = rg.row_start[i]; j < rg.row_start[i + 1]; ++j) rg.track_start[rg.entries[j] + 1]++;
+    }
+    for (size_t i = 0; i < rg.track_count; ++i) rg.track_start[i + 1] += rg.track_start[i];
+    rg.track_rows = malloc((rg.track_start[rg.track_count] ? rg.track_start[rg.track_count] : 1) * sizeof(*rg.track_rows));
+    uint32_t *fill = malloc((rg.track_count ? rg.track_count : 1) * sizeof(*fill));
+    memcpy(fill, rg.track_start, rg.track_count * sizeof(*fill));
+    for (size_t i = 0; i < rg.row_count; ++i) {
+        if (rg.row_dead[i]) continue;
+        for (uint32_t j = rg.row_start[i]; j < rg.row_start[i + 1]; ++j) rg.track_rows[fill[rg.entries[j]]++] = i;
+    }
+    free(fill);
+
+    rg.artist_start = calloc(rg.artist_count + 1, sizeof(*rg.artist_start));
+    for (size_t i = 0; i < rg.track_count; ++i) {
+        if (rg.tracks[i].artist != GRAPH_NONE) rg.artist_start[rg.tracks[i].artist + 1]++;
+    }
+    for (size_t i = 0; i < rg.artist_count; ++i) rg.artist_start[i + 1] += rg.artist_start[i];
+    rg.artist_tracks = malloc((rg.artist_start[rg.artist_count] ? rg.artist_start[rg.artist_count] : 1) *
+                              sizeof(*rg.artist_tracks));
+    fill = malloc((rg.artist_count ? rg.artist_count : 1) * sizeof(*fill));
+    memcpy(fill, rg.artist_start, rg.artist_count * sizeof(*fill));
+    for (size_t i = 0; i < rg.track_count; ++i) {
+        if (rg.tracks[i].artist != GRAPH_NONE) rg.artist_tracks[fill[rg.tracks[i].artist]++] = i;
+    }
+    free(fill);
+
+    rg.built_rows = rg.row_count;
+    rg.built_tracks = rg.track_count;
+    rg.built_artists = rg.artist_count;
+    rg.stale = false;
+}
+
+static void
+clear_graph() {
+    idmap_clear(&rg.track_ids);
+    idmap_clear(&rg.artist_ids);
+    idmap_clear(&rg.row_ids);
+    rg.track_count = rg.artist_count = rg.row_count = rg.entry_count = rg.dead_entries = 0;
+    if (rg.row_start) rg.row_start[0] = 0;
+    rg.stale = true;
+}
+
+static bool
+read_part(FILE *fp, void *data, size_t len) {
+    return !len || fread(data, 1, len, fp) == len;
+}
+
+// Reads the file and checks every index in it, so that queries never have to. Returns 1 if it is unusable.
+static int
+load() {
+    clear_graph();
+    FILE *fp = fopen(rg.path, "r");
+    if (!fp) return 1;
+    struct graph_header header;
+    if (!read_part(fp, &header, sizeof(header)) || header.magic != GRAPH_MAGIC || header.version != GRAPH_VERSION)
+        goto invalid;
+    uint64_t expected = sizeof(header) + (uint64_t) header.track_count * sizeof(*rg.tracks) +
+                        (uint64_t) header.artist_count * sizeof(*rg.artists) +
+                        (uint64_t) header.row_count * sizeof(*rg.row_keys) +
+                        ((uint64_t) header.row_count + 1) * sizeof(*rg.row_start) +
+                        (uint64_t) header.entry_count * sizeof(*rg.entries);
+    if (fseek(fp, 0, SEEK_END) || ftell(fp) != expected || fseek(fp, sizeof(header), SEEK_SET)) goto invalid;
+
+    rg.tracks = reserve(rg.tracks, &rg.track_size, header.track_count, sizeof(*rg.tracks));
+    rg.artists = reserve(rg.artists, &rg.artist_size, header.artist_count, sizeof(*rg.artists));
+    reserve_rows(header.row_count);
+    rg.entries = reserve(rg.entries, &rg.entry_size, header.entry_count, sizeof(*rg.entries));
+    if (!read_part(fp, rg.tracks, header.track_count * sizeof(*rg.tracks)) ||
+        !read_part(fp, rg.artists, header.artist_count * sizeof(*rg.artists)) ||
+        !read_part(fp, rg.row_keys, header.row_count * sizeof(*rg.row_keys)) ||
+        !read_part(fp, rg.row_start, (header.row_count + 1) * sizeof(*rg.row_start)) ||
+        !read_part(fp, rg.entries, header.entry_count * sizeof(*rg.entries)))
+        goto invalid;
+
+    for (uint32_t i = 0; i < header.track_count; ++i) {
+        uint32_t artist = rg.tracks[i].artist;
+        if (artist != GRAPH_NONE && artist >= header.artist_count) goto invalid;
+    }
+    if (rg.row_start[0] != 0 || rg.row_start[header.row_count] != header.entry_count) goto invalid;
+    for (uint32_t i = 0; i < header.row_count; ++i) {
+        if (rg.row_start[i] > rg.row_start[i + 1]) goto invalid;
+    }
+    for (uint32_t i = 0; i < header.entry_count; ++i) {
+        if (rg.entries[i] >= header.track_count) goto invalid;
+    }
+    fclose(fp);
+
+    rg.track_count = header.track_count;
+    rg.artist_count = header.artist_count;
+    rg.row_count = header.row_count;
+    rg.entry_count = header.entry_count;
+    for (size_t i = 0; i < rg.track_count; ++i) idmap_put(&rg.track_ids, rg.tracks[i].id, i);
+    for (size_t i = 0; i < rg.artist_count; ++i) idmap_put(&rg.artist_ids, rg.artists[i], i);
+    for (size_t i = 0; i < rg.row_count; ++i) {
+        rg.row_dead[i] = false;
+        idmap_put(&rg.row_ids, rg.row_keys[i], i);
+    }
+    return 0;
+
+    invalid:
+    fprintf(stderr, "[recommend] Recommendation graph is invalid\n");
+    fclose(fp);
+    clear_graph();
+    return 1;
+}
+
+static bool
+write_part(FILE *fp, const void *data, size_t len) {
+    return !len || fwrite(data, 1, len, fp) == len;
+}
+
+static void
+save() {
+    if (!rg.path || !rg.unsaved) return;
+    compact_rows();
+    struct graph_header header = {
+            .magic = GRAPH_MAGIC,
+            .version = GRAPH_VERSION,
+            .track_count = rg.track_count,
+            .artist_count = rg.artist_count,
+            .row_count = rg.row_count,
+            .entry_count = rg.entry_count
+    };
+    size_t path_len = strlen(rg.path);
+    char tmp_path[path_len + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", rg.path);
+    FILE *fp = fopen(tmp_path, "w");
+    bool ok = fp && write_part(fp, &header, sizeof(header)) &&
+              write_part(fp, rg.tracks, rg.track_count * sizeof(*rg.tracks)) &&
+              write_part(fp, rg.artists, rg.artist_count * sizeof(*rg.artists)) &&
+              write_part(fp, rg.row_keys, rg.row_count * sizeof(*rg.row_keys)) &&
+              write_part(fp, rg.row_start, (rg.row_count + 1) * sizeof(*rg.row_start)) &&
+              write_part(fp, rg.entries, rg.entry_count * sizeof(*rg.entries));
+    if (fp && fclose(fp)) ok = false;
+
+    if (!ok || rename(tmp_path, rg.path)) {
+        fprintf(stderr, "[recommend] Error when saving recommendation graph: %s\n", strerror(errno));
+        remove(tmp_path);
+        rg.save_at = rg.unsaved * 2; // Not retried on every new row
+        return;
+    }
+    rg.unsaved = 0;
+    rg.save_at = SAVE_ROWS;
+    printf("[recommend] Saved recommendation graph with %zu tracks in %zu albums and playlists\n", rg.track_count,
+           rg.row_count);
+}
+
+int
+local_recommend_init(const char *path) {
+    rg.path = strdup(path);
+    rg.save_at = SAVE_ROWS;
+    idmap_init(&rg.track_ids, 1024);
+    idmap_init(&rg.artist_ids, 256);
+    idmap_init(&rg.row_ids, 64);
+    reserve_rows(1);
+    if (load()) {
+        printf("[recommend] Building recommendation graph from cached info\n");
+        rg.save_at = SIZE_MAX; // Saved once by local_recommend_rebuilt
+        rg.rebuilding = true;
+    }
+    rg.stale = true;
+    printf("[recommend] Loaded recommendation graph with %zu tracks in %zu albums and playlists\n", rg.track_count,
+           rg.row_ids.count);
+    return 0;
+}
+
+bool
+local_recommend_needs_rebuild() {
+    return rg.rebuilding;
+}
+
+void
+local_recommend_rebuilt() {
+    rg.rebuilding = false;
+    rg.save_at = SAVE_ROWS;
+    rg.unsaved++; // Even an empty graph is saved, so that it isn't rebuilt every time
+    save();
+}
+
+void
+local_recommend_close() {
+    save();
+    idmap_free(&rg.track_ids);
+    idmap_free(&rg.artist_ids);
+    idmap_free(&rg.row_ids);
+    free(rg.tracks);
+    free(rg.artists);
+    free(rg.row_keys);
+    free(rg.row_start);
+    free(rg.row_dead);
+    free(rg.entries);
+    free(rg.track_start);
+    free(rg.track_rows);
+    free(rg.artist_start);
+    free(rg.artist_tracks);
+    free(rg.score);
+    free(rg.stamp);
+    free(rg.touched);
+    free(rg.path);
+    memset(&rg, 0, sizeof(rg));
+}
+
+void
+local_recommend_add_tracks(const Track *tracks, size_t count) {
+    if (!rg.path) return;
+    for (size_t i = 0; i < count; ++i) add_track(&tracks[i]);
+}
+
+void
+local_recommend_add_playlist(const PlaylistInfo *playlist, const Track *tracks, size_t count) {
+    if (!rg.path) return;
+    uint32_t *row = malloc((count ? count : 1) * sizeof(*row));
+    for (size_t i = 0; i < count; ++i) row[i] = add_track(&tracks[i]);
+    SpotifyId id;
+    if (spotify_id_parse(playlist->spotify_id, &id)) add_row(id, row, count);
+    free(row);
+}
+
+static void
+bump(uint32_t track, double weight, size_t *touched) {
+    if (rg.stamp[track] != rg.query) {
+        rg.stamp[track] = rg.query;
+        rg.score[track] = 0;
+        rg.touched[(*touched)++] = track;
+    }
+    rg.score[track] += weight;
+}
+
+static void
+score_row(size_t row, size_t *touched) {
+    uint32_t start = rg.row_start[row], len = rg.row_start[row + 1] - start;
+    double weight = ROW_WEIGHT / (ROW_WEIGHT + len);
+    for (uint32_t i = 0; i < len; ++i) bump(rg.entries[start + i], weight, touched);
+}
+
+static bool
+row_holds(size_t row, uint32_t track) {
+    size_t lo = rg.row_start[row], hi = rg.row_start[row + 1];
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rg.entries[mid] < track) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < rg.row_start[row + 1] && rg.entries[lo] == track;
+}
+
+static void
+score_artist(uint32_t artist, size_t *touched) {
+    if (artist < rg.built_artists) {
+        for (uint32_t i = rg.artist_start[artist]; i < rg.artist_start[artist + 1]; ++i)
+            bump(rg.artist_tracks[i], ARTIST_WEIGHT, touched);
+    }
+    for (size_t i = rg.built_tracks; i < rg.track_count; ++i) {
+        if (rg.tracks[i].artist == artist) bump(i, ARTIST_WEIGHT, touched);
+    }
+}
+
+size_t
+local_recommend(const SpotifyId *seed_tracks, size_t seed_track_count, const SpotifyId *seed_artists,
+                size_t seed_artist_count, local_recommend_filter filter, void *userp, SpotifyId *out, size_t max) {
+    if (!rg.path || !rg.track_count || !max) return 0;
+    if (rg.stale || rg.row_count - rg.built_rows > SCAN_ROWS || rg.track_count - rg.built_tracks > SCAN_TRACKS)
+        build_transposed();
+    if (rg.scratch_size < rg.track_count) {
+        size_t size = grown_size(rg.scratch_size, rg.track_count);
+        rg.score = resize(rg.score, size, sizeof(*rg.score));
+        rg.touched = resize(rg.touched, size, sizeof(*rg.touched));
+        rg.stamp = resize(rg.stamp, size, sizeof(*rg.stamp));
+        memset(&rg.stamp[rg.scratch_size], 0, (size - rg.scratch_size) * sizeof(*rg.stamp));
+        rg.scratch_size = size;
+    }
+    if (++rg.query == 0) { // Wrapped around, so old stamps could match again
+        memset(rg.stamp, 0, rg.scratch_size * sizeof(*rg.stamp));
+        rg.query = 1;
+    }
+
+    size_t touched = 0;
+    uint32_t seeds[seed_track_count ? seed_track_count : 1];
+    uint32_t artists[seed_track_count + seed_artist_count + 1];
+    size_t seed_count = 0, artist_count = 0;
+    for (size_t i = 0; i < seed_artist_count; ++i) {
+        uint64_t artist;
+        if (idmap_get(&rg.artist_ids, seed_artists[i], &artist)) artists[artist_count++] = artist;
+    }
+    for (size_t i = 0; i < seed_track_count; ++i) {
+        uint64_t track;
+        if (!idmap_get(&rg.track_ids, seed_tracks[i], &track)) continue;
+        seeds[seed_count++] = track;
+        if (track < rg.built_tracks) {
+            for (uint32_t j = rg.track_start[track]; j < rg.track_start[track + 1]; ++j) {
+                if (!rg.row_dead[rg.track_rows[j]]) score_row(rg.track_rows[j], &touched);
+            }
+        }
+        for (size_t row = rg.built_rows; row < rg.row_count; ++row) {
+            if (!rg.row_dead[row] && row_holds(row, track)) score_row(row, &touched);
+        }
+        uint32_t artist = rg.tracks[track].artist;
+        size_t j = 0;
+        while (j < artist_count && artists[j] != artist) j++;
+        if (artist != GRAPH_NONE && j == artist_count) artists[artist_count++] = artist;
+    }
+    for (size_t i = 0; i < artist_count; ++i) score_artist(artists[i], &touched);
+
+    struct candidate top[max];
+    size_t found = 0;
+    for (size_t i = 0; i < touched; ++i) {
+        uint32_t track = rg.touched[i];
+        size_t j = 0;
+        while (j < seed_count && seeds[j] != track) j++;
+        if (j < seed_count) continue;
+
+        SpotifyId id = rg.tracks[track].id;
+        uint32_t play_count = 0;
+        history_get(HISTORY_TRACK, id, NULL, &play_count);
+        double score = rg.score[track] * (1.0 + 0.1 * (play_count < PLAY_COUNT_MAX ? play_count : PLAY_COUNT_MAX));
+        if (found == max && score <= top[max - 1].score) continue;
+        if (!track_cache_contains(id) || (filter && !filter(id, userp))) continue;
+
+        j = found < max ? found++ : max - 1;
+        while (j > 0 && top[j - 1].score < score) {
+            top[j] = top[j - 1];
+            j--;
+        }
+        top[j] = (struct candidate) {.track = track, .score = score};
+    }
+    for (size_t i = 0; i < found; ++i) out[i] = rg.tracks[top[i].track].id;
+    return found;
+}
@@ -0,0 +1,49 @@
+#ifndef SMP_LOCAL_RECOMMEND_H
+#define SMP_LOCAL_RECOMMEND_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "spotify.h"
+
+#define LOCAL_RECOMMEND_FILE "recommend_graph.bin"
+
+// Returns whether a track may be recommended
+typedef bool (*local_recommend_filter)(SpotifyId id, void *userp);
+
+/*
+ * Graph of which tracks appear together in the albums and playlists whose info has been loaded, so the queue can be
+ * continued without a backend. The tracks of each album or playlist are a row of a matrix kept in CSR form (one array
+ * holding the tracks of every row and one holding where each row starts), so loading a playlist only appends a row.
+ * The transposed rows, from each track to the rows holding it and from each artist to its tracks, are built from those
+ * when a query finds that too much was added since they last were. Until then the rows and tracks added since are
+ * scanned by the query itself.
+ *
+ * The graph is saved at path whenever enough rows were added and by local_recommend_close. If the file can't be read
+ * the graph starts out empty and is rebuilt from the cached info by the caller, which then calls
+ * local_recommend_rebuilt to save it.
+ */
+int local_recommend_init(const char *path);
+
+bool local_recommend_needs_rebuild();
+
+void local_recommend_rebuilt();
+
+void local_recommend_close();
+
+// Adds tracks which aren't part of an album or playlist, which are linked to the others through their artist
+void local_recommend_add_tracks(const Track *tracks, size_t count);
+
+// Adds the row of an album or playlist holding count tracks, replacing the one it had before
+void local_recommend_add_playlist(const PlaylistInfo *playlist, const Track *tracks, size_t count);
+
+/*
+ * Writes the ids of up to max tracks to out, best first, and returns how many were written. Tracks score for every
+ * album or playlist they share with a seed track, where small ones count for more, and for being by one of the seed
+ * artists or the artists of the seed tracks. Tracks which were played often are preferred. Only tracks whose audio is
+ * in the track cache and which aren't seeds are returned, and only if filter is NULL or returns true for them.
+ */
+size_t local_recommend(const SpotifyId *seed_tracks, size_t seed_track_count, const SpotifyId *seed_artists,
+                       size_t seed_artist_count, local_recommend_filter filter, void *userp, SpotifyId *out,
+                       size_t max);
+
+#endif //SMP_LOCAL_RECOMMEND_H
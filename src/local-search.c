@@ -0,0 +1,890 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "local-search.h"
+#include "idmap.h"
+#include "io-pool.h"
+
+#define SEARCH_MAGIC 0x53504d53 // "SMPS"
+#define SEARCH_VERSION 2
+#define SEARCH_NONE UINT32_MAX // String offset of a missing string
+#define SEARCH_LIMIT 20 // Results of each kind
+#define MEM_FLUSH_ENTRIES 4096 // Entries kept in memory before they are merged into the file
+#define MEM_ENTRY (1ULL << 63) // Set in the id map for entries which are only in memory
+#define MAX_TRIGRAMS 256 // Per entry or query, the rest of a very long name isn't indexed
+
+#define TRIGRAM(a, b, c) (((uint32_t) (uint8_t) (a) << 16) | ((uint32_t) (uint8_t) (b) << 8) | (uint8_t) (c))
+
+enum local_kind {
+    LOCAL_TRACK = 0,
+    LOCAL_ALBUM,
+    LOCAL_PLAYLIST,
+    LOCAL_KIND_LAST
+};
+
+// The file holds the header, the entries, the trigrams sorted by value, their posting lists and the strings
+struct search_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t trigram_count;
+    uint32_t posting_count;
+    uint32_t strings_len;
+};
+
+struct search_entry {
+    SpotifyId id;
+    SpotifyId artist_id; // Zero for albums and playlists
+    uint8_t kind;
+    uint8_t reserved[3];
+    uint32_t name; // Offsets into the string table, SEARCH_NONE if missing
+    uint32_t artist;
+    uint32_t image;
+    uint32_t text; // The normalized name and artist, each followed by a NUL, so searching doesn't normalize them
+    uint32_t extra; // Duration of tracks in ms, track count of albums and playlists
+};
+
+struct search_trigram {
+    uint32_t trigram;
+    uint32_t first; // Start of its posting list, which holds the indexes of the entries in ascending order
+    uint32_t count;
+};
+
+// An entry which hasn't been merged into the file yet
+struct mem_entry {
+    SpotifyId id;
+    SpotifyId artist_id;
+    uint8_t kind;
+    bool dead; // Replaced by a newer entry
+    uint32_t extra;
+    char *name;
+    char *artist;
+    char *image;
+    char *text;
+};
+
+struct mem_posting {
+    uint32_t trigram; // 0 if the slot is empty, every trigram contains a letter, digit or space
+    uint32_t len;
+    uint32_t size;
+    uint32_t *ids;
+};
+
+// An entry wherever it is stored
+struct entry_view {
+    SpotifyId id;
+    SpotifyId artist_id;
+    uint8_t kind;
+    uint32_t extra;
+    const char *name;
+    const char *artist;
+    const char *image;
+    const char *text; // NULL for entries which are being added
+};
+
+struct ranked {
+    int score;
+    size_t name_len;
+    uint64_t where; // Same as the values of the id map
+};
+
+static struct {
+    char *path;
+    uint8_t *map;
+    size_t map_len;
+    const struct search_header *header;
+    const struct search_entry *entries;
+    const struct search_trigram *trigrams;
+    const uint32_t *postings;
+    const char *strings;
+    uint8_t *dead; // Per entry of the file, set once it has been replaced
+
+    struct idmap ids; // Id to the index of its entry, with MEM_ENTRY set if it is in mem
+    struct mem_entry *mem;
+    size_t mem_len;
+    size_t mem_size;
+    size_t flush_at;
+    bool saving; // A save job is running, the entries added meanwhile stay in mem
+    bool rebuilding; // The file couldn't be read, the entries are added from the cached info before it is saved
+    struct mem_posting *mem_postings; // Open addressing by trigram
+    size_t mem_posting_count;
+    size_t mem_posting_size; // Always a power of two
+} ls;
+
+static void save();
+
+// Lowercases ASCII and turns everything else which isn't a letter, digit or part of a UTF-8 character into single spaces
+static size_t
+normalize(const char *in, char *out) {
+    size_t len = 0;
+    for (; *in; ++in) {
+        uint8_t c = *in;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        else if (c < 0x80 && !(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9')) c = ' ';
+        if (c == ' ' && (!len || out[len - 1] == ' ')) continue;
+        out[len++] = (char) c;
+    }
+    if (len && out[len - 1] == ' ') len--;
+    out[len] = 0;
+    return len;
+}
+
+/*
+ * Adds the distinct trigrams of every word in a normalized text. Words are preceded by a space, so the start of a
+ * word has trigrams of its own and two letter words are indexed too.
+ */
+static size_t
+text_trigrams(const char *text, uint32_t *out, size_t n) {
+    const char *word = text;
+    while (*word && n < MAX_TRIGRAMS) {
+        const char *end = strchr(word, ' ');
+        if (!end) end = word + strlen(word);
+        for (const char *p = word; p + 1 < end && n < MAX_TRIGRAMS; ++p) {
+            uint32_t trigram = TRIGRAM(p == word ? ' ' : p[-1], p[0], p[1]);
+            size_t i = 0;
+            while (i < n && out[i] != trigram) i++;
+            if (i == n) out[n++] = trigram;
+        }
+        word = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+// Returns the normalized name followed by the normalized artist, which must be freed
+static char *
+make_text(const struct entry_view *e) {
+    char *text = malloc(strlen(e->name) + (e->artist ? strlen(e->artist) : 0) + 2);
+    size_t name_len = normalize(e->name, text);
+    normalize(e->artist ? e->artist : "", &text[name_len + 1]);
+    return text;
+}
+
+static const char *
+text_artist(const char *text) {
+    return text + strlen(text) + 1;
+}
+
+static size_t
+entry_trigrams(const struct entry_view *e, uint32_t out[MAX_TRIGRAMS]) {
+    size_t n = text_trigrams(e->text, out, 0);
+    if (e->kind == LOCAL_TRACK) n = text_trigrams(text_artist(e->text), out, n);
+    return n;
+}
+
+static const char *
+file_string(uint32_t offset) {
+    return offset == SEARCH_NONE ? NULL : &ls.strings[offset];
+}
+
+static void
+view_of(uint64_t where, struct entry_view *out) {
+    if (where & MEM_ENTRY) {
+        const struct mem_entry *m = &ls.mem[where & ~MEM_ENTRY];
+        *out = (struct entry_view) {m->id, m->artist_id, m->kind, m->extra, m->name, m->artist, m->image, m->text};
+    } else {
+        const struct search_entry *f = &ls.entries[where];
+        *out = (struct entry_view) {f->id, f->artist_id, f->kind, f->extra, file_string(f->name),
+                                    file_string(f->artist), file_string(f->image), &ls.strings[f->text]};
+    }
+}
+
+static bool
+same_string(const char *a, const char *b) {
+    return a == b || (a && b && !strcmp(a, b));
+}
+
+static bool
+same_entry(const struct entry_view *a, const struct entry_view *b) {
+    return a->kind == b->kind && a->extra == b->extra && spotify_id_equal(a->artist_id, b->artist_id) &&
+           same_string(a->name, b->name) && same_string(a->artist, b->artist) && same_string(a->image, b->image);
+}
+
+static struct mem_posting *
+mem_posting(uint32_t trigram, bool create) {
+    if (create && (ls.mem_posting_count + 1) * 2 > ls.mem_posting_size) {
+        size_t size = ls.mem_posting_size ? ls.mem_posting_size * 2 : 1024;
+        struct mem_posting *postings = calloc(size, sizeof(*postings));
+        for (size_t i = 0; i < ls.mem_posting_size; ++i) {
+            if (!ls.mem_postings[i].trigram) continue;
+            size_t j = (ls.mem_postings[i].trigram * 2654435761u) & (size - 1);
+            while (postings[j].trigram) j = (j + 1) & (size - 1);
+            postings[j] = ls.mem_postings[i];
+        }
+        free(ls.mem_postings);
+        ls.mem_postings = postings;
+        ls.mem_posting_size = size;
+    }
+    if (!ls.mem_posting_size) return NULL;
+    size_t i = (trigram * 2654435761u) & (ls.mem_posting_size - 1);
+    for (; ls.mem_postings[i].trigram; i = (i + 1) & (ls.mem_posting_size - 1)) {
+        if (ls.mem_postings[i].trigram == trigram) return &ls.mem_postings[i];
+    }
+    if (!create) return NULL;
+    ls.mem_postings[i].trigram = trigram;
+    ls.mem_posting_count++;
+    return &ls.mem_postings[i];
+}
+
+static void
+clear_mem() {
+    for (size_t i = 0; i < ls.mem_len; ++i) {
+        free(ls.mem[i].name);
+        free(ls.mem[i].artist);
+        free(ls.mem[i].image);
+        free(ls.mem[i].text);
+    }
+    free(ls.mem);
+    for (size_t i = 0; i < ls.mem_posting_size; ++i) free(ls.mem_postings[i].ids);
+    free(ls.mem_postings);
+    ls.mem = NULL;
+    ls.mem_len = ls.mem_size = 0;
+    ls.mem_postings = NULL;
+    ls.mem_posting_count = ls.mem_posting_size = 0;
+}
+
+static void
+unmap() {
+    if (ls.map) munmap(ls.map, ls.map_len);
+    free(ls.dead);
+    ls.map = NULL;
+    ls.map_len = 0;
+    ls.header = NULL;
+    ls.entries = NULL;
+    ls.trigrams = NULL;
+    ls.postings = NULL;
+    ls.strings = NULL;
+    ls.dead = NULL;
+}
+
+static bool
+valid_string(uint32_t offset, uint32_t strings_len) {
+    return offset == SEARCH_NONE || offset < strings_len;
+}
+
+// Maps the file at path read only. Returns 1 with errno set if it can't be.
+static int
+map_file(const char *path, uint8_t **map, size_t *map_len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return 1;
+    }
+    if (st.st_size < sizeof(struct search_header)) {
+        close(fd);
+        errno = EINVAL;
+        return 1;
+    }
+    *map_len = st.st_size;
+    *map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*map == MAP_FAILED) {
+        *map = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Searches a mapped file from now on. Unless it was just written, every offset in it is checked first, so that
+ * searching it never has to. Returns 1 and unmaps it if it is unusable.
+ */
+static int
+install(uint8_t *map, size_t map_len, bool check) {
+    unmap();
+    idmap_clear(&ls.ids);
+    ls.map = map;
+    ls.map_len = map_len;
+    const struct search_header *header = (const struct search_header *) ls.map;
+    if (header->magic != SEARCH_MAGIC || header->version != SEARCH_VERSION ||
+        sizeof(*header) + (uint64_t) header->entry_count * sizeof(struct search_entry) +
+        (uint64_t) header->trigram_count * sizeof(struct search_trigram) +
+        (uint64_t) header->posting_count * sizeof(uint32_t) + header->strings_len != ls.map_len)
+        goto invalid;
+    ls.header = header;
+    ls.entries = (const struct search_entry *) (header + 1);
+    ls.trigrams = (const struct search_trigram *) (ls.entries + header->entry_count);
+    ls.postings = (const uint32_t *) (ls.trigrams + header->trigram_count);
+    ls.strings = (const char *) (ls.postings + header->posting_count);
+    if (header->strings_len && ls.strings[header->strings_len - 1] != 0) goto invalid;
+
+    for (uint32_t i = 0; check && i < header->entry_count; ++i) {
+        const struct search_entry *e = &ls.entries[i];
+        if (e->kind >= LOCAL_KIND_LAST || e->name >= header->strings_len ||
+            !valid_string(e->artist, header->strings_len) || !valid_string(e->image, header->strings_len) ||
+            e->text >= header->strings_len ||
+            e->text + strlen(&ls.strings[e->text]) + 1 >= header->strings_len) // The artist ends within the table
+            goto invalid;
+    }
+    for (uint32_t i = 0; check && i < header->trigram_count; ++i) {
+        if ((uint64_t) ls.trigrams[i].first + ls.trigrams[i].count > header->posting_count) goto invalid;
+    }
+    for (uint32_t i = 0; check && i < header->posting_count; ++i) {
+        if (ls.postings[i] >= header->entry_count) goto invalid;
+    }
+
+    ls.dead = calloc(header->entry_count ? header->entry_count : 1, sizeof(*ls.dead));
+    for (uint32_t i = 0; i < header->entry_count; ++i) idmap_put(&ls.ids, ls.entries[i].id, i);
+    return 0;
+
+    invalid:
+    fprintf(stderr, "[local] Search index is invalid\n");
+    unmap();
+    return 1;
+}
+
+static int
+load() {
+    uint8_t *map;
+    size_t map_len;
+    if (map_file(ls.path, &map, &map_len)) {
+        if (errno != ENOENT) fprintf(stderr, "[local] Error when mapping search index: %s\n", strerror(errno));
+        return 1;
+    }
+    return install(map, map_len, true);
+}
+
+// Appends an entry to mem, which takes over its strings, and indexes it
+static void
+add_mem(const struct mem_entry *entry) {
+    if (ls.mem_len == ls.mem_size) {
+        ls.mem_size = ls.mem_size ? ls.mem_size * 2 : 256;
+        ls.mem = realloc(ls.mem, ls.mem_size * sizeof(*ls.mem));
+    }
+    uint32_t index = ls.mem_len++;
+    struct mem_entry *m = &ls.mem[index];
+    *m = *entry;
+    m->dead = false;
+    idmap_put(&ls.ids, m->id, index | MEM_ENTRY);
+
+    struct entry_view view;
+    view_of(index | MEM_ENTRY, &view);
+    uint32_t trigrams[MAX_TRIGRAMS];
+    size_t n = entry_trigrams(&view, trigrams);
+    for (size_t i = 0; i < n; ++i) {
+        struct mem_posting *posting = mem_posting(trigrams[i], true);
+        if (posting->len == posting->size) {
+            posting->size = posting->size ? posting->size * 2 : 4;
+            posting->ids = realloc(posting->ids, posting->size * sizeof(*posting->ids));
+        }
+        posting->ids[posting->len++] = index;
+    }
+}
+
+static void
+upsert(const struct entry_view *e) {
+    if (!ls.path || !e->name) return;
+    uint64_t where;
+    if (idmap_get(&ls.ids, e->id, &where)) {
+        struct entry_view old;
+        view_of(where, &old);
+        if (same_entry(&old, e)) return;
+        if (where & MEM_ENTRY) ls.mem[where & ~MEM_ENTRY].dead = true;
+        else ls.dead[where] = 1;
+    }
+
+    struct mem_entry m = {
+            .kind = e->kind,
+            .extra = e->extra,
+            .name = strdup(e->name),
+            .artist = e->artist ? strdup(e->artist) : NULL,
+            .image = e->image ? strdup(e->image) : NULL,
+            .text = make_text(e)
+    };
+    m.id = e->id;
+    m.artist_id = e->artist_id;
+    add_mem(&m);
+
+    if (ls.mem_len >= ls.flush_at) save();
+}
+
+struct string_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static uint32_t
+add_bytes(struct string_buf *buf, const char *data, size_t len) {
+    if (buf->len + len > buf->size) {
+        buf->size = (buf->len + len) * 2;
+        buf->data = realloc(buf->data, buf->size);
+    }
+    memcpy(&buf->data[buf->len], data, len);
+    buf->len += len;
+    return buf->len - len;
+}
+
+static uint32_t
+add_string(struct string_buf *buf, const char *s) {
+    return s ? add_bytes(buf, s, strlen(s) + 1) : SEARCH_NONE;
+}
+
+static int
+compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static bool
+write_part(FILE *fp, const void *data, size_t len) {
+    return !len || fwrite(data, 1, len, fp) == len;
+}
+
+// Every live entry as of when a save started, which is written to the file on the I/O pool
+struct save_job {
+    char *path;
+    struct search_entry *entries;
+    size_t count;
+    struct string_buf strings;
+    size_t flushed; // Number of entries in mem which are part of it
+    uint8_t *map; // The written file, mapped by the worker
+    size_t map_len;
+    int error;
+};
+
+// Builds the trigram table from scratch and replaces the file with it
+static void
+save_work(void *arg) {
+    struct save_job *job = arg;
+    uint64_t *pairs = NULL; // Trigram in the high half, entry in the low half
+    size_t pair_len = 0, pair_size = 0;
+    for (size_t i = 0; i < job->count; ++i) {
+        struct entry_view view = {.kind = job->entries[i].kind, .text = &job->strings.data[job->entries[i].text]};
+        uint32_t trigrams[MAX_TRIGRAMS];
+        size_t n = entry_trigrams(&view, trigrams);
+        if (pair_len + n > pair_size) {
+            pair_size = (pair_len + n) * 2;
+            pairs = realloc(pairs, pair_size * sizeof(*pairs));
+        }
+        for (size_t j = 0; j < n; ++j) pairs[pair_len++] = ((uint64_t) trigrams[j] << 32) | i;
+    }
+    if (pair_len) qsort(pairs, pair_len, sizeof(*pairs), compare_u64);
+
+    struct search_trigram *trigrams = malloc((pair_len ? pair_len : 1) * sizeof(*trigrams));
+    uint32_t *postings = malloc((pair_len ? pair_len : 1) * sizeof(*postings));
+    size_t trigram_count = 0;
+    for (size_t i = 0; i < pair_len; ++i) {
+        uint32_t trigram = pairs[i] >> 32;
+        if (!trigram_count || trigrams[trigram_count - 1].trigram != trigram)
+            trigrams[trigram_count++] = (struct search_trigram) {.trigram = trigram, .first = i};
+        trigrams[trigram_count - 1].count++;
+        postings[i] = (uint32_t) pairs[i];
+    }
+    free(pairs);
+
+    struct search_header header = {
+            .magic = SEARCH_MAGIC,
+            .version = SEARCH_VERSION,
+            .entry_count = job->count,
+            .trigram_count = trigram_count,
+            .posting_count = pair_len,
+            .strings_len = job->strings.len
+    };
+    size_t path_len = strlen(job->path);
+    char tmp_path[path_len + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->path);
+    FILE *fp = fopen(tmp_path, "w");
+    bool ok = fp && write_part(fp, &header, sizeof(header)) &&
+              write_part(fp, job->entries, job->count * sizeof(*job->entries)) &&
+              write_part(fp, trigrams, trigram_count * sizeof(*trigrams)) &&
+              write_part(fp, postings, pair_len * sizeof(*postings)) &&
+              write_part(fp, job->strings.data, job->strings.len);
+    if (fp && fclose(fp)) ok = false;
+    free(trigrams);
+    free(postings);
+
+    if (!ok || rename(tmp_path, job->path)) {
+        job->error = errno ? errno : EIO;
+        remove(tmp_path);
+        return;
+    }
+    if (map_file(job->path, &job->map, &job->map_len)) job->error = errno ? errno : EIO;
+}
+
+// Keeps the entries which were added to mem while the file was written, they are in the next one
+static void
+keep_mem(size_t flushed) {
+    struct mem_entry *mem = ls.mem;
+    size_t len = ls.mem_len;
+    for (size_t i = 0; i < ls.mem_posting_size; ++i) free(ls.mem_postings[i].ids);
+    free(ls.mem_postings);
+    ls.mem = NULL;
+    ls.mem_len = ls.mem_size = 0;
+    ls.mem_postings = NULL;
+    ls.mem_posting_count = ls.mem_posting_size = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (i >= flushed && !mem[i].dead) {
+            uint64_t where;
+            if (idmap_get(&ls.ids, mem[i].id, &where)) ls.dead[where] = 1; // Replaces the one which was saved
+            add_mem(&mem[i]);
+            continue;
+        }
+        free(mem[i].name);
+        free(mem[i].artist);
+        free(mem[i].image);
+        free(mem[i].text);
+    }
+    free(mem);
+}
+
+static void
+save_done(void *arg) {
+    struct save_job *job = arg;
+    ls.saving = false;
+    if (job->error) {
+        fprintf(stderr, "[local] Error when saving search index: %s\n", strerror(job->error));
+        ls.flush_at = ls.mem_len * 2; // Not retried on every new entry
+    } else if (install(job->map, job->map_len, false)) {
+        fprintf(stderr, "[local] Error when reloading search index\n");
+        keep_mem(0);
+    } else {
+        keep_mem(job->flushed);
+        ls.flush_at = MEM_FLUSH_ENTRIES;
+        printf("[local] Saved search index with %zu entries\n", job->count);
+    }
+    free(job->path);
+    free(job->entries);
+    free(job->strings.data);
+    free(job);
+    if (ls.mem_len >= ls.flush_at) save();
+}
+
+// Copies every live entry on the event loop, the rest of the work is done on the I/O pool
+static void
+write_index() {
+    struct save_job *job = calloc(1, sizeof(*job));
+    job->path = strdup(ls.path);
+    job->entries = calloc(ls.ids.count ? ls.ids.count : 1, sizeof(*job->entries));
+    job->flushed = ls.mem_len;
+    idmap_foreach(&ls.ids, e) { // Replaced entries aren't in the map anymore
+        struct entry_view view;
+        view_of(e->value, &view);
+        struct search_entry *out = &job->entries[job->count++];
+        out->id = view.id;
+        out->artist_id = view.artist_id;
+        out->kind = view.kind;
+        out->extra = view.extra;
+        out->name = add_string(&job->strings, view.name);
+        out->artist = add_string(&job->strings, view.artist);
+        out->image = add_string(&job->strings, view.image);
+        const char *artist = text_artist(view.text);
+        out->text = add_bytes(&job->strings, view.text, artist + strlen(artist) + 1 - view.text);
+    }
+    ls.saving = true;
+    io_pool_submit(save_work, save_done, job);
+}
+
+static void
+save() {
+    if (ls.path && ls.mem_len && !ls.saving) write_index();
+}
+
+int
+local_search_init(const char *path) {
+    ls.path = strdup(path);
+    ls.flush_at = MEM_FLUSH_ENTRIES;
+    idmap_init(&ls.ids, 1024);
+    if (load()) {
+        printf("[local] Building search index from cached info\n");
+        ls.flush_at = SIZE_MAX; // Saved once by local_search_rebuilt
+        ls.rebuilding = true;
+        return 0;
+    }
+    printf("[local] Loaded search index with %zu entries\n", ls.ids.count);
+    return 0;
+}
+
+bool
+local_search_needs_rebuild() {
+    return ls.rebuilding;
+}
+
+void
+local_search_rebuilt() {
+    ls.rebuilding = false;
+    ls.flush_at = MEM_FLUSH_ENTRIES;
+    write_index(); // Even an empty index is saved, so that it isn't rebuilt every time
+}
+
+void
+local_search_close() {
+    save();
+    unmap();
+    clear_mem();
+    idmap_free(&ls.ids);
+    free(ls.path);
+    memset(&ls, 0, sizeof(ls));
+}
+
+void
+local_search_add_tracks(const Track *tracks, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        struct entry_view view = {
+                .id = tracks[i].spotify_id,
+                .artist_id = tracks[i].info->spotify_artist_id,
+                .kind = LOCAL_TRACK,
+                .extra = tracks[i].duration_ms,
+                .name = tracks[i].info->spotify_name,
+                .artist = tracks[i].info->artist,
+                .image = tracks[i].info->spotify_album_art
+        };
+        upsert(&view);
+    }
+}
+
+void
+local_search_add_playlist(const PlaylistInfo *playlist) {
+    struct entry_view view = {
+            .kind = playlist->album ? LOCAL_ALBUM : LOCAL_PLAYLIST,
+            .extra = playlist->track_count,
+            .name = playlist->name,
+            .image = playlist->image_url
+    };
+    if (spotify_id_parse(playlist->spotify_id, &view.id)) upsert(&view);
+}
+
+// First index in list at or after from whose value isn't less than value
+static size_t
+lower_bound(const uint32_t *list, size_t from, size_t len, uint32_t value) {
+    size_t hi = from, step = 1;
+    while (hi < len && list[hi] < value) { // Galloping, since candidates are usually far apart
+        from = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > len) hi = len;
+    while (from < hi) {
+        size_t mid = from + (hi - from) / 2;
+        if (list[mid] < value) from = mid + 1;
+        else hi = mid;
+    }
+    return from;
+}
+
+/*
+ * Intersects posting lists, starting with the shortest. Returns the number of entries in all of them, which are
+ * written to a new array in out.
+ */
+static size_t
+intersect(const uint32_t **lists, size_t *counts, size_t n, uint32_t **out) {
+    for (size_t i = 1; i < n; ++i) { // Insertion sort by length, there are only a few lists
+        for (size_t j = i; j > 0 && counts[j] < counts[j - 1]; --j) {
+            const uint32_t *list = lists[j];
+            size_t count = counts[j];
+            lists[j] = lists[j - 1];
+            counts[j] = counts[j - 1];
+            lists[j - 1] = list;
+            counts[j - 1] = count;
+        }
+    }
+    uint32_t *candidates = malloc((counts[0] ? counts[0] : 1) * sizeof(*candidates));
+    memcpy(candidates, lists[0], counts[0] * sizeof(*candidates));
+    size_t len = counts[0];
+    for (size_t i = 1; i < n && len; ++i) {
+        size_t kept = 0, pos = 0;
+        for (size_t j = 0; j < len; ++j) {
+            pos = lower_bound(lists[i], pos, counts[i], candidates[j]);
+            if (pos == counts[i]) break;
+            if (lists[i][pos] == candidates[j]) candidates[kept++] = candidates[j];
+        }
+        len = kept;
+    }
+    *out = candidates;
+    return len;
+}
+
+// 2 if word is a whole word of text, 1 if it only starts one, 0 if it doesn't match
+static int
+word_match(const char *text, const char *word, size_t len) {
+    int best = 0;
+    for (const char *w = text; *w;) {
+        if (!strncmp(w, word, len)) {
+            if (w[len] == ' ' || !w[len]) return 2;
+            best = 1;
+        }
+        const char *end = strchr(w, ' ');
+        if (!end) break;
+        w = end + 1;
+    }
+    return best;
+}
+
+// Every word of the query has to start a word of the name or artist, matches in the name count more
+static int
+rank(const struct entry_view *e, const char *query, size_t query_len, size_t *name_len) {
+    const char *name = e->text;
+    *name_len = strlen(name);
+
+    int score = 0;
+    for (const char *w = query; *w;) {
+        const char *end = strchr(w, ' ');
+        size_t len = end ? end - w : strlen(w);
+        int m = word_match(name, w, len);
+        if (m) score += 2 + m;
+        else if ((m = word_match(text_artist(name), w, len))) score += m;
+        else return 0;
+        if (!end) break;
+        w = end + 1;
+    }
+    if (!strncmp(name, query, query_len)) score += name[query_len] ? 4 : 8;
+    return score;
+}
+
+static void
+add_ranked(struct ranked *top, size_t *top_len, struct ranked r) {
+    size_t i = *top_len;
+    while (i > 0 && (top[i - 1].score < r.score ||
+                     (top[i - 1].score == r.score && top[i - 1].name_len > r.name_len)))
+        i--;
+    if (i >= SEARCH_LIMIT) return;
+    size_t last = *top_len < SEARCH_LIMIT ? (*top_len)++ : SEARCH_LIMIT - 1;
+    memmove(&top[i + 1], &top[i], (last - i) * sizeof(*top));
+    top[i] = r;
+}
+
+static void
+rank_candidates(const uint32_t *candidates, size_t count, uint64_t flag, const bool *wanted, const char *query,
+                size_t query_len, struct ranked top[LOCAL_KIND_LAST][SEARCH_LIMIT], size_t *top_len) {
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t where = candidates[i] | flag;
+        if (flag ? ls.mem[candidates[i]].dead : ls.dead[candidates[i]]) continue;
+        struct entry_view view;
+        view_of(where, &view);
+        if (!wanted[view.kind]) continue;
+        size_t name_len;
+        int score = rank(&view, query, query_len, &name_len);
+        if (score) add_ranked(top[view.kind], &top_len[view.kind], (struct ranked) {score, name_len, where});
+    }
+}
+
+static const struct search_trigram *
+find_trigram(uint32_t trigram) {
+    size_t lo = 0, hi = ls.header->trigram_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ls.trigrams[mid].trigram < trigram) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < ls.header->trigram_count && ls.trigrams[lo].trigram == trigram ? &ls.trigrams[lo] : NULL;
+}
+
+static void
+fill_track(const struct entry_view *view, Track *track, struct arena *arena) {
+    track->spotify_id = view->id;
+    TrackInfo *info = new_track_info(track, arena);
+    info->spotify_artist_id = view->artist_id;
+    info->spotify_name = arena_strdup(arena, view->name);
+    info->artist = arena_intern_string(arena, view->artist ? view->artist : "");
+    info->spotify_album_art = arena_intern_string(arena, view->image ? view->image : "");
+    track->duration_ms = view->extra;
+    track->download_state = DS_NOT_DOWNLOADED;
+}
+
+static void
+fill_playlists(const struct ranked *top, size_t len, PlaylistInfo **out, size_t *out_len) {
+    *out = calloc(len ? len : 1, sizeof(**out));
+    *out_len = len;
+    for (size_t i = 0; i < len; ++i) {
+        struct entry_view view;
+        view_of(top[i].where, &view);
+        PlaylistInfo *playlist = &(*out)[i];
+        playlist->not_empty = true;
+        playlist->album = view.kind == LOCAL_ALBUM;
+        playlist->name = strdup(view.name);
+        playlist->image_url = strdup(view.image ? view.image : "");
+        spotify_id_format(view.id, playlist->spotify_id);
+        playlist->track_count = view.extra;
+    }
+}
+
+int
+local_search(const char *query, bool tracks, bool artists, bool albums, bool playlists,
+             struct spotify_search_results *results) {
+    results->qtracks = tracks;
+    results->qartists = artists;
+    results->qalbums = albums;
+    results->qplaylists = playlists;
+    const bool wanted[LOCAL_KIND_LAST] = {[LOCAL_TRACK] = tracks, [LOCAL_ALBUM] = albums,
+                                          [LOCAL_PLAYLIST] = playlists};
+
+    char norm[strlen(query) + 1];
+    size_t query_len = normalize(query, norm);
+    uint32_t trigrams[MAX_TRIGRAMS];
+    size_t n = text_trigrams(norm, trigrams, 0);
+    struct ranked top[LOCAL_KIND_LAST][SEARCH_LIMIT];
+    size_t top_len[LOCAL_KIND_LAST] = {0};
+
+    const uint32_t *lists[MAX_TRIGRAMS];
+    size_t counts[MAX_TRIGRAMS];
+    uint32_t *candidates;
+    size_t i;
+    if (n && ls.header) {
+        for (i = 0; i < n; ++i) {
+            const struct search_trigram *t = find_trigram(trigrams[i]);
+            if (!t) break;
+            lists[i] = &ls.postings[t->first];
+            counts[i] = t->count;
+        }
+        if (i == n) {
+            size_t count = intersect(lists, counts, n, &candidates);
+            rank_candidates(candidates, count, 0, wanted, norm, query_len, top, top_len);
+            free(candidates);
+        }
+    }
+    if (n && ls.mem_len) {
+        for (i = 0; i < n; ++i) {
+            const struct mem_posting *posting = mem_posting(trigrams[i], false);
+            if (!posting) break;
+            lists[i] = posting->ids;
+            counts[i] = posting->len;
+        }
+        if (i == n) {
+            size_t count = intersect(lists, counts, n, &candidates);
+            rank_candidates(candidates, count, MEM_ENTRY, wanted, norm, query_len, top, top_len);
+            free(candidates);
+        }
+    }
+
+    if (tracks) {
+        results->tracks = calloc(top_len[LOCAL_TRACK] ? top_len[LOCAL_TRACK] : 1, sizeof(*results->tracks));
+        results->track_len = top_len[LOCAL_TRACK];
+        struct arena *arena = arena_new();
+        for (i = 0; i < top_len[LOCAL_TRACK]; ++i) {
+            struct entry_view view;
+            view_of(top[LOCAL_TRACK][i].where, &view);
+            fill_track(&view, &results->tracks[i], arena);
+        }
+        arena_seal(arena);
+        arena_release(arena);
+    }
+    if (albums) fill_playlists(top[LOCAL_ALBUM], top_len[LOCAL_ALBUM], &results->albums, &results->album_len);
+    if (playlists)
+        fill_playlists(top[LOCAL_PLAYLIST], top_len[LOCAL_PLAYLIST], &results->playlists, &results->playlist_len);
+    if (artists) results->artists = calloc(1, sizeof(*results->artists));
+    return 0;
+}
+
+size_t
+local_search_get_tracks(const SpotifyId *ids, size_t count, Track *out) {
+    size_t found = 0;
+    struct arena *arena = arena_new();
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t where;
+        if (!idmap_get(&ls.ids, ids[i], &where)) continue;
+        struct entry_view view;
+        view_of(where, &view);
+        if (view.kind != LOCAL_TRACK) continue;
+        fill_track(&view, &out[found++], arena);
+    }
+    arena_seal(arena);
+    arena_release(arena);
+    return found;
+}
@@ -0,0 +1,45 @@
+#ifndef SMP_LOCAL_SEARCH_H
+#define SMP_LOCAL_SEARCH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "spotify.h"
+
+#define LOCAL_SEARCH_FILE "search_index.bin"
+
+/*
+ * Inverted index over the names and artists of every track, album and playlist whose info has been loaded, so they
+ * can be searched without a backend. Each word is indexed by the trigrams of its start, and a query matches the
+ * entries where every word of the query starts a word of the name or artist.
+ *
+ * The index is saved at path as a sorted trigram table with posting lists which is mapped and searched in place.
+ * Entries added since then are kept in memory and merged into the file by local_search_close, or once there are
+ * enough of them, on the I/O pool. If the file can't be read the index starts out empty and is rebuilt from the cached
+ * info by the caller, which then calls local_search_rebuilt to save it.
+ */
+int local_search_init(const char *path);
+
+bool local_search_needs_rebuild();
+
+void local_search_rebuilt();
+
+void local_search_close();
+
+void local_search_add_tracks(const Track *tracks, size_t count);
+
+void local_search_add_playlist(const PlaylistInfo *playlist);
+
+/*
+ * Fills results with the best matches of each requested kind, like parse_search_json does. Artists aren't indexed, so
+ * that list is always empty. Returns 0 on success.
+ */
+int local_search(const char *query, bool tracks, bool artists, bool albums, bool playlists,
+                 struct spotify_search_results *results);
+
+/*
+ * Fills out with the tracks of the given ids which are in the index, in the same order, and returns how many there
+ * were. They share one arena like the tracks of a search.
+ */
+size_t local_search_get_tracks(const SpotifyId *ids, size_t count, Track *out);
+
+#endif //SMP_LOCAL_SEARCH_H
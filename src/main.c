@@ -5,27 +5,52 @@
 #include "config.h"
 #include "cli.h"
 #include "ctrl.h"
+#include "playlist-index.h"
+#include "history.h"
+#include "negative-cache.h"
+#include "response-cache.h"
+#include "local-search.h"
+#include "local-recommend.h"
+#include "cache-dir.h"
+#include "track-store.h"
+#include "io-pool.h"
+#include "meta-cache.h"
 #include <event2/event.h>
 #include <unistd.h>
 
 
-void
-dbus_poll(int fd, short what, void *arg){
-    struct dbus_state *dbus_state = (struct dbus_state*) arg;
-    handle_message(dbus_state->bus);
-}
-
 static int check_for_folder(const char *path){
-    if (access(track_info_path, F_OK)){
+    if (access(path, F_OK)){
         printf("'%s' doesn't exist, creating\n", path);
         return rek_mkdir(path);
-    } else if (access(track_info_path, R_OK | W_OK)){
+    } else if (access(path, R_OK | W_OK)){
         fprintf(stderr, "'%s' exists but can't be written/read to\n", path);
         return 1;
     }
     return 0;
 }
 
+static void rebuild_local_cb(const PlaylistInfo *playlist, const Track *tracks, size_t count, void *userp){
+    const bool *rebuild = userp;
+    if (rebuild[0]) {
+        local_search_add_tracks(tracks, count);
+        if (playlist) local_search_add_playlist(playlist);
+    }
+    if (rebuild[1]) {
+        if (playlist) local_recommend_add_playlist(playlist, tracks, count);
+        else local_recommend_add_tracks(tracks, count);
+    }
+}
+
+// Both local indexes are built from the same info, so it is only read once even if neither file could be loaded
+static void rebuild_local_indexes(){
+    bool rebuild[2] = {local_search_needs_rebuild(), local_recommend_needs_rebuild()};
+    if (!rebuild[0] && !rebuild[1]) return;
+    for (enum meta_kind kind = 0; kind < META_KIND_LAST; ++kind) meta_cache_foreach(kind, rebuild_local_cb, rebuild);
+    if (rebuild[0]) local_search_rebuilt();
+    if (rebuild[1]) local_recommend_rebuilt();
+}
+
 int main(int argc, char **argv) {
     srand(clock());
     if (handle_cli(argc, argv)) {
@@ -35,21 +60,46 @@ int main(int argc, char **argv) {
     if (load_config()) {
         return EXIT_FAILURE;
     }
+    if (check_for_folder(cache_path)) return 1;
     if (check_for_folder(track_save_path)) return 1;
     if (check_for_folder(track_info_path)) return 1;
     if (check_for_folder(album_info_path)) return 1;
     if (check_for_folder(playlist_info_path)) return 1;
 
     struct event_base *base = event_base_new();
+    if (io_pool_init(base, (int) io_threads)) return 1;
+    if (cache_dirs_init(base)) return 1;
+    if (track_store_init(base)) return 1;
+
+    char index_path[cache_path_len + sizeof(PLAYLIST_INDEX_FILE)];
+    snprintf(index_path, sizeof(index_path), "%s%s", cache_path, PLAYLIST_INDEX_FILE);
+    if (playlist_index_init(index_path)) return 1;
+
+    char history_path[cache_path_len + sizeof(HISTORY_FILE)];
+    snprintf(history_path, sizeof(history_path), "%s%s", cache_path, HISTORY_FILE);
+    if (history_init(base, history_path)) return 1;
+
+    char negative_path[cache_path_len + sizeof(NEGATIVE_CACHE_FILE)];
+    snprintf(negative_path, sizeof(negative_path), "%s%s", cache_path, NEGATIVE_CACHE_FILE);
+    if (negative_cache_init(negative_path)) return 1;
+
+    char response_path[cache_path_len + sizeof(RESPONSE_CACHE_FILE)];
+    snprintf(response_path, sizeof(response_path), "%s%s", cache_path, RESPONSE_CACHE_FILE);
+    if (response_cache_init(response_cache_persist ? response_path : NULL)) return 1;
+
+    char local_search_path[cache_path_len + sizeof(LOCAL_SEARCH_FILE)];
+    snprintf(local_search_path, sizeof(local_search_path), "%s%s", cache_path, LOCAL_SEARCH_FILE);
+    if (local_search_init(local_search_path)) return 1;
+
+    char local_recommend_path[cache_path_len + sizeof(LOCAL_RECOMMEND_FILE)];
+    snprintf(local_recommend_path, sizeof(local_recommend_path), "%s%s", cache_path, LOCAL_RECOMMEND_FILE);
+    if (local_recommend_init(local_recommend_path)) return 1;
+    rebuild_local_indexes();
+
     struct smp_context *ctx = ctrl_create_context(base);
 
     struct dbus_state *dbus_state = init_dbus(ctx);
-    struct event *dbus_polling = event_new(base, -1, EV_PERSIST, dbus_poll, dbus_state);
-    struct timeval tv = {
-            .tv_sec = 0,
-            .tv_usec = 50000,
-    };
-    event_add(dbus_polling, &tv);
+    if (dbus_attach_event_base(dbus_state, base)) return 1;
     ctrl_set_dbus_ifaces(ctx, dbus_state->mplayer_iface, dbus_state->mplaylist_iface, dbus_state->mtracks_iface, dbus_state->smp_iface,
                          dbus_state->bus);
 
@@ -59,10 +109,21 @@ int main(int argc, char **argv) {
 
     event_base_dispatch(base);
 
-    event_free(dbus_polling);
+    // Let all cache reads and writes finish while everything they report back to still exists
+    track_store_flush();
+    io_pool_close();
     ctrl_free(ctx);
+    track_store_close();
+    cache_dirs_close();
+    dbus_detach_event_base();
     dbus_util_free_bus(dbus_state->bus);
     free(dbus_state);
+    history_close();
+    negative_cache_close();
+    response_cache_close();
+    local_search_close();
+    local_recommend_close();
+    playlist_index_close();
     clean_config();
     event_base_free(base);
 
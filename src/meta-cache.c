@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "meta-cache.h"
+#include "crc32c.h"
+
+#define META_MAGIC 0x42504d53 // "SMPB"
+#define META_VERSION 2
+#define META_NONE UINT32_MAX // String offset of a missing string
+
+// All fields are little endian, string fields are offsets into the string table following the track records
+struct meta_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t kind;
+    uint32_t track_count;
+    uint32_t strings_len;
+    uint32_t name;
+    uint32_t image_url;
+    uint32_t source_crc; // Of the JSON the entry was made from, to tell whether a refreshed copy has changed
+    char id[SPOTIFY_ID_LEN];
+    uint16_t reserved;
+};
+
+struct meta_track {
+    char id[SPOTIFY_ID_LEN];
+    char artist_id[SPOTIFY_ID_LEN];
+    uint32_t name;
+    uint32_t artist;
+    uint32_t album_art;
+    uint32_t regions; // region_count pairs of characters
+    uint16_t region_count;
+    uint16_t reserved;
+    uint32_t duration_ms;
+};
+
+struct string_table {
+    char *data;
+    size_t len;
+    size_t size;
+    uint32_t *slots; // Offset + 1 of each distinct string, 0 if empty
+    size_t slot_count;
+    size_t used;
+};
+
+
+static uint32_t
+hash_string(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) h = (h ^ (uint8_t) s[i]) * 16777619u;
+    return h;
+}
+
+static void
+grow_slots(struct string_table *t) {
+    size_t count = t->slot_count ? t->slot_count * 2 : 256;
+    uint32_t *slots = calloc(count, sizeof(*slots));
+    for (size_t i = 0; i < t->slot_count; ++i) {
+        if (!t->slots[i]) continue;
+        const char *s = &t->data[t->slots[i] - 1];
+        size_t j = hash_string(s, strlen(s)) & (count - 1);
+        while (slots[j]) j = (j + 1) & (count - 1);
+        slots[j] = t->slots[i];
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->slot_count = count;
+}
+
+// Adds len bytes of s followed by a NUL, unless the same string is already in the table
+static uint32_t
+add_string(struct string_table *t, const char *s, size_t len) {
+    if (!s) return htole32(META_NONE);
+    if ((t->used + 1) * 2 > t->slot_count) grow_slots(t);
+    size_t i = hash_string(s, len) & (t->slot_count - 1);
+    for (; t->slots[i]; i = (i + 1) & (t->slot_count - 1)) {
+        const char *existing = &t->data[t->slots[i] - 1];
+        if (!memcmp(existing, s, len) && existing[len] == 0) return htole32(t->slots[i] - 1);
+    }
+    if (t->len + len + 1 > t->size) {
+        t->size = (t->len + len + 1) * 2;
+        t->data = realloc(t->data, t->size);
+    }
+    uint32_t offset = t->len;
+    memcpy(&t->data[t->len], s, len);
+    t->data[t->len + len] = 0;
+    t->len += len + 1;
+    t->slots[i] = offset + 1;
+    t->used++;
+    return htole32(offset);
+}
+
+static uint32_t
+add_cstring(struct string_table *t, const char *s) {
+    return add_string(t, s, s ? strlen(s) : 0);
+}
+
+enum cache_dir
+meta_cache_dir(enum cache_dir dir) {
+    switch (dir) {
+        case CACHE_DIR_TRACK_INFO:
+            return CACHE_DIR_TRACK_META;
+        case CACHE_DIR_ALBUM_INFO:
+            return CACHE_DIR_ALBUM_META;
+        case CACHE_DIR_PLAYLIST_INFO:
+            return CACHE_DIR_PLAYLIST_META;
+        default:
+            return CACHE_DIR_NONE;
+    }
+}
+
+uint32_t
+meta_cache_hash_source(const char *data, size_t len) {
+    while (len && data[len - 1] == 0) len--; // Cached copies are passed on with their terminator
+    return crc32c(0, data, len);
+}
+
+uint32_t
+meta_cache_source(const char *data) {
+    struct meta_header header;
+    memcpy(&header, data, sizeof(header));
+    return le32toh(header.source_crc);
+}
+
+void
+meta_cache_store(enum meta_kind kind, const char id[SPOTIFY_ID_LEN], uint32_t source_crc, const PlaylistInfo *playlist,
+                 const Track *tracks, size_t count) {
+    static const enum cache_dir dirs[META_KIND_LAST] = {
+            [META_TRACK] = CACHE_DIR_TRACK_META,
+            [META_ALBUM] = CACHE_DIR_ALBUM_META,
+            [META_PLAYLIST] = CACHE_DIR_PLAYLIST_META,
+    };
+    struct string_table strings = {0};
+    struct meta_track *records = calloc(count ? count : 1, sizeof(*records));
+    for (size_t i = 0; i < count; ++i) {
+        const Track *track = &tracks[i];
+        spotify_id_format(track->spotify_id, records[i].id);
+        const TrackInfo *info = track->info;
+        if (!spotify_id_none(info->spotify_artist_id)) spotify_id_format(info->spotify_artist_id, records[i].artist_id);
+        records[i].name = add_cstring(&strings, info->spotify_name);
+        records[i].artist = add_cstring(&strings, info->artist);
+        records[i].album_art = add_cstring(&strings, info->spotify_album_art);
+        // Tracks of the same album usually share their markets, so these are deduplicated too
+        records[i].regions = add_string(&strings, info->regions, info->region_count * 2);
+        records[i].region_count = htole16(info->region_count);
+        records[i].duration_ms = htole32(track->duration_ms);
+    }
+    struct meta_header header = {
+            .magic = htole32(META_MAGIC),
+            .version = htole16(META_VERSION),
+            .kind = htole16(kind),
+            .track_count = htole32(count),
+            .name = add_cstring(&strings, playlist ? playlist->name : NULL),
+            .image_url = add_cstring(&strings, playlist ? playlist->image_url : NULL),
+    };
+    header.strings_len = htole32(strings.len);
+    header.source_crc = htole32(source_crc);
+    memcpy(header.id, id, SPOTIFY_ID_LEN);
+
+    size_t len = sizeof(header) + count * sizeof(*records) + strings.len;
+    char *data = malloc(len);
+    memcpy(data, &header, sizeof(header));
+    memcpy(&data[sizeof(header)], records, count * sizeof(*records));
+    if (strings.len) memcpy(&data[sizeof(header) + count * sizeof(*records)], strings.data, strings.len);
+    cache_write_async(dirs[kind], id, data, len);
+
+    free(records);
+    free(strings.data);
+    free(strings.slots);
+}
+
+static bool
+valid_string(uint32_t offset, uint32_t strings_len) {
+    return offset == META_NONE || offset < strings_len;
+}
+
+int64_t
+meta_cache_check(const char *data, size_t len, enum meta_kind kind) {
+    struct meta_header header;
+    if (len < sizeof(header)) return -1;
+    memcpy(&header, data, sizeof(header));
+    if (le32toh(header.magic) != META_MAGIC || le16toh(header.version) != META_VERSION ||
+        le16toh(header.kind) != kind)
+        return -1;
+    uint64_t count = le32toh(header.track_count);
+    uint32_t strings_len = le32toh(header.strings_len);
+    if (sizeof(header) + count * sizeof(struct meta_track) + strings_len > len) return -1;
+    const char *strings = &data[sizeof(header) + count * sizeof(struct meta_track)];
+    // Every string ends within the table as long as the table itself ends with a NUL
+    if (strings_len && strings[strings_len - 1] != 0) return -1;
+    if (!valid_string(le32toh(header.name), strings_len) || !valid_string(le32toh(header.image_url), strings_len))
+        return -1;
+    for (uint64_t i = 0; i < count; ++i) {
+        struct meta_track rec;
+        memcpy(&rec, &data[sizeof(header) + i * sizeof(rec)], sizeof(rec));
+        uint32_t regions = le32toh(rec.regions);
+        if (le32toh(rec.name) >= strings_len || le32toh(rec.artist) >= strings_len ||
+            !valid_string(le32toh(rec.album_art), strings_len) ||
+            (regions != META_NONE && regions + (uint64_t) le16toh(rec.region_count) * 2 > strings_len))
+            return -1;
+    }
+    return (int64_t) count;
+}
+
+static char *
+get_string(const char *strings, uint32_t offset) {
+    offset = le32toh(offset);
+    return offset == META_NONE ? NULL : (char *) &strings[offset];
+}
+
+void
+meta_cache_decode(const char *data, PlaylistInfo *playlist, Track *tracks) {
+    struct meta_header header;
+    memcpy(&header, data, sizeof(header));
+    size_t count = le32toh(header.track_count);
+    const char *strings = &data[sizeof(header) + count * sizeof(struct meta_track)];
+
+    if (playlist) {
+        char *name = get_string(strings, header.name);
+        char *image_url = get_string(strings, header.image_url);
+        playlist->not_empty = true;
+        playlist->album = le16toh(header.kind) == META_ALBUM;
+        playlist->name = strdup(name ? name : "");
+        playlist->image_url = image_url ? strdup(image_url) : NULL;
+        memcpy(playlist->spotify_id, header.id, SPOTIFY_ID_LEN);
+        playlist->spotify_id[SPOTIFY_ID_LEN] = 0;
+        playlist->track_count = count;
+    }
+
+    struct arena *arena = arena_new();
+    for (size_t i = 0; i < count; ++i) {
+        struct meta_track rec;
+        memcpy(&rec, &data[sizeof(header) + i * sizeof(rec)], sizeof(rec));
+        const char *album_art = get_string(strings, rec.album_art);
+        const char *regions = get_string(strings, rec.regions);
+        size_t region_count = regions ? le16toh(rec.region_count) : 0;
+
+        Track *track = &tracks[i];
+        memset(track, 0, sizeof(*track));
+        TrackInfo *info = new_track_info(track, arena);
+        info->spotify_name = arena_strdup(arena, get_string(strings, rec.name));
+        info->artist = arena_intern_string(arena, get_string(strings, rec.artist));
+        if (album_art) info->spotify_album_art = arena_intern_string(arena, album_art);
+        if (region_count) info->regions = arena_intern(arena, regions, region_count * 2);
+        info->region_count = region_count;
+
+        spotify_id_parse(rec.id, &track->spotify_id); // Both stay zero if the record doesn't hold an id
+        spotify_id_parse(rec.artist_id, &info->spotify_artist_id);
+        track->duration_ms = le32toh(rec.duration_ms);
+        track->download_state = DS_NOT_DOWNLOADED;
+    }
+    arena_seal(arena);
+    arena_release(arena);
+}
+
+void
+meta_cache_foreach(enum meta_kind kind, meta_cache_entry_cb cb, void *userp) {
+    static const enum cache_dir dirs[META_KIND_LAST] = {
+            [META_TRACK] = CACHE_DIR_TRACK_META,
+            [META_ALBUM] = CACHE_DIR_ALBUM_META,
+            [META_PLAYLIST] = CACHE_DIR_PLAYLIST_META
+    };
+    struct cache_dir_iter it;
+    char id[CACHE_ID_LEN];
+    struct stat st;
+    cache_dir_iter_begin(dirs[kind], &it);
+    while (cache_dir_iter_next(&it, id, &st)) {
+        int fd = cache_open(dirs[kind], id, O_RDONLY);
+        if (fd < 0) continue;
+        char *data = malloc(st.st_size ? st.st_size : 1);
+        ssize_t got = read(fd, data, st.st_size);
+        close(fd);
+        int64_t count = got == st.st_size ? meta_cache_check(data, got, kind) : -1;
+        if (count >= 0) {
+            PlaylistInfo playlist = {0};
+            Track *tracks = calloc(count ? count : 1, sizeof(*tracks));
+            meta_cache_decode(data, kind == META_TRACK ? NULL : &playlist, tracks);
+            cb(kind == META_TRACK ? NULL : &playlist, tracks, count, userp);
+            if (kind != META_TRACK) free_playlist(&playlist);
+            free_tracks(tracks, count);
+            free(tracks);
+        }
+        free(data);
+    }
+    cache_dir_iter_end(&it);
+}
@@ -0,0 +1,54 @@
+#ifndef SMP_META_CACHE_H
+#define SMP_META_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "spotify.h"
+#include "cache-dir.h"
+
+/*
+ * Parsed track, album and playlist info is stored in a compact binary form next to the JSON it came from, so that
+ * loading it again doesn't need the JSON parser. An entry is a header, an array of fixed size track records and a
+ * table of the strings they refer to, where every distinct string is only stored once.
+ */
+enum meta_kind {
+    META_TRACK = 0,
+    META_ALBUM,
+    META_PLAYLIST,
+    META_KIND_LAST
+};
+
+// The directory of the binary entries belonging to the info files in dir, CACHE_DIR_NONE if there are none
+enum cache_dir meta_cache_dir(enum cache_dir dir);
+
+// Checksum of the JSON an entry is made from, which may still end with the terminator added when reading the cache
+uint32_t meta_cache_hash_source(const char *data, size_t len);
+
+/*
+ * Serializes count tracks and, unless kind is META_TRACK, their playlist and writes them to the cache under id.
+ * source_crc is the meta_cache_hash_source of the JSON they were parsed from.
+ */
+void meta_cache_store(enum meta_kind kind, const char id[SPOTIFY_ID_LEN], uint32_t source_crc,
+                      const PlaylistInfo *playlist, const Track *tracks, size_t count);
+
+// Returns the number of tracks in an entry or -1 if it isn't a valid entry of the current version
+int64_t meta_cache_check(const char *data, size_t len, enum meta_kind kind);
+
+// The source_crc an entry which has passed meta_cache_check was stored with
+uint32_t meta_cache_source(const char *data);
+
+/*
+ * Fills in the tracks of an entry which has passed meta_cache_check, and its playlist if playlist isn't NULL. The
+ * strings of all the tracks are put into one arena which they share.
+ */
+void meta_cache_decode(const char *data, PlaylistInfo *playlist, Track *tracks);
+
+typedef void (*meta_cache_entry_cb)(const PlaylistInfo *playlist, const Track *tracks, size_t count, void *userp);
+
+/*
+ * Reads and decodes every valid entry of kind in the cache and passes it to cb, with playlist set to NULL for
+ * META_TRACK. Used to rebuild indexes from the cached info, so it blocks until all of them were read.
+ */
+void meta_cache_foreach(enum meta_kind kind, meta_cache_entry_cb cb, void *userp);
+
+#endif //SMP_META_CACHE_H
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "negative-cache.h"
+#include "idmap.h"
+#include "config.h"
+
+#define NEGATIVE_MAGIC 0x4e504d53 // "SMPN"
+#define NEGATIVE_VERSION 1
+#define COMPACT_MIN_RECORDS 256
+#define NO_ENTRY UINT64_MAX
+
+struct negative_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+// Every new entry appends one record, compaction drops the ones which have expired
+struct negative_record {
+    int64_t expires;
+    char id[SPOTIFY_ID_LEN];
+    char region[2];
+    uint8_t reason;
+    uint8_t reserved[7];
+};
+
+struct negative_entry {
+    int64_t expires;
+    char region[2];
+    uint8_t reason;
+    uint64_t next; // Next entry of the same id, NO_ENTRY if none
+};
+
+static const char *reasons[NEGATIVE_REASON_LAST] = {
+        [NEGATIVE_LOCAL] = "local file",
+        [NEGATIVE_UNPLAYABLE] = "not playable",
+        [NEGATIVE_FAILED] = "request failed",
+};
+
+static struct {
+    int fd;
+    char *path;
+    size_t record_count; // Records in the journal file
+    struct idmap ids; // Id to the index of its first entry
+    struct negative_entry *entries;
+    size_t entries_len;
+    size_t entries_size;
+} neg = {.fd = -1};
+
+static void
+apply_record(SpotifyId id, const struct negative_record *rec) {
+    uint64_t *head = idmap_upsert(&neg.ids, id, NO_ENTRY);
+    for (uint64_t i = *head; i != NO_ENTRY; i = neg.entries[i].next) {
+        if (memcmp(neg.entries[i].region, rec->region, 2) != 0) continue;
+        if (rec->expires > neg.entries[i].expires) neg.entries[i].expires = rec->expires;
+        neg.entries[i].reason = rec->reason;
+        return;
+    }
+    if (neg.entries_len == neg.entries_size) {
+        neg.entries_size = neg.entries_size ? neg.entries_size * 2 : 64;
+        neg.entries = realloc(neg.entries, neg.entries_size * sizeof(*neg.entries));
+    }
+    struct negative_entry *entry = &neg.entries[neg.entries_len];
+    entry->expires = rec->expires;
+    memcpy(entry->region, rec->region, 2);
+    entry->reason = rec->reason;
+    entry->next = *head;
+    *head = neg.entries_len++;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Rewrites the journal with only the entries which haven't expired
+static void
+compact() {
+    size_t path_len = strlen(neg.path);
+    char tmp_path[path_len + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", neg.path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[negative] Error when compacting unavailable ids: %s\n", strerror(errno));
+        return;
+    }
+    struct negative_header header = {.magic = NEGATIVE_MAGIC, .version = NEGATIVE_VERSION};
+    int err = write_all(fd, &header, sizeof(header));
+    size_t written = 0;
+    int64_t now = time(NULL);
+    idmap_foreach(&neg.ids, e) {
+        for (uint64_t i = e->value; i != NO_ENTRY && !err; i = neg.entries[i].next) {
+            if (neg.entries[i].expires <= now) continue;
+            struct negative_record rec = {
+                    .expires = neg.entries[i].expires,
+                    .reason = neg.entries[i].reason
+            };
+            spotify_id_format(e->id, rec.id);
+            memcpy(rec.region, neg.entries[i].region, 2);
+            err = write_all(fd, &rec, sizeof(rec));
+            written++;
+        }
+        if (err) break;
+    }
+    if (err || fdatasync(fd) || rename(tmp_path, neg.path)) {
+        fprintf(stderr, "[negative] Error when compacting unavailable ids: %s\n", strerror(errno));
+        close(fd);
+        remove(tmp_path);
+        return;
+    }
+    close(neg.fd);
+    neg.fd = open(neg.path, O_WRONLY | O_APPEND);
+    close(fd);
+    neg.record_count = written;
+    printf("[negative] Compacted unavailable ids to %zu records\n", neg.record_count);
+}
+
+static int
+load(int fd) {
+    struct stat st;
+    if (fstat(fd, &st)) return 1;
+    struct negative_header header;
+    if (st.st_size == 0) {
+        header = (struct negative_header) {.magic = NEGATIVE_MAGIC, .version = NEGATIVE_VERSION};
+        return write_all(fd, &header, sizeof(header));
+    }
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != NEGATIVE_MAGIC ||
+        header.version != NEGATIVE_VERSION) {
+        fprintf(stderr, "[negative] Unavailable id file is invalid, starting a new one\n");
+        if (ftruncate(fd, 0)) return 1;
+        header = (struct negative_header) {.magic = NEGATIVE_MAGIC, .version = NEGATIVE_VERSION};
+        return pwrite(fd, &header, sizeof(header), 0) != sizeof(header);
+    }
+
+    struct negative_record recs[128];
+    ssize_t got;
+    size_t leftover = 0;
+    int64_t now = time(NULL);
+    while ((got = read(fd, (uint8_t *) recs + leftover, sizeof(recs) - leftover)) > 0) {
+        size_t total = leftover + got;
+        size_t n = total / sizeof(*recs);
+        for (size_t i = 0; i < n; ++i) {
+            SpotifyId id;
+            if (recs[i].expires > now && recs[i].reason < NEGATIVE_REASON_LAST && spotify_id_parse(recs[i].id, &id))
+                apply_record(id, &recs[i]);
+        }
+        neg.record_count += n;
+        leftover = total - n * sizeof(*recs);
+        memmove(recs, &recs[n], leftover);
+    }
+    if (leftover) { // A record which was only partially written before exiting
+        if (ftruncate(fd, (off_t) (sizeof(header) + neg.record_count * sizeof(*recs)))) return 1;
+    }
+    return 0;
+}
+
+int
+negative_cache_init(const char *path) {
+    neg.path = strdup(path);
+    idmap_init(&neg.ids, 64);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || load(fd)) {
+        fprintf(stderr, "[negative] Error when opening unavailable ids '%s': %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    close(fd);
+    neg.fd = open(path, O_WRONLY | O_APPEND);
+    if (neg.record_count > COMPACT_MIN_RECORDS && neg.record_count > neg.entries_len * 2) compact();
+    printf("[negative] Loaded %zu unavailable ids\n", neg.ids.count);
+    return 0;
+}
+
+void
+negative_cache_close() {
+    if (neg.fd >= 0) close(neg.fd);
+    idmap_free(&neg.ids);
+    free(neg.entries);
+    free(neg.path);
+    memset(&neg, 0, sizeof(neg));
+    neg.fd = -1;
+}
+
+void
+negative_cache_add(SpotifyId id, const char region[2], enum negative_reason reason) {
+    if (neg.fd < 0 || !unavailable_ttl || reason >= NEGATIVE_REASON_LAST) return;
+    struct negative_record rec = {
+            .expires = time(NULL) + unavailable_ttl,
+            .reason = reason
+    };
+    spotify_id_format(id, rec.id);
+    memcpy(rec.region, region, 2);
+    apply_record(id, &rec);
+    // Losing the last few of these in a crash only means requesting them once more, so they aren't synced
+    if (write_all(neg.fd, &rec, sizeof(rec))) {
+        fprintf(stderr, "[negative] Error when writing unavailable ids: %s\n", strerror(errno));
+    } else {
+        neg.record_count++;
+    }
+    if (region[0]) printf("[negative] Skipping '%.22s' in %.2s for now: %s\n", rec.id, region, reasons[reason]);
+    else printf("[negative] Skipping '%.22s' for now: %s\n", rec.id, reasons[reason]);
+}
+
+bool
+negative_cache_has(SpotifyId id, const char region[2]) {
+    uint64_t i;
+    if (!idmap_get(&neg.ids, id, &i)) return false;
+    int64_t now = time(NULL);
+    for (; i != NO_ENTRY; i = neg.entries[i].next) {
+        const struct negative_entry *entry = &neg.entries[i];
+        if (entry->expires > now && (!entry->region[0] || !memcmp(entry->region, region, 2))) return true;
+    }
+    return false;
+}
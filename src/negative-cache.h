@@ -0,0 +1,33 @@
+#ifndef SMP_NEGATIVE_CACHE_H
+#define SMP_NEGATIVE_CACHE_H
+
+#include <stdbool.h>
+#include "spotify.h"
+
+#define NEGATIVE_CACHE_FILE "unavailable.log"
+
+// Any region, for ids which can't be played anywhere
+#define NEGATIVE_ANY_REGION "\0\0"
+
+enum negative_reason {
+    NEGATIVE_LOCAL = 0, // A local file in someone's playlist, which was never on spotify
+    NEGATIVE_UNPLAYABLE, // Marked as not playable by spotify
+    NEGATIVE_FAILED, // The backend answered a request for it with an error
+    NEGATIVE_REASON_LAST
+};
+
+/*
+ * Remembers ids which couldn't be loaded or played for unavailable_ttl seconds, so the same dead ids in a playlist
+ * or in recommendations aren't requested over and over. Entries are kept per region, since a track which isn't
+ * available through a backend in one region may still be available in another. They are stored in a journal at path.
+ */
+int negative_cache_init(const char *path);
+
+void negative_cache_close();
+
+void negative_cache_add(SpotifyId id, const char region[2], enum negative_reason reason);
+
+// True if id is known to be unavailable in region, or in every region
+bool negative_cache_has(SpotifyId id, const char region[2]);
+
+#endif //SMP_NEGATIVE_CACHE_H
@@ -0,0 +1,623 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <endian.h>
+#include "pack-store.h"
+#include "idmap.h"
+#include "io-pool.h"
+
+#define SEGMENT_MAGIC 0x4b504d53 // "SMPK"
+#define SEGMENT_VERSION 2
+#define SEGMENT_MAX_SIZE (256 * 1024 * 1024)
+#define SEGMENT_NAME_LEN 32
+#define RECORD_MAGIC 0x52504d53 // "SMPR"
+#define RECORD_ALIGN 8
+#define COMPACT_BATCH (8 * 1024 * 1024) // Bytes copied per job on the I/O pool
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+// A location is the segment number in the top 16 bits and the offset of the record in the rest
+#define LOC(segment, offset) (((uint64_t) (segment) << 48) | (offset))
+#define LOC_SEGMENT(loc) ((uint32_t) ((loc) >> 48))
+#define LOC_OFFSET(loc) ((loc) & ((1ULL << 48) - 1))
+
+enum record_state {
+    RECORD_PENDING = 0,
+    RECORD_LIVE = 1,
+    RECORD_DEAD = 2
+};
+
+// All fields are little endian so that segments can be copied between machines
+struct segment_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct record_header {
+    uint32_t magic;
+    uint32_t state;
+    char id[PACK_ID_LEN];
+    uint16_t reserved;
+    uint64_t length; // Bytes of data following the header
+    int64_t time;
+    uint32_t crc; // CRC-32C of the data
+    uint32_t reserved1;
+};
+
+// A record copied by compaction which is committed once the batch is synced
+struct compact_copy {
+    char id[PACK_ID_LEN];
+    uint64_t from; // Location of the record being copied
+    uint64_t handle;
+    uint64_t length;
+    uint32_t crc;
+    int fd; // Segment of the copy
+    uint64_t data_pos;
+};
+
+// Records of the segment being compacted which are copied and synced on the I/O pool
+struct compact_batch {
+    uint32_t number;
+    int fd;
+    bool failed; // Set by the worker
+    size_t count;
+    size_t size;
+    struct compact_copy *copies;
+};
+
+struct segment {
+    int fd; // -1 if the segment doesn't exist
+    uint8_t *map;
+    size_t map_len;
+    uint64_t end; // Offset at which the next record will be written
+    uint64_t live_bytes;
+    uint64_t dead_bytes;
+    uint32_t pending;
+};
+
+static struct {
+    int dir_fd;
+    struct event *compact_event;
+    struct idmap index; // Id to location of the live record
+    struct segment *segments; // Indexed by segment number
+    uint32_t segment_count;
+    uint32_t active;
+    int64_t compacting; // Segment being emptied, -1 if none
+    uint64_t compact_offset;
+} pack = {.dir_fd = -1, .compacting = -1};
+
+static uint64_t
+record_size(uint64_t length) {
+    return (sizeof(struct record_header) + length + RECORD_ALIGN - 1) & ~((uint64_t) RECORD_ALIGN - 1);
+}
+
+static void
+segment_name(uint32_t number, char out[SEGMENT_NAME_LEN]) {
+    snprintf(out, SEGMENT_NAME_LEN, "segment-%05u.pack", number);
+}
+
+static struct segment *
+get_segment(uint32_t number) {
+    if (number >= pack.segment_count) {
+        uint32_t count = number + 1;
+        struct segment *tmp = realloc(pack.segments, count * sizeof(*pack.segments));
+        if (!tmp) {
+            perror("[pack] Error when calling realloc");
+            exit(EXIT_FAILURE);
+        }
+        pack.segments = tmp;
+        for (uint32_t i = pack.segment_count; i < count; ++i) {
+            memset(&pack.segments[i], 0, sizeof(pack.segments[i]));
+            pack.segments[i].fd = -1;
+        }
+        pack.segment_count = count;
+    }
+    return &pack.segments[number];
+}
+
+// Makes sure the mapping of a segment covers at least len bytes
+static int
+map_segment(struct segment *seg, size_t len) {
+    if (seg->map && seg->map_len >= len) return 0;
+    struct stat st;
+    if (fstat(seg->fd, &st)) return 1;
+    if (st.st_size < len) return 1;
+    if (seg->map) munmap(seg->map, seg->map_len);
+    seg->map_len = st.st_size;
+    seg->map = mmap(NULL, seg->map_len, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        fprintf(stderr, "[pack] Error when mapping segment: %s\n", strerror(errno));
+        seg->map = NULL;
+        seg->map_len = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static void
+close_segment(uint32_t number, bool delete) {
+    struct segment *seg = &pack.segments[number];
+    if (seg->map) munmap(seg->map, seg->map_len);
+    if (seg->fd >= 0) close(seg->fd);
+    if (delete) {
+        char name[SEGMENT_NAME_LEN];
+        segment_name(number, name);
+        unlinkat(pack.dir_fd, name, 0);
+        printf("[pack] Removed empty segment %u\n", number);
+    }
+    memset(seg, 0, sizeof(*seg));
+    seg->fd = -1;
+}
+
+static int
+new_segment() {
+    uint32_t number = pack.segment_count;
+    struct segment *seg = get_segment(number);
+    char name[SEGMENT_NAME_LEN];
+    segment_name(number, name);
+    seg->fd = openat(pack.dir_fd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    struct segment_header header = {.magic = htole32(SEGMENT_MAGIC), .version = htole32(SEGMENT_VERSION)};
+    if (seg->fd < 0 || pwrite(seg->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        fprintf(stderr, "[pack] Error when creating segment '%s': %s\n", name, strerror(errno));
+        if (seg->fd >= 0) close(seg->fd);
+        seg->fd = -1;
+        return 1;
+    }
+    seg->end = sizeof(header);
+    pack.active = number;
+    return 0;
+}
+
+static int
+set_state(uint64_t loc, enum record_state state) {
+    uint32_t value = htole32(state);
+    struct segment *seg = &pack.segments[LOC_SEGMENT(loc)];
+    return pwrite(seg->fd, &value, sizeof(value), (off_t) (LOC_OFFSET(loc) + offsetof(struct record_header, state))) !=
+           sizeof(value);
+}
+
+static void
+schedule_compaction() {
+    if (pack.compacting < 0 && !event_pending(pack.compact_event, EV_TIMEOUT, NULL))
+        event_active(pack.compact_event, EV_TIMEOUT, 0);
+}
+
+// Marks a live record as dead, the space is reclaimed once its segment is compacted
+static void
+kill_record(uint64_t loc, uint64_t length) {
+    struct segment *seg = &pack.segments[LOC_SEGMENT(loc)];
+    set_state(loc, RECORD_DEAD);
+    uint64_t size = record_size(length);
+    seg->live_bytes -= size;
+    seg->dead_bytes += size;
+    if (LOC_SEGMENT(loc) != pack.active) schedule_compaction();
+}
+
+static const struct record_header *
+record_at(uint64_t loc) {
+    struct segment *seg = &pack.segments[LOC_SEGMENT(loc)];
+    uint64_t offset = LOC_OFFSET(loc);
+    if (map_segment(seg, offset + sizeof(struct record_header))) return NULL;
+    const struct record_header *rec = (const struct record_header *) &seg->map[offset];
+    if (map_segment(seg, offset + sizeof(*rec) + le64toh(rec->length))) return NULL;
+    return (const struct record_header *) &seg->map[offset]; // The mapping may have moved
+}
+
+int
+pack_store_reserve(const char id[PACK_ID_LEN], uint64_t length, uint64_t *handle) {
+    SpotifyId key;
+    if (pack.dir_fd < 0 || !spotify_id_parse(id, &key)) return 1;
+    struct segment *seg = &pack.segments[pack.active];
+    uint64_t size = record_size(length);
+    // Large tracks still go into an empty segment on their own
+    if (seg->end + size > SEGMENT_MAX_SIZE && seg->end > sizeof(struct segment_header)) {
+        if (new_segment()) return 1;
+        seg = &pack.segments[pack.active];
+    }
+    struct record_header rec = {
+            .magic = htole32(RECORD_MAGIC),
+            .state = htole32(RECORD_PENDING),
+            .length = htole64(length),
+            .time = (int64_t) htole64(time(NULL))
+    };
+    memcpy(rec.id, id, PACK_ID_LEN);
+    if (pwrite(seg->fd, &rec, sizeof(rec), (off_t) seg->end) != sizeof(rec)) {
+        fprintf(stderr, "[pack] Error when writing record header: %s\n", strerror(errno));
+        return 1;
+    }
+    *handle = LOC(pack.active, seg->end);
+    seg->end += size;
+    seg->pending++;
+    return 0;
+}
+
+int
+pack_store_write(uint64_t handle, uint64_t offset, const void *data, size_t len) {
+    struct segment *seg = &pack.segments[LOC_SEGMENT(handle)];
+    off_t pos = (off_t) (LOC_OFFSET(handle) + sizeof(struct record_header) + offset);
+    const uint8_t *p = data;
+    while (len) {
+        ssize_t written = pwrite(seg->fd, p, len, pos);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "[pack] Error when writing track data: %s\n", strerror(errno));
+            return 1;
+        }
+        p += written;
+        pos += written;
+        len -= written;
+    }
+    return 0;
+}
+
+void
+pack_store_target(uint64_t handle, int *fd, uint64_t *data_pos) {
+    *fd = pack.segments[LOC_SEGMENT(handle)].fd;
+    *data_pos = LOC_OFFSET(handle) + sizeof(struct record_header);
+}
+
+int
+pack_store_commit(uint64_t handle, uint32_t crc) {
+    struct segment *seg = &pack.segments[LOC_SEGMENT(handle)];
+    uint32_t crc_le = htole32(crc);
+    off_t crc_pos = (off_t) (LOC_OFFSET(handle) + offsetof(struct record_header, crc));
+    if (pwrite(seg->fd, &crc_le, sizeof(crc_le), crc_pos) != sizeof(crc_le)) {
+        pack_store_abort(handle);
+        return 1;
+    }
+    const struct record_header *rec = record_at(handle);
+    if (!rec || set_state(handle, RECORD_LIVE)) {
+        pack_store_abort(handle);
+        return 1;
+    }
+    seg->pending--;
+    seg->live_bytes += record_size(le64toh(rec->length));
+
+    SpotifyId id;
+    spotify_id_parse(rec->id, &id); // Checked by pack_store_reserve
+    uint64_t *loc = idmap_upsert(&pack.index, id, handle);
+    if (*loc != handle) { // Replaces an older copy
+        uint64_t old = *loc;
+        *loc = handle;
+        const struct record_header *old_rec = record_at(old);
+        if (old_rec) kill_record(old, le64toh(old_rec->length));
+    }
+    return 0;
+}
+
+void
+pack_store_abort(uint64_t handle) {
+    struct segment *seg = &pack.segments[LOC_SEGMENT(handle)];
+    struct record_header header; // Read directly since the data may not have been written up to the end
+    if (pread(seg->fd, &header, sizeof(header), (off_t) LOC_OFFSET(handle)) != sizeof(header) ||
+        le32toh(header.state) != RECORD_PENDING)
+        return;
+    seg->pending--;
+    set_state(handle, RECORD_DEAD);
+    seg->dead_bytes += record_size(le64toh(header.length));
+    if (LOC_SEGMENT(handle) != pack.active) schedule_compaction();
+}
+
+int
+pack_store_locate(const char id[PACK_ID_LEN], int *fd, uint64_t *data_pos, uint64_t *length, uint32_t *crc) {
+    SpotifyId key;
+    uint64_t loc;
+    if (!spotify_id_parse(id, &key) || !idmap_get(&pack.index, key, &loc)) return 1;
+    const struct record_header *rec = record_at(loc);
+    if (!rec) return 1;
+    *fd = pack.segments[LOC_SEGMENT(loc)].fd;
+    *data_pos = LOC_OFFSET(loc) + sizeof(*rec);
+    *length = le64toh(rec->length);
+    *crc = le32toh(rec->crc);
+    return 0;
+}
+
+bool
+pack_store_has(const char id[PACK_ID_LEN]) {
+    SpotifyId key;
+    return spotify_id_parse(id, &key) && idmap_get(&pack.index, key, NULL);
+}
+
+int
+pack_store_remove(const char id[PACK_ID_LEN]) {
+    SpotifyId key;
+    uint64_t loc;
+    if (!spotify_id_parse(id, &key) || !idmap_get(&pack.index, key, &loc)) {
+        errno = ENOENT;
+        return -1;
+    }
+    const struct record_header *rec = record_at(loc);
+    idmap_remove(&pack.index, key);
+    if (rec) kill_record(loc, le64toh(rec->length));
+    return 0;
+}
+
+bool
+pack_store_next(size_t *pos, char id_out[PACK_ID_LEN], uint64_t *length, int64_t *time) {
+    for (; *pos < pack.index.size; ++*pos) {
+        struct idmap_entry *e = &pack.index.entries[*pos];
+        if (!e->used) continue;
+        const struct record_header *rec = record_at(e->value);
+        if (!rec) continue;
+        spotify_id_format(e->id, id_out);
+        if (length) *length = le64toh(rec->length);
+        if (time) *time = (int64_t) le64toh(rec->time);
+        ++*pos;
+        return true;
+    }
+    return false;
+}
+
+static int64_t
+pick_segment_to_compact() {
+    for (uint32_t i = 0; i < pack.segment_count; ++i) {
+        struct segment *seg = &pack.segments[i];
+        if (seg->fd < 0 || i == pack.active || seg->pending) continue;
+        if (seg->dead_bytes && seg->dead_bytes >= seg->live_bytes) return i;
+    }
+    return -1;
+}
+
+// Copies len bytes between two files with pread and pwrite, since the data has to pass through the page cache anyway
+static int
+copy_range(int from_fd, uint64_t from_pos, int to_fd, uint64_t to_pos, uint64_t len, uint8_t *buf) {
+    while (len) {
+        ssize_t got = pread(from_fd, buf, len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE, (off_t) from_pos);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+        for (ssize_t done = 0; done < got;) {
+            ssize_t written = pwrite(to_fd, buf + done, got - done, (off_t) (to_pos + done));
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) return 1;
+            done += written;
+        }
+        from_pos += got;
+        to_pos += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// Copies the data of every record and syncs the segments the copies were written to
+static void
+compact_work(void *arg) {
+    struct compact_batch *batch = arg;
+    uint8_t *buf = malloc(COPY_BUFFER_SIZE);
+    int last = -1;
+    for (size_t i = 0; i < batch->count && !batch->failed; ++i) {
+        struct compact_copy *copy = &batch->copies[i];
+        if (copy_range(batch->fd, LOC_OFFSET(copy->from) + sizeof(struct record_header), copy->fd, copy->data_pos,
+                       copy->length, buf)) {
+            fprintf(stderr, "[pack] Error when copying record: %s\n", strerror(errno));
+            batch->failed = true;
+        }
+    }
+    free(buf);
+    for (size_t i = 0; i < batch->count && !batch->failed; ++i) {
+        if (batch->copies[i].fd == last) continue;
+        last = batch->copies[i].fd;
+        if (fdatasync(last)) {
+            fprintf(stderr, "[pack] Error when syncing segment: %s\n", strerror(errno));
+            batch->failed = true;
+        }
+    }
+}
+
+static void
+finish_compaction(uint32_t number, bool failed) {
+    struct segment *seg = &pack.segments[number];
+    if (failed) {
+        fprintf(stderr, "[pack] Stopped compacting segment %u\n", number);
+        pack.compacting = -1;
+        return; // Tried again when more records die
+    }
+    if (pack.compact_offset >= seg->end || !seg->live_bytes) {
+        close_segment(number, true);
+        pack.compacting = -1;
+    }
+    event_active(pack.compact_event, EV_TIMEOUT, 0); // Continue with this or the next segment
+}
+
+/*
+ * Commits the copies, which kills the records they were copied from. Copies of records which were removed or replaced
+ * in the meantime are aborted, as are all of them if copying or syncing failed.
+ */
+static void
+compact_done(void *arg) {
+    struct compact_batch *batch = arg;
+    bool failed = batch->failed;
+    for (size_t i = 0; i < batch->count; ++i) {
+        struct compact_copy *copy = &batch->copies[i];
+        SpotifyId id;
+        uint64_t current;
+        if (batch->failed || !spotify_id_parse(copy->id, &id) || !idmap_get(&pack.index, id, &current) ||
+            current != copy->from) {
+            pack_store_abort(copy->handle);
+        } else if (pack_store_commit(copy->handle, copy->crc)) {
+            failed = true; // The old record is still live, so the segment can't be deleted
+        }
+    }
+    uint32_t number = batch->number;
+    free(batch->copies);
+    free(batch);
+    finish_compaction(number, failed);
+}
+
+/*
+ * Moves the live records of a mostly dead segment to the active one and deletes it. Only the record headers are
+ * written here, the data is copied and synced on the I/O pool.
+ */
+static void
+compact_cb(evutil_socket_t fd, short what, void *arg) {
+    if (pack.compacting < 0) {
+        pack.compacting = pick_segment_to_compact();
+        pack.compact_offset = sizeof(struct segment_header);
+        if (pack.compacting < 0) return;
+        printf("[pack] Compacting segment %ld\n", (long) pack.compacting);
+    }
+    // Only the number is kept, since reserving can start a new segment and move pack.segments
+    uint32_t number = (uint32_t) pack.compacting;
+    struct compact_batch *batch = calloc(1, sizeof(*batch));
+    batch->number = number;
+    batch->fd = pack.segments[number].fd;
+    uint64_t copied = 0;
+    bool failed = false;
+    while (copied < COMPACT_BATCH && pack.compact_offset < pack.segments[number].end) {
+        uint64_t loc = LOC(number, pack.compact_offset);
+        const struct record_header *rec = record_at(loc);
+        if (!rec) {
+            failed = true;
+            break;
+        }
+        uint64_t length = le64toh(rec->length);
+        SpotifyId id;
+        uint64_t current;
+        if (le32toh(rec->state) != RECORD_LIVE || !spotify_id_parse(rec->id, &id) ||
+            !idmap_get(&pack.index, id, &current) || current != loc) {
+            pack.compact_offset += record_size(length);
+            continue;
+        }
+        if (batch->count == batch->size) {
+            batch->size = batch->size ? batch->size * 2 : 16;
+            struct compact_copy *tmp = realloc(batch->copies, batch->size * sizeof(*tmp));
+            if (!tmp) {
+                perror("[pack] Error when calling realloc");
+                exit(EXIT_FAILURE);
+            }
+            batch->copies = tmp;
+        }
+        struct compact_copy *copy = &batch->copies[batch->count];
+        memcpy(copy->id, rec->id, PACK_ID_LEN);
+        copy->from = loc;
+        copy->length = length;
+        copy->crc = le32toh(rec->crc);
+        if (pack_store_reserve(copy->id, length, &copy->handle)) {
+            failed = true;
+            break;
+        }
+        pack_store_target(copy->handle, &copy->fd, &copy->data_pos);
+        batch->count++;
+        pack.compact_offset += record_size(length);
+        copied += length;
+    }
+    if (failed) batch->failed = true;
+    if (!batch->count) {
+        free(batch->copies);
+        free(batch);
+        finish_compaction(number, failed);
+        return;
+    }
+    io_pool_submit(compact_work, compact_done, batch);
+}
+
+static void
+load_segment(uint32_t number) {
+    struct segment *seg = get_segment(number);
+    char name[SEGMENT_NAME_LEN];
+    segment_name(number, name);
+    seg->fd = openat(pack.dir_fd, name, O_RDWR | O_CLOEXEC);
+    if (seg->fd < 0 && errno == ENOENT) return; // Removed by compaction
+    struct segment_header header;
+    if (seg->fd < 0 || pread(seg->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        le32toh(header.magic) != SEGMENT_MAGIC || le32toh(header.version) != SEGMENT_VERSION) {
+        fprintf(stderr, "[pack] Ignoring invalid segment '%s'\n", name);
+        if (seg->fd >= 0) close(seg->fd);
+        seg->fd = -1;
+        return;
+    }
+    struct stat st;
+    if (fstat(seg->fd, &st) || map_segment(seg, st.st_size)) {
+        close_segment(number, false);
+        return;
+    }
+
+    uint64_t offset = sizeof(header);
+    while (offset + sizeof(struct record_header) <= seg->map_len) {
+        const struct record_header *rec = (const struct record_header *) &seg->map[offset];
+        uint64_t size = record_size(le64toh(rec->length));
+        if (le32toh(rec->magic) != RECORD_MAGIC || offset + sizeof(*rec) + le64toh(rec->length) > seg->map_len) break;
+        uint64_t loc = LOC(number, offset);
+        SpotifyId id;
+        if (le32toh(rec->state) == RECORD_LIVE && spotify_id_parse(rec->id, &id)) {
+            seg->live_bytes += size;
+            uint64_t *current = idmap_upsert(&pack.index, id, loc);
+            if (*current != loc) { // Later records replace earlier ones
+                uint64_t old = *current;
+                *current = loc;
+                const struct record_header *old_rec = record_at(old);
+                if (old_rec) kill_record(old, le64toh(old_rec->length));
+            }
+        } else {
+            if (le32toh(rec->state) == RECORD_PENDING) set_state(loc, RECORD_DEAD); // Download was interrupted
+            seg->dead_bytes += size;
+        }
+        offset += size;
+    }
+    if (offset < seg->map_len) { // Torn write at the end
+        fprintf(stderr, "[pack] Truncating segment '%s' after the last complete record\n", name);
+        if (ftruncate(seg->fd, (off_t) offset) == 0) {
+            munmap(seg->map, seg->map_len);
+            seg->map = NULL;
+            seg->map_len = 0;
+        }
+    }
+    seg->end = offset;
+}
+
+int
+pack_store_init(struct event_base *base, int dir_fd) {
+    pack.dir_fd = dir_fd;
+    idmap_init(&pack.index, 1024);
+    pack.compact_event = event_new(base, -1, 0, compact_cb, NULL);
+
+    int scan_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = scan_fd >= 0 ? fdopendir(scan_fd) : NULL;
+    if (!d) {
+        fprintf(stderr, "[pack] Error when opening track directory: %s\n", strerror(errno));
+        if (scan_fd >= 0) close(scan_fd);
+        pack.dir_fd = -1;
+        return 1;
+    }
+    // Segments are loaded in order so that later copies of a track win
+    uint32_t max_number = 0;
+    bool found = false;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        unsigned int number;
+        char end;
+        if (sscanf(entry->d_name, "segment-%u.pac%c", &number, &end) != 2 || end != 'k' || number > UINT16_MAX)
+            continue;
+        get_segment(number);
+        if (number > max_number) max_number = number;
+        found = true;
+    }
+    closedir(d);
+    for (uint32_t i = 0; found && i <= max_number; ++i) load_segment(i);
+
+    if (found && pack.segments[max_number].fd >= 0 && pack.segments[max_number].end < SEGMENT_MAX_SIZE) {
+        pack.active = max_number;
+    } else if (new_segment()) {
+        pack.dir_fd = -1;
+        return 1;
+    }
+    printf("[pack] Loaded %zu tracks from %u segments\n", pack.index.count, pack.segment_count);
+    schedule_compaction();
+    return 0;
+}
+
+void
+pack_store_close() {
+    for (uint32_t i = 0; i < pack.segment_count; ++i) close_segment(i, false);
+    free(pack.segments);
+    if (pack.compact_event) event_free(pack.compact_event);
+    idmap_free(&pack.index);
+    memset(&pack, 0, sizeof(pack));
+    pack.dir_fd = -1;
+    pack.compacting = -1;
+}
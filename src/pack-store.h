@@ -0,0 +1,52 @@
+#ifndef SMP_PACK_STORE_H
+#define SMP_PACK_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <event2/event.h>
+
+#define PACK_ID_LEN 22
+
+/*
+ * Log structured store for tracks. Tracks are appended to segment files in the tracks directory and located through
+ * an in-memory index which is rebuilt from the segments at startup. Replaced and removed tracks leave holes which are
+ * reclaimed by rewriting mostly empty segments in the background.
+ */
+int pack_store_init(struct event_base *base, int dir_fd);
+
+void pack_store_close();
+
+/*
+ * Reserves space for a track of length bytes. The data can then be written in any order with pack_store_write and
+ * becomes visible once pack_store_commit is called. Returns 1 on error.
+ */
+int pack_store_reserve(const char id[PACK_ID_LEN], uint64_t length, uint64_t *handle);
+
+int pack_store_write(uint64_t handle, uint64_t offset, const void *data, size_t len);
+
+/*
+ * Where the data of a reserved track goes, for writing it without calling into the pack store. fd stays open until
+ * the track is committed or aborted.
+ */
+void pack_store_target(uint64_t handle, int *fd, uint64_t *data_pos);
+
+// crc is the CRC-32C of the whole data, stored for verification when reading
+int pack_store_commit(uint64_t handle, uint32_t crc);
+
+void pack_store_abort(uint64_t handle);
+
+/*
+ * Finds the data of a track in its segment file for reading it without calling into the pack store. fd is owned by the
+ * pack store and should be duplicated, the data stays in place as long as the file is open.
+ */
+int pack_store_locate(const char id[PACK_ID_LEN], int *fd, uint64_t *data_pos, uint64_t *length, uint32_t *crc);
+
+bool pack_store_has(const char id[PACK_ID_LEN]);
+
+int pack_store_remove(const char id[PACK_ID_LEN]);
+
+// Iterates over all stored tracks, pos should start at 0
+bool pack_store_next(size_t *pos, char id_out[PACK_ID_LEN], uint64_t *length, int64_t *time);
+
+#endif //SMP_PACK_STORE_H
@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "playlist-index.h"
+#include "idmap.h"
+#include "io-pool.h"
+
+#define INDEX_MAGIC 0x49504d53 // "SMPI"
+#define INDEX_VERSION 1
+#define RECORD_DEAD 0x1
+#define RECORD_ALIGN 8
+#define MIN_CAPACITY 4096
+
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/*
+ * Records are appended after the header and followed by the name and image url, both null terminated, padded to
+ * RECORD_ALIGN bytes. A record which has been replaced is marked dead and skipped until the file is compacted. The file
+ * is grown ahead of the records by doubling its size, and the zeroed space after the last record ends the list. Records
+ * are written through the shared mapping, so only growing the file and compacting it call into the file system.
+ */
+struct index_record {
+    char id[SPOTIFY_ID_LEN];
+    uint8_t album;
+    uint8_t flags;
+    uint32_t track_count;
+    uint16_t name_len;
+    uint16_t image_len;
+    int64_t last_played;
+};
+
+static struct {
+    int fd;
+    char *path;
+    uint8_t *map;
+    size_t map_len; // Size of the file
+    size_t end; // Offset after the last record
+    size_t dead_bytes;
+    struct idmap offsets; // Id to offset of the live record
+    size_t *sorted[PLAYLIST_INDEX_ORDER_LAST]; // Cached record offsets in every order, NULL when out of date
+    bool compacting;
+} idx = {.fd = -1};
+
+static size_t
+record_size(const struct index_record *rec) {
+    size_t size = sizeof(*rec) + rec->name_len + 1 + rec->image_len + 1;
+    return (size + RECORD_ALIGN - 1) & ~((size_t) RECORD_ALIGN - 1);
+}
+
+static struct index_record *
+record_at(size_t offset) {
+    return (struct index_record *) &idx.map[offset];
+}
+
+static const char *
+record_name(const struct index_record *rec) {
+    return (const char *) (rec + 1);
+}
+
+static const char *
+record_image(const struct index_record *rec) {
+    return record_name(rec) + rec->name_len + 1;
+}
+
+static void
+invalidate_sorted() {
+    for (int i = 0; i < PLAYLIST_INDEX_ORDER_LAST; ++i) {
+        free(idx.sorted[i]);
+        idx.sorted[i] = NULL;
+    }
+}
+
+static int
+remap() {
+    if (idx.map) munmap(idx.map, idx.map_len);
+    idx.map = NULL;
+    struct stat st;
+    if (fstat(idx.fd, &st)) return 1;
+    idx.map_len = st.st_size;
+    if (!idx.map_len) return 0;
+    idx.map = mmap(NULL, idx.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, idx.fd, 0);
+    if (idx.map == MAP_FAILED) {
+        idx.map = NULL;
+        fprintf(stderr, "[index] Error when mapping playlist index: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Builds the id map from the records in the file. Returns 1 if the file is corrupt.
+static int
+load_records() {
+    idmap_clear(&idx.offsets);
+    idx.dead_bytes = 0;
+    idx.end = 0;
+    if (idx.map_len < sizeof(struct index_header)) return 1;
+    struct index_header *header = (struct index_header *) idx.map;
+    if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION) return 1;
+
+    size_t offset = sizeof(*header);
+    while (offset + sizeof(struct index_record) <= idx.map_len) {
+        struct index_record *rec = record_at(offset);
+        if (!rec->id[0]) break; // Space reserved for the next records
+        size_t size = record_size(rec);
+        if (offset + size > idx.map_len) break; // Partially written record, ignored and overwritten by the next one
+        SpotifyId id;
+        if ((rec->flags & RECORD_DEAD) || !spotify_id_parse(rec->id, &id)) idx.dead_bytes += size;
+        else idmap_put(&idx.offsets, id, offset);
+        offset += size;
+    }
+    idx.end = offset;
+    for (size_t i = offset; i < idx.map_len; ++i) {
+        if (!idx.map[i]) continue;
+        // Left over from a record which wasn't fully written, cut off so it can't be read as one after the next append
+        if (ftruncate(idx.fd, (off_t) offset) == 0) remap();
+        break;
+    }
+    return 0;
+}
+
+static int
+write_header(int fd) {
+    struct index_header header = {.magic = INDEX_MAGIC, .version = INDEX_VERSION};
+    return pwrite(fd, &header, sizeof(header), 0) != sizeof(header);
+}
+
+// Grows the file by doubling its size until it can hold needed bytes. The space is allocated, so writing it can't fail.
+static int
+reserve(size_t needed) {
+    if (needed <= idx.map_len) return 0;
+    size_t capacity = idx.map_len > MIN_CAPACITY ? idx.map_len : MIN_CAPACITY;
+    while (capacity < needed) capacity *= 2;
+    int err = posix_fallocate(idx.fd, 0, (off_t) capacity);
+    if (err) {
+        fprintf(stderr, "[index] Error when growing playlist index: %s\n", strerror(err));
+        return 1;
+    }
+    return remap();
+}
+
+// Appends a record with its strings after the last one and points its id at it, marking the one it replaces dead
+static void
+put_record(SpotifyId id, const struct index_record *rec, const char *name, const char *image) {
+    size_t size = record_size(rec);
+    if (reserve(idx.end + size)) return;
+    uint8_t *buf = &idx.map[idx.end];
+    memset(buf, 0, size);
+    memcpy(buf, rec, sizeof(*rec));
+    if (rec->name_len) memcpy(&buf[sizeof(*rec)], name, rec->name_len);
+    if (rec->image_len) memcpy(&buf[sizeof(*rec) + rec->name_len + 1], image, rec->image_len);
+
+    uint64_t *offset = idmap_upsert(&idx.offsets, id, idx.end);
+    if (*offset != idx.end) { // Only once the new record is in place, the old one stays if anything above failed
+        struct index_record *old = record_at(*offset);
+        old->flags |= RECORD_DEAD;
+        idx.dead_bytes += record_size(old);
+        *offset = idx.end;
+    }
+    idx.end += size;
+    invalidate_sorted();
+}
+
+// The live records as of when compaction started, which are written to a new file on the I/O pool
+struct index_compaction {
+    char *path;
+    uint8_t *data;
+    size_t len; // Same as the end of the new file
+    size_t end; // End of the old file when compaction started, the records after it are copied over once it is done
+    int fd;
+    int error;
+};
+
+static void
+compact_work(void *arg) {
+    struct index_compaction *job = arg;
+    size_t path_len = strlen(job->path);
+    char tmp_path[path_len + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        job->error = errno;
+        return;
+    }
+    for (size_t done = 0; done < job->len;) {
+        ssize_t written = pwrite(fd, &job->data[done], job->len - done, (off_t) done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            job->error = written < 0 ? errno : EIO;
+            break;
+        }
+        done += written;
+    }
+    if (!job->error && (fdatasync(fd) || rename(tmp_path, job->path))) job->error = errno;
+    if (job->error) {
+        close(fd);
+        remove(tmp_path);
+        return;
+    }
+    job->fd = fd;
+}
+
+/*
+ * Switches to the compacted file. Records appended since compaction started are appended to it again, and the fixed
+ * size fields of the others are copied over since they could have been updated in place.
+ */
+static void
+compact_done(void *arg) {
+    struct index_compaction *job = arg;
+    idx.compacting = false;
+    if (job->error) {
+        fprintf(stderr, "[index] Error when compacting playlist index: %s\n", strerror(job->error));
+        goto out;
+    }
+    uint8_t *old_map = idx.map;
+    size_t old_map_len = idx.map_len;
+    int old_fd = idx.fd;
+    struct idmap old_offsets = idx.offsets;
+    idx.fd = job->fd;
+    idx.map = NULL;
+    idmap_init(&idx.offsets, 64);
+    if (remap() || load_records()) {
+        fprintf(stderr, "[index] Error when loading compacted playlist index\n");
+        if (idx.map) munmap(idx.map, idx.map_len);
+        close(idx.fd);
+        idmap_free(&idx.offsets);
+        idx.fd = old_fd;
+        idx.map = old_map;
+        idx.map_len = old_map_len;
+        idx.offsets = old_offsets;
+        load_records();
+        goto out;
+    }
+    idmap_foreach(&old_offsets, e) {
+        const struct index_record *rec = (const struct index_record *) &old_map[e->value];
+        uint64_t offset;
+        if (e->value >= job->end || !idmap_get(&idx.offsets, e->id, &offset)) {
+            put_record(e->id, rec, record_name(rec), record_image(rec));
+            continue;
+        }
+        record_at(offset)->track_count = rec->track_count;
+        record_at(offset)->last_played = rec->last_played;
+    }
+    munmap(old_map, old_map_len);
+    close(old_fd);
+    idmap_free(&old_offsets);
+    invalidate_sorted();
+    printf("[index] Compacted playlist index\n");
+
+    out:
+    free(job->path);
+    free(job->data);
+    free(job);
+}
+
+// Rewrites the index without dead records
+static void
+compact() {
+    struct index_compaction *job = calloc(1, sizeof(*job));
+    job->path = strdup(idx.path);
+    job->data = malloc(idx.end - idx.dead_bytes);
+    job->end = idx.end;
+    job->fd = -1;
+    struct index_header header = {.magic = INDEX_MAGIC, .version = INDEX_VERSION};
+    memcpy(job->data, &header, sizeof(header));
+    job->len = sizeof(header);
+    idmap_foreach(&idx.offsets, e) {
+        size_t size = record_size(record_at(e->value));
+        memcpy(&job->data[job->len], record_at(e->value), size);
+        job->len += size;
+    }
+    idx.compacting = true;
+    io_pool_submit(compact_work, compact_done, job);
+}
+
+static void
+rebuild() {
+    printf("[index] Rebuilding playlist index from cached playlist info\n");
+    if (ftruncate(idx.fd, 0) || write_header(idx.fd) || remap()) {
+        fprintf(stderr, "[index] Error when creating playlist index: %s\n", strerror(errno));
+        return;
+    }
+    load_records();
+
+    PlaylistInfo *playlists = NULL;
+    size_t count = 0;
+    get_all_playlist_info(&playlists, &count);
+    for (size_t i = 0; i < count; ++i) {
+        if (playlists[i].not_empty) playlist_index_upsert(&playlists[i]);
+        free_playlist(&playlists[i]);
+    }
+    free(playlists);
+}
+
+int
+playlist_index_init(const char *path) {
+    idx.path = strdup(path);
+    idmap_init(&idx.offsets, 64);
+    idx.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (idx.fd < 0) {
+        fprintf(stderr, "[index] Error when opening playlist index '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (remap() || load_records()) rebuild();
+    printf("[index] Loaded %zu playlists from index\n", idx.offsets.count);
+    return 0;
+}
+
+void
+playlist_index_close() {
+    invalidate_sorted();
+    if (idx.map) munmap(idx.map, idx.map_len);
+    if (idx.fd >= 0) close(idx.fd);
+    idmap_free(&idx.offsets);
+    free(idx.path);
+    memset(&idx, 0, sizeof(idx));
+    idx.fd = -1;
+}
+
+void
+playlist_index_upsert(const PlaylistInfo *playlist) {
+    SpotifyId id;
+    if (idx.fd < 0 || !spotify_id_parse(playlist->spotify_id, &id)) return;
+    int64_t last_played = playlist->last_played;
+    uint64_t offset;
+    if (idmap_get(&idx.offsets, id, &offset)) {
+        struct index_record *rec = record_at(offset);
+        bool same_strings = !strncmp(record_name(rec), playlist->name ? playlist->name : "", rec->name_len) &&
+                            !strncmp(record_image(rec), playlist->image_url ? playlist->image_url : "",
+                                     rec->image_len) &&
+                            rec->name_len == (playlist->name ? strlen(playlist->name) : 0) &&
+                            rec->image_len == (playlist->image_url ? strlen(playlist->image_url) : 0);
+        if (last_played < rec->last_played) last_played = rec->last_played;
+        if (same_strings && rec->album == playlist->album) { // Fixed size fields can be updated in place
+            if (rec->track_count != playlist->track_count || rec->last_played != last_played) {
+                rec->track_count = playlist->track_count;
+                rec->last_played = last_played;
+                invalidate_sorted();
+            }
+            return;
+        }
+    }
+
+    size_t name_len = playlist->name ? strlen(playlist->name) : 0;
+    size_t image_len = playlist->image_url ? strlen(playlist->image_url) : 0;
+    struct index_record rec = {
+            .album = playlist->album,
+            .track_count = playlist->track_count,
+            .name_len = name_len > UINT16_MAX ? UINT16_MAX : name_len,
+            .image_len = image_len > UINT16_MAX ? UINT16_MAX : image_len,
+            .last_played = last_played
+    };
+    memcpy(rec.id, playlist->spotify_id, SPOTIFY_ID_LEN);
+    put_record(id, &rec, playlist->name, playlist->image_url);
+
+    if (!idx.compacting && idx.dead_bytes > 4096 && idx.dead_bytes * 2 > idx.end) compact();
+}
+
+void
+playlist_index_set_last_played(SpotifyId id, time_t last_played) {
+    uint64_t offset;
+    if (!idmap_get(&idx.offsets, id, &offset)) return;
+    struct index_record *rec = record_at(offset);
+    if (rec->last_played == last_played) return;
+    rec->last_played = last_played;
+    free(idx.sorted[PLAYLIST_INDEX_PLAYED]);
+    idx.sorted[PLAYLIST_INDEX_PLAYED] = NULL;
+}
+
+size_t
+playlist_index_count() {
+    return idx.offsets.count;
+}
+
+static int
+compare_name(const void *a, const void *b) {
+    return strcmp(record_name(record_at(*(const size_t *) a)), record_name(record_at(*(const size_t *) b)));
+}
+
+static int
+compare_last_played(const void *a, const void *b) {
+    int64_t pa = record_at(*(const size_t *) a)->last_played, pb = record_at(*(const size_t *) b)->last_played;
+    return (pa < pb) - (pa > pb); // Most recently played first
+}
+
+static size_t *
+sorted_offsets(enum playlist_index_order order) {
+    if (idx.sorted[order]) return idx.sorted[order];
+    size_t *offsets = malloc((idx.offsets.count ? idx.offsets.count : 1) * sizeof(*offsets));
+    size_t i = 0;
+    idmap_foreach(&idx.offsets, e) offsets[i++] = e->value;
+    qsort(offsets, i, sizeof(*offsets), order == PLAYLIST_INDEX_PLAYED ? compare_last_played : compare_name);
+    idx.sorted[order] = offsets;
+    return offsets;
+}
+
+size_t
+playlist_index_list(enum playlist_index_order order, bool reverse, size_t index, size_t max_count,
+                    PlaylistInfo *out) {
+    size_t count = idx.offsets.count;
+    if (index >= count || order >= PLAYLIST_INDEX_ORDER_LAST) return 0;
+    size_t *offsets = sorted_offsets(order);
+    size_t n = 0;
+    for (size_t i = index; i < count && n < max_count; ++i, ++n) {
+        struct index_record *rec = record_at(offsets[reverse ? count - 1 - i : i]);
+        memset(&out[n], 0, sizeof(out[n]));
+        out[n].not_empty = true;
+        out[n].album = rec->album;
+        out[n].name = (char *) record_name(rec);
+        out[n].image_url = (char *) record_image(rec);
+        memcpy(out[n].spotify_id, rec->id, SPOTIFY_ID_LEN);
+        out[n].spotify_id[SPOTIFY_ID_LEN] = 0;
+        out[n].last_played = rec->last_played;
+        out[n].track_count = rec->track_count;
+    }
+    return n;
+}
@@ -0,0 +1,39 @@
+#ifndef SMP_PLAYLIST_INDEX_H
+#define SMP_PLAYLIST_INDEX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include "spotify.h"
+
+#define PLAYLIST_INDEX_FILE "playlist_index.bin"
+
+enum playlist_index_order {
+    PLAYLIST_INDEX_ALPHABETICAL = 0,
+    PLAYLIST_INDEX_PLAYED,
+    PLAYLIST_INDEX_ORDER_LAST
+};
+
+/*
+ * Opens the index of saved playlists and albums at path, rebuilding it from the playlist_info and album_info
+ * directories if it doesn't exist or can't be read.
+ */
+int playlist_index_init(const char *path);
+
+void playlist_index_close();
+
+// Adds or updates the entry of a playlist/album after its info has been loaded
+void playlist_index_upsert(const PlaylistInfo *playlist);
+
+void playlist_index_set_last_played(SpotifyId id, time_t last_played);
+
+size_t playlist_index_count();
+
+/*
+ * Fills out with at most max_count entries starting at index in the specified order. The name and image_url of the
+ * returned entries point into the index and must not be freed or used after the index changes.
+ */
+size_t playlist_index_list(enum playlist_index_order order, bool reverse, size_t index, size_t max_count,
+                           PlaylistInfo *out);
+
+#endif //SMP_PLAYLIST_INDEX_H
@@ -0,0 +1,54 @@
+#include <time.h>
+#include "prebuffer.h"
+#include "config.h"
+
+#define RATE_SAMPLE_INTERVAL_US 100000
+#define RATE_SMOOTHING 0.3
+
+static uint64_t
+now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+void
+prebuffer_begin(struct prebuffer *pb, size_t progress) {
+    pb->last_us = now_us();
+    pb->last_progress = progress;
+    pb->rate = 0;
+}
+
+static void
+update_rate(struct prebuffer *pb, size_t progress) {
+    uint64_t now = now_us();
+    uint64_t elapsed = now - pb->last_us;
+    if (elapsed < RATE_SAMPLE_INTERVAL_US || progress < pb->last_progress) return;
+
+    double sample = (double) (progress - pb->last_progress) / ((double) elapsed * 0.000001);
+    pb->rate = pb->rate == 0 ? sample : RATE_SMOOTHING * sample + (1.0 - RATE_SMOOTHING) * pb->rate;
+    pb->last_us = now;
+    pb->last_progress = progress;
+}
+
+bool
+prebuffer_ready(struct prebuffer *pb, size_t progress, size_t expecting, double buffered,
+                double bytes_per_second) {
+    update_rate(pb, progress);
+    if (expecting && progress >= expecting) return true; // Everything is here, nothing left to wait for
+
+    double min_buffered = (double) prebuffer_min_ms * 0.001;
+    if (buffered < min_buffered) return false;
+    if (prebuffer_strictness <= 0) return true;
+    if (pb->rate <= 0 || bytes_per_second <= 0 || !expecting) return false; // No estimate yet
+
+    /*
+     * With a constant download rate r and a track which needs b bytes per second of audio, the decoded audio grows
+     * by r/b seconds every second while playback consumes one. If r < b the margin is smallest right when the
+     * download finishes, so starting with remaining * (1/r - 1/b) seconds buffered never drains the buffer.
+     */
+    double remaining = (double) (expecting - progress);
+    double deficit = remaining / pb->rate - remaining / bytes_per_second;
+    if (deficit < 0) deficit = 0;
+    return buffered >= min_buffered + prebuffer_strictness * deficit;
+}
@@ -0,0 +1,27 @@
+#ifndef SMP_PREBUFFER_H
+#define SMP_PREBUFFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Decides when a track which is still being downloaded has enough audio decoded ahead of the playback position to
+ * start playing. The download rate is estimated from how fast the connection's progress grows.
+ */
+struct prebuffer {
+    uint64_t last_us;
+    size_t last_progress;
+    double rate; // Exponentially weighted average of the download rate in bytes/s, 0 while unknown
+};
+
+void prebuffer_begin(struct prebuffer *pb, size_t progress);
+
+/*
+ * buffered is the amount of decoded audio in seconds and bytes_per_second the amount of encoded data that makes up one
+ * second of audio. Returns true once playback can start.
+ */
+bool prebuffer_ready(struct prebuffer *pb, size_t progress, size_t expecting, double buffered,
+                     double bytes_per_second);
+
+#endif //SMP_PREBUFFER_H
@@ -0,0 +1,77 @@
+#include <string.h>
+#include "queue-index.h"
+#include "spotify.h"
+
+void
+queue_index_free(struct queue_index *index) {
+    idmap_free(&index->tracks);
+    idmap_free(&index->artists);
+    index->indexed = 0;
+}
+
+void
+queue_index_reset(struct queue_index *index) {
+    idmap_clear(&index->tracks);
+    idmap_clear(&index->artists);
+    index->indexed = 0;
+}
+
+static void
+sync(struct queue_index *index, const Track *tracks, size_t count) {
+    if (count < index->indexed) queue_index_reset(index); // Cleared without telling the index
+    for (size_t i = index->indexed; i < count; ++i) {
+        idmap_upsert(&index->tracks, tracks[i].spotify_id, i); // Keeps the first occurrence
+        SpotifyId artist_id = tracks[i].info->spotify_artist_id;
+        if (!spotify_id_none(artist_id)) (*idmap_upsert(&index->artists, artist_id, 0))++;
+    }
+    index->indexed = count;
+}
+
+void
+queue_index_remove(struct queue_index *index, const Track *tracks, size_t count, uint32_t slot) {
+    sync(index, tracks, count);
+    if (slot >= count) return;
+    uint64_t first;
+    // Another copy of the track later in the queue won't be found anymore, which is rare enough not to matter
+    if (idmap_get(&index->tracks, tracks[slot].spotify_id, &first) && first == slot)
+        idmap_remove(&index->tracks, tracks[slot].spotify_id);
+    uint64_t appearances;
+    SpotifyId artist_id = tracks[slot].info->spotify_artist_id;
+    if (!spotify_id_none(artist_id) && idmap_get(&index->artists, artist_id, &appearances)) {
+        if (appearances > 1) idmap_put(&index->artists, artist_id, appearances - 1);
+        else idmap_remove(&index->artists, artist_id);
+    }
+}
+
+int64_t
+queue_index_find(struct queue_index *index, const Track *tracks, size_t count, SpotifyId id) {
+    sync(index, tracks, count);
+    uint64_t pos;
+    if (!idmap_get(&index->tracks, id, &pos)) return -1;
+    if (pos < count && spotify_id_equal(tracks[pos].spotify_id, id)) return (int64_t) pos;
+
+    // The queue was replaced by at least as many tracks without a reset, so the index is out of date
+    queue_index_reset(index);
+    sync(index, tracks, count);
+    return idmap_get(&index->tracks, id, &pos) ? (int64_t) pos : -1;
+}
+
+size_t
+queue_index_top_artists(struct queue_index *index, const Track *tracks, size_t count, SpotifyId *ids,
+                        size_t max) {
+    sync(index, tracks, count);
+    uint64_t appearances[max ? max : 1];
+    size_t found = 0;
+    idmap_foreach(&index->artists, e) {
+        size_t i = found < max ? found : max;
+        while (i > 0 && appearances[i - 1] < e->value) i--;
+        if (i >= max) continue;
+        size_t last = found < max ? found : max - 1;
+        memmove(&appearances[i + 1], &appearances[i], (last - i) * sizeof(*appearances));
+        memmove(&ids[i + 1], &ids[i], (last - i) * sizeof(*ids));
+        appearances[i] = e->value;
+        ids[i] = e->id;
+        if (found < max) found++;
+    }
+    return found;
+}
@@ -0,0 +1,38 @@
+#ifndef SMP_QUEUE_INDEX_H
+#define SMP_QUEUE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "idmap.h"
+
+struct Track;
+
+/*
+ * Hash index over the queue from track id to the slot of its first occurrence in spotify->tracks, and from artist id
+ * to how many queued tracks are by that artist. The queue is appended to from many places, so new tracks are indexed
+ * the next time the index is used. Slots don't change when the queue is reordered, but clearing the queue has to call
+ * queue_index_reset and removing a track queue_index_remove.
+ */
+struct queue_index {
+    struct idmap tracks;
+    struct idmap artists;
+    size_t indexed; // Leading slots which are in the maps
+};
+
+void queue_index_free(struct queue_index *index);
+
+void queue_index_reset(struct queue_index *index);
+
+void queue_index_remove(struct queue_index *index, const struct Track *tracks, size_t count, uint32_t slot);
+
+// Returns the first slot holding id, or -1 if there is none
+int64_t queue_index_find(struct queue_index *index, const struct Track *tracks, size_t count, SpotifyId id);
+
+/*
+ * Writes the ids of up to max artists with the most tracks in the queue to ids, most tracks first, and returns how
+ * many were written.
+ */
+size_t queue_index_top_artists(struct queue_index *index, const struct Track *tracks, size_t count, SpotifyId *ids,
+                               size_t max);
+
+#endif //SMP_QUEUE_INDEX_H
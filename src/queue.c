@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "queue.h"
+
+#define NIL QUEUE_NONE
+
+static uint32_t
+size(const struct queue *queue, uint32_t n) {
+    return n == NIL ? 0 : queue->nodes[n].size;
+}
+
+static void
+update(struct queue *queue, uint32_t n) {
+    struct queue_node *node = &queue->nodes[n];
+    node->size = 1 + size(queue, node->left) + size(queue, node->right);
+    if (node->left != NIL) queue->nodes[node->left].parent = n;
+    if (node->right != NIL) queue->nodes[node->right].parent = n;
+}
+
+static uint32_t
+random_priority(struct queue *queue) {
+    queue->seed ^= queue->seed << 13; // xorshift64
+    queue->seed ^= queue->seed >> 7;
+    queue->seed ^= queue->seed << 17;
+    return (uint32_t) (queue->seed >> 32);
+}
+
+// Splits the subtree at n into its first count nodes and the rest
+static void
+split(struct queue *queue, uint32_t n, size_t count, uint32_t *left, uint32_t *right) {
+    if (n == NIL) {
+        *left = *right = NIL;
+        return;
+    }
+    struct queue_node *node = &queue->nodes[n];
+    if (size(queue, node->left) < count) {
+        split(queue, node->right, count - size(queue, node->left) - 1, &node->right, right);
+        *left = n;
+    } else {
+        split(queue, node->left, count, left, &node->left);
+        *right = n;
+    }
+    update(queue, n);
+}
+
+static uint32_t
+merge(struct queue *queue, uint32_t a, uint32_t b) {
+    if (a == NIL) return b;
+    if (b == NIL) return a;
+    if (queue->nodes[a].priority > queue->nodes[b].priority) {
+        queue->nodes[a].right = merge(queue, queue->nodes[a].right, b);
+        update(queue, a);
+        return a;
+    }
+    queue->nodes[b].left = merge(queue, a, queue->nodes[b].left);
+    update(queue, b);
+    return b;
+}
+
+static void
+set_root(struct queue *queue, uint32_t root) {
+    queue->root = root;
+    if (root != NIL) queue->nodes[root].parent = NIL;
+}
+
+static void
+detach(struct queue *queue, uint32_t slot) {
+    uint32_t left, mid, right;
+    split(queue, queue->root, queue_position(queue, slot), &left, &right);
+    split(queue, right, 1, &mid, &right);
+    set_root(queue, merge(queue, left, right));
+}
+
+static void
+attach(struct queue *queue, uint32_t slot, size_t position) {
+    uint32_t left, right;
+    split(queue, queue->root, position, &left, &right);
+    set_root(queue, merge(queue, merge(queue, left, slot), right));
+}
+
+void
+queue_free(struct queue *queue) {
+    free(queue->nodes);
+    memset(queue, 0, sizeof(*queue));
+}
+
+void
+queue_reset(struct queue *queue) {
+    queue->root = NIL;
+    queue->synced = 0;
+}
+
+size_t
+queue_sync(struct queue *queue, size_t slot_count, size_t position) {
+    if (!queue->nodes) queue->root = NIL; // Zero initialized
+    if (!queue->seed) queue->seed = 0x9e3779b97f4a7c15ULL;
+    if (slot_count <= queue->synced) return 0;
+    if (slot_count > queue->nodes_size) {
+        size_t new_size = queue->nodes_size ? queue->nodes_size : 64;
+        while (new_size < slot_count) new_size *= 2;
+        struct queue_node *tmp = realloc(queue->nodes, new_size * sizeof(*tmp));
+        if (!tmp) {
+            perror("[queue] Error when calling realloc");
+            exit(EXIT_FAILURE);
+        }
+        queue->nodes = tmp;
+        queue->nodes_size = new_size;
+    }
+
+    uint32_t run = NIL;
+    for (size_t slot = queue->synced; slot < slot_count; ++slot) {
+        queue->nodes[slot] = (struct queue_node) {
+                .left = NIL,
+                .right = NIL,
+                .parent = NIL,
+                .size = 1,
+                .priority = random_priority(queue),
+                .queued = true,
+        };
+        run = merge(queue, run, (uint32_t) slot);
+    }
+    size_t added = slot_count - queue->synced;
+    queue->synced = slot_count;
+
+    uint32_t left, right;
+    size_t length = queue_length(queue);
+    split(queue, queue->root, position < length ? position : length, &left, &right);
+    set_root(queue, merge(queue, merge(queue, left, run), right));
+    return added;
+}
+
+size_t
+queue_length(const struct queue *queue) {
+    return queue->nodes ? size(queue, queue->root) : 0;
+}
+
+bool
+queue_contains(const struct queue *queue, uint32_t slot) {
+    return slot < queue->synced && queue->nodes[slot].queued;
+}
+
+uint32_t
+queue_at(const struct queue *queue, size_t position) {
+    if (position >= queue_length(queue)) return NIL;
+    uint32_t n = queue->root;
+    for (;;) {
+        size_t left = size(queue, queue->nodes[n].left);
+        if (position == left) return n;
+        if (position < left) {
+            n = queue->nodes[n].left;
+        } else {
+            position -= left + 1;
+            n = queue->nodes[n].right;
+        }
+    }
+}
+
+size_t
+queue_position(const struct queue *queue, uint32_t slot) {
+    size_t position = size(queue, queue->nodes[slot].left);
+    for (uint32_t n = slot, parent; (parent = queue->nodes[n].parent) != NIL; n = parent) {
+        if (queue->nodes[parent].right == n) position += size(queue, queue->nodes[parent].left) + 1;
+    }
+    return position;
+}
+
+uint32_t
+queue_prev(const struct queue *queue, uint32_t slot) {
+    uint32_t n = queue->nodes[slot].left;
+    if (n != NIL) {
+        while (queue->nodes[n].right != NIL) n = queue->nodes[n].right;
+        return n;
+    }
+    for (n = slot; queue->nodes[n].parent != NIL; n = queue->nodes[n].parent) {
+        if (queue->nodes[queue->nodes[n].parent].right == n) return queue->nodes[n].parent;
+    }
+    return NIL;
+}
+
+uint32_t
+queue_next(const struct queue *queue, uint32_t slot) {
+    uint32_t n = queue->nodes[slot].right;
+    if (n != NIL) {
+        while (queue->nodes[n].left != NIL) n = queue->nodes[n].left;
+        return n;
+    }
+    for (n = slot; queue->nodes[n].parent != NIL; n = queue->nodes[n].parent) {
+        if (queue->nodes[queue->nodes[n].parent].left == n) return queue->nodes[n].parent;
+    }
+    return NIL;
+}
+
+void
+queue_remove(struct queue *queue, uint32_t slot) {
+    if (!queue_contains(queue, slot)) return;
+    detach(queue, slot);
+    queue->nodes[slot].queued = false;
+}
+
+void
+queue_move(struct queue *queue, uint32_t slot, size_t position) {
+    if (!queue_contains(queue, slot)) return;
+    detach(queue, slot);
+    size_t length = queue_length(queue);
+    attach(queue, slot, position < length ? position : length);
+}
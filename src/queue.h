@@ -0,0 +1,60 @@
+#ifndef SMP_QUEUE_H
+#define SMP_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define QUEUE_NONE UINT32_MAX
+
+/*
+ * Play order of the queue. Tracks are stored in spotify->tracks, which is only ever appended to until the queue is
+ * cleared, so the index of a track in that array is a stable handle to it, called its slot. This keeps the slots in
+ * queue order in a treap keyed by position, so finding the slot at a position or the position of a slot, and
+ * inserting, removing or moving a track, are all O(log n).
+ *
+ * Removed tracks keep their slot until the queue is cleared, so a removed track which is still playing stays valid.
+ */
+struct queue {
+    struct queue_node {
+        uint32_t left;
+        uint32_t right;
+        uint32_t parent;
+        uint32_t size; // Nodes in this subtree
+        uint32_t priority;
+        bool queued;
+    } *nodes; // Indexed by slot
+    size_t nodes_size;
+    uint32_t root;
+    size_t synced; // Slots which have been added to the queue
+    uint64_t seed;
+};
+
+void queue_free(struct queue *queue);
+
+void queue_reset(struct queue *queue);
+
+// Inserts the slots appended since the last call, up to slot_count, at position. Returns how many were added.
+size_t queue_sync(struct queue *queue, size_t slot_count, size_t position);
+
+size_t queue_length(const struct queue *queue);
+
+bool queue_contains(const struct queue *queue, uint32_t slot);
+
+// Returns the slot at position, or QUEUE_NONE if position is past the end
+uint32_t queue_at(const struct queue *queue, size_t position);
+
+// The slot has to be in the queue
+size_t queue_position(const struct queue *queue, uint32_t slot);
+
+// Return the slot before or after slot in the queue, or QUEUE_NONE if there is none
+uint32_t queue_prev(const struct queue *queue, uint32_t slot);
+
+uint32_t queue_next(const struct queue *queue, uint32_t slot);
+
+void queue_remove(struct queue *queue, uint32_t slot);
+
+// Moves a queued slot so it ends up at position, or at the end if position is past it
+void queue_move(struct queue *queue, uint32_t slot, size_t position);
+
+#endif //SMP_QUEUE_H
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "response-cache.h"
+#include "config.h"
+
+#define RESPONSE_MAGIC 0x43504d53 // "SMPC"
+#define RESPONSE_VERSION 1
+#define MIN_BUCKETS 64
+
+struct response_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+// Entries are saved from the least to the most recently used, so loading them in order restores the LRU order
+struct response_record {
+    int64_t stored;
+    uint32_t request_len;
+    uint32_t response_len;
+};
+
+struct response_entry {
+    struct response_entry *prev; // Towards the most recently used entry
+    struct response_entry *next;
+    struct response_entry *chain; // Next entry in the same bucket
+    uint64_t hash;
+    int64_t stored;
+    size_t request_len;
+    size_t response_len;
+    char data[]; // The request followed by the response
+};
+
+static struct {
+    char *path;
+    struct response_entry **buckets;
+    size_t bucket_count; // Always a power of two
+    size_t count;
+    size_t used; // Bytes of all entries
+    struct response_entry *newest;
+    struct response_entry *oldest;
+} cache;
+
+static uint64_t
+hash_request(const char *request, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t) request[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static size_t
+entry_size(const struct response_entry *entry) {
+    return sizeof(*entry) + entry->request_len + entry->response_len;
+}
+
+static void
+list_unlink(struct response_entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache.newest = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache.oldest = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void
+list_push_newest(struct response_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache.newest;
+    if (cache.newest) cache.newest->prev = entry;
+    else cache.oldest = entry;
+    cache.newest = entry;
+}
+
+static struct response_entry **
+find(const char *request, size_t request_len, uint64_t hash) {
+    struct response_entry **slot = &cache.buckets[hash & (cache.bucket_count - 1)];
+    for (; *slot; slot = &(*slot)->chain) {
+        if ((*slot)->hash == hash && (*slot)->request_len == request_len &&
+            !memcmp((*slot)->data, request, request_len))
+            break;
+    }
+    return slot;
+}
+
+static void
+remove_entry(struct response_entry *entry) {
+    struct response_entry **slot = find(entry->data, entry->request_len, entry->hash);
+    *slot = entry->chain;
+    list_unlink(entry);
+    cache.used -= entry_size(entry);
+    cache.count--;
+    free(entry);
+}
+
+static void
+grow() {
+    size_t count = cache.bucket_count * 2;
+    struct response_entry **buckets = calloc(count, sizeof(*buckets));
+    for (size_t i = 0; i < cache.bucket_count; ++i) {
+        struct response_entry *entry = cache.buckets[i];
+        while (entry) {
+            struct response_entry *next = entry->chain;
+            entry->chain = buckets[entry->hash & (count - 1)];
+            buckets[entry->hash & (count - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(cache.buckets);
+    cache.buckets = buckets;
+    cache.bucket_count = count;
+}
+
+static void
+insert(const char *request, size_t request_len, const char *response, size_t len, int64_t stored) {
+    if (!cache.buckets || sizeof(struct response_entry) + request_len + len > response_cache_size) return;
+    uint64_t hash = hash_request(request, request_len);
+    struct response_entry **slot = find(request, request_len, hash);
+    if (*slot) remove_entry(*slot);
+
+    struct response_entry *entry = malloc(sizeof(*entry) + request_len + len);
+    entry->hash = hash;
+    entry->stored = stored;
+    entry->request_len = request_len;
+    entry->response_len = len;
+    memcpy(entry->data, request, request_len);
+    memcpy(&entry->data[request_len], response, len);
+    while (cache.oldest && cache.used + entry_size(entry) > response_cache_size) remove_entry(cache.oldest);
+
+    if (cache.count >= cache.bucket_count) grow();
+    slot = &cache.buckets[hash & (cache.bucket_count - 1)];
+    entry->chain = *slot;
+    *slot = entry;
+    list_push_newest(entry);
+    cache.used += entry_size(entry);
+    cache.count++;
+}
+
+static void
+load() {
+    FILE *fp = fopen(cache.path, "r");
+    if (!fp) return;
+    struct response_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != RESPONSE_MAGIC ||
+        header.version != RESPONSE_VERSION) {
+        fprintf(stderr, "[response] Saved responses are invalid, ignoring them\n");
+        fclose(fp);
+        return;
+    }
+    struct response_record rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        char *data = malloc((size_t) rec.request_len + rec.response_len);
+        if (!data || fread(data, 1, (size_t) rec.request_len + rec.response_len, fp) !=
+                     (size_t) rec.request_len + rec.response_len) {
+            free(data);
+            break;
+        }
+        insert(data, rec.request_len, &data[rec.request_len], rec.response_len, rec.stored);
+        free(data);
+    }
+    fclose(fp);
+}
+
+static void
+save() {
+    size_t path_len = strlen(cache.path);
+    char tmp_path[path_len + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache.path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "[response] Error when saving responses: %s\n", strerror(errno));
+        return;
+    }
+    struct response_header header = {.magic = RESPONSE_MAGIC, .version = RESPONSE_VERSION};
+    bool err = fwrite(&header, sizeof(header), 1, fp) != 1;
+    for (struct response_entry *entry = cache.oldest; entry && !err; entry = entry->prev) {
+        struct response_record rec = {
+                .stored = entry->stored,
+                .request_len = entry->request_len,
+                .response_len = entry->response_len
+        };
+        err = fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+              fwrite(entry->data, 1, entry->request_len + entry->response_len, fp) !=
+              entry->request_len + entry->response_len;
+    }
+    if (fclose(fp) || err || rename(tmp_path, cache.path)) {
+        fprintf(stderr, "[response] Error when saving responses: %s\n", strerror(errno));
+        remove(tmp_path);
+    }
+}
+
+int
+response_cache_init(const char *path) {
+    if (!response_cache_size) return 0;
+    cache.bucket_count = MIN_BUCKETS;
+    cache.buckets = calloc(cache.bucket_count, sizeof(*cache.buckets));
+    if (path) {
+        cache.path = strdup(path);
+        load();
+        printf("[response] Loaded %zu saved responses\n", cache.count);
+    }
+    return 0;
+}
+
+void
+response_cache_close() {
+    if (cache.path) save();
+    while (cache.oldest) remove_entry(cache.oldest);
+    free(cache.buckets);
+    free(cache.path);
+    memset(&cache, 0, sizeof(cache));
+}
+
+char *
+response_cache_get(const char *request, size_t request_len, bool allow_stale, size_t *len, bool *stale) {
+    if (!cache.buckets) return NULL;
+    struct response_entry *entry = *find(request, request_len, hash_request(request, request_len));
+    if (!entry) return NULL;
+    bool is_stale = time(NULL) - entry->stored >= response_cache_ttl;
+    if (stale) *stale = is_stale;
+    if (is_stale && !allow_stale) return NULL;
+
+    list_unlink(entry);
+    list_push_newest(entry);
+    char *copy = malloc(entry->response_len + 1);
+    memcpy(copy, &entry->data[entry->request_len], entry->response_len);
+    copy[entry->response_len] = 0;
+    *len = entry->response_len;
+    return copy;
+}
+
+void
+response_cache_put(const char *request, size_t request_len, const char *response, size_t len) {
+    insert(request, request_len, response, len, time(NULL));
+}
@@ -0,0 +1,27 @@
+#ifndef SMP_RESPONSE_CACHE_H
+#define SMP_RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define RESPONSE_CACHE_FILE "responses.bin"
+
+/*
+ * In memory LRU cache of backend responses which aren't stored anywhere else, like searches and recommendations,
+ * keyed by the exact bytes of the request. It holds at most response_cache_size bytes. Entries older than
+ * response_cache_ttl are stale: they aren't used while the backend can be reached, but are kept as a fallback for
+ * when it can't. If path isn't NULL the cache is loaded from it and written back to it by response_cache_close.
+ */
+int response_cache_init(const char *path);
+
+void response_cache_close();
+
+/*
+ * Returns a copy of the cached response to a request, which must be freed, or NULL if there is none. stale is set
+ * if the entry is older than the TTL, and stale entries are only returned if allow_stale is set.
+ */
+char *response_cache_get(const char *request, size_t request_len, bool allow_stale, size_t *len, bool *stale);
+
+void response_cache_put(const char *request, size_t request_len, const char *response, size_t len);
+
+#endif //SMP_RESPONSE_CACHE_H
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search-session.h"
+#include "config.h"
+
+#define SEARCH_SESSION_MAX 16
+
+struct search_request;
+
+struct search_session {
+    char *token;
+    char *query;
+    bool tracks, artists, albums, playlists;
+    uint32_t serial; // Of the latest query
+    struct search_request *request; // Backend request of the latest query, NULL if none is waiting for a response
+    struct event *debounce;
+    uint64_t last_used;
+};
+
+// userp of a search sent to the backend. It is freed by the search callback, so it may outlive its session.
+struct search_request {
+    struct search_session *session; // NULL once the session has ended
+    uint32_t serial;
+    struct connection *conn;
+};
+
+static struct {
+    struct event_base *base;
+    struct spotify_state *spotify;
+    search_session_cb cb;
+    void *userp;
+    struct search_session *sessions[SEARCH_SESSION_MAX];
+    size_t count;
+    uint64_t clock; // Orders the sessions by their last use
+} ss;
+
+static void
+results_cb(struct spotify_state *spotify, void *userp) {
+    struct spotify_search_results *results = userp;
+    struct search_request *req = results->userp;
+    struct search_session *session = req->session;
+    if (session && session->request == req) {
+        session->request = NULL;
+        ss.cb(session->token, req->serial, true, results, ss.userp);
+    } else {
+        free_search_results(results);
+    }
+    free(req);
+}
+
+// Stops the backend request of the session, if it has one
+static void
+drop_request(struct search_session *session) {
+    struct search_request *req = session->request;
+    if (!req) return;
+    session->request = NULL;
+    if (cancel_search(req->conn, req)) free(req);
+    else req->session = NULL; // Its callback is still coming, or the request failed
+}
+
+static void
+debounce_cb(evutil_socket_t fd, short what, void *arg) {
+    struct search_session *session = arg;
+    struct search_request *req = malloc(sizeof(*req));
+    req->session = session;
+    req->serial = session->serial;
+    req->conn = NULL;
+    session->request = req;
+    printf("[search] Searching for '%s'\n", session->query);
+    if (search(ss.spotify, session->query, results_cb, session->tracks, session->artists, session->albums,
+               session->playlists, req, &req->conn)) {
+        fprintf(stderr, "[search] Error when searching for '%s'\n", session->query);
+        session->request = NULL;
+        free(req);
+    }
+}
+
+static struct search_session *
+find_session(const char *token) {
+    for (size_t i = 0; i < ss.count; ++i) {
+        if (!strcmp(ss.sessions[i]->token, token)) return ss.sessions[i];
+    }
+    return NULL;
+}
+
+static void
+remove_session(struct search_session *session) {
+    for (size_t i = 0; i < ss.count; ++i) {
+        if (ss.sessions[i] != session) continue;
+        ss.sessions[i] = ss.sessions[--ss.count];
+        break;
+    }
+    drop_request(session);
+    event_free(session->debounce);
+    free(session->token);
+    free(session->query);
+    free(session);
+}
+
+static struct search_session *
+new_session(const char *token) {
+    if (ss.count == SEARCH_SESSION_MAX) { // Clients which don't end their sessions make room for new ones
+        struct search_session *oldest = ss.sessions[0];
+        for (size_t i = 1; i < ss.count; ++i) {
+            if (ss.sessions[i]->last_used < oldest->last_used) oldest = ss.sessions[i];
+        }
+        remove_session(oldest);
+    }
+    struct search_session *session = calloc(1, sizeof(*session));
+    session->token = strdup(token);
+    session->debounce = evtimer_new(ss.base, debounce_cb, session);
+    ss.sessions[ss.count++] = session;
+    return session;
+}
+
+void
+search_session_init(struct event_base *base, struct spotify_state *spotify, search_session_cb cb, void *userp) {
+    ss.base = base;
+    ss.spotify = spotify;
+    ss.cb = cb;
+    ss.userp = userp;
+}
+
+void
+search_session_close() {
+    while (ss.count) remove_session(ss.sessions[0]);
+}
+
+void
+search_session_query(const char *token, uint32_t serial, const char *query, bool tracks, bool artists, bool albums,
+                     bool playlists) {
+    struct search_session *session = find_session(token);
+    if (!session) session = new_session(token);
+    else if (serial <= session->serial) return;
+    session->last_used = ++ss.clock;
+    session->serial = serial;
+    drop_request(session); // Cancelled first, so its connection is free for this query
+    evtimer_del(session->debounce);
+    free(session->query);
+    session->query = strdup(query);
+    session->tracks = tracks;
+    session->artists = artists;
+    session->albums = albums;
+    session->playlists = playlists;
+    if (!tracks && !artists && !albums && !playlists) return;
+
+    struct spotify_search_results *cached = calloc(1, sizeof(*cached));
+    bool stale = false;
+    if (!search_cached(query, tracks, artists, albums, playlists, cached, &stale)) {
+        ss.cb(token, serial, !stale, cached, ss.userp);
+        if (!stale) return;
+    } else {
+        free(cached);
+    }
+
+    struct timeval delay = {.tv_sec = search_debounce_ms / 1000, .tv_usec = (search_debounce_ms % 1000) * 1000};
+    evtimer_add(session->debounce, &delay);
+}
+
+void
+search_session_end(const char *token) {
+    struct search_session *session = find_session(token);
+    if (session) remove_session(session);
+}
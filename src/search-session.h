@@ -0,0 +1,32 @@
+#ifndef SMP_SEARCH_SESSION_H
+#define SMP_SEARCH_SESSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <event2/event.h>
+#include "spotify.h"
+
+/*
+ * Called with results for the query with the given serial. Results from the response cache are delivered as soon as
+ * the query arrives, with final unset if the backend is asked as well. The callback owns results.
+ */
+typedef void (*search_session_cb)(const char *token, uint32_t serial, bool final,
+                                  struct spotify_search_results *results, void *userp);
+
+/*
+ * Search sessions let a client search while the user is typing. Sessions are named by a token chosen by the client,
+ * and each query replaces the previous one of its session: the request of the previous query is cancelled, results of
+ * superseded queries are never delivered, and a query is only sent to the backend once it hasn't been replaced for
+ * search_debounce_ms.
+ */
+void search_session_init(struct event_base *base, struct spotify_state *spotify, search_session_cb cb, void *userp);
+
+void search_session_close();
+
+// Queries with a serial which isn't greater than the latest one of the session are ignored
+void search_session_query(const char *token, uint32_t serial, const char *query, bool tracks, bool artists,
+                          bool albums, bool playlists);
+
+void search_session_end(const char *token);
+
+#endif //SMP_SEARCH_SESSION_H
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "shuffle.h"
+
+#define FEISTEL_ROUNDS 8 // Fewer visibly favour some orders of small ranges
+
+static uint64_t
+mix(uint64_t x) {
+    x ^= x >> 30; // splitmix64 finalizer
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t
+next_key(struct shuffle *shuffle) {
+    if (!shuffle->seed) shuffle->seed = ((uint64_t) rand() << 32) ^ (uint64_t) rand() ^ 0x9e3779b97f4a7c15ULL;
+    shuffle->seed += 0x9e3779b97f4a7c15ULL;
+    return mix(shuffle->seed);
+}
+
+/*
+ * Bijection of [0, n) onto itself. A Feistel network permutes the smallest range of an even number of bits which holds
+ * n, and results outside of [0, n) are fed through it again until they land inside. That range is less than four
+ * times n, so this takes few passes on average.
+ */
+static uint64_t
+permute(uint64_t i, uint64_t n, uint64_t key) {
+    if (n <= 1) return 0;
+    unsigned half = 1;
+    while (half < 32 && (1ULL << (half * 2)) < n) half++;
+    uint64_t mask = (1ULL << half) - 1;
+    do {
+        uint64_t left = i >> half, right = i & mask;
+        for (uint64_t round = 0; round < FEISTEL_ROUNDS; ++round) {
+            uint64_t next = left ^ (mix(right ^ key ^ (round * 0x9e3779b97f4a7c15ULL)) & mask);
+            left = right;
+            right = next;
+        }
+        i = (left << half) | right;
+    } while (i >= n);
+    return i;
+}
+
+static struct shuffle_segment *
+push_segment(struct shuffle *shuffle) {
+    if (shuffle->segment_count == shuffle->segment_size) {
+        uint32_t size = shuffle->segment_size ? shuffle->segment_size * 2 : 8;
+        struct shuffle_segment *tmp = realloc(shuffle->segments, size * sizeof(*tmp));
+        if (!tmp) {
+            perror("[shuffle] Error when calling realloc");
+            exit(EXIT_FAILURE);
+        }
+        shuffle->segments = tmp;
+        shuffle->segment_size = size;
+    }
+    struct shuffle_segment *segment = &shuffle->segments[shuffle->segment_count++];
+    memset(segment, 0, sizeof(*segment));
+    segment->key = next_key(shuffle);
+    segment->hole = SHUFFLE_NONE;
+    return segment;
+}
+
+void
+shuffle_free(struct shuffle *shuffle) {
+    free(shuffle->segments);
+    free(shuffle->prefix);
+    free(shuffle->prefix_sorted);
+    memset(shuffle, 0, sizeof(*shuffle));
+}
+
+void
+shuffle_reset(struct shuffle *shuffle) {
+    shuffle->segment_count = 0;
+    shuffle->prefix_len = 0;
+    shuffle->length = 0;
+}
+
+void
+shuffle_start(struct shuffle *shuffle, uint32_t first, size_t slot_count) {
+    shuffle_reset(shuffle);
+    if (!slot_count) return;
+    struct shuffle_segment *segment;
+    if (first < slot_count) {
+        segment = push_segment(shuffle);
+        segment->length = 1;
+        segment->first_slot = first;
+        segment->fixed = true;
+        if (slot_count > 1) {
+            segment = push_segment(shuffle);
+            segment->start = 1;
+            segment->length = slot_count - 1;
+            segment->base = 1;
+            segment->hole = first;
+        }
+    } else {
+        segment = push_segment(shuffle);
+        segment->length = slot_count;
+    }
+    shuffle->length = slot_count;
+}
+
+static int
+compare_slots(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Stores the slots of the positions before from and replaces the segments by a single one permuting the other slots
+static void
+collapse(struct shuffle *shuffle, uint64_t from) {
+    uint32_t *prefix = malloc((from ? from : 1) * sizeof(*prefix));
+    uint32_t *sorted = malloc((from ? from : 1) * sizeof(*sorted));
+    if (!prefix || !sorted) {
+        perror("[shuffle] Error when calling malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t position = 0; position < from; ++position) prefix[position] = shuffle_at(shuffle, position);
+    memcpy(sorted, prefix, from * sizeof(*sorted));
+    qsort(sorted, from, sizeof(*sorted), compare_slots);
+    free(shuffle->prefix);
+    free(shuffle->prefix_sorted);
+    shuffle->prefix = prefix;
+    shuffle->prefix_sorted = sorted;
+    shuffle->prefix_len = from;
+
+    shuffle->segment_count = 0;
+    if (from == shuffle->length) return;
+    struct shuffle_segment *segment = push_segment(shuffle);
+    segment->start = from;
+    segment->length = shuffle->length - from;
+    segment->skips_prefix = true;
+}
+
+void
+shuffle_add(struct shuffle *shuffle, uint64_t from, uint32_t first_slot, size_t count, bool next) {
+    if (!count) return;
+    if (from > shuffle->length) from = shuffle->length;
+    struct shuffle_segment *top = shuffle->segment_count ? &shuffle->segments[shuffle->segment_count - 1] : NULL;
+    if (!next && top && !top->fixed && top->start == from && top->inherited_from == from &&
+        top->first_slot + (top->length - top->inherited) == first_slot) {
+        // Nothing was played since the last tracks were added here, so they can share a segment. Otherwise every
+        // load would add a step to looking up the positions after it.
+        top->length += count;
+        top->key = next_key(shuffle);
+        shuffle->length += count;
+        return;
+    }
+    if (shuffle->segment_count + 2 > SHUFFLE_MAX_SEGMENTS) collapse(shuffle, from);
+    uint32_t base = shuffle->segment_count;
+    uint64_t rest = shuffle->length - from;
+    uint64_t start = from;
+    if (next) {
+        struct shuffle_segment *segment = push_segment(shuffle);
+        segment->start = start++;
+        segment->length = 1;
+        segment->base = base;
+        segment->first_slot = first_slot++;
+        segment->fixed = true;
+        count--;
+    }
+    if (count || rest) {
+        struct shuffle_segment *segment = push_segment(shuffle);
+        segment->start = start;
+        segment->length = rest + count;
+        segment->inherited = rest;
+        segment->inherited_from = from;
+        segment->base = base;
+        segment->first_slot = first_slot;
+    }
+    shuffle->length = start + rest + count;
+}
+
+uint64_t
+shuffle_length(const struct shuffle *shuffle) {
+    return shuffle->length;
+}
+
+// The slot at index of the ones which aren't in the prefix
+static uint32_t
+skip_prefix(const struct shuffle *shuffle, uint64_t index) {
+    // Every slot in the prefix which comes before it moves it up by one, and those are the sorted[j] with
+    // sorted[j] - j <= index
+    uint64_t lo = 0, hi = shuffle->prefix_len;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (shuffle->prefix_sorted[mid] - mid <= index) lo = mid + 1;
+        else hi = mid;
+    }
+    return (uint32_t) (index + lo);
+}
+
+uint32_t
+shuffle_at(const struct shuffle *shuffle, uint64_t position) {
+    if (position >= shuffle->length) return SHUFFLE_NONE;
+    uint32_t limit = shuffle->segment_count;
+    for (;;) {
+        // The segment which decided the position last in the order made of the segments below limit
+        uint32_t k = limit;
+        while (k > 0 && shuffle->segments[k - 1].start > position) k--;
+        if (!k) return position < shuffle->prefix_len ? shuffle->prefix[position] : SHUFFLE_NONE;
+        const struct shuffle_segment *segment = &shuffle->segments[k - 1];
+        uint64_t i = permute(position - segment->start, segment->length, segment->key);
+        if (i < segment->inherited) {
+            position = segment->inherited_from + i;
+            limit = segment->base;
+            continue;
+        }
+        if (segment->skips_prefix) return skip_prefix(shuffle, i);
+        uint64_t slot = segment->first_slot + (i - segment->inherited);
+        if (segment->hole != SHUFFLE_NONE && slot >= segment->hole) slot++;
+        return (uint32_t) slot;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef SMP_SHUFFLE_H
+#define SMP_SHUFFLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SHUFFLE_NONE UINT32_MAX
+#define SHUFFLE_MAX_SEGMENTS 32
+
+/*
+ * Shuffled play order over the slots of spotify->tracks (see queue.h) which is computed on demand instead of stored.
+ * The order is made of segments, each of which is a keyed Feistel permutation over a range of positions, so finding
+ * the slot at a position takes a few hashes and memory only grows with the number of times tracks were added.
+ *
+ * When tracks are added, a new segment covering every position after the ones already played is started, which
+ * permutes the positions the previous segments had there together with the new slots. Positions which were already
+ * played keep their slots, so the order can still be walked backwards. Looking up a position takes a step for every
+ * segment it was inherited through, which stays low because a segment only inherits the tracks which hadn't been
+ * played yet, and loads which follow each other without anything being played in between share one.
+ *
+ * Finding the segment of a position still scans them, so once there are SHUFFLE_MAX_SEGMENTS they are collapsed: the
+ * slots of the played positions are stored in a table and a single new segment permutes all the other slots. That
+ * takes 8 bytes per played position and requires the slots to be added in ascending order without gaps, like the
+ * queue hands them out.
+ */
+struct shuffle {
+    struct shuffle_segment {
+        uint64_t start; // First position covered, the segment covers every position after it as well
+        uint64_t length;
+        uint64_t key;
+        uint64_t inherited; // The first permuted indices are positions of the order as it was before this segment
+        uint64_t inherited_from; // Position of the first of those
+        uint32_t base; // Number of segments making up the order before this segment
+        uint32_t first_slot; // The other indices are the slots from first_slot on
+        uint32_t hole; // Slot which is left out of those, SHUFFLE_NONE if none
+        bool fixed; // Holds a single slot which was put at its position on purpose
+        bool skips_prefix; // Its slots are the ones which aren't in the prefix
+    } *segments;
+    uint32_t segment_count;
+    uint32_t segment_size;
+    uint32_t *prefix; // Slots of the positions before the first segment since the segments were last collapsed
+    uint32_t *prefix_sorted; // The same slots in ascending order
+    uint64_t prefix_len;
+    uint64_t length;
+    uint64_t seed;
+};
+
+void shuffle_free(struct shuffle *shuffle);
+
+void shuffle_reset(struct shuffle *shuffle);
+
+/*
+ * Starts a new order of the slots below slot_count. If first isn't SHUFFLE_NONE it is put at position 0 and the rest
+ * follow in random order.
+ */
+void shuffle_start(struct shuffle *shuffle, uint32_t first, size_t slot_count);
+
+/*
+ * Adds count slots starting at first_slot at random positions from position from on, mixed with the ones which were
+ * already there. If next is set, first_slot is put at position from instead. from is clamped to the length.
+ */
+void shuffle_add(struct shuffle *shuffle, uint64_t from, uint32_t first_slot, size_t count, bool next);
+
+uint64_t shuffle_length(const struct shuffle *shuffle);
+
+// Returns the slot at position, or SHUFFLE_NONE if position is past the end
+uint32_t shuffle_at(const struct shuffle *shuffle, uint64_t position);
+
+#endif //SMP_SHUFFLE_H
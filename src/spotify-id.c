@@ -0,0 +1,45 @@
+#include "spotify-id.h"
+
+static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+static int
+digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'Z') return c - 'A' + 36;
+    return -1;
+}
+
+// The number is handled as four 32-bit limbs, least significant first, since not every target has 128-bit integers
+bool
+spotify_id_parse(const char *text, SpotifyId *id) {
+    uint64_t limbs[4] = {0};
+    for (int i = 0; i < SPOTIFY_ID_LEN; ++i) {
+        int value = digit_value(text[i]);
+        if (value < 0) return false;
+        uint64_t carry = (uint64_t) value;
+        for (int j = 0; j < 4; ++j) {
+            uint64_t v = limbs[j] * 62 + carry;
+            limbs[j] = v & 0xffffffff;
+            carry = v >> 32;
+        }
+        if (carry) return false; // Larger than 128 bits
+    }
+    id->lo = limbs[0] | (limbs[1] << 32);
+    id->hi = limbs[2] | (limbs[3] << 32);
+    return true;
+}
+
+void
+spotify_id_format(SpotifyId id, char text[SPOTIFY_ID_LEN]) {
+    uint64_t limbs[4] = {id.lo & 0xffffffff, id.lo >> 32, id.hi & 0xffffffff, id.hi >> 32};
+    for (int i = SPOTIFY_ID_LEN - 1; i >= 0; --i) {
+        uint64_t rem = 0;
+        for (int j = 3; j >= 0; --j) {
+            uint64_t v = (rem << 32) | limbs[j];
+            limbs[j] = v / 62;
+            rem = v % 62;
+        }
+        text[i] = digits[rem];
+    }
+}
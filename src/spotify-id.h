@@ -0,0 +1,36 @@
+#ifndef SMP_SPOTIFY_ID_H
+#define SMP_SPOTIFY_ID_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SPOTIFY_ID_LEN 22
+#define SPOTIFY_ID_LEN_NULL (SPOTIFY_ID_LEN+1)
+
+/*
+ * A spotify id decoded from its 22 base62 digits into the 128-bit number they spell, so ids are compared and hashed as
+ * two integers. The text form is only made where it leaves the process: cache file names and records, backend
+ * requests and D-Bus. Zero is never a valid id and stands for a missing one.
+ */
+typedef struct SpotifyId {
+    uint64_t hi;
+    uint64_t lo;
+} SpotifyId;
+
+// Decodes the first SPOTIFY_ID_LEN characters of text. Returns false if they aren't an id.
+bool spotify_id_parse(const char *text, SpotifyId *id);
+
+// Writes the SPOTIFY_ID_LEN digits of id to text, which isn't null terminated
+void spotify_id_format(SpotifyId id, char text[SPOTIFY_ID_LEN]);
+
+static inline bool
+spotify_id_equal(SpotifyId a, SpotifyId b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+static inline bool
+spotify_id_none(SpotifyId id) {
+    return !id.hi && !id.lo;
+}
+
+#endif //SMP_SPOTIFY_ID_H
@@ -8,12 +8,30 @@
 #include "../lib/cjson/cJSON.h"
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include "config.h"
 #include "audio.h"
 #include "ctrl.h"
+#include "playlist-index.h"
+#include "history.h"
+#include "track-cache.h"
+#include "meta-cache.h"
+#include "idmap.h"
+#include "negative-cache.h"
+#include "response-cache.h"
+#include "local-search.h"
+#include "local-recommend.h"
+
+#define REFRESH_DELAY_SEC 10 // Stale entries are refreshed once the track started from them is under way
+/*
+ * Vorbis streams without a nominal bitrate report it as -1 or 0, which ends up as a huge or zero size_t. Real streams
+ * stay well under 1 Mbit/s, so anything from this up is treated as unset.
+ */
+#define MAX_NOMINAL_BITRATE 10000000
 
 struct json_track_parse_params {
     Track **tracks;
@@ -21,17 +39,67 @@ struct json_track_parse_params {
     size_t *track_len;
 };
 
+// A request which is answered from the cache if possible
+struct cached_request {
+    struct spotify_state *spotify;
+    char *payload;
+    size_t payload_len;
+    struct cache_file cache;
+    json_parse_func func;
+    json_parse_func meta_func; // Parses the binary copy of the cached JSON, NULL if there is none
+    void *userp;
+    info_received_cb func1;
+    void *userp1;
+    info_received_cb read_local_cb;
+};
+
+// A track which is being read from the cache to be played
+struct local_read {
+    struct spotify_state *spotify;
+    struct buffer *buf;
+    struct connection **conn_out;
+    uint64_t generation;
+    Track track; // Only what is needed to download the track instead
+};
+
+// A cached playlist or album which was served while stale and is fetched again in the background
+struct refresh {
+    struct spotify_state *spotify;
+    char payload[SPOTIFY_ID_LEN + 1];
+    struct cache_file cache;
+    uint32_t source_crc;
+};
+
+// A response from the response cache, which is handed to its parse function on the next loop iteration
+struct cached_response {
+    struct spotify_state *spotify;
+    char *data;
+    size_t len;
+    json_parse_func func;
+    void *userp;
+    info_received_cb func1;
+    void *userp1;
+};
+
+struct download_done {
+    struct spotify_state *spotify;
+    info_received_cb cb;
+    void *userp;
+};
+
+// Search results from the local index, which are passed on in the next loop iteration like a response would be
+struct local_answer {
+    struct spotify_state *spotify;
+    info_received_cb cb;
+    void *userp;
+};
+
 struct backend_sort {
     struct backend_instance *inst;
     uint32_t score;
     char *fmatch;
 };
 
-struct ArtistQuantity {
-    char id[23];
-    size_t appearances;
-};
-
 bool
 contains_regions(char *regions, size_t region_count, char *region) {
     if (!region_count || !regions) return true;
@@ -45,11 +113,6 @@ contains_regions(char *regions, size_t region_count, char *region) {
     return false;
 }
 
-static int
-compare_artist_quantities(const void *a, const void *b) {
-    return (int) (((struct ArtistQuantity *) b)->appearances - ((struct ArtistQuantity *) a)->appearances);
-}
-
 static int
 backend_sort_comprar(const void *a, const void *b) {
     return (int) (((struct backend_sort *) a)->score - ((struct backend_sort *) b)->score);
@@ -58,6 +121,12 @@ backend_sort_comprar(const void *a, const void *b) {
 int
 parse_playlist_info(const char *data, size_t len, PlaylistInfo *playlist);
 
+int
+parse_album_json(const char *data, size_t len, void *userp);
+
+int
+parse_playlist_json(const char *data, size_t len, void *userp);
+
 void
 generic_read_cb(struct bufferevent *bev, void *arg);
 
@@ -65,19 +134,14 @@ void
 free_tracks(Track *track, size_t count) {
     if (!track || !count) return;
     for (int i = 0; i < count; ++i) {
-        free(track[i].spotify_name);
-        free(track[i].spotify_album_art);
-        free(track[i].artist);
+        if (track[i].info) arena_release(track[i].info->arena);
     }
     memset(track, 0, sizeof(*track) * count);
 }
 
 void
 free_track(Track *track) {
-    free(track->spotify_name);
-    free(track->spotify_album_art);
-    free(track->artist);
-    free(track->regions);
+    if (track->info) arena_release(track->info->arena);
     if (track->playlist) {
         if (--track->playlist->reference_count == 0) {
             free(track->playlist->name);
@@ -90,13 +154,24 @@ free_track(Track *track) {
 
 void
 clear_tracks(Track *tracks, size_t *track_len, size_t *track_size) {
-    *track_size = 0;
-    if (!tracks || !track_len) {
-        *track_len = 0;
-        return;
-    }
+    for (size_t i = 0; tracks && i < *track_len; ++i) free_track(&tracks[i]);
     *track_len = 0;
-    for (size_t i = 0; i < *track_len; ++i) free_track(&tracks[i]);
+    *track_size = 0;
+}
+
+TrackInfo *
+new_track_info(Track *track, struct arena *arena) {
+    track->info = arena_zalloc(arena, sizeof(*track->info));
+    track->info->arena = arena_ref(arena);
+    return track->info;
+}
+
+void
+spotify_track_uri(SpotifyId id, char uri[SPOTIFY_URI_LEN_NULL]) {
+    static const char prefix[] = "spotify:track:";
+    memcpy(uri, prefix, sizeof(prefix) - 1);
+    spotify_id_format(id, &uri[sizeof(prefix) - 1]);
+    uri[SPOTIFY_URI_LEN] = 0;
 }
 
 void
@@ -118,99 +193,63 @@ free_artist(Artist *artist) {
     free(artist->name);
 }
 
+void
+free_search_results(struct spotify_search_results *results) {
+    free_tracks(results->tracks, results->track_len);
+    free(results->tracks);
+    for (int i = 0; i < results->playlist_len; ++i) {
+        free_playlist(&results->playlists[i]);
+    }
+    free(results->playlists);
+    for (int i = 0; i < results->album_len; ++i) {
+        free_playlist(&results->albums[i]);
+    }
+    free(results->albums);
+    for (int i = 0; i < results->artist_len; ++i) {
+        free_artist(&results->artists[i]);
+    }
+    free(results->artists);
+    free(results);
+}
+
 void
 free_connection(struct connection *conn) {
     free(conn->payload);
     conn->payload = NULL;
     conn->payload_len = 0;
-    free(conn->cache_path);
-    conn->cache_path = NULL;
-    if (conn->cache_fp) {
-        fclose(conn->cache_fp);
-        conn->cache_fp = NULL;
-    }
+    conn->cache_file.dir = CACHE_DIR_NONE;
+    track_writer_finish(&conn->cache_writer, conn->expecting && conn->progress == conn->expecting, NULL, NULL);
     conn->busy = false;
     conn->retries = 0;
     conn->expecting = conn->progress = 0;
     conn->error_type = ET_NO_ERROR;
 }
 
-void
-track_filepath_id(const char id[SPOTIFY_ID_LEN], char **out) {
-    (*out) = malloc((track_save_path_len + SPOTIFY_ID_LEN + 4 + 1) * sizeof(char));
-    snprintf((*out), track_save_path_len + SPOTIFY_ID_LEN + 4 + 1, "%s%.22s.ogg", track_save_path,
-             id);
-}
-
-void
-track_info_filepath_id(const char id[SPOTIFY_ID_LEN], char **out) {
-    (*out) = malloc((track_info_path_len + SPOTIFY_ID_LEN + 5 + 1) * sizeof(char));
-    snprintf((*out), track_info_path_len + SPOTIFY_ID_LEN + 5 + 1, "%s%.22s.json", track_info_path,
-             id);
-}
-
-void
-album_info_filepath_id(const char id[SPOTIFY_ID_LEN], char **out) {
-    (*out) = malloc((album_info_path_len + SPOTIFY_ID_LEN + 5 + 1) * sizeof(char));
-    snprintf((*out), album_info_path_len + SPOTIFY_ID_LEN + 5 + 1, "%s%.22s.json", album_info_path,
-             id);
-}
-
-void
-playlist_info_filepath_id(const char id[SPOTIFY_ID_LEN], char **out) {
-    (*out) = malloc((playlist_info_path_len + SPOTIFY_ID_LEN + 5 + 1) * sizeof(char));
-    snprintf((*out), playlist_info_path_len + SPOTIFY_ID_LEN + 5 + 1, "%s%.22s.json", playlist_info_path,
-             id);
-}
-
 size_t
-get_saved_playlist_from_dir_count(const char *dir) {
+get_saved_playlist_from_dir_count(enum cache_dir dir) {
     size_t count = 0;
-    DIR *dirp = opendir(dir);
-    if (!dirp) {
-        fprintf(stderr, "[spotify] Error when opening playlist directory '%s': %s\n", dir,
-                strerror(errno));
-        return 0;
-    }
-
-    errno = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dirp))) {
-        count += (1 - (entry->d_name[0] == '.'));
-    }
-    if (errno) {
-        fprintf(stderr, "[spotify] Error while counting playlists in directory '%s': %s\n", dir,
-                strerror(errno));
-    }
-    closedir(dirp);
+    struct cache_dir_iter it;
+    char id[SPOTIFY_ID_LEN];
+    cache_dir_iter_begin(dir, &it);
+    while (cache_dir_iter_next(&it, id, NULL)) count++;
+    cache_dir_iter_end(&it);
     return count;
 }
 
 size_t
 get_saved_playlist_count() {
-    return get_saved_playlist_from_dir_count(playlist_info_path) + get_saved_playlist_from_dir_count(album_info_path);
+    return get_saved_playlist_from_dir_count(CACHE_DIR_PLAYLIST_INFO) +
+           get_saved_playlist_from_dir_count(CACHE_DIR_ALBUM_INFO);
 }
 
 int
-get_all_playlists_from_dir(PlaylistInfo *playlistInfo, size_t count, const char *dir) {
-    DIR *dirp = opendir(dir);
-    if (!dirp) {
-        fprintf(stderr, "[spotify] Error when opening playlist directory '%s': %s\n", dir,
-                strerror(errno));
-        return 1;
-    }
-    size_t dir_len = strlen(dir);
-    char *name = calloc(PLAYLIST_NAME_LEN_NULL + dir_len + 5, sizeof(*name));
-    memcpy(name, dir, dir_len);
-
-    errno = 0;
+get_all_playlists_from_dir(PlaylistInfo *playlistInfo, size_t count, enum cache_dir dir) {
+    struct cache_dir_iter it;
+    char id[SPOTIFY_ID_LEN];
     size_t i = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dirp)) && i < count) {
-        if (entry->d_name[0] == '.')continue;
-        memcpy(name + dir_len, entry->d_name, PLAYLIST_NAME_LEN_NULL + 5); // +5 for .json extension
-
-        FILE *fp = fopen(name, "r");
+    cache_dir_iter_begin(dir, &it);
+    while (i < count && cache_dir_iter_next(&it, id, NULL)) {
+        FILE *fp = cache_fopen(dir, id, "r");
         if (!fp)continue;
         fseek(fp, 0L, SEEK_END);
         size_t len = ftell(fp);
@@ -220,26 +259,20 @@ get_all_playlists_from_dir(PlaylistInfo *playlistInfo, size_t count, const char
         fclose(fp);
         parse_playlist_info(buf, len, &playlistInfo[i++]);
     }
-    free(name);
-    if (errno) {
-        fprintf(stderr, "[spotify] Error while counting playlists in directory '%s': %s\n", dir,
-                strerror(errno));
-        return 1;
-    }
-    closedir(dirp);
+    cache_dir_iter_end(&it);
     return 0;
 }
 
 int
 get_all_playlist_info(PlaylistInfo **playlistInfo, size_t *countOut) {
-    size_t album_count = get_saved_playlist_from_dir_count(album_info_path);
-    size_t playlist_count = get_saved_playlist_from_dir_count(playlist_info_path);
+    size_t album_count = get_saved_playlist_from_dir_count(CACHE_DIR_ALBUM_INFO);
+    size_t playlist_count = get_saved_playlist_from_dir_count(CACHE_DIR_PLAYLIST_INFO);
 
     *playlistInfo = calloc(album_count + playlist_count, sizeof(**playlistInfo));
     *countOut = album_count + playlist_count;
 
-    return get_all_playlists_from_dir(*playlistInfo, album_count, album_info_path) +
-           get_all_playlists_from_dir(&(*playlistInfo)[album_count], playlist_count, playlist_info_path);
+    return get_all_playlists_from_dir(*playlistInfo, album_count, CACHE_DIR_ALBUM_INFO) +
+           get_all_playlists_from_dir(&(*playlistInfo)[album_count], playlist_count, CACHE_DIR_PLAYLIST_INFO);
 }
 
 #define ERROR_ENTRY(x) [x]=#x
@@ -252,6 +285,54 @@ static const char *err_c[] = {
         ERROR_ENTRY(ET_FULL),
 };
 
+static bool
+response_cacheable(const char *payload) {
+    return payload[0] == SEARCH || payload[0] == RECOMMENDATIONS;
+}
+
+static void
+cached_response_cb(evutil_socket_t fd, short what, void *arg) {
+    struct cached_response *res = arg;
+    if (res->func(res->data, res->len, res->userp) == 0 && res->func1) res->func1(res->spotify, res->userp1);
+    free(res->data);
+    free(res);
+}
+
+// Takes ownership of data. Callers expect the parse function to run later, like it would for a request.
+static int
+answer_from_cache(struct spotify_state *spotify, char *data, size_t len, json_parse_func func, void *userp,
+                  info_received_cb func1, void *userp1) {
+    struct cached_response *res = malloc(sizeof(*res));
+    res->spotify = spotify;
+    res->data = data;
+    res->len = len;
+    res->func = func;
+    res->userp = userp;
+    res->func1 = func1;
+    res->userp1 = userp1;
+    if (event_base_once(spotify->base, -1, EV_TIMEOUT, cached_response_cb, res, NULL)) {
+        free(data);
+        free(res);
+        return -1;
+    }
+    return 0;
+}
+
+// Answers a request which failed with an expired cached response, if there is one
+static bool
+answer_from_stale(struct connection *conn) {
+    if (!conn->payload || !response_cacheable(conn->payload) || !conn->params.func) return false;
+    size_t len;
+    char *data = response_cache_get(conn->payload, conn->payload_len, true, &len, NULL);
+    if (!data) return false;
+    fprintf(stderr, "[spotify] Backend unavailable, using an older cached response\n");
+    answer_from_cache(conn->spotify, data, len, conn->params.func, conn->params.func_userp, conn->params.func1,
+                      conn->params.func1_userp);
+    conn->params.func = NULL;
+    conn->params.func1 = NULL;
+    return true;
+}
+
 void
 spotify_reconnect(struct connection *conn);
 
@@ -267,7 +348,8 @@ void spotify_bufferevent_cb(struct bufferevent *bev, short what, void *ctx) {
         } else {
             if (conn->retries >= 3) {
                 fprintf(stderr, "[spotify] Error occurred on connection. Closing because failed after 3 retries.\n");
-                if (conn->spotify->err_cb) conn->spotify->err_cb(conn, conn->spotify->err_userp);
+                if (!answer_from_stale(conn) && conn->spotify->err_cb)
+                    conn->spotify->err_cb(conn, conn->spotify->err_userp);
                 conn->inst->disabled = true;
             } else {
                 printf("[spotify] Error occurred on connection. Closing because was idle.\n");
@@ -380,6 +462,17 @@ spotify_reconnect(struct connection *conn) {
     }
 }
 
+// Remembers the track of a request which the backend rejected, so that it isn't requested again right away
+static void
+remember_rejected(struct connection *conn) {
+    SpotifyId id;
+    if (!conn->payload || conn->payload_len < SPOTIFY_ID_LEN + 1 || !spotify_id_parse(&conn->payload[1], &id)) return;
+    if (conn->payload[0] == MUSIC_DATA && conn->payload_len >= SPOTIFY_ID_LEN + 3)
+        negative_cache_add(id, &conn->payload[SPOTIFY_ID_LEN + 1], NEGATIVE_FAILED);
+    else if (conn->payload[0] == MUSIC_INFO)
+        negative_cache_add(id, NEGATIVE_ANY_REGION, NEGATIVE_FAILED);
+}
+
 void
 generic_read_cb(struct bufferevent *bev, void *arg) {
     struct connection *conn = (struct connection *) arg;
@@ -399,21 +492,20 @@ generic_read_cb(struct bufferevent *bev, void *arg) {
                     fprintf(stderr, "[spotify] Received unknown error code, closing connection (possibly data corruption)\n");
                     conn->error_buffer = NULL;
                     conn->error_type = -1;
-                    if (conn->spotify->err_cb) conn->spotify->err_cb(conn, conn->spotify->err_userp);
+                    if (!answer_from_stale(conn) && conn->spotify->err_cb)
+                        conn->spotify->err_cb(conn, conn->spotify->err_userp);
                     free_connection(conn);
                     conn->busy = false;
                     return;
             }
             conn->error_buffer = calloc(conn->expecting + 1, sizeof(*conn->error_buffer));
-            free(conn->cache_path);
-            conn->cache_path = NULL; // Not caching errors
+            conn->cache_file.dir = CACHE_DIR_NONE; // Not caching errors
         } else {
             conn->error_buffer = NULL;
-            if (conn->cache_path) {
-                conn->cache_fp = fopen(conn->cache_path, "w");
-                fwrite(&conn->expecting, sizeof(conn->expecting), 1, conn->cache_fp);
-            } else {
-                conn->cache_fp = NULL;
+            if (conn->cache_file.dir == CACHE_DIR_TRACKS &&
+                track_writer_begin(&conn->cache_writer, conn->cache_file.id, conn->expecting)) {
+                fprintf(stderr, "[spotify] Error when trying to cache track %.22s: %s\n", conn->cache_file.id,
+                        strerror(errno));
             }
         }
         conn->error_type = data[0];
@@ -428,7 +520,9 @@ generic_read_cb(struct bufferevent *bev, void *arg) {
             free(conn->error_buffer);
             conn->error_buffer = NULL;
             if (conn->error_type == ET_SPOTIFY || conn->retries > 3) {
-                if (conn->spotify->err_cb) conn->spotify->err_cb(conn, conn->spotify->err_userp);
+                if (conn->error_type == ET_SPOTIFY) remember_rejected(conn);
+                if (!answer_from_stale(conn) && conn->spotify->err_cb)
+                    conn->spotify->err_cb(conn, conn->spotify->err_userp);
                 free_connection(conn);
                 conn->busy = false;
                 return; // ET_SPOTIFY means an error with the query (invalid track id, etc.) so reconnecting won't help
@@ -441,9 +535,9 @@ generic_read_cb(struct bufferevent *bev, void *arg) {
             bufferevent_setcb(conn->bev, generic_read_cb, NULL, spotify_bufferevent_cb, conn);
         }
     } else {
-        if (conn->cache_fp) {
+        if (conn->cache_writer.open) {
             uint8_t *data = evbuffer_pullup(input, -1);
-            fwrite(data, 1, evbuffer_get_length(input), conn->cache_fp);
+            track_writer_write(&conn->cache_writer, data, evbuffer_get_length(input));
         }
         if (conn->cb) conn->cb(bev, conn, conn->cb_arg);
         if (conn->expecting == conn->progress) {
@@ -461,20 +555,15 @@ generic_proxy_cb(struct bufferevent *bev, struct connection *conn, void *arg) {
         char buf[conn->progress];
         evbuffer_remove(input, buf, conn->progress);
 
-        if (params->path) {
-            FILE *fp = fopen(params->path, "w");
-            if (fp) {
-                fwrite(buf, 1, conn->progress, fp);
-                fclose(fp);
-            } else {
-                fprintf(stderr, "[spotify] Error when trying to open/create cache file '%s': %s\n", params->path,
-                        strerror(errno));
-            }
-            free(params->path);
-            params->path = NULL;
+        if (params->cache.dir != CACHE_DIR_NONE) {
+            char *copy = malloc(conn->progress);
+            memcpy(copy, buf, conn->progress);
+            cache_write_async(params->cache.dir, params->cache.id, copy, conn->progress);
+            params->cache.dir = CACHE_DIR_NONE;
         }
 
-        params->func(buf, conn->progress, params->func_userp);
+        if (params->func(buf, conn->progress, params->func_userp) == 0 && response_cacheable(conn->payload))
+            response_cache_put(conn->payload, conn->payload_len, buf, conn->progress);
         printf("[spotify] Parsed JSON info\n");
         if (params->func1) params->func1(conn->spotify, params->func1_userp);
     }
@@ -493,10 +582,7 @@ make_and_parse_generic_request_with_conn(struct connection *conn, char *payload,
     conn->progress = 0;
     conn->expecting = 0;
     conn->busy = true;
-    if (conn->cache_path) {
-        free(conn->cache_path);
-        conn->cache_path = NULL;
-    }
+    conn->cache_file.dir = CACHE_DIR_NONE;
     conn->cb = generic_proxy_cb;
     conn->cb_arg = &conn->params;
 
@@ -510,43 +596,290 @@ make_and_parse_generic_request_with_conn(struct connection *conn, char *payload,
     return 0;
 }
 
-int
-make_and_parse_generic_request(struct spotify_state *spotify, char *payload, size_t payload_len, char *cache_path,
-                               json_parse_func func, void *userp, info_received_cb func1, void *userp1,
-                               info_received_cb read_local_cb) {
-    //Try to read from file
-    if (cache_path) {
-        FILE *fp = fopen(cache_path, "r");
-        if (!fp) goto remote;
-        fseek(fp, 0L, SEEK_END);
-        size_t file_len = ftell(fp);
-        rewind(fp);
-        char file_buf[file_len + 1];
-        size_t read = fread(file_buf, 1, file_len, fp);
-        fclose(fp);
-        if (read != file_len) goto remote;
-        file_buf[file_len] = 0;
-        int ret;
-        if ((ret = func(file_buf, file_len + 1, userp)) != 0) return ret;
-        if (read_local_cb) read_local_cb(spotify, userp1);
-        else if (func1) func1(spotify, userp1);
-        return ret;
-    }
-    //Make request and download data otherwise
-    remote:
-    {
-        struct connection *conn = spotify_connect(spotify);
-        if (!conn) return -1;
-
-        if (cache_path) {
-            conn->params.path = calloc(strlen(cache_path) + 1, sizeof(*cache_path));
-            strncpy(conn->params.path, cache_path, strlen(cache_path) + 1);
-        } else {
-            conn->params.path = NULL;
+// Parse function of searches which were superseded while their response was already arriving
+static int
+discard_search_json(const char *data, size_t len, void *userp) {
+    free(userp);
+    return 0; // The response is still worth caching
+}
+
+// Closes superseded searches which are still receiving their response, to make room for a newer one
+static struct connection *
+reclaim_search_connection(struct spotify_state *spotify) {
+    for (size_t i = 0; i < spotify->connections_len; ++i) {
+        struct connection *conn = &spotify->connections[i];
+        if (!conn->busy || conn->params.func != discard_search_json) continue;
+        free(conn->params.func_userp);
+        free_connection(conn);
+        bufferevent_free(conn->bev);
+        conn->bev = NULL;
+        printf("[spotify] Closing superseded search for a newer one\n");
+        return spotify_connect(spotify);
+    }
+    return NULL;
+}
+
+static int
+make_remote_request(struct spotify_state *spotify, char *payload, size_t payload_len, const struct cache_file *cache,
+                    json_parse_func func, void *userp, info_received_cb func1, void *userp1,
+                    struct connection **conn_out) {
+    SpotifyId id;
+    if (payload[0] == MUSIC_INFO && spotify_id_parse(&payload[1], &id) && negative_cache_has(id, NEGATIVE_ANY_REGION)) {
+        fprintf(stderr, "[spotify] Not requesting info of '%.22s', it was unavailable recently\n", &payload[1]);
+        return -1;
+    }
+    struct connection *conn = spotify_connect(spotify);
+    if (!conn && payload[0] == SEARCH) conn = reclaim_search_connection(spotify);
+    if (!conn) return -1;
+
+    if (cache) conn->params.cache = *cache;
+    else conn->params.cache.dir = CACHE_DIR_NONE;
+    conn->spotify = spotify;
+    int ret = make_and_parse_generic_request_with_conn(conn, payload, payload_len, func, userp, func1, userp1);
+    if (!ret && conn_out) *conn_out = conn;
+    return ret;
+}
+
+static time_t
+cache_ttl(enum cache_dir dir) {
+    switch (dir) {
+        case CACHE_DIR_ALBUM_INFO:
+            return album_info_ttl;
+        case CACHE_DIR_PLAYLIST_INFO:
+            return playlist_info_ttl;
+        default:
+            return 0;
+    }
+}
+
+static void
+refresh_done(struct spotify_state *spotify, void *userp) {
+    free(userp);
+}
+
+// Appends the tracks of a refreshed playlist which aren't in the queue yet to the queue, frees all others
+static void
+merge_refreshed(struct spotify_state *spotify, Track *fresh, size_t count) {
+    if (!count) return;
+    PlaylistInfo *fresh_playlist = fresh[0].playlist;
+    uint32_t fresh_track_count = fresh_playlist->track_count;
+    PlaylistInfo *live = NULL;
+    for (size_t i = 0; i < spotify->track_count && !live; ++i) {
+        PlaylistInfo *playlist = spotify->tracks[i].playlist;
+        if (playlist && !strcmp(playlist->spotify_id, fresh_playlist->spotify_id)) live = playlist;
+    }
+    if (!live) { // No longer in the queue, only the cache needed updating
+        for (size_t i = 0; i < count; ++i) free_track(&fresh[i]);
+        return;
+    }
+
+    struct idmap queued;
+    idmap_init(&queued, spotify->track_count);
+    for (size_t i = 0; i < spotify->track_count; ++i) {
+        if (spotify->tracks[i].playlist == live) idmap_put(&queued, spotify->tracks[i].spotify_id, 0);
+    }
+    size_t added = 0;
+    for (size_t i = 0; i < count; ++i) {
+        // Tracks which were removed from the playlist stay in the queue, so that nothing disappears while playing
+        if (idmap_get(&queued, fresh[i].spotify_id, NULL)) {
+            free_track(&fresh[i]);
+            continue;
+        }
+        idmap_put(&queued, fresh[i].spotify_id, 0);
+        if (spotify->track_size <= spotify->track_count) {
+            Track *tmp = realloc(spotify->tracks, (spotify->track_size + count) * sizeof(*tmp));
+            if (!tmp) perror("[spotify] Error when calling realloc to expand track array");
+            spotify->tracks = tmp;
+            spotify->track_size += count;
+        }
+        Track *track = &spotify->tracks[spotify->track_count++];
+        *track = fresh[i];
+        track->playlist = live;
+        live->reference_count++;
+        added++;
+        if (--fresh_playlist->reference_count == 0) {
+            free(fresh_playlist->name);
+            free(fresh_playlist->image_url);
+            free(fresh_playlist);
+        }
+    }
+    idmap_free(&queued);
+    live->track_count = fresh_track_count;
+
+    printf("[spotify] Added %zu new tracks to the queue from '%s'\n", added, live->spotify_id);
+    if (added && spotify->tracks_added_cb) spotify->tracks_added_cb(spotify, spotify->tracks_added_userp);
+}
+
+static int
+refresh_parse(const char *data, size_t len, void *userp) {
+    struct refresh *refresh = userp;
+    if (meta_cache_hash_source(data, len) == refresh->source_crc) {
+        printf("[spotify] Cached info for '%.22s' is still up to date\n", refresh->cache.id);
+        cache_touch_async(refresh->cache.dir, refresh->cache.id);
+        cache_touch_async(meta_cache_dir(refresh->cache.dir), refresh->cache.id);
+        return 0;
+    }
+
+    Track *tracks = NULL;
+    size_t track_size = 0, track_len = 0;
+    struct json_track_parse_params *params = malloc(sizeof(*params));
+    params->tracks = &tracks;
+    params->track_size = &track_size;
+    params->track_len = &track_len;
+    int ret = refresh->cache.dir == CACHE_DIR_ALBUM_INFO ? parse_album_json(data, len, params)
+                                                         : parse_playlist_json(data, len, params);
+    if (ret) {
+        free(tracks);
+        return 1;
+    }
+    char *copy = malloc(len);
+    memcpy(copy, data, len);
+    cache_write_async(refresh->cache.dir, refresh->cache.id, copy, len);
+    merge_refreshed(refresh->spotify, tracks, track_len);
+    free(tracks);
+    return 0;
+}
+
+static void
+refresh_start(evutil_socket_t fd, short what, void *arg) {
+    struct refresh *refresh = arg;
+    if (make_remote_request(refresh->spotify, refresh->payload, sizeof(refresh->payload), NULL, refresh_parse,
+                            refresh, refresh_done, refresh, NULL)) {
+        fprintf(stderr, "[spotify] Error when refreshing '%.22s'\n", refresh->cache.id);
+        free(refresh);
+    }
+}
+
+/*
+ * Fetches an entry which was served from the cache again if it is older than the TTL of its type. This happens after a
+ * delay, so that it doesn't compete with starting playback, and the cached copy is only replaced if it changed.
+ */
+static void
+maybe_refresh(struct cached_request *req, time_t mtime, uint32_t source_crc) {
+    time_t ttl = cache_ttl(req->cache.dir);
+    if (!ttl || time(NULL) - mtime < ttl || req->payload_len != SPOTIFY_ID_LEN + 1) return;
+
+    printf("[spotify] Cached info for '%.22s' is stale, refreshing it in the background\n", req->cache.id);
+    struct refresh *refresh = malloc(sizeof(*refresh));
+    refresh->spotify = req->spotify;
+    memcpy(refresh->payload, req->payload, sizeof(refresh->payload));
+    refresh->cache = req->cache;
+    refresh->source_crc = source_crc;
+    struct timeval delay = {.tv_sec = REFRESH_DELAY_SEC};
+    if (event_base_once(req->spotify->base, -1, EV_TIMEOUT, refresh_start, refresh, &delay)) free(refresh);
+}
+
+static void
+cached_request_parsed(struct cached_request *req) {
+    if (req->read_local_cb) req->read_local_cb(req->spotify, req->userp1);
+    else if (req->func1) req->func1(req->spotify, req->userp1);
+}
+
+static void
+cached_request_read_cb(char *data, size_t len, time_t mtime, void *userp) {
+    struct cached_request *req = userp;
+    if (event_base_got_break(req->spotify->base)) {
+        free(req->payload);
+        free(req);
+        return; // Shutting down, nothing is waiting for the result anymore
+    }
+    if (data) {
+        // The parse functions free their parameters even when they fail, so the backend gets a copy
+        struct json_track_parse_params *params = malloc(sizeof(*params));
+        memcpy(params, req->userp, sizeof(*params));
+        if (req->func(data, len + 1, req->userp) == 0) {
+            free(params);
+            cached_request_parsed(req);
+            maybe_refresh(req, mtime, meta_cache_hash_source(data, len));
+            free(req->payload);
+            free(req);
+            return;
         }
-        conn->spotify = spotify;
-        return make_and_parse_generic_request_with_conn(conn, payload, payload_len, func, userp, func1, userp1);
-    };
+        fprintf(stderr, "[spotify] Cached info for '%.22s' is unreadable, requesting it again\n", req->cache.id);
+        cache_unlink_async(req->cache.dir, req->cache.id);
+        if (meta_cache_dir(req->cache.dir) != CACHE_DIR_NONE)
+            cache_unlink_async(meta_cache_dir(req->cache.dir), req->cache.id);
+        req->userp = params;
+    }
+    if (make_remote_request(req->spotify, req->payload, req->payload_len, &req->cache, req->func, req->userp,
+                            req->func1, req->userp1, NULL))
+        fprintf(stderr, "[spotify] Error when requesting '%.22s'\n", req->cache.id);
+    free(req->payload);
+    free(req);
+}
+
+static void
+cached_request_meta_cb(char *data, size_t len, time_t mtime, void *userp) {
+    struct cached_request *req = userp;
+    if (!event_base_got_break(req->spotify->base)) {
+        if (data && req->meta_func(data, len, req->userp) == 0) {
+            cached_request_parsed(req);
+            maybe_refresh(req, mtime, meta_cache_source(data));
+        } else { // Missing or outdated, the JSON is parsed instead and stores it again
+            cache_read_async(req->cache.dir, req->cache.id, cached_request_read_cb, req);
+            return;
+        }
+    }
+    free(req->payload);
+    free(req);
+}
+
+// Answers from the response cache if it has a fresh entry, otherwise asks the backend and falls back to a stale entry
+static int
+make_cacheable_request(struct spotify_state *spotify, char *payload, size_t payload_len, json_parse_func func,
+                       void *userp, info_received_cb func1, void *userp1, struct connection **conn_out) {
+    size_t len;
+    char *data = response_cache_get(payload, payload_len, false, &len, NULL);
+    if (data) return answer_from_cache(spotify, data, len, func, userp, func1, userp1);
+    if (!make_remote_request(spotify, payload, payload_len, NULL, func, userp, func1, userp1, conn_out)) return 0;
+    data = response_cache_get(payload, payload_len, true, &len, NULL);
+    if (!data) return -1;
+    fprintf(stderr, "[spotify] Backend unavailable, using an older cached response\n");
+    return answer_from_cache(spotify, data, len, func, userp, func1, userp1);
+}
+
+int
+make_and_parse_generic_request(struct spotify_state *spotify, char *payload, size_t payload_len,
+                               const struct cache_file *cache, json_parse_func func, json_parse_func meta_func,
+                               void *userp, info_received_cb func1, void *userp1, info_received_cb read_local_cb) {
+    if (!cache && response_cacheable(payload))
+        return make_cacheable_request(spotify, payload, payload_len, func, userp, func1, userp1, NULL);
+    if (!cache) return make_remote_request(spotify, payload, payload_len, NULL, func, userp, func1, userp1, NULL);
+
+    // Try to read from the cache first, the request is only made if that fails
+    struct cached_request *req = malloc(sizeof(*req));
+    req->spotify = spotify;
+    req->payload = malloc(payload_len);
+    memcpy(req->payload, payload, payload_len);
+    req->payload_len = payload_len;
+    req->cache = *cache;
+    req->func = func;
+    req->meta_func = meta_func;
+    req->userp = userp;
+    req->func1 = func1;
+    req->userp1 = userp1;
+    req->read_local_cb = read_local_cb;
+    enum cache_dir meta_dir = meta_func ? meta_cache_dir(cache->dir) : CACHE_DIR_NONE;
+    if (meta_dir != CACHE_DIR_NONE) cache_read_async(meta_dir, cache->id, cached_request_meta_cb, req);
+    else cache_read_async(cache->dir, cache->id, cached_request_read_cb, req);
+    return 0;
+}
+
+static void
+update_prebuffer(struct spotify_state *spotify, struct connection *conn) {
+    struct audio_context *audio_ctx = ctrl_get_audio_context(spotify->smp_ctx);
+    if (!audio_buffering(audio_ctx)) return;
+
+    double buffered = audio_get_buffered(audio_ctx);
+    size_t bitrate = audio_get_bitrate(audio_ctx);
+    double bytes_per_second;
+    if (bitrate > 0 && bitrate < MAX_NOMINAL_BITRATE) bytes_per_second = (double) bitrate / 8.0;
+    else bytes_per_second = buffered > 0 ? (double) conn->progress / buffered : 0; // No nominal bitrate in the stream
+
+    if (prebuffer_ready(&spotify->prebuffer, conn->progress, conn->expecting, buffered, bytes_per_second)) {
+        printf("[spotify] Buffered %.2f s of audio, starting playback\n", buffered);
+        audio_set_buffering(audio_ctx, false);
+    }
 }
 
 void
@@ -557,27 +890,70 @@ track_data_read_cb(struct bufferevent *bev, struct connection *conn, void *arg)
                        ctrl_get_audio_info(conn->spotify->smp_ctx), ctrl_get_audio_info_prev(conn->spotify->smp_ctx),
                        (audio_info_cb) audio_start, ctrl_get_audio_context(conn->spotify->smp_ctx))) { // Stream is over
         clean_vorbis_decode(&conn->spotify->decode_ctx);
+        audio_set_buffering(ctrl_get_audio_context(conn->spotify->smp_ctx), false);
         printf("[spotify] End of stream\n");
+    } else {
+        update_prebuffer(conn->spotify, conn);
     }
     if (conn->expecting == conn->progress) {
         printf("[spotify] All data received\n");
+        if (conn->spotify->stream_done_cb) conn->spotify->stream_done_cb(conn->spotify, conn->spotify->stream_done_userp);
     }
 }
 
+static void
+download_stored_cb(bool stored, void *userp) {
+    struct download_done *done = userp;
+    done->cb(done->spotify, done->userp);
+    free(done);
+}
+
+static void
+track_download_cb(struct bufferevent *bev, struct connection *conn, void *arg) {
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t len = evbuffer_get_length(input);
+    conn->progress += len;
+    evbuffer_drain(input, len); // Already written to the cache file by generic_read_cb
+    if (conn->expecting != conn->progress) return;
+
+    printf("[spotify] Finished downloading track in the background\n");
+    struct download_done *done = NULL;
+    if (conn->params.func1) {
+        done = malloc(sizeof(*done));
+        done->spotify = conn->spotify;
+        done->cb = conn->params.func1;
+        done->userp = conn->params.func1_userp;
+        conn->params.func1 = NULL;
+    }
+    // Nobody is notified before the track can be read back from the cache
+    track_writer_finish(&conn->cache_writer, true, done ? download_stored_cb : NULL, done);
+}
+
 int
 read_remote_track(struct spotify_state *spotify, const Track *track, struct buffer *buf,
                   struct connection **conn_out) {
+    const TrackInfo *info = track->info;
     struct connection *conn;
+    char id[SPOTIFY_ID_LEN];
+    spotify_id_format(track->spotify_id, id);
 
-    if (track->region_count > 0){
+    if (negative_cache_has(track->spotify_id, NEGATIVE_ANY_REGION)) {
+        fprintf(stderr, "[spotify] Not downloading '%.22s', it was unavailable recently\n", id);
+        return 1;
+    }
+    if (info->region_count > 0){
         // Choose best instance based on available regions
         struct backend_sort scores[backend_instance_count];
         memset(scores, 0, sizeof(scores));
         for (int i = 0; i < backend_instance_count; ++i) {
             uint32_t incl = 0;
             for (int j = 0; j < backend_instances[i].region_count; ++j) {
-                incl += contains_regions(track->regions, track->region_count, &backend_instances[i].regions[j * 2]);
-                if (!scores[i].fmatch) scores[i].fmatch = &backend_instances[i].regions[j * 2];
+                char *region = &backend_instances[i].regions[j * 2];
+                // Regions the track recently failed to download in count as not having it
+                bool usable = contains_regions(info->regions, info->region_count, region) &&
+                              !negative_cache_has(track->spotify_id, region);
+                incl += usable;
+                if (usable && !scores[i].fmatch) scores[i].fmatch = region;
             }
             scores[i].inst = &backend_instances[i];
             scores[i].score = (uint32_t) (((float) incl / (float) backend_instances[i].region_count) * 1000);
@@ -593,13 +969,13 @@ read_remote_track(struct spotify_state *spotify, const Track *track, struct buff
         }
         if (fzero == 0) {
             fprintf(stderr,
-                    "[spotify] No backends with support for any regions of track with id '%s'. Needed one of following regions: ",
-                    track->spotify_id);
-            for (int i = 0; i < track->region_count; ++i) {
-                if (i == track->region_count - 1)
-                    fprintf(stderr, "%.2s\n", &track->regions[i * 2]);
+                    "[spotify] No backends with support for any regions of track with id '%.22s'. Needed one of following regions: ",
+                    id);
+            for (int i = 0; i < info->region_count; ++i) {
+                if (i == info->region_count - 1)
+                    fprintf(stderr, "%.2s\n", &info->regions[i * 2]);
                 else
-                    fprintf(stderr, "%.2s,", &track->regions[i * 2]);
+                    fprintf(stderr, "%.2s,", &info->regions[i * 2]);
             }
             return 1;
         }
@@ -628,8 +1004,7 @@ read_remote_track(struct spotify_state *spotify, const Track *track, struct buff
 
 
     conn->payload[0] = MUSIC_DATA;
-    memcpy(&conn->payload[1], track->spotify_id,
-           22); // Payload stored for later in case of error if it has to be resent
+    memcpy(&conn->payload[1], id, SPOTIFY_ID_LEN); // Payload stored for later in case of error if it has to be resent
 
     conn->progress = 0;
     conn->expecting = 0;
@@ -638,40 +1013,25 @@ read_remote_track(struct spotify_state *spotify, const Track *track, struct buff
     if (buf) {
         conn->cb = track_data_read_cb;
         conn->cb_arg = buf;
+        prebuffer_begin(&spotify->prebuffer, 0);
+        audio_set_buffering(ctrl_get_audio_context(spotify->smp_ctx), true);
     } else {
-        conn->cb = NULL;
+        conn->cb = track_download_cb;
         conn->cb_arg = NULL;
     }
-    if (conn->cache_path) {
-        free(conn->cache_path);
-        conn->cache_path = NULL;
-    }
-    track_filepath_id(track->spotify_id, &conn->cache_path);
+    conn->params.func1 = NULL;
+    conn->params.func1_userp = NULL;
+    conn->cache_file.dir = CACHE_DIR_TRACKS;
+    memcpy(conn->cache_file.id, id, SPOTIFY_ID_LEN);
 
     if (bufferevent_write(conn->bev, conn->payload, conn->payload_len) != 0) return 1;
     bufferevent_setcb(conn->bev, generic_read_cb, NULL, spotify_bufferevent_cb, conn);
     return 0;
 }
 
-int
-read_local_track(struct spotify_state *spotify, const char id[SPOTIFY_ID_LEN], struct buffer *buf) {
-    char *path = NULL;
-    track_filepath_id(id, &path);
-    FILE *fp = fopen(path, "r");
-    free(path);
-    path = NULL;
-    if (!fp) return 1;
-    fseek(fp, 0L, SEEK_END);
-    size_t file_len = ftell(fp);
-    rewind(fp);
-
-    struct evbuffer *file_buf = evbuffer_new();
-    evbuffer_add_file(file_buf, fileno(fp), 0, -1);
-
-    size_t expected_len = 0;
-    evbuffer_remove(file_buf, &expected_len, sizeof(expected_len));
-    if (expected_len != file_len - sizeof(expected_len)) goto fail;
-
+static int
+decode_local_track(struct spotify_state *spotify, SpotifyId id, struct evbuffer *file_buf,
+                   struct buffer *buf) {
     size_t p = 0;
     int ret, fails = 0;
     while ((ret = decode_vorbis(file_buf, buf, &spotify->decode_ctx, &p, ctrl_get_audio_info(spotify->smp_ctx), ctrl_get_audio_info_prev(spotify->smp_ctx),
@@ -679,44 +1039,88 @@ read_local_track(struct spotify_state *spotify, const char id[SPOTIFY_ID_LEN], s
         if (ret >= 2) fails += ret - 1;
         if (fails >= 3 || ret == -1) goto fail;
     }
-    evbuffer_free(file_buf);
-    fclose(fp);
     printf("[spotify] Finished decoding the audio data\n");
     return 0;
 
 
     fail:
-    fclose(fp);
-    evbuffer_free(file_buf);
     clean_vorbis_decode(&spotify->decode_ctx);
     printf("[spotify] Encountered error while reading local file, fetching from remote.\n");
-    track_filepath_id(id, &path);
-    remove(path);
-    free(path);
-    path = NULL;
+    char text[SPOTIFY_ID_LEN];
+    spotify_id_format(id, text);
+    track_store_remove(text);
+    track_cache_remove(id);
     return 1;
 }
 
+static void
+local_track_read_cb(struct evbuffer *data, void *userp) {
+    struct local_read *read = userp;
+    struct spotify_state *spotify = read->spotify;
+    // Skip it if another track has been started in the meantime or the player is shutting down
+    if (read->generation != spotify->play_generation || event_base_got_break(spotify->base)) goto done;
+
+    if (data && !decode_local_track(spotify, read->track.spotify_id, data, read->buf)) {
+        audio_set_buffering(ctrl_get_audio_context(spotify->smp_ctx), false); // Decoded all at once
+        goto done;
+    }
+    if (read_remote_track(spotify, &read->track, read->buf, read->conn_out)) { // TODO: Handle audio corruption on remote track
+        char id[SPOTIFY_ID_LEN];
+        spotify_id_format(read->track.spotify_id, id);
+        fprintf(stderr, "[spotify] Error when trying to download track %.22s\n", id);
+        if (spotify->play_error_cb) spotify->play_error_cb(spotify, spotify->play_error_userp);
+    }
+
+    done:
+    arena_release(read->track.info->arena);
+    free(read);
+}
+
+void
+hold_playback(struct spotify_state *spotify) {
+    clean_vorbis_decode(&spotify->decode_ctx);
+    spotify->play_generation++;
+    audio_set_buffering(ctrl_get_audio_context(spotify->smp_ctx), true);
+}
+
 int
 play_track(struct spotify_state *spotify, const Track *track, struct buffer *buf, struct connection **conn_out) {
     if (!spotify || !track || !buf) return 0;
-    clean_vorbis_decode(&spotify->decode_ctx);
-    if (read_local_track(spotify, track->spotify_id, buf))
-        return read_remote_track(spotify, track, buf, conn_out); // TODO: Handle audio corruption on remote track
+    // Nothing can be played until the track has been read from the cache or the download has started
+    hold_playback(spotify);
+
+    struct local_read *read = calloc(1, sizeof(*read));
+    read->spotify = spotify;
+    read->buf = buf;
+    read->conn_out = conn_out;
+    read->generation = spotify->play_generation;
+    read->track.spotify_id = track->spotify_id;
+    // The info stays valid through the reference even if the queue is cleared in the meantime
+    read->track.info = track->info;
+    arena_ref(track->info->arena);
+    char id[SPOTIFY_ID_LEN];
+    spotify_id_format(track->spotify_id, id);
+    track_store_read(id, local_track_read_cb, read);
     return 0;
 }
 
+bool
+track_cached(SpotifyId id) {
+    char text[SPOTIFY_ID_LEN];
+    spotify_id_format(id, text);
+    return track_store_has(text);
+}
+
 int
-ensure_track(struct spotify_state *spotify, const Track *track, char *region, struct connection **conn_out) {
+ensure_track(struct spotify_state *spotify, const Track *track, info_received_cb cb, void *userp,
+             struct connection **conn_out) {
+    *conn_out = NULL;
     if (!spotify || !track) return 0;
-    char *path = NULL;
-    track_filepath_id(track->spotify_id, &path);
-    if (!access(path, R_OK)) {
-        free(path);
-        return 0;
-    }
-    free(path);
-    return read_remote_track(spotify, track, NULL, conn_out);
+    if (track_cached(track->spotify_id)) return 0;
+    if (read_remote_track(spotify, track, NULL, conn_out)) return 1;
+    (*conn_out)->params.func1 = cb;
+    (*conn_out)->params.func1_userp = userp;
+    return 0;
 }
 
 int
@@ -739,52 +1143,78 @@ parse_available_regions(const char *data, size_t len, void *userp) {
     return 0;
 }
 
+// Copies a string into the arena after sanitizing it, interned if intern is set
+static char *
+arena_sanitized(struct arena *arena, const char *str, bool intern) {
+    if (!strstr(str, "’")) return intern ? arena_intern_string(arena, str) : arena_strdup(arena, str);
+    char *copy = strdup(str);
+    sanitize(&copy);
+    char *ret = intern ? arena_intern_string(arena, copy) : arena_strdup(arena, copy);
+    free(copy);
+    return ret;
+}
+
+// Fills in track from its JSON, with its strings put into arena. The track takes a reference to the arena.
 int
-parse_track_cjson(cJSON *track_json, Track *track) {
+parse_track_cjson(cJSON *track_json, Track *track, struct arena *arena) {
     if (cJSON_IsNull(track_json)) {
         return 1;
     }
     char *id = cJSON_GetStringValue(cJSON_GetObjectItem(track_json, "id"));
+    SpotifyId spotify_id = {0};
+    bool valid_id = id && strlen(id) == SPOTIFY_ID_LEN && spotify_id_parse(id, &spotify_id);
     if (cJSON_IsTrue(cJSON_GetObjectItem(track_json, "is_local"))) {
         fprintf(stderr, "[spotify] Local spotify tracks cannot be downloaded. (ID: %s)\n", id);
+        if (valid_id) negative_cache_add(spotify_id, NEGATIVE_ANY_REGION, NEGATIVE_LOCAL);
         return 1;
     }
     if (cJSON_IsFalse(cJSON_GetObjectItem(track_json, "is_playable"))){
+        if (valid_id) negative_cache_add(spotify_id, NEGATIVE_ANY_REGION, NEGATIVE_UNPLAYABLE);
         return 1; // TODO: Handle this when the reason is regional
     }
+    if (!valid_id) {
+        fprintf(stderr, "[spotify] Track has an invalid id: %s\n", id ? id : "(none)");
+        return 1;
+    }
 
     track->playlist = NULL;
-    memcpy(track->spotify_id, id, SPOTIFY_ID_LEN_NULL);
-    track->spotify_name = strdup(cJSON_GetStringValue(cJSON_GetObjectItem(track_json, "name")));
-    sanitize(&track->spotify_name);
-    memcpy(track->spotify_uri, cJSON_GetStringValue(cJSON_GetObjectItem(track_json, "uri")), SPOTIFY_URI_LEN_NULL);
+    track->spotify_id = spotify_id;
+    TrackInfo *info = new_track_info(track, arena);
+    info->spotify_name = arena_sanitized(arena, cJSON_GetStringValue(cJSON_GetObjectItem(track_json, "name")), false);
 
     char *album_cover = cJSON_GetStringValue(
             cJSON_GetObjectItem(
                     cJSON_GetArrayItem(cJSON_GetObjectItem(cJSON_GetObjectItem(track_json, "album"), "images"),
                                        0), "url"));
-    track->spotify_album_art = album_cover ? strdup(album_cover) : NULL; // Null when parsing album's tracks
+    // Null when parsing album's tracks
+    info->spotify_album_art = album_cover ? arena_intern_string(arena, album_cover) : NULL;
     track->download_state = DS_NOT_DOWNLOADED;
     track->duration_ms = cJSON_GetObjectItem(track_json, "duration_ms")->valueint;
 
     cJSON *artist = cJSON_GetArrayItem(cJSON_GetObjectItem(track_json, "artists"), 0);
-    track->artist = strdup(cJSON_GetStringValue(cJSON_GetObjectItem(artist, "name")));
+    info->artist = arena_sanitized(arena, cJSON_GetStringValue(cJSON_GetObjectItem(artist, "name")), true);
 
-    memcpy(track->spotify_artist_id, cJSON_GetStringValue(cJSON_GetObjectItem(artist, "id")), SPOTIFY_ID_LEN_NULL);
-    sanitize(&track->artist);
+    char *artist_id = cJSON_GetStringValue(cJSON_GetObjectItem(artist, "id"));
+    if (!artist_id || strlen(artist_id) != SPOTIFY_ID_LEN || !spotify_id_parse(artist_id, &info->spotify_artist_id))
+        info->spotify_artist_id = (SpotifyId) {0};
 
+    // Most tracks of a playlist are available in the same regions, so the list is interned like the strings
     cJSON *markets = cJSON_GetObjectItem(track_json, "available_markets");
-    track->region_count = cJSON_GetArraySize(markets);
-    track->regions = track->region_count ? calloc(track->region_count, 2) : NULL;
+    info->region_count = cJSON_GetArraySize(markets);
+    if (!info->region_count) return 0;
+    char stack_regions[512];
+    char *regions = info->region_count * 2 <= sizeof(stack_regions) ? stack_regions : malloc(info->region_count * 2);
 
     int i = 0;
     cJSON *e;
     cJSON_ArrayForEach(e, markets) {
         char *s = cJSON_GetStringValue(e);
-        track->regions[i * 2] = s[0];
-        track->regions[i * 2 + 1] = s[1];
+        regions[i * 2] = s[0];
+        regions[i * 2 + 1] = s[1];
         i++;
     }
+    info->regions = arena_intern(arena, regions, info->region_count * 2);
+    if (regions != stack_regions) free(regions);
     return 0;
 }
 
@@ -853,9 +1283,16 @@ parse_track_json(const char *data, size_t len, void *userp) {
         *track_len = 0;
     }
     Track *track = &(*tracks)[*track_len];
+    struct arena *arena = arena_new();
+    int err = parse_track_cjson(root, track, arena);
+    arena_release(arena);
+    if (err) return 1;
     *track_len += 1;
-
-    if (parse_track_cjson(root, track)) return 1;
+    char id[SPOTIFY_ID_LEN];
+    spotify_id_format(track->spotify_id, id);
+    meta_cache_store(META_TRACK, id, meta_cache_hash_source(data, len), NULL, track, 1);
+    local_search_add_tracks(track, 1);
+    local_recommend_add_tracks(track, 1);
 
     cJSON_Delete(root);
     return 0;
@@ -883,6 +1320,13 @@ parse_playlist_info(const char *data, size_t len, PlaylistInfo *playlist) {
     return 0;
 }
 
+static void
+get_last_played(PlaylistInfo *playlist) {
+    SpotifyId id;
+    if (spotify_id_parse(playlist->spotify_id, &id))
+        history_get(playlist->album ? HISTORY_ALBUM : HISTORY_PLAYLIST, id, &playlist->last_played, NULL);
+}
+
 int
 parse_album_json(const char *data, size_t len, void *userp) {
     struct json_track_parse_params *params = (struct json_track_parse_params *) userp;
@@ -905,7 +1349,7 @@ parse_album_json(const char *data, size_t len, void *userp) {
         return 1;
     }
 
-    PlaylistInfo *playlist = malloc(sizeof(*playlist));
+    PlaylistInfo *playlist = calloc(1, sizeof(*playlist));
     playlist->not_empty = true;
     playlist->album = true;
     playlist->name = strdup(cJSON_GetObjectItem(root, "name")->valuestring);
@@ -923,16 +1367,27 @@ parse_album_json(const char *data, size_t len, void *userp) {
     playlist->image_url = strdup(cJSON_GetObjectItem(cJSON_GetArrayItem(cJSON_GetObjectItem(root, "images"), 0),
                                                      "url")->valuestring);
 
+    struct arena *arena = arena_new();
+    char *album_art = arena_intern_string(arena, playlist->image_url);
     cJSON *track;
     cJSON_ArrayForEach(track, tracks_array) {
-        if (parse_track_cjson(track, &(*tracks)[i])) continue;
-        (*tracks)[i].spotify_album_art = strdup(playlist->image_url);
+        if (parse_track_cjson(track, &(*tracks)[i], arena)) continue;
+        (*tracks)[i].info->spotify_album_art = album_art;
         (*tracks)[i].playlist = playlist;
         playlist->reference_count++;
         i++;
     }
+    arena_seal(arena);
+    arena_release(arena);
     playlist->track_count = i - *track_len;
+    meta_cache_store(META_ALBUM, playlist->spotify_id, meta_cache_hash_source(data, len), playlist,
+                     &(*tracks)[*track_len], playlist->track_count);
+    local_search_add_tracks(&(*tracks)[*track_len], playlist->track_count);
+    local_search_add_playlist(playlist);
+    local_recommend_add_playlist(playlist, &(*tracks)[*track_len], playlist->track_count);
     *track_len = i;
+    get_last_played(playlist);
+    playlist_index_upsert(playlist);
     cJSON_Delete(root);
     return 0;
 }
@@ -946,6 +1401,11 @@ parse_playlist_json(const char *data, size_t len, void *userp) {
     free(params);
     cJSON *root = cJSON_ParseWithLength(data, len);
 
+    if (!root) {
+        fprintf(stderr, "[spotify] Error when parsing JSON: %s\n", cJSON_GetErrorPtr());
+        return 1;
+    }
+
     if (cJSON_HasObjectItem(root, "error")) {
         char *error = cJSON_GetObjectItem(
                 cJSON_GetObjectItem(root, "error"), "message")->valuestring;
@@ -954,7 +1414,7 @@ parse_playlist_json(const char *data, size_t len, void *userp) {
         return 1;
     }
 
-    PlaylistInfo *playlist = malloc(sizeof(*playlist));
+    PlaylistInfo *playlist = calloc(1, sizeof(*playlist));
     playlist->not_empty = true;
     playlist->album = false;
     playlist->name = strdup(cJSON_GetObjectItem(root, "name")->valuestring);
@@ -973,19 +1433,75 @@ parse_playlist_json(const char *data, size_t len, void *userp) {
             cJSON_GetObjectItem(cJSON_GetArrayItem(cJSON_GetObjectItem(root, "images"), 0), "url")->valuestring);
     memcpy(playlist->spotify_id, cJSON_GetObjectItem(root, "id")->valuestring, 23);
 
+    struct arena *arena = arena_new();
     cJSON *element;
     cJSON_ArrayForEach(element, tracks_array) {
-        if (parse_track_cjson(cJSON_GetObjectItem(element, "track"), &(*tracks)[i])) continue;
+        if (parse_track_cjson(cJSON_GetObjectItem(element, "track"), &(*tracks)[i], arena)) continue;
         (*tracks)[i].playlist = playlist;
         playlist->reference_count++;
         i++;
     }
+    arena_seal(arena);
+    arena_release(arena);
     playlist->track_count = i - *track_len;
+    meta_cache_store(META_PLAYLIST, playlist->spotify_id, meta_cache_hash_source(data, len), playlist,
+                     &(*tracks)[*track_len], playlist->track_count);
+    local_search_add_tracks(&(*tracks)[*track_len], playlist->track_count);
+    local_search_add_playlist(playlist);
+    local_recommend_add_playlist(playlist, &(*tracks)[*track_len], playlist->track_count);
     *track_len = i;
+    get_last_played(playlist);
+    playlist_index_upsert(playlist);
     cJSON_Delete(root);
     return 0;
 }
 
+static int
+parse_meta(const char *data, size_t len, void *userp, enum meta_kind kind) {
+    int64_t count = meta_cache_check(data, len, kind);
+    if (count < 0 || (kind == META_TRACK && count != 1)) return 1; // The parameters are still needed for the JSON
+
+    struct json_track_parse_params *params = (struct json_track_parse_params *) userp;
+    struct Track **tracks = params->tracks;
+    size_t *track_size = params->track_size;
+    size_t *track_len = params->track_len;
+    free(params);
+
+    if (!*tracks) *track_size = *track_len = 0;
+    if (*track_size - *track_len < count) {
+        Track *tmp = realloc(*tracks, (*track_size + count) * sizeof(*tmp));
+        if (!tmp) perror("[spotify] Error when calling realloc to expand track array");
+        *tracks = tmp;
+        *track_size += count;
+    }
+    Track *added = &(*tracks)[*track_len];
+    PlaylistInfo *playlist = kind == META_TRACK ? NULL : calloc(1, sizeof(*playlist));
+    meta_cache_decode(data, playlist, added);
+    *track_len += count;
+    if (!playlist) return 0;
+
+    for (size_t i = 0; i < count; ++i) added[i].playlist = playlist;
+    playlist->reference_count = count;
+    get_last_played(playlist);
+    playlist_index_upsert(playlist);
+    return 0;
+}
+
+int
+parse_track_meta(const char *data, size_t len, void *userp) {
+    return parse_meta(data, len, userp, META_TRACK);
+}
+
+int
+parse_album_meta(const char *data, size_t len, void *userp) {
+    return parse_meta(data, len, userp, META_ALBUM);
+}
+
+int
+parse_playlist_meta(const char *data, size_t len, void *userp) {
+    return parse_meta(data, len, userp, META_PLAYLIST);
+}
+
 int
 parse_recommendations_json(const char *data, size_t len, void *userp) {
     struct json_track_parse_params *params = (struct json_track_parse_params *) userp;
@@ -1013,11 +1529,14 @@ parse_recommendations_json(const char *data, size_t len, void *userp) {
 
     size_t i = *track_len;
 
+    struct arena *arena = arena_new();
     cJSON *track;
     cJSON_ArrayForEach(track, tracks_array) {
-        if (parse_track_cjson(track, &(*tracks)[i])) continue;
+        if (parse_track_cjson(track, &(*tracks)[i], arena)) continue;
         i++;
     }
+    arena_seal(arena);
+    arena_release(arena);
     *track_len = i;
     cJSON_Delete(root);
     return 0;
@@ -1045,13 +1564,16 @@ parse_search_json(const char *data, size_t len, void *userp) {
         params->track_len = cJSON_GetArraySize(tracks_arr);
         params->tracks = calloc(params->track_len, sizeof(*params->tracks));
 
+        struct arena *arena = arena_new();
         i = 0;
         cJSON_ArrayForEach(e, tracks_arr) {
-            if (parse_track_cjson(e, &params->tracks[i++])) {
+            if (parse_track_cjson(e, &params->tracks[i++], arena)) {
                 params->track_len--;
                 i--;
             }
         }
+        arena_seal(arena);
+        arena_release(arena);
         if (i != params->track_len) {
             Track *tmp = realloc(params->tracks, i * sizeof(*params->tracks));
             if (!tmp)
@@ -1102,6 +1624,12 @@ parse_search_json(const char *data, size_t len, void *userp) {
     }
     cJSON_Delete(root);
 
+    // Results are indexed too, so what was found once can be found again without a backend
+    if (params->qtracks) local_search_add_tracks(params->tracks, params->track_len);
+    if (params->qtracks) local_recommend_add_tracks(params->tracks, params->track_len);
+    for (i = 0; params->qalbums && i < params->album_len; ++i) local_search_add_playlist(&params->albums[i]);
+    for (i = 0; params->qplaylists && i < params->playlist_len; ++i) local_search_add_playlist(&params->playlists[i]);
+
     return 0;
 }
 
@@ -1132,18 +1660,16 @@ add_track_info(struct spotify_state *spotify, const char id[22], Track **tracks,
     char payload[SPOTIFY_ID_LEN + 1];
     payload[0] = MUSIC_INFO;
     memcpy(&payload[1], id, SPOTIFY_ID_LEN);
-    char *path = NULL;
-    track_info_filepath_id(id, &path);
+    struct cache_file cache = {.dir = CACHE_DIR_TRACK_INFO};
+    memcpy(cache.id, id, SPOTIFY_ID_LEN);
 
     struct json_track_parse_params *userp1 = malloc(sizeof(*userp1));
     userp1->track_size = track_size;
     userp1->tracks = tracks;
     userp1->track_len = track_len;
 
-    int ret = make_and_parse_generic_request(spotify, payload, sizeof(payload), path, parse_track_json, userp1, func,
-                                             userp, NULL);
-    free(path);
-    return ret;
+    return make_and_parse_generic_request(spotify, payload, sizeof(payload), &cache, parse_track_json,
+                                          parse_track_meta, userp1, func, userp, NULL);
 }
 
 int
@@ -1157,21 +1683,19 @@ add_playlist(struct spotify_state *spotify, const char id[22], Track **tracks, s
     userp_func->tracks = tracks;
     userp_func->track_len = track_len;
 
-    char *path = NULL;
-    int ret;
+    struct cache_file cache;
+    memcpy(cache.id, id, SPOTIFY_ID_LEN);
     if (album) {
         payload[0] = ALBUM_INFO;
-        album_info_filepath_id(id, &path);
-        ret = make_and_parse_generic_request(spotify, payload, sizeof(payload), path, parse_album_json, userp_func,
-                                             func, userp, read_local_cb);
+        cache.dir = CACHE_DIR_ALBUM_INFO;
+        return make_and_parse_generic_request(spotify, payload, sizeof(payload), &cache, parse_album_json,
+                                              parse_album_meta, userp_func, func, userp, read_local_cb);
     } else {
         payload[0] = PLAYLIST_INFO;
-        playlist_info_filepath_id(id, &path);
-        ret = make_and_parse_generic_request(spotify, payload, sizeof(payload), path, parse_playlist_json, userp_func,
-                                             func, userp, read_local_cb);
+        cache.dir = CACHE_DIR_PLAYLIST_INFO;
+        return make_and_parse_generic_request(spotify, payload, sizeof(payload), &cache, parse_playlist_json,
+                                              parse_playlist_meta, userp_func, func, userp, read_local_cb);
     }
-    free(path);
-    return ret;
 }
 
 int
@@ -1190,60 +1714,98 @@ add_recommendations(struct spotify_state *spotify, const char *track_ids, const
     userp1->tracks = tracks;
     userp1->track_len = track_len;
 
-    return make_and_parse_generic_request(spotify, payload, sizeof(payload), NULL, parse_recommendations_json,
+    return make_and_parse_generic_request(spotify, payload, sizeof(payload), NULL, parse_recommendations_json, NULL,
                                           userp1, func, userp, NULL);
 }
 
+/*
+ * The seeds of recommendations for the queue, which are the 3 artists with the most tracks in it and as many of the
+ * last queued tracks as make 5 seeds in total
+ */
+static void
+queue_seeds(struct spotify_state *spotify, const Track *tracks, size_t track_len,
+            SpotifyId seed_tracks[RECOMMENDATION_SEEDS], size_t *track_amount,
+            SpotifyId seed_artists[RECOMMENDATION_SEEDS], size_t *artist_count) {
+    *artist_count = queue_index_top_artists(&spotify->queue_index, tracks, track_len, seed_artists, 3);
+    size_t queued = queue_length(&spotify->queue);
+    *track_amount = queued >= RECOMMENDATION_SEEDS - *artist_count ? RECOMMENDATION_SEEDS - *artist_count : queued;
+    for (uint32_t i = 0, slot = queue_at(&spotify->queue, queued - 1); i < *track_amount;
+         ++i, slot = queue_prev(&spotify->queue, slot)) {
+        seed_tracks[i] = tracks[slot].spotify_id;
+    }
+}
+
 int
 add_recommendations_from_tracks(struct spotify_state *spotify, Track **tracks, size_t *track_size, size_t *track_len,
                                 info_received_cb func, void *userp) {
-    char *seed_tracks; //Last 5 tracks
-    char *seed_artists;
-    struct ArtistQuantity *artists = calloc(*track_len, sizeof(*artists));
-    for (int i = 0; i < *track_len; ++i) {
-        for (int j = 0; j < *track_len; ++j) {
-            if (strcmp((*tracks)[i].spotify_artist_id, artists[j].id) != 0) continue;
-            artists[j].appearances++;
-            goto end_loop;
-        }
-        memcpy(artists[i].id, (*tracks)[i].spotify_artist_id, SPOTIFY_ID_LEN_NULL);
-        artists[i].appearances = 1;
-        end_loop:;
-    }
-    qsort(artists, *track_len, sizeof(*artists), compare_artist_quantities);
-    size_t artist_count = 0;
-    for (int i = 0; i < *track_len; ++i) {
-        if (artists[i].appearances)artist_count++;
-        if (artist_count >= 3)break; //Don't need more than 3
-    }
-    seed_artists = calloc(artist_count, SPOTIFY_ID_LEN);
-    for (int i = 0; i < artist_count; ++i) {
-        memcpy(&seed_artists[i * SPOTIFY_ID_LEN], artists[i].id, SPOTIFY_ID_LEN);
-    }
-    size_t track_amount = *track_len >= 5 - artist_count ? 5 - artist_count : *track_len;
-    seed_tracks = calloc(track_amount, SPOTIFY_ID_LEN);
-    for (int i = 0; i < track_amount; ++i) {
-        memcpy(&seed_tracks[i * SPOTIFY_ID_LEN], (*tracks)[*track_len - (i + 1)].spotify_id, SPOTIFY_ID_LEN);
-    }
-    free(artists);
-    int ret = add_recommendations(spotify, seed_tracks, seed_artists, track_amount, artist_count, tracks, track_size,
-                                  track_len, func, userp);
-    free(seed_tracks);
-    free(seed_artists);
-    return ret;
+    SpotifyId seed_tracks[RECOMMENDATION_SEEDS];
+    SpotifyId seed_artists[RECOMMENDATION_SEEDS];
+    size_t track_amount, artist_count;
+    queue_seeds(spotify, *tracks, *track_len, seed_tracks, &track_amount, seed_artists, &artist_count);
+    char track_ids[RECOMMENDATION_SEEDS][SPOTIFY_ID_LEN];
+    char artist_ids[RECOMMENDATION_SEEDS][SPOTIFY_ID_LEN];
+    for (size_t i = 0; i < track_amount; ++i) spotify_id_format(seed_tracks[i], track_ids[i]);
+    for (size_t i = 0; i < artist_count; ++i) spotify_id_format(seed_artists[i], artist_ids[i]);
+    return add_recommendations(spotify, (const char *) track_ids, (const char *) artist_ids, track_amount,
+                               artist_count, tracks, track_size, track_len, func, userp);
 }
 
-int
-search(struct spotify_state *spotify, const char *query, info_received_cb cb, bool tracks, bool artists, bool albums,
-       bool playlists, void *userp_in) {
-    if (!tracks && !artists && !albums && !playlists) return 0;
-    uint16_t q_len = strlen(query);
+static bool
+not_queued(SpotifyId id, void *userp) {
+    struct spotify_state *spotify = (struct spotify_state *) userp;
+    return queue_index_find(&spotify->queue_index, spotify->tracks, spotify->track_count, id) < 0;
+}
 
-    uint8_t payload[2 + sizeof(q_len) + q_len];
+size_t
+add_local_recommendations(struct spotify_state *spotify, Track **tracks, size_t *track_size, size_t *track_len) {
+    SpotifyId seed_tracks[RECOMMENDATION_SEEDS];
+    SpotifyId seed_artists[RECOMMENDATION_SEEDS];
+    size_t track_amount, artist_count;
+    queue_seeds(spotify, *tracks, *track_len, seed_tracks, &track_amount, seed_artists, &artist_count);
+
+    SpotifyId ids[LOCAL_RECOMMENDATIONS];
+    size_t count = local_recommend(seed_tracks, track_amount, seed_artists, artist_count, not_queued, spotify, ids,
+                                   LOCAL_RECOMMENDATIONS);
+    if (!count) return 0;
+    if (*track_size - *track_len < count) {
+        Track *tmp = realloc(*tracks, (*track_size + count) * sizeof(*tmp));
+        if (!tmp) perror("[spotify] Error when calling realloc to expand track array");
+        *tracks = tmp;
+        *track_size += count;
+    }
+    size_t added = local_search_get_tracks(ids, count, &(*tracks)[*track_len]);
+    *track_len += added;
+    printf("[spotify] Found %zu recommendations among the cached tracks\n", added);
+    return added;
+}
+
+static void
+local_answer_cb(evutil_socket_t fd, short what, void *arg) {
+    struct local_answer *answer = arg;
+    if (answer->cb) answer->cb(answer->spotify, answer->userp);
+    free(answer);
+}
+
+#define SEARCH_PAYLOAD_LEN(q_len) (2 + sizeof(uint16_t) + (q_len))
+
+static void
+make_search_payload(uint8_t *payload, const char *query, uint16_t q_len, bool tracks, bool artists, bool albums,
+                    bool playlists) {
     payload[0] = SEARCH;
     payload[1] = (tracks * 1) + (artists * 2) + (albums * 4) + (playlists * 8);
     memcpy(&payload[2], &q_len, sizeof(q_len));
     memcpy(&payload[2 + sizeof(q_len)], query, q_len);
+}
+
+int
+search(struct spotify_state *spotify, const char *query, info_received_cb cb, bool tracks, bool artists, bool albums,
+       bool playlists, void *userp_in, struct connection **conn_out) {
+    if (conn_out) *conn_out = NULL;
+    if (!tracks && !artists && !albums && !playlists) return 0;
+    uint16_t q_len = strlen(query);
+
+    uint8_t payload[SEARCH_PAYLOAD_LEN(q_len)];
+    make_search_payload(payload, query, q_len, tracks, artists, albums, playlists);
 
     struct spotify_search_results *userp = calloc(1, sizeof(*userp));
     userp->qalbums = albums;
@@ -1252,26 +1814,86 @@ search(struct spotify_state *spotify, const char *query, info_received_cb cb, bo
     userp->qtracks = tracks;
     userp->userp = userp_in;
 
-    return make_and_parse_generic_request(spotify, payload, sizeof(payload), NULL, parse_search_json, userp, cb, userp,
-                                          NULL);
+    if (!make_cacheable_request(spotify, (char *) payload, sizeof(payload), parse_search_json, userp, cb, userp,
+                                conn_out))
+        return 0;
+
+    fprintf(stderr, "[spotify] Backend unavailable, searching the local index\n");
+    local_search(query, tracks, artists, albums, playlists, userp);
+    struct local_answer *answer = malloc(sizeof(*answer));
+    answer->spotify = spotify;
+    answer->cb = cb;
+    answer->userp = userp;
+    if (event_base_once(spotify->base, -1, EV_TIMEOUT, local_answer_cb, answer, NULL)) {
+        free(answer);
+        return -1;
+    }
+    return 0;
 }
 
-void
-cancel_track_transfer(struct connection *conn){
-    if (!conn || !conn->busy) return;
-    conn->cb = NULL;
-    conn->cb_arg = NULL;
-
-    double done_percentage = ((double) conn->progress)/((double) conn->expecting);
-    if (done_percentage < 0.75){
-        fclose(conn->cache_fp);
-        conn->cache_fp = NULL;
-        remove(conn->cache_path);
+int
+search_cached(const char *query, bool tracks, bool artists, bool albums, bool playlists,
+              struct spotify_search_results *results, bool *stale) {
+    if (!tracks && !artists && !albums && !playlists) return -1;
+    uint16_t q_len = strlen(query);
+
+    uint8_t payload[SEARCH_PAYLOAD_LEN(q_len)];
+    make_search_payload(payload, query, q_len, tracks, artists, albums, playlists);
+
+    size_t len;
+    char *data = response_cache_get((char *) payload, sizeof(payload), true, &len, stale);
+    if (!data) return -1;
+    results->qalbums = albums;
+    results->qartists = artists;
+    results->qplaylists = playlists;
+    results->qtracks = tracks;
+    int ret = parse_search_json(data, len, results);
+    free(data);
+    return ret;
+}
+
+bool
+cancel_search(struct connection *conn, const void *userp) {
+    if (!conn || !conn->busy || conn->params.func != parse_search_json ||
+        ((struct spotify_search_results *) conn->params.func_userp)->userp != userp)
+        return false;
+
+    if (conn->expecting) {
+        // The response is already arriving, so let it finish to keep the connection rather than reconnecting
+        conn->params.func = discard_search_json;
+        conn->params.func1 = NULL;
+        printf("[spotify] Leaving superseded search\n");
+    } else {
+        free(conn->params.func_userp);
         free_connection(conn);
         bufferevent_free(conn->bev);
         conn->bev = NULL;
-        printf("Closing download\n");
-    } else{
-        printf("Leaving download\n");
+        printf("[spotify] Closing superseded search\n");
+    }
+    return true;
+}
+
+void
+abort_track_transfer(struct connection *conn){
+    if (!conn || !conn->busy) return;
+    track_writer_finish(&conn->cache_writer, false, NULL, NULL);
+    free_connection(conn);
+    bufferevent_free(conn->bev);
+    conn->bev = NULL;
+    printf("[spotify] Closing download\n");
+}
+
+void
+cancel_track_transfer(struct connection *conn){
+    if (!conn || !conn->busy) return;
+
+    if (!conn->expecting || ((double) conn->progress) / ((double) conn->expecting) < 0.75) {
+        abort_track_transfer(conn);
+    } else {
+        // Nearly done, let it finish into the cache without decoding it
+        conn->cb = track_download_cb;
+        conn->cb_arg = NULL;
+        conn->params.func1 = NULL;
+        printf("[spotify] Leaving download\n");
     }
 }
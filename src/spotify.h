@@ -7,15 +7,22 @@
 #include <stdio.h>
 #include <event2/bufferevent.h>
 #include "util.h"
+#include "prebuffer.h"
+#include "cache-dir.h"
+#include "track-store.h"
+#include "queue-index.h"
+#include "queue.h"
+#include "arena.h"
+#include "spotify-id.h"
 
-#define SPOTIFY_ID_LEN 22
-#define SPOTIFY_ID_LEN_NULL (SPOTIFY_ID_LEN+1)
 #define SPOTIFY_URI_LEN 36
 #define SPOTIFY_URI_LEN_NULL (SPOTIFY_URI_LEN+1)
 #define PLAYLIST_NAME_LEN SPOTIFY_ID_LEN
 #define PLAYLIST_NAME_LEN_NULL (PLAYLIST_NAME_LEN+1)
 #define CONNECTION_POOL_MAX 10
 #define SPOTIFY_PORT 5394
+#define RECOMMENDATION_SEEDS 5 // Tracks and artists the backend accepts per request
+#define LOCAL_RECOMMENDATIONS 10 // Tracks found by add_local_recommendations at most
 
 struct spotify_state;
 
@@ -38,18 +45,27 @@ typedef struct PlaylistInfo {
     size_t reference_count; // Used when songs from multiple playlists are in the queue allowing each track to point to the correct playlist
 } PlaylistInfo;
 
-typedef struct Track {
-    char spotify_id[SPOTIFY_ID_LEN_NULL];
-    char spotify_uri[SPOTIFY_URI_LEN_NULL];
+// The parts of a track which are only needed to show or download it
+typedef struct TrackInfo {
     char *spotify_name;
     char *spotify_album_art;
     char *artist;
-    char spotify_artist_id[SPOTIFY_ID_LEN_NULL];
+    SpotifyId spotify_artist_id;
     char *regions;
     size_t region_count;
+    struct arena *arena; // Holds this and the strings above, shared with the other tracks loaded along with this one
+} TrackInfo;
+
+/*
+ * Only what scans over the queue look at is kept inline, so the queue stays a dense array. The URI isn't stored, it is
+ * made from the id with spotify_track_uri when needed.
+ */
+typedef struct Track {
+    SpotifyId spotify_id;
     uint32_t duration_ms;
     uint32_t download_state; //enum DownloadState
     PlaylistInfo *playlist;
+    TrackInfo *info; // Owned by the track, which holds a reference to info->arena
 } Track;
 
 typedef struct Artist {
@@ -100,7 +116,7 @@ typedef void(*info_received_cb)(struct spotify_state *spotify, void *userp);
 typedef void(*connection_error_cb)(struct connection *conn, void *userp);
 
 struct parse_func_params {
-    char *path;
+    struct cache_file cache;
     json_parse_func func;
     void *func_userp;
     info_received_cb func1;
@@ -118,8 +134,8 @@ struct spotify_state {
         struct spotify_state *spotify;
         spotify_conn_cb cb;
         void *cb_arg;
-        FILE *cache_fp;
-        char *cache_path;
+        struct cache_file cache_file;
+        struct track_writer cache_writer;
         struct parse_func_params params;
 
         char *error_buffer;
@@ -132,21 +148,50 @@ struct spotify_state {
     size_t connections_len;
     struct event_base *base;
     struct decode_context decode_ctx;
+    struct prebuffer prebuffer;
     struct smp_context *smp_ctx;
 
     Track *tracks;
     size_t track_count;
     size_t track_size;
+    struct queue queue; // Play order of tracks, whose indexes are stable while the queue isn't cleared
+    struct queue_index queue_index;
 
     connection_error_cb err_cb;
     void *err_userp;
+    info_received_cb stream_done_cb; // Called when the track being played has been fully downloaded
+    void *stream_done_userp;
+    info_received_cb play_error_cb; // Called when the track being played can neither be read nor downloaded
+    void *play_error_userp;
+    uint64_t play_generation; // Changes whenever play_track is called
+    info_received_cb tracks_added_cb; // Called when refreshing a stale playlist or album added tracks to the queue
+    void *tracks_added_userp;
 };
 
 void clear_tracks(Track *tracks, size_t *track_len, size_t *track_size);
 
+// Allocates the info of a track in arena and takes a reference to the arena for it
+TrackInfo *new_track_info(Track *track, struct arena *arena);
+
+void spotify_track_uri(SpotifyId id, char uri[SPOTIFY_URI_LEN_NULL]);
+
+/*
+ * Starts playing a track from the cache or, if it isn't cached, downloads it. Since the cache is read on the I/O
+ * threads, conn_out is only set once it is known that the track has to be downloaded.
+ */
 int play_track(struct spotify_state *spotify, const Track *track, struct buffer *buf, struct connection **conn_out);
 
-int ensure_track(struct spotify_state *spotify, const Track *track, char *region, struct connection **conn_out);
+// Silences the output and drops whatever play_track was still reading, for a track which can't be started yet
+void hold_playback(struct spotify_state *spotify);
+
+/*
+ * Downloads a track into the cache without playing it. If the track is already cached nothing happens and conn_out is
+ * set to NULL, otherwise cb is called once the whole track has been written.
+ */
+int ensure_track(struct spotify_state *spotify, const Track *track, info_received_cb cb, void *userp,
+                 struct connection **conn_out);
+
+bool track_cached(SpotifyId id);
 
 int refresh_available_regions(struct spotify_state *spotify);
 
@@ -163,13 +208,40 @@ add_recommendations(struct spotify_state *spotify, const char *track_ids, const
                     size_t artist_count, Track **tracks, size_t *track_size, size_t *track_len, info_received_cb func,
                     void *userp);
 
+// Seeds recommendations from the queue, so tracks, track_size and track_len have to be those of spotify
 int
 add_recommendations_from_tracks(struct spotify_state *spotify, Track **tracks, size_t *track_size, size_t *track_len,
                                 info_received_cb func, void *userp);
 
+/*
+ * Appends up to LOCAL_RECOMMENDATIONS tracks which aren't queued and whose audio is cached, found by the local
+ * recommender from the same seeds as add_recommendations_from_tracks. Doesn't need a backend and returns the number of
+ * tracks appended right away.
+ */
+size_t
+add_local_recommendations(struct spotify_state *spotify, Track **tracks, size_t *track_size, size_t *track_len);
+
+/*
+ * Searches for query and calls cb with a struct spotify_search_results whose userp is userp. If the search is sent to
+ * the backend, conn_out is set to the connection it uses, which can be passed to cancel_search.
+ */
 int
 search(struct spotify_state *spotify, const char *query, info_received_cb cb, bool tracks, bool artists, bool albums,
-       bool playlists, void *userp);
+       bool playlists, void *userp, struct connection **conn_out);
+
+/*
+ * Fills results from the response cache without making a request, including from entries older than the TTL, in
+ * which case stale is set. Returns 0 if there was a cached response.
+ */
+int search_cached(const char *query, bool tracks, bool artists, bool albums, bool playlists,
+                  struct spotify_search_results *results, bool *stale);
+
+/*
+ * Stops a search started with userp if conn is still busy with it, in which case true is returned and its callback is
+ * never called. A response which is already arriving is received and cached but not parsed, so the connection can be
+ * reused.
+ */
+bool cancel_search(struct connection *conn, const void *userp);
 
 void free_track(Track *track);
 
@@ -181,14 +253,15 @@ void free_playlist(PlaylistInfo *playlist);
 
 void free_artist(Artist *artist);
 
+// Frees the results and the struct itself, but not its userp
+void free_search_results(struct spotify_search_results *results);
+
 size_t get_saved_playlist_count();
 
 int get_all_playlist_info(PlaylistInfo **playlistInfo, size_t *countOut);
 
-void track_info_filepath_id(const char id[SPOTIFY_ID_LEN], char **out);
-
-void track_filepath_id(const char id[SPOTIFY_ID_LEN], char **out);
-
 void cancel_track_transfer(struct connection *conn);
 
+void abort_track_transfer(struct connection *conn);
+
 #endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "track-cache.h"
+#include "history.h"
+#include "config.h"
+#include "track-store.h"
+
+#define SCAN_BATCH 256
+#define EVICT_BATCH 16
+#define LOW_WATERMARK(x) ((x) / 10 * 9) // Evict down to 90% of the budget so that every download doesn't evict
+
+struct cache_entry {
+    SpotifyId id;
+    uint64_t size;
+    int64_t mtime;
+};
+
+struct eviction_candidate {
+    size_t entry;
+    int64_t last_played;
+    uint32_t play_count;
+};
+
+static struct {
+    struct event *scan_event;
+    struct event *evict_event;
+    struct track_store_iter scan;
+    bool scanning;
+    track_cache_pin_cb pin_cb;
+    void *pin_userp;
+
+    struct idmap ids; // Id to index in entries
+    struct cache_entry *entries;
+    size_t entries_len;
+    size_t entries_size;
+    uint64_t used;
+
+    struct eviction_candidate *candidates; // Eviction order of the current pass, NULL if no pass is running
+    size_t candidates_len;
+    size_t candidates_pos;
+} cache;
+
+static int
+compare_lru(const void *a, const void *b) {
+    const struct eviction_candidate *ca = a, *cb = b;
+    if (ca->last_played != cb->last_played) return ca->last_played < cb->last_played ? -1 : 1;
+    return (ca->play_count > cb->play_count) - (ca->play_count < cb->play_count);
+}
+
+static int
+compare_lfu(const void *a, const void *b) {
+    const struct eviction_candidate *ca = a, *cb = b;
+    if (ca->play_count != cb->play_count) return ca->play_count < cb->play_count ? -1 : 1;
+    return (ca->last_played > cb->last_played) - (ca->last_played < cb->last_played);
+}
+
+static void
+put_entry(SpotifyId id, uint64_t size, int64_t mtime) {
+    uint64_t *index = idmap_upsert(&cache.ids, id, cache.entries_len);
+    if (*index == cache.entries_len) {
+        if (cache.entries_len == cache.entries_size) {
+            cache.entries_size = cache.entries_size ? cache.entries_size * 2 : 256;
+            cache.entries = realloc(cache.entries, cache.entries_size * sizeof(*cache.entries));
+        }
+        cache.entries[cache.entries_len].id = id;
+        cache.entries_len++;
+    } else {
+        cache.used -= cache.entries[*index].size;
+    }
+    cache.entries[*index].size = size;
+    cache.entries[*index].mtime = mtime;
+    cache.used += size;
+}
+
+static void
+remove_entry(size_t index) {
+    struct cache_entry *entry = &cache.entries[index];
+    cache.used -= entry->size;
+    idmap_remove(&cache.ids, entry->id);
+    size_t last = --cache.entries_len;
+    if (index != last) { // Move the last entry into the hole
+        *entry = cache.entries[last];
+        idmap_put(&cache.ids, entry->id, index);
+    }
+}
+
+static void
+schedule_eviction() {
+    if (!cache.scanning && track_cache_size && cache.used > track_cache_size && !event_pending(cache.evict_event, EV_TIMEOUT, NULL))
+        event_active(cache.evict_event, EV_TIMEOUT, 0);
+}
+
+static void
+get_pinned(struct idmap *pinned) {
+    idmap_init(pinned, 64);
+    if (cache.pin_cb) cache.pin_cb(pinned, cache.pin_userp);
+}
+
+static void
+build_candidates(struct idmap *pinned) {
+    cache.candidates = malloc((cache.entries_len ? cache.entries_len : 1) * sizeof(*cache.candidates));
+    cache.candidates_len = cache.candidates_pos = 0;
+    for (size_t i = 0; i < cache.entries_len; ++i) {
+        struct cache_entry *entry = &cache.entries[i];
+        if (idmap_get(pinned, entry->id, NULL)) continue;
+        struct eviction_candidate *c = &cache.candidates[cache.candidates_len++];
+        c->entry = i;
+        time_t last_played = 0;
+        c->play_count = 0;
+        history_get(HISTORY_TRACK, entry->id, &last_played, &c->play_count);
+        c->last_played = last_played > entry->mtime ? last_played : entry->mtime; // Never played tracks use download time
+    }
+    qsort(cache.candidates, cache.candidates_len, sizeof(*cache.candidates),
+          track_cache_lfu ? compare_lfu : compare_lru);
+}
+
+static void
+evict_cb(evutil_socket_t fd, short what, void *arg) {
+    uint64_t target = LOW_WATERMARK(track_cache_size);
+    if (cache.used <= target) {
+        free(cache.candidates);
+        cache.candidates = NULL;
+        return;
+    }
+    // The queue may have changed since the pass started, so tracks are checked against the pins again before removal
+    struct idmap pinned;
+    get_pinned(&pinned);
+    if (!cache.candidates) build_candidates(&pinned);
+
+    for (int i = 0; i < EVICT_BATCH && cache.used > target; ++i) {
+        if (cache.candidates_pos >= cache.candidates_len) {
+            fprintf(stderr, "[cache] Unable to shrink track cache below %lu bytes, all remaining tracks are in use\n",
+                    (unsigned long) cache.used);
+            free(cache.candidates);
+            cache.candidates = NULL;
+            idmap_free(&pinned);
+            return;
+        }
+        struct cache_entry entry = cache.entries[cache.candidates[cache.candidates_pos++].entry];
+        if (idmap_get(&pinned, entry.id, NULL)) continue;
+        char id[SPOTIFY_ID_LEN];
+        spotify_id_format(entry.id, id);
+        if (track_store_remove(id) && errno != ENOENT) {
+            fprintf(stderr, "[cache] Error when evicting track %.22s: %s\n", id, strerror(errno));
+        } else {
+            printf("[cache] Evicted track %.22s (%lu bytes)\n", id, (unsigned long) entry.size);
+        }
+
+        uint64_t index;
+        if (!idmap_get(&cache.ids, entry.id, &index)) continue;
+        size_t moved = cache.entries_len - 1;
+        remove_entry(index);
+        for (size_t j = cache.candidates_pos; j < cache.candidates_len && index != moved; ++j) { // Follow the moved entry
+            if (cache.candidates[j].entry == moved) {
+                cache.candidates[j].entry = index;
+                break;
+            }
+        }
+    }
+    idmap_free(&pinned);
+    event_active(cache.evict_event, EV_TIMEOUT, 0); // Continue in the next loop iteration
+}
+
+static void
+scan_cb(evutil_socket_t fd, short what, void *arg) {
+    char id[SPOTIFY_ID_LEN];
+    uint64_t size;
+    int64_t mtime;
+    for (int i = 0; i < SCAN_BATCH; ++i) {
+        if (!track_store_iter_next(&cache.scan, id, &size, &mtime)) {
+            track_store_iter_end(&cache.scan);
+            cache.scanning = false;
+            printf("[cache] Track cache holds %zu tracks using %lu bytes\n", cache.entries_len,
+                   (unsigned long) cache.used);
+            schedule_eviction();
+            return;
+        }
+        SpotifyId key;
+        if (spotify_id_parse(id, &key)) put_entry(key, size, mtime);
+    }
+    event_active(cache.scan_event, EV_TIMEOUT, 0);
+}
+
+int
+track_cache_init(struct event_base *base, track_cache_pin_cb pin_cb, void *userp) {
+    cache.pin_cb = pin_cb;
+    cache.pin_userp = userp;
+    idmap_init(&cache.ids, 256);
+    cache.evict_event = event_new(base, -1, 0, evict_cb, NULL);
+    cache.scan_event = event_new(base, -1, 0, scan_cb, NULL);
+    track_store_iter_begin(&cache.scan);
+    cache.scanning = true;
+    event_active(cache.scan_event, EV_TIMEOUT, 0);
+    return 0;
+}
+
+void
+track_cache_close() {
+    if (cache.scanning) track_store_iter_end(&cache.scan);
+    if (cache.scan_event) event_free(cache.scan_event);
+    if (cache.evict_event) event_free(cache.evict_event);
+    idmap_free(&cache.ids);
+    free(cache.entries);
+    free(cache.candidates);
+    memset(&cache, 0, sizeof(cache));
+}
+
+void
+track_cache_add(SpotifyId id, uint64_t size) {
+    if (!cache.evict_event) return;
+    put_entry(id, size, time(NULL));
+    schedule_eviction();
+}
+
+void
+track_cache_remove(SpotifyId id) {
+    uint64_t index;
+    if (!idmap_get(&cache.ids, id, &index)) return;
+    remove_entry(index);
+    // Candidates refer to entries by index, which has just changed
+    free(cache.candidates);
+    cache.candidates = NULL;
+}
+
+uint64_t
+track_cache_used() {
+    return cache.used;
+}
+
+bool
+track_cache_contains(SpotifyId id) {
+    return idmap_get(&cache.ids, id, NULL);
+}
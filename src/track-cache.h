@@ -0,0 +1,30 @@
+#ifndef SMP_TRACK_CACHE_H
+#define SMP_TRACK_CACHE_H
+
+#include <stdint.h>
+#include <event2/event.h>
+#include "spotify.h"
+#include "idmap.h"
+
+// Called before every batch of evictions to add the ids of tracks which must not be evicted to pinned
+typedef void (*track_cache_pin_cb)(struct idmap *pinned, void *userp);
+
+/*
+ * Starts scanning track_save_path in the background. Once the scan is done, the least valuable tracks (by last play
+ * or by play count, depending on track_cache_policy) are removed whenever the cache grows beyond track_cache_size.
+ */
+int track_cache_init(struct event_base *base, track_cache_pin_cb pin_cb, void *userp);
+
+void track_cache_close();
+
+// Registers a fully downloaded track of size bytes
+void track_cache_add(SpotifyId id, uint64_t size);
+
+void track_cache_remove(SpotifyId id);
+
+uint64_t track_cache_used();
+
+// Whether the audio of a track is in the cache, as far as the scan has got
+bool track_cache_contains(SpotifyId id);
+
+#endif //SMP_TRACK_CACHE_H
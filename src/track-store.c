@@ -0,0 +1,524 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "track-store.h"
+#include "pack-store.h"
+#include "track-cache.h"
+#include "crc32c.h"
+#include "io-pool.h"
+#include "config.h"
+
+#define TRACK_FILE_MAGIC 0x54504d53 // "SMPT"
+#define TRACK_FILE_VERSION 1
+
+#define WRITE_CHUNK_SIZE (256 * 1024)
+#define SYNC_DELAY_MS 1000
+#define SYNC_BATCH_MAX 16
+
+// Start of every track file, all fields are little endian
+struct track_file_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t crc; // CRC-32C of the data
+    uint32_t reserved;
+    uint64_t length; // Bytes of data following the header
+};
+
+struct file_mapping {
+    void *map;
+    size_t len;
+};
+
+// State of a track being written, which outlives its writer until all data is on the disk
+struct track_write {
+    char id[CACHE_ID_LEN];
+    uint64_t length;
+    uint32_t crc;
+    int fd; // The temporary file or the pack segment
+    uint64_t data_pos;
+    uint64_t pack_handle;
+    char tmp_name[CACHE_TMP_NAME_LEN];
+    unsigned outstanding; // Chunks which haven't been written yet
+    bool finished;
+    bool complete;
+    bool failed;
+    track_stored_cb cb;
+    void *userp;
+    struct track_write *next; // In a sync batch
+};
+
+struct write_chunk {
+    struct track_write *tw;
+    uint8_t *data;
+    size_t len;
+    uint64_t pos;
+    bool failed;
+};
+
+struct sync_batch {
+    struct track_write *writes;
+};
+
+struct track_read {
+    char id[CACHE_ID_LEN];
+    int fd; // Duplicated pack segment
+    uint64_t data_pos;
+    uint64_t length;
+    uint32_t crc;
+    bool has_crc;
+    struct file_mapping *mapping;
+    const uint8_t *data;
+    enum {
+        READ_OK, READ_MISSING, READ_CORRUPT
+    } status;
+    track_read_cb cb;
+    void *userp;
+};
+
+static struct {
+    struct track_write *batch; // Finished tracks waiting to be synced
+    size_t batch_len;
+    bool flushing; // Shutting down, tracks are synced as soon as they are finished
+    struct event *sync_event;
+} store;
+
+static void sync_cb(evutil_socket_t fd, short what, void *arg);
+
+int
+track_store_init(struct event_base *base) {
+    store.sync_event = evtimer_new(base, sync_cb, NULL);
+    if (!track_store_pack) return 0;
+    return pack_store_init(base, cache_dir_fd(CACHE_DIR_TRACKS));
+}
+
+void
+track_store_flush() {
+    store.flushing = true;
+    if (store.batch) sync_cb(-1, EV_TIMEOUT, NULL);
+}
+
+void
+track_store_close() {
+    track_store_flush();
+    if (store.sync_event) event_free(store.sync_event);
+    store.sync_event = NULL;
+    if (track_store_pack) pack_store_close();
+}
+
+static int
+pwrite_all(int fd, const void *data, size_t len, uint64_t pos) {
+    const uint8_t *p = data;
+    while (len) {
+        ssize_t written = pwrite(fd, p, len, (off_t) pos);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        p += written;
+        pos += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static void
+write_done(struct track_write *tw, bool stored) {
+    SpotifyId id;
+    if (stored) {
+        if (spotify_id_parse(tw->id, &id))
+            track_cache_add(id, track_store_pack ? tw->length : tw->length + sizeof(struct track_file_header));
+    } else if (tw->complete) {
+        fprintf(stderr, "[cache] Track %.22s couldn't be stored\n", tw->id);
+    }
+    if (tw->cb) tw->cb(stored, tw->userp);
+    free(tw);
+}
+
+// Syncs every pack segment the batch wrote to once, however many of its tracks are in it
+static void
+sync_segments(struct track_write *writes) {
+    for (struct track_write *tw = writes; tw; tw = tw->next) {
+        struct track_write *prev = writes;
+        while (prev != tw && prev->fd != tw->fd) prev = prev->next;
+        if (prev != tw) {
+            tw->failed = prev->failed;
+            continue;
+        }
+        if (fdatasync(tw->fd)) {
+            fprintf(stderr, "[cache] Error when syncing tracks: %s\n", strerror(errno));
+            tw->failed = true;
+        }
+    }
+}
+
+static void
+sync_work(void *arg) {
+    struct sync_batch *batch = arg;
+    if (track_store_pack) {
+        sync_segments(batch->writes);
+        return;
+    }
+    for (struct track_write *tw = batch->writes; tw; tw = tw->next) {
+        // Written last so that the track can't be taken for complete before it is
+        struct track_file_header header = {
+                .magic = htole32(TRACK_FILE_MAGIC),
+                .version = htole16(TRACK_FILE_VERSION),
+                .crc = htole32(tw->crc),
+                .length = htole64(tw->length)
+        };
+        tw->failed = pwrite_all(tw->fd, &header, sizeof(header), 0) != 0;
+        if (!tw->failed && fdatasync(tw->fd)) {
+            fprintf(stderr, "[cache] Error when syncing track %.22s: %s\n", tw->id, strerror(errno));
+            tw->failed = true;
+        }
+        if (close(tw->fd)) tw->failed = true;
+        if (!tw->failed && cache_tmp_publish(CACHE_DIR_TRACKS, tw->tmp_name, tw->id)) tw->failed = true;
+        if (tw->failed) cache_tmp_discard(CACHE_DIR_TRACKS, tw->tmp_name);
+    }
+}
+
+static void
+sync_done(void *arg) {
+    struct sync_batch *batch = arg;
+    struct track_write *tw = batch->writes;
+    while (tw) {
+        struct track_write *next = tw->next;
+        bool stored = !tw->failed;
+        if (track_store_pack) {
+            if (stored) stored = !pack_store_commit(tw->pack_handle, tw->crc);
+            else pack_store_abort(tw->pack_handle);
+        }
+        write_done(tw, stored);
+        tw = next;
+    }
+    free(batch);
+}
+
+static void
+sync_cb(evutil_socket_t fd, short what, void *arg) {
+    if (store.sync_event) evtimer_del(store.sync_event);
+    if (!store.batch) return;
+    struct sync_batch *batch = malloc(sizeof(*batch));
+    batch->writes = store.batch;
+    store.batch = NULL;
+    store.batch_len = 0;
+    io_pool_submit(sync_work, sync_done, batch);
+}
+
+static void
+discard_work(void *arg) {
+    struct track_write *tw = arg;
+    close(tw->fd);
+    cache_tmp_discard(CACHE_DIR_TRACKS, tw->tmp_name);
+}
+
+static void
+discard_done(void *arg) {
+    write_done(arg, false);
+}
+
+// Continues with a finished track once all of its chunks have been written
+static void
+settle(struct track_write *tw) {
+    if (tw->outstanding || !tw->finished) return;
+    if (!tw->complete || tw->failed) {
+        if (track_store_pack) {
+            pack_store_abort(tw->pack_handle);
+            write_done(tw, false);
+        } else {
+            io_pool_submit(discard_work, discard_done, tw);
+        }
+        return;
+    }
+    tw->next = store.batch;
+    store.batch = tw;
+    if (++store.batch_len >= SYNC_BATCH_MAX || store.flushing) {
+        sync_cb(-1, EV_TIMEOUT, NULL);
+    } else if (!evtimer_pending(store.sync_event, NULL)) {
+        struct timeval tv = {.tv_sec = SYNC_DELAY_MS / 1000, .tv_usec = (SYNC_DELAY_MS % 1000) * 1000};
+        evtimer_add(store.sync_event, &tv);
+    }
+}
+
+static void
+chunk_work(void *arg) {
+    struct write_chunk *chunk = arg;
+    chunk->failed = pwrite_all(chunk->tw->fd, chunk->data, chunk->len, chunk->pos) != 0;
+    if (chunk->failed) fprintf(stderr, "[cache] Error when writing track data: %s\n", strerror(errno));
+}
+
+static void
+chunk_done(void *arg) {
+    struct write_chunk *chunk = arg;
+    struct track_write *tw = chunk->tw;
+    if (chunk->failed) tw->failed = true;
+    tw->outstanding--;
+    free(chunk->data);
+    free(chunk);
+    settle(tw);
+}
+
+static void
+flush_chunk(struct track_writer *w) {
+    if (!w->chunk_len) return;
+    struct write_chunk *chunk = malloc(sizeof(*chunk));
+    chunk->tw = w->pending;
+    chunk->data = w->chunk;
+    chunk->len = w->chunk_len;
+    chunk->pos = w->pending->data_pos + w->written - w->chunk_len;
+    w->chunk = NULL;
+    w->chunk_len = 0;
+    w->pending->outstanding++;
+    io_pool_submit(chunk_work, chunk_done, chunk);
+}
+
+int
+track_writer_begin(struct track_writer *w, const char id[CACHE_ID_LEN], uint64_t length) {
+    if (w->open) track_writer_finish(w, false, NULL, NULL);
+    memcpy(w->id, id, CACHE_ID_LEN);
+    w->length = length;
+    w->written = 0;
+    w->crc = 0;
+    struct track_write *tw = calloc(1, sizeof(*tw));
+    memcpy(tw->id, id, CACHE_ID_LEN);
+    tw->length = length;
+    if (track_store_pack) {
+        if (pack_store_reserve(id, length, &tw->pack_handle)) {
+            free(tw);
+            return 1;
+        }
+        pack_store_target(tw->pack_handle, &tw->fd, &tw->data_pos);
+    } else {
+        // Written to a temporary file, which replaces the track file once it is complete and on the disk
+        tw->fd = cache_tmp_open(CACHE_DIR_TRACKS, tw->tmp_name);
+        if (tw->fd < 0) {
+            free(tw);
+            return 1;
+        }
+        tw->data_pos = sizeof(struct track_file_header);
+    }
+    w->pending = tw;
+    w->open = true;
+    return 0;
+}
+
+void
+track_writer_write(struct track_writer *w, const void *data, size_t len) {
+    if (!w->open) return;
+    if (len > w->length - w->written) len = w->length - w->written;
+    w->crc = crc32c(w->crc, data, len);
+    // Small reads from the network are collected so that the disk sees few large writes
+    const uint8_t *p = data;
+    while (len) {
+        if (!w->chunk) w->chunk = malloc(WRITE_CHUNK_SIZE);
+        size_t n = WRITE_CHUNK_SIZE - w->chunk_len;
+        if (n > len) n = len;
+        memcpy(&w->chunk[w->chunk_len], p, n);
+        w->chunk_len += n;
+        w->written += n;
+        p += n;
+        len -= n;
+        if (w->chunk_len == WRITE_CHUNK_SIZE) flush_chunk(w);
+    }
+}
+
+void
+track_writer_finish(struct track_writer *w, bool complete, track_stored_cb cb, void *userp) {
+    if (!w->open) {
+        if (cb) cb(false, userp);
+        return;
+    }
+    w->open = false;
+    struct track_write *tw = w->pending;
+    tw->complete = complete && w->written == w->length;
+    tw->crc = w->crc;
+    tw->cb = cb;
+    tw->userp = userp;
+    if (tw->complete) {
+        flush_chunk(w);
+    } else {
+        free(w->chunk);
+        w->chunk = NULL;
+        w->chunk_len = 0;
+    }
+    w->pending = NULL;
+    tw->finished = true;
+    settle(tw);
+}
+
+static void
+unmap_cleanup(const void *data, size_t len, void *arg) {
+    struct file_mapping *mapping = arg;
+    munmap(mapping->map, mapping->len);
+    free(mapping);
+}
+
+/*
+ * Checks the header of a track file of file_len bytes, of which avail are in start. Returns the offset of the data or
+ * 0 if the file isn't valid. Files written before the header was versioned only start with the host endian length of
+ * the data.
+ */
+static size_t
+check_header(const uint8_t *start, size_t avail, size_t file_len, uint64_t *length, uint32_t *crc, bool *has_crc) {
+    struct track_file_header header;
+    if (avail >= sizeof(header)) {
+        memcpy(&header, start, sizeof(header));
+        if (le32toh(header.magic) == TRACK_FILE_MAGIC) {
+            if (le16toh(header.version) != TRACK_FILE_VERSION ||
+                le64toh(header.length) != file_len - sizeof(header))
+                return 0;
+            *length = le64toh(header.length);
+            *crc = le32toh(header.crc);
+            *has_crc = true;
+            return sizeof(header);
+        }
+    }
+    size_t legacy_len;
+    if (avail < sizeof(legacy_len)) return 0;
+    memcpy(&legacy_len, start, sizeof(legacy_len));
+    if (legacy_len != file_len - sizeof(legacy_len)) return 0;
+    *length = legacy_len;
+    *has_crc = false;
+    return sizeof(legacy_len);
+}
+
+static void
+read_work(void *arg) {
+    struct track_read *r = arg;
+    r->status = READ_MISSING;
+    size_t map_offset = 0;
+    if (track_store_pack) {
+        // Only the track's part of the segment is mapped, starting at a page boundary
+        map_offset = r->data_pos % sysconf(_SC_PAGESIZE);
+        r->mapping = malloc(sizeof(*r->mapping));
+        r->mapping->len = map_offset + r->length;
+        r->mapping->map = mmap(NULL, r->mapping->len, PROT_READ, MAP_PRIVATE, r->fd, (off_t) (r->data_pos - map_offset));
+        close(r->fd);
+        r->fd = -1;
+        r->has_crc = true;
+    } else {
+        int fd = cache_open(CACHE_DIR_TRACKS, r->id, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) || st.st_size == 0) {
+            close(fd);
+            return;
+        }
+        r->mapping = malloc(sizeof(*r->mapping));
+        r->mapping->len = st.st_size;
+        r->mapping->map = mmap(NULL, r->mapping->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+    }
+    if (r->mapping->map == MAP_FAILED) {
+        free(r->mapping);
+        r->mapping = NULL;
+        return;
+    }
+    if (!track_store_pack) {
+        map_offset = check_header(r->mapping->map, r->mapping->len, r->mapping->len, &r->length, &r->crc, &r->has_crc);
+        if (!map_offset) return;
+    }
+    r->data = (const uint8_t *) r->mapping->map + map_offset;
+    madvise(r->mapping->map, r->mapping->len, MADV_SEQUENTIAL);
+    // Checking the data also reads all of it from the disk, so decoding it won't have to wait
+    if (verify_cached_tracks && r->has_crc && crc32c(0, r->data, r->length) != r->crc) {
+        r->status = READ_CORRUPT;
+        return;
+    }
+    r->status = READ_OK;
+}
+
+static void
+read_done(void *arg) {
+    struct track_read *r = arg;
+    struct evbuffer *buf = NULL;
+    if (r->status == READ_OK) {
+        buf = evbuffer_new();
+        if (evbuffer_add_reference(buf, r->data, r->length, unmap_cleanup, r->mapping)) {
+            evbuffer_free(buf);
+            buf = NULL;
+        } else {
+            r->mapping = NULL; // Unmapped when buf is freed
+        }
+    } else if (r->status == READ_CORRUPT) {
+        fprintf(stderr, "[cache] Checksum mismatch in cached track %.22s, removing it\n", r->id);
+        track_store_remove(r->id);
+        SpotifyId id;
+        if (spotify_id_parse(r->id, &id)) track_cache_remove(id);
+    }
+    if (r->mapping) unmap_cleanup(NULL, 0, r->mapping);
+    r->cb(buf, r->userp);
+    if (buf) evbuffer_free(buf);
+    free(r);
+}
+
+void
+track_store_read(const char id[CACHE_ID_LEN], track_read_cb cb, void *userp) {
+    struct track_read *r = calloc(1, sizeof(*r));
+    memcpy(r->id, id, CACHE_ID_LEN);
+    r->cb = cb;
+    r->userp = userp;
+    r->fd = -1;
+    if (track_store_pack) {
+        int fd;
+        // Duplicated so that the segment stays readable even if it is compacted away in the meantime
+        if (pack_store_locate(id, &fd, &r->data_pos, &r->length, &r->crc) ||
+            (r->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+            cb(NULL, userp);
+            free(r);
+            return;
+        }
+    }
+    io_pool_submit(read_work, read_done, r);
+}
+
+bool
+track_store_has(const char id[CACHE_ID_LEN]) {
+    if (track_store_pack) return pack_store_has(id);
+    int fd = cache_open(CACHE_DIR_TRACKS, id, O_RDONLY);
+    if (fd < 0) return false;
+    uint8_t start[sizeof(struct track_file_header)];
+    struct stat st;
+    ssize_t got = pread(fd, start, sizeof(start), 0);
+    bool ok = got > 0 && !fstat(fd, &st);
+    close(fd);
+    uint64_t length;
+    uint32_t crc;
+    bool has_crc;
+    return ok && check_header(start, got, st.st_size, &length, &crc, &has_crc) != 0;
+}
+
+int
+track_store_remove(const char id[CACHE_ID_LEN]) {
+    if (track_store_pack) return pack_store_remove(id);
+    cache_unlink_async(CACHE_DIR_TRACKS, id);
+    return 0;
+}
+
+void
+track_store_iter_begin(struct track_store_iter *it) {
+    memset(it, 0, sizeof(*it));
+    if (!track_store_pack) cache_dir_iter_begin(CACHE_DIR_TRACKS, &it->files);
+}
+
+bool
+track_store_iter_next(struct track_store_iter *it, char id_out[CACHE_ID_LEN], uint64_t *size, int64_t *time) {
+    if (track_store_pack) return pack_store_next(&it->pack_pos, id_out, size, time);
+    struct stat st;
+    if (!cache_dir_iter_next(&it->files, id_out, &st)) return false;
+    *size = st.st_size;
+    *time = st.st_mtime;
+    return true;
+}
+
+void
+track_store_iter_end(struct track_store_iter *it) {
+    if (!track_store_pack) cache_dir_iter_end(&it->files);
+}
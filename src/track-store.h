@@ -0,0 +1,75 @@
+#ifndef SMP_TRACK_STORE_H
+#define SMP_TRACK_STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include "cache-dir.h"
+
+/*
+ * Storage of downloaded tracks. Depending on track_store in the config, tracks are either kept as one file per track
+ * in the tracks directory or appended to the segment files of the pack store. All reading and writing of track data
+ * happens on the I/O threads. Written data is collected into large chunks first, and finished tracks are synced to
+ * disk in batches before they become visible.
+ */
+struct track_write;
+
+struct track_writer {
+    bool open;
+    char id[CACHE_ID_LEN];
+    uint64_t length;
+    uint64_t written;
+    uint32_t crc; // Of the data written so far
+    struct track_write *pending; // Owned by the I/O threads' completions once the writer is finished
+    uint8_t *chunk;
+    size_t chunk_len;
+};
+
+// Called on the event loop once a finished track has reached the disk, or once it has been discarded
+typedef void (*track_stored_cb)(bool stored, void *userp);
+
+// Called on the event loop with the audio data of a cached track, which is NULL if it couldn't be read
+typedef void (*track_read_cb)(struct evbuffer *data, void *userp);
+
+struct track_store_iter {
+    struct cache_dir_iter files;
+    size_t pack_pos;
+};
+
+int track_store_init(struct event_base *base);
+
+// Stops batching, finished tracks are synced right away from now on. Called before shutting down.
+void track_store_flush();
+
+void track_store_close();
+
+// Starts writing a track of length bytes. A writer which is still open is aborted first.
+int track_writer_begin(struct track_writer *w, const char id[CACHE_ID_LEN], uint64_t length);
+
+void track_writer_write(struct track_writer *w, const void *data, size_t len);
+
+/*
+ * Finishes writing. A complete track is registered with the track cache once it has been stored, otherwise everything
+ * written so far is discarded. cb is optional and also called if the writer wasn't open.
+ */
+void track_writer_finish(struct track_writer *w, bool complete, track_stored_cb cb, void *userp);
+
+/*
+ * Reads the audio data of a cached track without copying it and passes it to cb. The data is NULL if the track isn't
+ * cached, is incomplete or, with verify_cached_tracks, doesn't match its checksum. Corrupt tracks are removed.
+ */
+void track_store_read(const char id[CACHE_ID_LEN], track_read_cb cb, void *userp);
+
+bool track_store_has(const char id[CACHE_ID_LEN]);
+
+int track_store_remove(const char id[CACHE_ID_LEN]);
+
+void track_store_iter_begin(struct track_store_iter *it);
+
+bool track_store_iter_next(struct track_store_iter *it, char id_out[CACHE_ID_LEN], uint64_t *size, int64_t *time);
+
+void track_store_iter_end(struct track_store_iter *it);
+
+#endif //SMP_TRACK_STORE_H